@@ -9,11 +9,21 @@
 #define	ADNUMBER_HPP
 
 #include <queue>
+#include <limits>
+#include <valarray>
 
 #include <sys/resource.h>
 
+#if !defined(ADNUMBER_C11) && __cplusplus >= 201103L
+#define ADNUMBER_C11
+#endif
+
 
 #include "util/Expression.hpp"
+#include "util/Tape.hpp"
+#include "util/CompiledExpression.hpp"
+#include "util/Taylor.hpp"
+#include "util/GraphFile.hpp"
 
 namespace ad {
 
@@ -56,47 +66,26 @@ namespace ad {
     template<class T>
     static const ADNumber<T> Derivative(const ADNumber<T> &x, const ADNumber<T> &wrt, unsigned int order = 1);
 
-    /*!
-     * Creates a unique identifier.
-     * @return 
-     */
-    class IDGenerator {
-    public:
-        static IDGenerator * instance();
-
-        const unsigned long next() {
-            return ++_id;
-        }
-    private:
-
-        IDGenerator() : _id(0) {
-        }
-
-        unsigned long _id;
-    };
-
-    static IDGenerator* only_copy;
-
-    inline IDGenerator *
-    IDGenerator::instance() {
-
-        if (!only_copy) {
-            only_copy = new IDGenerator();
-        }
+    template<class T>
+    static T MixedPartialValue(const ADNumber<T> &x, const std::vector<const ADNumber<T>*> &wrt);
 
-        return only_copy;
-    }
+#ifdef ADNUMBER_EXPRESSION_TEMPLATES
+    template<class T, class E> class ADExpression;
+    template<class T> class ADTerm;
+    template<class T, class L, class R, int OP> class ADBinaryExpression;
+#endif
 
     template<class T>
     class ADNumber {
         T value;
-        std::string name;
         unsigned long id;
         Expression<T>* expression;
-        static bool record_expressoion;
         bool bounded;
         T min_boundary;
         T max_boundary;
+        mutable int tape_index;
+        mutable unsigned long tape_generation;
+        bool named;
     public:
 
         /*!
@@ -107,9 +96,10 @@ namespace ad {
         value(T(0.0)), bounded(false),
         min_boundary(std::numeric_limits<T>::min()),
         max_boundary(std::numeric_limits<T>::max()),
-        name(std::string("")),
-        id(IDGenerator::instance()->next()) {
-            this->SetName("");
+        id(RecordingContext<T>::Active()->NextID()),
+        tape_index(-1),
+        tape_generation(0),
+        named(false) {
             Initialize();
         }
 
@@ -123,9 +113,10 @@ namespace ad {
         value(value), bounded(false),
         min_boundary(std::numeric_limits<T>::min()),
         max_boundary(std::numeric_limits<T>::max()),
-        //         name(std::string("")),
-        id(IDGenerator::instance()->next()) {
-            this->SetName("");
+        id(RecordingContext<T>::Active()->NextID()),
+        tape_index(-1),
+        tape_generation(0),
+        named(false) {
             Initialize();
         }
 
@@ -139,14 +130,15 @@ namespace ad {
         value(value), bounded(false),
         min_boundary(std::numeric_limits<T>::min()),
         max_boundary(std::numeric_limits<T>::max()),
-        //         name(std::string("")),
-        id(IDGenerator::instance()->next()) {
-            this->SetName("");
+        id(RecordingContext<T>::Active()->NextID()),
+        tape_index(-1),
+        tape_generation(0),
+        named(false) {
             //            expression->take();
             expression->take();
             expression->SetId(id);
             expression->SetValue(value);
-
+            this->Canonicalize();
         }
 
         /*!
@@ -158,40 +150,77 @@ namespace ad {
          */
         ADNumber(const std::string &name, const T &value = T(0.0)) :
         value(value),
-        name(name),
         expression(new Expression<T>()),
         bounded(false),
         min_boundary(std::numeric_limits<T>::min()),
         max_boundary(std::numeric_limits<T>::max()),
-        id(IDGenerator::instance()->next()) {
+        id(RecordingContext<T>::Active()->NextID()),
+        tape_index(-1),
+        tape_generation(0),
+        named(false) {
 
             Initialize();
+            this->SetName(name);
         }
 
         /*!
-         * Copy Constructor.
+         * Copy Constructor. The copy gets its own root node, so SetValue on
+         * it leaves orig alone, while the operands below are shared with 
+         * orig through their reference counts. Use Clone for an independent
+         * copy of the whole graph.
          * 
          * @param orig
          */
         ADNumber(const ADNumber& orig) :
         value(orig.value),
-        name(orig.name),
         id(orig.id),
+        expression(NULL),
         bounded(orig.bounded),
         min_boundary(orig.min_boundary),
-        max_boundary(orig.max_boundary) {
+        max_boundary(orig.max_boundary),
+        tape_index(orig.tape_index),
+        tape_generation(orig.tape_generation),
+        named(orig.named) {
 
-            expression = Clone(orig.expression);
-            expression->take();
+            if (named) {
+                VariableNames::Retain(id);
+            }
+
+            expression = ADNumber<T>::CopyRoot(orig.expression);
 
         }
 
+#ifdef ADNUMBER_C11
+
+        /*!
+         * Move Constructor. Takes over orig's expression without touching
+         * its reference count.
+         * 
+         * @param orig
+         */
+        ADNumber(ADNumber&& orig) :
+        value(orig.value),
+        id(orig.id),
+        expression(orig.expression),
+        bounded(orig.bounded),
+        min_boundary(orig.min_boundary),
+        max_boundary(orig.max_boundary),
+        tape_index(orig.tape_index),
+        tape_generation(orig.tape_generation),
+        named(orig.named) {
+            orig.expression = NULL;
+            orig.named = false;
+        }
+#endif
+
         ADNumber(ExpressionPtr exp) :
        bounded(false),
         min_boundary(std::numeric_limits<T>::min()),
         max_boundary(std::numeric_limits<T>::max()),
-        name(exp->GetName()),
-        id(IDGenerator::instance()->next()) {
+        id(RecordingContext<T>::Active()->NextID()),
+        tape_index(-1),
+        tape_generation(0),
+        named(false) {
 
             expression = exp;
             SetValue(Evaluate(exp));
@@ -199,16 +228,35 @@ namespace ad {
 
         }
 
+#ifdef ADNUMBER_EXPRESSION_TEMPLATES
+
+        /**
+         * Records a whole statement, see ExpressionTemplate.hpp. Only the
+         * result gets an id, and none when recording a tape.
+         * 
+         * @param statement
+         */
+        template<class E>
+        ADNumber(const ADExpression<T, E> &statement) :
+        expression(NULL),
+        value(T(0.0)), bounded(false),
+        min_boundary(std::numeric_limits<T>::min()),
+        max_boundary(std::numeric_limits<T>::max()),
+        id(ADNumber<T>::IsRecordingTape() ? 0 : RecordingContext<T>::Active()->NextID()),
+        tape_index(-1),
+        tape_generation(0),
+        named(false) {
+            this->RecordStatement(statement.Cast());
+        }
+#endif
+
         virtual ~ADNumber() {
-            if (ADNumber<T>::IsRecordingExpression()) {
-                if(!expression){
-                    std::cout<<"NULL ptr....."<<std::endl;
-                }
+            if (expression != NULL) {
                 expression->release();
-            } else {
-                delete this->expression;
             }
-
+            if (named) {
+                VariableNames::Release(id);
+            }
         }
 
         operator T&() {
@@ -244,25 +292,77 @@ namespace ad {
         //         * @return ADNumber
         //         */
 
+        /**
+         * In member assignment operator. Like the copy constructor, this
+         * gets its own root node sharing val's operands, so SetValue on
+         * one leaves the other alone.
+         * 
+         * @param val
+         * @return ADNumber
+         */
         ADNumber<T>& operator =(const ADNumber<T> &val) {
             value = val.GetValue();
+            tape_index = val.tape_index;
+            tape_generation = val.tape_generation;
             if (ADNumber<T>::IsRecordingExpression()) {
 
+                ExpressionPtr root = ADNumber<T>::CopyRoot(val.GetExpression());
+
                 if (this->expression != NULL) {
                     this->expression->release();
                 }
                 //                           ExpressionPtr exp = expression;
 
-                val.GetExpression()->take();
+                if (val.named) {
+                    VariableNames::Retain(val.id);
+                }
+                if (this->named) {
+                    VariableNames::Release(this->id);
+                }
                 this->id = val.GetID();
-                expression = val.GetExpression();
-                //            expression->take();
+                this->named = val.named;
+                expression = root;
+
+            } else {
+                this->SetValue(value);
+            }
+            return *this;
+        }
+
+#ifdef ADNUMBER_C11
 
+        /**
+         * In member move assignment operator. Takes over val's expression
+         * without touching its reference count.
+         * 
+         * @param val
+         * @return ADNumber
+         */
+        ADNumber<T>& operator =(ADNumber<T> &&val) {
+            if (this == &val) {
+                return *this;
+            }
+            value = val.value;
+            tape_index = val.tape_index;
+            tape_generation = val.tape_generation;
+            if (ADNumber<T>::IsRecordingExpression()) {
+                if (this->expression != NULL) {
+                    this->expression->release();
+                }
+                if (this->named) {
+                    VariableNames::Release(this->id);
+                }
+                this->id = val.id;
+                this->named = val.named;
+                expression = val.expression;
+                val.expression = NULL;
+                val.named = false;
             } else {
                 this->SetValue(value);
             }
             return *this;
         }
+#endif
 
         /**
          * In member assignment operator to set this value 
@@ -273,6 +373,7 @@ namespace ad {
          */
         ADNumber<T> & operator =(const T & val) {
             value = val;
+            tape_generation = 0;
 
             if (ADNumber<T>::IsRecordingExpression()) {
 
@@ -287,11 +388,13 @@ namespace ad {
                 //                }
 
 
-                // this->expression->release();
-
-                this->SetValue(value);
+                //the old node may be shared, leave its value alone
+                if (this->expression != NULL) {
+                    this->expression->release();
+                }
                 this->expression = NEW_EXPRESSION(T);
                 this->Initialize();
+                this->SetValue(value);
 
             } else {
                 this->SetValue(value);
@@ -300,6 +403,43 @@ namespace ad {
             return *this;
         }
 
+#ifdef ADNUMBER_EXPRESSION_TEMPLATES
+
+        /**
+         * Records a whole statement into this number, see 
+         * ExpressionTemplate.hpp. The statement may read this number.
+         * 
+         * @param statement
+         * @return ADNumber
+         */
+        template<class E>
+        ADNumber<T>& operator =(const ADExpression<T, E> &statement) {
+            this->RecordStatement(statement.Cast());
+            return *this;
+        }
+
+        template<class E>
+        ADNumber<T>& operator +=(const ADExpression<T, E> &rhs) {
+            return *this = ADBinaryExpression<T, ADTerm<T>, E, PLUS > (ADTerm<T > (*this), rhs.Cast());
+        }
+
+        template<class E>
+        ADNumber<T>& operator -=(const ADExpression<T, E> &rhs) {
+            return *this = ADBinaryExpression<T, ADTerm<T>, E, MINUS > (ADTerm<T > (*this), rhs.Cast());
+        }
+
+        template<class E>
+        ADNumber<T>& operator *=(const ADExpression<T, E> &rhs) {
+            return *this = ADBinaryExpression<T, ADTerm<T>, E, MULTIPLY > (ADTerm<T > (*this), rhs.Cast());
+        }
+
+        template<class E>
+        ADNumber<T>& operator /=(const ADExpression<T, E> &rhs) {
+            return *this = ADBinaryExpression<T, ADTerm<T>, E, DIVIDE > (ADTerm<T > (*this), rhs.Cast());
+        }
+#endif
+
+#ifndef ADNUMBER_EXPRESSION_TEMPLATES
 #ifdef USE_AD_POOL
 
         /**
@@ -323,7 +463,7 @@ namespace ad {
 
                 return ADNumber<T > (val,
                         NEW_EXPRESSION(T)(val,
-                        0, "", PLUS, expression, rhs.GetExpression()));
+                        0, PLUS, expression, rhs.GetExpression()));
             }
         }
 
@@ -456,18 +596,22 @@ namespace ad {
         const ADNumber<T> operator +(const ADNumber<T>& rhs) const {
             T val = value + rhs.value;
 
+            if (ADNumber<T >::IsRecordingTape()) {
+                return TapeOperation(val, PLUS, GetTapeIndex(), rhs.GetTapeIndex(), T(1.0), T(1.0));
+            }
+
             if (ADNumber<T >::IsRecordingExpression()) {
                 if (expression == rhs.GetExpression()) {
 
                     return ADNumber<T > (val,
-                            NEW_EXPRESSION(T)(val, 0, PLUS,
+                            NEW_EXPRESSION(T)(val, 0, MULTIPLY,
                             NEW_EXPRESSION(T)(2.0, 0, CONSTANT, NULL, NULL),
                             expression));
                 } else {
 
                     return ADNumber<T > (val,
                             NEW_EXPRESSION(T)(val,
-                            0, "", PLUS, expression, rhs.GetExpression()));
+                            0, PLUS, expression, rhs.GetExpression()));
                 }
             } else {
                 return ADNumber<T > (val);
@@ -484,6 +628,10 @@ namespace ad {
          */
         const ADNumber<T> operator +(const T & rhs) const {
             T val = value + rhs;
+
+            if (ADNumber<T >::IsRecordingTape()) {
+                return TapeOperation(val, PLUS, GetTapeIndex(), -1, T(1.0), T(0.0));
+            }
             if (ADNumber<T >::IsRecordingExpression()) {
                 return ADNumber<T > (val,
                         NEW_EXPRESSION(T)(val,
@@ -507,6 +655,10 @@ namespace ad {
 
             T val = value - rhs;
 
+            if (ADNumber<T >::IsRecordingTape()) {
+                return TapeOperation(val, MINUS, GetTapeIndex(), rhs.GetTapeIndex(), T(1.0), T(-1.0));
+            }
+
             if (ADNumber<T >::IsRecordingExpression()) {
                 return ADNumber<T > (val,
                         NEW_EXPRESSION(T)(val,
@@ -528,6 +680,10 @@ namespace ad {
 
             T val = value - rhs;
 
+            if (ADNumber<T >::IsRecordingTape()) {
+                return TapeOperation(val, MINUS, GetTapeIndex(), -1, T(1.0), T(0.0));
+            }
+
             if (ADNumber<T >::IsRecordingExpression()) {
                 return ADNumber<T > (val,
                         NEW_EXPRESSION(T)(val,
@@ -546,6 +702,10 @@ namespace ad {
         const ADNumber<T> operator *(const ADNumber<T>& rhs) const {
 
             T val = value * rhs.value;
+
+            if (ADNumber<T >::IsRecordingTape()) {
+                return TapeOperation(val, MULTIPLY, GetTapeIndex(), rhs.GetTapeIndex(), rhs.value, value);
+            }
             if (ADNumber<T >::IsRecordingExpression()) {
                 if (expression == rhs.GetExpression()) {
 
@@ -573,6 +733,10 @@ namespace ad {
         const ADNumber<T> operator *(const T & rhs) const {
 
             T val = value * rhs;
+
+            if (ADNumber<T >::IsRecordingTape()) {
+                return TapeOperation(val, MULTIPLY, GetTapeIndex(), -1, rhs, T(0.0));
+            }
             if (ADNumber<T >::IsRecordingExpression()) {
                 return ADNumber<T > (val,
                         NEW_EXPRESSION(T)(val,
@@ -591,6 +755,10 @@ namespace ad {
         const ADNumber<T> operator /(const ADNumber<T>& rhs) const {
 
             T val = value / rhs.value;
+
+            if (ADNumber<T >::IsRecordingTape()) {
+                return TapeOperation(val, DIVIDE, GetTapeIndex(), rhs.GetTapeIndex(), T(1.0) / rhs.value, T(-1.0) * val / rhs.value);
+            }
             if (ADNumber<T >::IsRecordingExpression()) {
                 return ADNumber<T > (val,
                         NEW_EXPRESSION(T)(val,
@@ -609,6 +777,10 @@ namespace ad {
         const ADNumber<T> operator /(const T & rhs) const {
 
             T val = value / rhs;
+
+            if (ADNumber<T >::IsRecordingTape()) {
+                return TapeOperation(val, DIVIDE, GetTapeIndex(), -1, T(1.0) / rhs, T(0.0));
+            }
             if (ADNumber<T >::IsRecordingExpression()) {
                 return ADNumber<T > (val,
                         NEW_EXPRESSION(T)(val,
@@ -622,6 +794,7 @@ namespace ad {
 
 
 
+#endif
 #endif
 
         /*!
@@ -632,9 +805,14 @@ namespace ad {
 
         const ADNumber<T>& operator +=(const ADNumber<T>& rhs) {
 
+            if (ADNumber<T>::IsRecordingTape()) {
+                TapeAssign(value + rhs.value, PLUS, GetTapeIndex(), rhs.GetTapeIndex(), T(1.0), T(1.0));
+                return *this;
+            }
+
             T val = value + rhs.value;
             if (ADNumber<T>::IsRecordingExpression()) {
-                ExpressionPtr exp = NEW_EXPRESSION(T) (val, id, name, PLUS, expression, rhs.GetExpression());
+                ExpressionPtr exp = NEW_EXPRESSION(T) (val, id, PLUS, expression, rhs.GetExpression());
                 if (expression != NULL) {
                     expression->release();
                 }
@@ -643,6 +821,7 @@ namespace ad {
 
 
                 expression->take();
+                this->Canonicalize();
                 value = val;
                 return *this;
             } else {
@@ -659,12 +838,18 @@ namespace ad {
          */
         const ADNumber<T>& operator -=(const ADNumber<T>& rhs) {
 
-            ExpressionPtr exp = NEW_EXPRESSION(T) (value - rhs.value, id, name, MINUS, expression, rhs.GetExpression());
+            if (ADNumber<T>::IsRecordingTape()) {
+                TapeAssign(value - rhs.value, MINUS, GetTapeIndex(), rhs.GetTapeIndex(), T(1.0), T(-1.0));
+                return *this;
+            }
+
+            ExpressionPtr exp = NEW_EXPRESSION(T) (value - rhs.value, id, MINUS, expression, rhs.GetExpression());
             if (expression != NULL) {
                 expression->release();
             }
             expression = exp;
             expression->take();
+            this->Canonicalize();
             value = expression->GetValue();
             return *this;
         }
@@ -677,16 +862,22 @@ namespace ad {
          */
         const ADNumber<T>& operator *=(const ADNumber<T>& rhs) {
 
+            if (ADNumber<T>::IsRecordingTape()) {
+                TapeAssign(value * rhs.value, MULTIPLY, GetTapeIndex(), rhs.GetTapeIndex(), rhs.value, value);
+                return *this;
+            }
+
             ExpressionPtr temp = this->expression;
             if (this->expression == rhs.GetExpression()) {
                 temp = ad::Clone(this->expression);
             }
-            ExpressionPtr exp = NEW_EXPRESSION(T) (value * rhs.value, id, name, MULTIPLY, temp, rhs.GetExpression());
+            ExpressionPtr exp = NEW_EXPRESSION(T) (value * rhs.value, id, MULTIPLY, temp, rhs.GetExpression());
             if (expression != NULL) {
                 expression->release();
             }
             expression = exp;
             expression->take();
+            this->Canonicalize();
             value = expression->GetValue();
             return *this;
         }
@@ -699,12 +890,18 @@ namespace ad {
          */
         const ADNumber<T>& operator /=(const ADNumber<T>&rhs) {
 
-            ExpressionPtr exp = NEW_EXPRESSION(T) (value / rhs.value, id, name, DIVIDE, expression, rhs.GetExpression());
+            if (ADNumber<T>::IsRecordingTape()) {
+                TapeAssign(value / rhs.value, DIVIDE, GetTapeIndex(), rhs.GetTapeIndex(), T(1.0) / rhs.value, T(-1.0) * value / (rhs.value * rhs.value));
+                return *this;
+            }
+
+            ExpressionPtr exp = NEW_EXPRESSION(T) (value / rhs.value, id, DIVIDE, expression, rhs.GetExpression());
             if (expression != NULL) {
                 expression->release();
             }
             expression = exp;
             expression->take();
+            this->Canonicalize();
             value = expression->GetValue();
             return *this;
         }
@@ -717,17 +914,23 @@ namespace ad {
          */
         const ADNumber<T>& operator +=(const T & rhs) {
 
+            if (ADNumber<T>::IsRecordingTape()) {
+                TapeAssign(value + rhs, PLUS, GetTapeIndex(), -1, T(1.0), T(0.0));
+                return *this;
+            }
+
             if (ADNumber<T>::IsRecordingExpression()) {
                 ExpressionPtr c = NEW_EXPRESSION(T) ();
                 c->SetOp(CONSTANT);
                 c->SetValue(T(rhs));
 
-                ExpressionPtr exp = NEW_EXPRESSION(T) (value + rhs, id, name, PLUS, expression, c);
+                ExpressionPtr exp = NEW_EXPRESSION(T) (value + rhs, id, PLUS, expression, c);
                 if (expression != NULL) {
                     expression->release();
                 }
                 expression = exp;
                 expression->take();
+                this->Canonicalize();
                 value = expression->GetValue();
                 return *this;
 
@@ -745,15 +948,21 @@ namespace ad {
          */
         const ADNumber<T>& operator -=(const T & rhs) {
 
+            if (ADNumber<T>::IsRecordingTape()) {
+                TapeAssign(value - rhs, MINUS, GetTapeIndex(), -1, T(1.0), T(0.0));
+                return *this;
+            }
+
             ExpressionPtr c = NEW_EXPRESSION(T) ();
             c->SetOp(CONSTANT);
             c->SetValue(T(rhs));
-            ExpressionPtr exp = NEW_EXPRESSION(T) (value - rhs, id, name, MINUS, expression, c);
+            ExpressionPtr exp = NEW_EXPRESSION(T) (value - rhs, id, MINUS, expression, c);
             if (expression != NULL) {
                 expression->release();
             }
             expression = exp;
             expression->take();
+            this->Canonicalize();
             value = expression->GetValue();
             return *this;
         }
@@ -766,15 +975,21 @@ namespace ad {
          */
         ADNumber<T>& operator *=(const T & rhs) {
 
+            if (ADNumber<T>::IsRecordingTape()) {
+                TapeAssign(value * rhs, MULTIPLY, GetTapeIndex(), -1, rhs, T(0.0));
+                return *this;
+            }
+
             ExpressionPtr c = NEW_EXPRESSION(T) ();
             c->SetOp(CONSTANT);
             c->SetValue(T(rhs));
-            ExpressionPtr exp = NEW_EXPRESSION(T) (value * rhs, id, name, MULTIPLY, expression, c);
+            ExpressionPtr exp = NEW_EXPRESSION(T) (value * rhs, id, MULTIPLY, expression, c);
             if (expression != NULL) {
                 expression->release();
             }
             expression = exp;
             expression->take();
+            this->Canonicalize();
             value = expression->GetValue();
             return *this;
         }
@@ -787,15 +1002,21 @@ namespace ad {
          */
         ADNumber<T>& operator /=(const T & rhs) {
 
+            if (ADNumber<T>::IsRecordingTape()) {
+                TapeAssign(value / rhs, DIVIDE, GetTapeIndex(), -1, T(1.0) / rhs, T(0.0));
+                return *this;
+            }
+
             ExpressionPtr c = NEW_EXPRESSION(T) ();
             c->SetOp(CONSTANT);
             c->SetValue(T(rhs));
-            ExpressionPtr exp = NEW_EXPRESSION(T) (value / rhs, id, name, DIVIDE, expression, c);
+            ExpressionPtr exp = NEW_EXPRESSION(T) (value / rhs, id, DIVIDE, expression, c);
             if (expression != NULL) {
                 expression->release();
             }
             expression = exp;
             expression->take();
+            this->Canonicalize();
             value = expression->GetValue();
             return *this;
         }
@@ -807,16 +1028,22 @@ namespace ad {
          */
         const ADNumber<T>& operator ++() {
 
+            if (ADNumber<T>::IsRecordingTape()) {
+                TapeAssign(value + T(1.0), PLUS, GetTapeIndex(), -1, T(1.0), T(0.0));
+                return *this;
+            }
+
             ExpressionPtr c = NEW_EXPRESSION(T) ();
             c->SetOp(CONSTANT);
             c->SetValue(T(1.0));
 
-            ExpressionPtr exp = NEW_EXPRESSION(T) (value + 1, id, name, PLUS, expression, c);
+            ExpressionPtr exp = NEW_EXPRESSION(T) (value + 1, id, PLUS, expression, c);
             if (expression != NULL) {
                 expression->release();
             }
             expression = exp;
             expression->take();
+            this->Canonicalize();
             value = expression->GetValue();
             return *this;
 
@@ -829,15 +1056,21 @@ namespace ad {
          */
         const ADNumber<T>& operator --() {
 
+            if (ADNumber<T>::IsRecordingTape()) {
+                TapeAssign(value - T(1.0), MINUS, GetTapeIndex(), -1, T(1.0), T(0.0));
+                return *this;
+            }
+
             ExpressionPtr c = NEW_EXPRESSION(T) ();
             c->SetOp(CONSTANT);
             c->SetValue(T(1.0));
-            ExpressionPtr exp = NEW_EXPRESSION(T) (value - 1, id, name, MINUS, expression, c);
+            ExpressionPtr exp = NEW_EXPRESSION(T) (value - 1, id, MINUS, expression, c);
             if (expression != NULL) {
                 expression->release();
             }
             expression = exp;
             expression->take();
+            this->Canonicalize();
             value = expression->GetValue();
             return *this;
         }
@@ -849,16 +1082,22 @@ namespace ad {
          */
         const ADNumber<T>& operator ++(int) {
 
+            if (ADNumber<T>::IsRecordingTape()) {
+                TapeAssign(value + T(1.0), PLUS, GetTapeIndex(), -1, T(1.0), T(0.0));
+                return *this;
+            }
+
             ExpressionPtr c = NEW_EXPRESSION(T) ();
             c->SetOp(CONSTANT);
             c->SetValue(T(1.0));
 
-            ExpressionPtr exp = NEW_EXPRESSION(T) (value + 1, id, name, PLUS, expression, c);
+            ExpressionPtr exp = NEW_EXPRESSION(T) (value + 1, id, PLUS, expression, c);
             if (expression != NULL) {
                 expression->release();
             }
             expression = exp;
             expression->take();
+            this->Canonicalize();
             value = expression->GetValue();
             return *this;
         }
@@ -870,16 +1109,22 @@ namespace ad {
          */
         const ADNumber<T>& operator --(int) {
 
+            if (ADNumber<T>::IsRecordingTape()) {
+                TapeAssign(value - T(1.0), MINUS, GetTapeIndex(), -1, T(1.0), T(0.0));
+                return *this;
+            }
+
             ExpressionPtr c = NEW_EXPRESSION(T) ();
             c->SetOp(CONSTANT);
             c->SetValue(T(1.0));
 
-            ExpressionPtr exp = NEW_EXPRESSION(T) (value - 1, id, name, MINUS, expression, c);
+            ExpressionPtr exp = NEW_EXPRESSION(T) (value - 1, id, MINUS, expression, c);
             if (expression != NULL) {
                 expression->release();
             }
             expression = exp;
             expression->take();
+            this->Canonicalize();
             value = expression->GetValue();
             return *this;
         }
@@ -913,17 +1158,22 @@ namespace ad {
          * @return 
          */
         const std::string GetName() const {
-            if (name.empty()) {
-                std::stringstream ss;
-                ss << "x" << GetID();
-                return ss.str();
-            }
-            return name;
+            return VariableNames::Get(GetID());
         }
 
+        /*!
+         * Interns name for this variable's id. Names live in the
+         * VariableNames side table, not in the expression graph, and the
+         * entry is dropped with the last number that carries it.
+         */
         void SetName(const std::string &name) {
-            expression->SetName(name);
-            this->name = name;
+            VariableNames::Set(GetID(), name);
+            if (name.empty()) {
+                this->named = false;
+            } else if (!this->named) {
+                VariableNames::Retain(GetID());
+                this->named = true;
+            }
         }
 
         bool IsBounded() {
@@ -950,29 +1200,26 @@ namespace ad {
             if (this->bounded) {
                 if (val != val) {//nan
                     this->value = this->min_boundary + (this->max_boundary - this->min_boundary) / 2.0;
-                    expression->SetValue(value);
-                    return;
-                }
-                if (val<this->min_boundary) {
+                } else if (val<this->min_boundary) {
                     this->value = this->min_boundary;
-                    expression->SetValue(value);
                 } else if (val>this->max_boundary) {
                     this->value = this->max_boundary;
-                    expression->SetValue(value);
                 } else {
                     value = val;
-                    expression->SetValue(value);
                 }
-
-
             } else {
                 value = val;
+            }
+
+            if (expression != NULL) {
                 expression->SetValue(value);
             }
         }
 
         void Upate() {
-            this->value = ad::Evaluate(this->expression);
+            if (this->expression != NULL) {
+                this->value = ad::Evaluate(this->expression);
+            }
         }
 
         /*
@@ -983,798 +1230,328 @@ namespace ad {
             return id;
         }
 
+        /**
+         * Switches expression recording for the calling thread's
+         * RecordingContext.
+         * 
+         * @param record
+         */
         static void SetRecordExpression(bool record) {
-            ADNumber<T>::record_expressoion = record;
+            RecordingContext<T>::Active()->SetRecordExpression(record);
         }
 
         static bool IsRecordingExpression() {
-            return ADNumber<T>::record_expressoion;
-        }
-
-        static bool IsUsingRecursion() {
-            return Expression<T>::use_recusion_m;
-        }
-
-        static void SetUseRecurion(bool use_recursion) {
-            Expression<T>::use_recusion_m = use_recursion;
+            return RecordingContext<T>::Active()->IsRecordingExpression();
         }
 
         /**
-         * Derivative with respect to var0....var1 in order.
-         *
-         * @param var1
-         * @return  derivative
+         * When set, arithmetic on ADNumbers is recorded as flat entries on
+         * the calling thread's ad::Tape instead of as Expression trees. 
+         * Results of taped operations carry no expression.
+         * 
+         * @param record
          */
-        const ADNumber<T> WRT(const ADNumber<T> &var1) {
-            return ad::Derivative(*this, var1, 1);
+        static void SetRecordTape(bool record) {
+            RecordingContext<T>::Active()->SetRecordTape(record);
         }
 
-        /**
-         * Derivative with respect to var0....var2 in order.
-         *
-         * @param var1
-         * @param var2
-         * @return  derivative
-         */
-        const ADNumber<T> WRT(const ADNumber<T> &var1,
-                const ADNumber<T> &var2) {
-            ADNumber<T> ret = ad::Derivative(*this, var1, 1);
-            //std::cout << ret.GetExpression()->ToString(true) << std::flush;
-            ADNumber<T> ret2 = ad::Derivative(ret, var2, 1);
-
-            ExpressionPtr exp = ret2.expression;
-            //std::cout<<ad::Evaluate(ret.expression)<<"\n\n\n\n\n\n";
-            //std::cout << ret.GetExpression()->ToString()<<"\n\n\n\n\n\n" << std::flush;
-
-            return ret2;
+        static bool IsRecordingTape() {
+            return RecordingContext<T>::Active()->IsRecordingTape();
         }
 
         /**
-         * Derivative with respect to var0....var3 in order.
-         *
-         * @param var1
-         * @param var2
-         * @param var3
-         * @return  derivative
+         * Returns the index of this value on the active tape. A value that
+         * is not yet on the current tape (a parameter, a constant, or a
+         * result from before the last Tape::Clear) is recorded as a
+         * variable leaf.
+         * 
+         * @return 
          */
-        const ADNumber<T> WRT(const ADNumber<T> &var1,
-                const ADNumber<T> &var2,
-                const ADNumber<T> &var3) {
-            ADNumber<T> ret = ad::Derivative(*this, var1, 1);
-            ret = ad::Derivative(ret, var2, 1);
-            return ad::Derivative(ret, var3, 1);
+        const int GetTapeIndex() const {
+            Tape<T>* tape = Tape<T>::Active();
+            if (tape_generation != tape->Generation()) {
+                tape_index = tape->Push(VARIABLE, id, value, -1, -1, T(0), T(0));
+                tape_generation = tape->Generation();
+            }
+            return tape_index;
         }
 
         /**
-         * Derivative with respect to var0....var4 in order.
-         *
-         * @param var1
-         * @param var2
-         * @param var3
-         * @param var4
-         * @return  derivative
+         * Records an operation on the active tape and returns its result.
+         * 
+         * @param val - result value
+         * @param op
+         * @param left - tape index of the left operand, -1 if constant
+         * @param right - tape index of the right operand, -1 if constant
+         * @param partial_left - d(val)/d(left)
+         * @param partial_right - d(val)/d(right)
+         * @return 
          */
-        const ADNumber<T> WRT(const ADNumber<T> &var1,
-                const ADNumber<T> &var2,
-                const ADNumber<T> &var3,
-                const ADNumber<T> &var4) {
-            ADNumber<T> ret = ad::Derivative(*this, var1, 1);
-            ret = ad::Derivative(ret, var2, 1);
-            ret = ad::Derivative(ret, var3, 1);
-            return ad::Derivative(ret, var4, 1);
+        static const ADNumber<T> TapeOperation(const T &val, Operation op,
+                int left, int right,
+                const T &partial_left, const T &partial_right) {
+            Tape<T>* tape = Tape<T>::Active();
+            int index = tape->Push(op, 0, val, left, right, partial_left, partial_right);
+            return ADNumber<T > (val, index, tape->Generation());
         }
 
-        /**
-         * Derivative with respect to var0....var5 in order.
-         *
-         * @param var1
-         * @param var2
-         * @param var3
-         * @param var4
-         * @param var5
-         * @return  derivative
-         */
-        const ADNumber<T> WRT(const ADNumber<T> &var1,
-                const ADNumber<T> &var2,
-                const ADNumber<T> &var3,
-                const ADNumber<T> &var4,
-                const ADNumber<T> &var5) {
-            ADNumber<T> ret = ad::Derivative(*this, var1, 1);
-            ret = ad::Derivative(ret, var2, 1);
-            ret = ad::Derivative(ret, var3, 1);
-            ret = ad::Derivative(ret, var4, 1);
-            return ad::Derivative(ret, var5, 1);
+        static bool IsUsingRecursion() {
+            return RecordingContext<T>::Active()->IsUsingRecursion();
         }
 
-        /**
-         * Derivative with respect to var0....var6 in order.
-         *
-         * @param var1
-         * @param var2
-         * @param var3
-         * @param var4
-         * @param var5
-         * @param var6
-         * @return  derivative
-         */
-        const ADNumber<T> WRT(const ADNumber<T> &var1,
-                const ADNumber<T> &var2,
-                const ADNumber<T> &var3,
-                const ADNumber<T> &var4,
-                const ADNumber<T> &var5,
-                const ADNumber<T> &var6) {
-            ADNumber<T> ret = ad::Derivative(*this, var1, 1);
-            ret = ad::Derivative(ret, var2, 1);
-            ret = ad::Derivative(ret, var3, 1);
-            ret = ad::Derivative(ret, var4, 1);
-            ret = ad::Derivative(ret, var5, 1);
-            return ad::Derivative(ret, var6, 1);
+        static void SetUseRecurion(bool use_recursion) {
+            RecordingContext<T>::Active()->SetUseRecursion(use_recursion);
         }
 
         /**
-         * Derivative with respect to var0....var7 in order.
-         *
-         * @param var1
-         * @param var2
-         * @param var3
-         * @param var4
-         * @param var5
-         * @param var6
-         * @param var7
-         * @return  derivative
+         * When set, operations recorded on the calling thread reuse an 
+         * equal node (same op, same operands, equal constants) instead of 
+         * allocating a new one. Turning it off drops the table. See 
+         * RecordingContext::Intern.
+         * 
+         * @param hash_consing
          */
-        const ADNumber<T> WRT(const ADNumber<T> &var1,
-                const ADNumber<T> &var2,
-                const ADNumber<T> &var3,
-                const ADNumber<T> &var4,
-                const ADNumber<T> &var5,
-                const ADNumber<T> &var6,
-                const ADNumber<T> &var7) {
-            ADNumber<T> ret = ad::Derivative(*this, var1, 1);
-            ret = ad::Derivative(ret, var2, 1);
-            ret = ad::Derivative(ret, var3, 1);
-            ret = ad::Derivative(ret, var4, 1);
-            ret = ad::Derivative(ret, var5, 1);
-            ret = ad::Derivative(ret, var6, 1);
-            return ad::Derivative(ret, var7, 1);
+        static void SetHashConsing(bool hash_consing) {
+            RecordingContext<T>::Active()->SetHashConsing(hash_consing);
         }
 
-        /**
-         * Derivative with respect to var0....var8 in order.
-         *
-         * @param var1
-         * @param var2
-         * @param var3
-         * @param var4
-         * @param var5
-         * @param var6
-         * @param var7
-         * @param var8
-         * @return  derivative
-         */
-        const ADNumber<T> WRT(const ADNumber<T> &var1,
-                const ADNumber<T> &var2,
-                const ADNumber<T> &var3,
-                const ADNumber<T> &var4,
-                const ADNumber<T> &var5,
-                const ADNumber<T> &var6,
-                const ADNumber<T> &var7,
-                const ADNumber<T> &var8) {
-            ADNumber<T> ret = ad::Derivative(*this, var1, 1);
-            ret = ad::Derivative(ret, var2, 1);
-            ret = ad::Derivative(ret, var3, 1);
-            ret = ad::Derivative(ret, var4, 1);
-            ret = ad::Derivative(ret, var5, 1);
-            ret = ad::Derivative(ret, var6, 1);
-            ret = ad::Derivative(ret, var7, 1);
-            return ad::Derivative(ret, var8, 1);
+        static bool IsHashConsing() {
+            return RecordingContext<T>::Active()->IsHashConsing();
         }
 
         /**
-         * Derivative with respect to var0....var9 in order.
-         *
-         * @param var1
-         * @param var2
-         * @param var3
-         * @param var4
-         * @param var5
-         * @param var6
-         * @param var7
-         * @param var8
-         * @param var9
-         * @return  derivative
+         * Lookups, hits and table size of the calling thread's hash 
+         * consing; DedupRatio() is hits / lookups.
+         * 
+         * @return 
          */
-        const ADNumber<T> WRT(const ADNumber<T> &var1,
-                const ADNumber<T> &var2,
-                const ADNumber<T> &var3,
-                const ADNumber<T> &var4,
-                const ADNumber<T> &var5,
-                const ADNumber<T> &var6,
-                const ADNumber<T> &var7,
-                const ADNumber<T> &var8,
-                const ADNumber<T> &var9) {
-            ADNumber<T> ret = ad::Derivative(*this, var1, 1);
-            ret = ad::Derivative(ret, var2, 1);
-            ret = ad::Derivative(ret, var3, 1);
-            ret = ad::Derivative(ret, var4, 1);
-            ret = ad::Derivative(ret, var5, 1);
-            ret = ad::Derivative(ret, var6, 1);
-            ret = ad::Derivative(ret, var7, 1);
-            ret = ad::Derivative(ret, var8, 1);
-            return ad::Derivative(ret, var9, 1);
+        static const HashConsStatistics GetHashConsStatistics() {
+            return RecordingContext<T>::Active()->GetHashConsStatistics();
         }
 
         /**
-         * Derivative with respect to var0....var10 in order.
-         *
-         * @param var1
-         * @param var2
-         * @param var3
-         * @param var4
-         * @param var5
-         * @param var6
-         * @param var7
-         * @param var8
-         * @param var9
-         * @param var10
-         * @return  derivative
+         * Switches record time simplification for the calling thread: 
+         * operations on constants are folded and x*1, x*0, x+0, x-0, x/1,
+         * pow(x,1), pow(x,0) and 0-(0-x) record no new operation. Default is 
+         * true.
+         * 
+         * @param simplify
          */
-        const ADNumber<T> WRT(const ADNumber<T> &var1,
-                const ADNumber<T> &var2,
-                const ADNumber<T> &var3,
-                const ADNumber<T> &var4,
-                const ADNumber<T> &var5,
-                const ADNumber<T> &var6,
-                const ADNumber<T> &var7,
-                const ADNumber<T> &var8,
-                const ADNumber<T> &var9,
-                const ADNumber<T> &var10) {
-            ADNumber<T> ret = ad::Derivative(*this, var1, 1);
-            ret = ad::Derivative(ret, var2, 1);
-            ret = ad::Derivative(ret, var3, 1);
-            ret = ad::Derivative(ret, var4, 1);
-            ret = ad::Derivative(ret, var5, 1);
-            ret = ad::Derivative(ret, var6, 1);
-            ret = ad::Derivative(ret, var7, 1);
-            ret = ad::Derivative(ret, var8, 1);
-            ret = ad::Derivative(ret, var9, 1);
-            return ad::Derivative(ret, var10, 1);
+        static void SetSimplify(bool simplify) {
+            RecordingContext<T>::Active()->SetSimplifying(simplify);
         }
 
-        /**
-         * Derivative with respect to var0....var11 in order.
-         *
-         * @param var1
-         * @param var2
-         * @param var3
-         * @param var4
-         * @param var5
-         * @param var6
-         * @param var7
-         * @param var8
-         * @param var9
-         * @param var10
-         * @param var11
-         * @return  derivative
-         */
-        const ADNumber<T> WRT(const ADNumber<T> &var1,
-                const ADNumber<T> &var2,
-                const ADNumber<T> &var3,
-                const ADNumber<T> &var4,
-                const ADNumber<T> &var5,
-                const ADNumber<T> &var6,
-                const ADNumber<T> &var7,
-                const ADNumber<T> &var8,
-                const ADNumber<T> &var9,
-                const ADNumber<T> &var10,
-                const ADNumber<T> &var11) {
-            ADNumber<T> ret = ad::Derivative(*this, var1, 1);
-            ret = ad::Derivative(ret, var2, 1);
-            ret = ad::Derivative(ret, var3, 1);
-            ret = ad::Derivative(ret, var4, 1);
-            ret = ad::Derivative(ret, var5, 1);
-            ret = ad::Derivative(ret, var6, 1);
-            ret = ad::Derivative(ret, var7, 1);
-            ret = ad::Derivative(ret, var8, 1);
-            ret = ad::Derivative(ret, var9, 1);
-            ret = ad::Derivative(ret, var10, 1);
-            return ad::Derivative(ret, var11, 1);
+        static bool IsSimplifying() {
+            return RecordingContext<T>::Active()->IsSimplifying();
         }
 
         /**
-         * Derivative with respect to var0....var12 in order.
-         *
-         * @param var1
-         * @param var2
-         * @param var3
-         * @param var4
-         * @param var5
-         * @param var6
-         * @param var7
-         * @param var8
-         * @param var9
-         * @param var10
-         * @param var11
-         * @param var12
-         * @return  derivative
+         * Rewrites the node just recorded for this number: simplification
+         * (see ad::SimplifyNode), then hash consing, as switched on the 
+         * calling thread's context.
          */
-        const ADNumber<T> WRT(const ADNumber<T> &var1,
-                const ADNumber<T> &var2,
-                const ADNumber<T> &var3,
-                const ADNumber<T> &var4,
-                const ADNumber<T> &var5,
-                const ADNumber<T> &var6,
-                const ADNumber<T> &var7,
-                const ADNumber<T> &var8,
-                const ADNumber<T> &var9,
-                const ADNumber<T> &var10,
-                const ADNumber<T> &var11,
-                const ADNumber<T> &var12) {
-            ADNumber<T> ret = ad::Derivative(*this, var1, 1);
-            ret = ad::Derivative(ret, var2, 1);
-            ret = ad::Derivative(ret, var3, 1);
-            ret = ad::Derivative(ret, var4, 1);
-            ret = ad::Derivative(ret, var5, 1);
-            ret = ad::Derivative(ret, var6, 1);
-            ret = ad::Derivative(ret, var7, 1);
-            ret = ad::Derivative(ret, var8, 1);
-            ret = ad::Derivative(ret, var9, 1);
-            ret = ad::Derivative(ret, var10, 1);
-            ret = ad::Derivative(ret, var11, 1);
-            return ad::Derivative(ret, var12, 1);
+        inline void Canonicalize() {
+            if (this->expression != NULL) {
+                this->expression = ad::CanonicalizeNode<T > (this->expression);
+            }
         }
 
         /**
-         * Derivative with respect to var0....var13 in order.
+         * Mixed partial derivative with respect to the variables in wrt as
+         * an expression graph (see ad::Derivative), so the result can be
+         * differentiated again. A variable listed k times is differentiated
+         * k times at once, so one derivative graph is built per distinct
+         * variable. Use WRTValue when only the value is needed.
          *
-         * @param var1
-         * @param var2
-         * @param var3
-         * @param var4
-         * @param var5
-         * @param var6
-         * @param var7
-         * @param var8
-         * @param var9
-         * @param var10
-         * @param var11
-         * @param var12
-         * @param var13
+         * @param wrt
          * @return  derivative
          */
-        const ADNumber<T> WRT(const ADNumber<T> &var1,
-                const ADNumber<T> &var2,
-                const ADNumber<T> &var3,
-                const ADNumber<T> &var4,
-                const ADNumber<T> &var5,
-                const ADNumber<T> &var6,
-                const ADNumber<T> &var7,
-                const ADNumber<T> &var8,
-                const ADNumber<T> &var9,
-                const ADNumber<T> &var10,
-                const ADNumber<T> &var11,
-                const ADNumber<T> &var12,
-                const ADNumber<T> &var13) {
-            ADNumber<T> ret = ad::Derivative(*this, var1, 1);
-            ret = ad::Derivative(ret, var2, 1);
-            ret = ad::Derivative(ret, var3, 1);
-            ret = ad::Derivative(ret, var4, 1);
-            ret = ad::Derivative(ret, var5, 1);
-            ret = ad::Derivative(ret, var6, 1);
-            ret = ad::Derivative(ret, var7, 1);
-            ret = ad::Derivative(ret, var8, 1);
-            ret = ad::Derivative(ret, var9, 1);
-            ret = ad::Derivative(ret, var10, 1);
-            ret = ad::Derivative(ret, var11, 1);
-            ret = ad::Derivative(ret, var12, 1);
-            return ad::Derivative(ret, var13, 1);
-        }
+        const ADNumber<T> WRT(const std::vector<const ADNumber<T>*> &wrt) {
+            std::vector<const ADNumber<T>*> distinct;
+            std::vector<unsigned int> order;
+            for (size_t i = 0; i < wrt.size(); i++) {
+                size_t j = 0;
+                while (j < distinct.size() && distinct[j]->GetID() != wrt[i]->GetID()) {
+                    j++;
+                }
+                if (j == distinct.size()) {
+                    distinct.push_back(wrt[i]);
+                    order.push_back(0);
+                }
+                order[j]++;
+            }
 
-        /**
-         * Derivative with respect to var0....var14 in order.
-         *
-         * @param var1
-         * @param var2
-         * @param var3
-         * @param var4
-         * @param var5
-         * @param var6
-         * @param var7
-         * @param var8
-         * @param var9
-         * @param var10
-         * @param var11
-         * @param var12
-         * @param var13
-         * @param var14
-         * @return  derivative
-         */
-        const ADNumber<T> WRT(const ADNumber<T> &var1,
-                const ADNumber<T> &var2,
-                const ADNumber<T> &var3,
-                const ADNumber<T> &var4,
-                const ADNumber<T> &var5,
-                const ADNumber<T> &var6,
-                const ADNumber<T> &var7,
-                const ADNumber<T> &var8,
-                const ADNumber<T> &var9,
-                const ADNumber<T> &var10,
-                const ADNumber<T> &var11,
-                const ADNumber<T> &var12,
-                const ADNumber<T> &var13,
-                const ADNumber<T> &var14) {
-            ADNumber<T> ret = ad::Derivative(*this, var1, 1);
-            ret = ad::Derivative(ret, var2, 1);
-            ret = ad::Derivative(ret, var3, 1);
-            ret = ad::Derivative(ret, var4, 1);
-            ret = ad::Derivative(ret, var5, 1);
-            ret = ad::Derivative(ret, var6, 1);
-            ret = ad::Derivative(ret, var7, 1);
-            ret = ad::Derivative(ret, var8, 1);
-            ret = ad::Derivative(ret, var9, 1);
-            ret = ad::Derivative(ret, var10, 1);
-            ret = ad::Derivative(ret, var11, 1);
-            ret = ad::Derivative(ret, var12, 1);
-            ret = ad::Derivative(ret, var13, 1);
-            return ad::Derivative(ret, var14, 1);
+            ADNumber<T> ret(*this);
+            for (size_t j = 0; j < distinct.size(); j++) {
+                ret = ad::Derivative(ret, *distinct[j], order[j]);
+            }
+            return ret;
         }
 
         /**
-         * Derivative with respect to var0....var15 in order.
+         * The single sweep entry point for mixed partials: the derivative
+         * with respect to the variables in wrt, in any order; a variable
+         * listed k times is differentiated k times. Computed by one
+         * multi-directional Taylor sweep over the recorded graph (see
+         * ad::MixedPartialValue), so no derivative graphs are built. The
+         * result is a value; use WRT for a derivative that can be
+         * differentiated again.
          *
-         * @param var1
-         * @param var2
-         * @param var3
-         * @param var4
-         * @param var5
-         * @param var6
-         * @param var7
-         * @param var8
-         * @param var9
-         * @param var10
-         * @param var11
-         * @param var12
-         * @param var13
-         * @param var14
-         * @param var15
+         * @param wrt
          * @return  derivative
          */
-        const ADNumber<T> WRT(const ADNumber<T> &var1,
-                const ADNumber<T> &var2,
-                const ADNumber<T> &var3,
-                const ADNumber<T> &var4,
-                const ADNumber<T> &var5,
-                const ADNumber<T> &var6,
-                const ADNumber<T> &var7,
-                const ADNumber<T> &var8,
-                const ADNumber<T> &var9,
-                const ADNumber<T> &var10,
-                const ADNumber<T> &var11,
-                const ADNumber<T> &var12,
-                const ADNumber<T> &var13,
-                const ADNumber<T> &var14,
-                const ADNumber<T> &var15) {
-            ADNumber<T> ret = ad::Derivative(*this, var1, 1);
-            ret = ad::Derivative(ret, var2, 1);
-            ret = ad::Derivative(ret, var3, 1);
-            ret = ad::Derivative(ret, var4, 1);
-            ret = ad::Derivative(ret, var5, 1);
-            ret = ad::Derivative(ret, var6, 1);
-            ret = ad::Derivative(ret, var7, 1);
-            ret = ad::Derivative(ret, var8, 1);
-            ret = ad::Derivative(ret, var9, 1);
-            ret = ad::Derivative(ret, var10, 1);
-            ret = ad::Derivative(ret, var11, 1);
-            ret = ad::Derivative(ret, var12, 1);
-            ret = ad::Derivative(ret, var13, 1);
-            ret = ad::Derivative(ret, var14, 1);
-            return ad::Derivative(ret, var15, 1);
+        const T WRTValue(const std::vector<const ADNumber<T>*> &wrt) {
+            return ad::MixedPartialValue(*this, wrt);
         }
 
+#ifdef ADNUMBER_C11
+
         /**
-         * Derivative with respect to var0....var16 in order.
+         * Derivative with respect to var1, vars... in order; see 
+         * WRT(const std::vector<const ADNumber<T>*>&).
          *
          * @param var1
-         * @param var2
-         * @param var3
-         * @param var4
-         * @param var5
-         * @param var6
-         * @param var7
-         * @param var8
-         * @param var9
-         * @param var10
-         * @param var11
-         * @param var12
-         * @param var13
-         * @param var14
-         * @param var15
-         * @param var16
+         * @param vars
          * @return  derivative
          */
-        const ADNumber<T> WRT(const ADNumber<T> &var1,
-                const ADNumber<T> &var2,
-                const ADNumber<T> &var3,
-                const ADNumber<T> &var4,
-                const ADNumber<T> &var5,
-                const ADNumber<T> &var6,
-                const ADNumber<T> &var7,
-                const ADNumber<T> &var8,
-                const ADNumber<T> &var9,
-                const ADNumber<T> &var10,
-                const ADNumber<T> &var11,
-                const ADNumber<T> &var12,
-                const ADNumber<T> &var13,
-                const ADNumber<T> &var14,
-                const ADNumber<T> &var15,
-                const ADNumber<T> &var16) {
-            ADNumber<T> ret = ad::Derivative(*this, var1, 1);
-            ret = ad::Derivative(ret, var2, 1);
-            ret = ad::Derivative(ret, var3, 1);
-            ret = ad::Derivative(ret, var4, 1);
-            ret = ad::Derivative(ret, var5, 1);
-            ret = ad::Derivative(ret, var6, 1);
-            ret = ad::Derivative(ret, var7, 1);
-            ret = ad::Derivative(ret, var8, 1);
-            ret = ad::Derivative(ret, var9, 1);
-            ret = ad::Derivative(ret, var10, 1);
-            ret = ad::Derivative(ret, var11, 1);
-            ret = ad::Derivative(ret, var12, 1);
-            ret = ad::Derivative(ret, var13, 1);
-            ret = ad::Derivative(ret, var14, 1);
-            ret = ad::Derivative(ret, var15, 1);
-            return ad::Derivative(ret, var16, 1);
+        template<class... Vars>
+        const ADNumber<T> WRT(const ADNumber<T> &var1, const Vars&... vars) {
+            std::vector<const ADNumber<T>*> wrt = {&var1, &vars...};
+            return this->WRT(wrt);
         }
 
         /**
-         * Derivative with respect to var0....var17 in order.
+         * Mixed partial derivative value with respect to var1, vars...; see 
+         * WRTValue(const std::vector<const ADNumber<T>*>&).
          *
          * @param var1
-         * @param var2
-         * @param var3
-         * @param var4
-         * @param var5
-         * @param var6
-         * @param var7
-         * @param var8
-         * @param var9
-         * @param var10
-         * @param var11
-         * @param var12
-         * @param var13
-         * @param var14
-         * @param var15
-         * @param var16
-         * @param var17
+         * @param vars
          * @return  derivative
          */
-        const ADNumber<T> WRT(const ADNumber<T> &var1,
-                const ADNumber<T> &var2,
-                const ADNumber<T> &var3,
-                const ADNumber<T> &var4,
-                const ADNumber<T> &var5,
-                const ADNumber<T> &var6,
-                const ADNumber<T> &var7,
-                const ADNumber<T> &var8,
-                const ADNumber<T> &var9,
-                const ADNumber<T> &var10,
-                const ADNumber<T> &var11,
-                const ADNumber<T> &var12,
-                const ADNumber<T> &var13,
-                const ADNumber<T> &var14,
-                const ADNumber<T> &var15,
-                const ADNumber<T> &var16,
-                const ADNumber<T> &var17) {
-            ADNumber<T> ret = ad::Derivative(*this, var1, 1);
-            ret = ad::Derivative(ret, var2, 1);
-            ret = ad::Derivative(ret, var3, 1);
-            ret = ad::Derivative(ret, var4, 1);
-            ret = ad::Derivative(ret, var5, 1);
-            ret = ad::Derivative(ret, var6, 1);
-            ret = ad::Derivative(ret, var7, 1);
-            ret = ad::Derivative(ret, var8, 1);
-            ret = ad::Derivative(ret, var9, 1);
-            ret = ad::Derivative(ret, var10, 1);
-            ret = ad::Derivative(ret, var11, 1);
-            ret = ad::Derivative(ret, var12, 1);
-            ret = ad::Derivative(ret, var13, 1);
-            ret = ad::Derivative(ret, var14, 1);
-            ret = ad::Derivative(ret, var15, 1);
-            ret = ad::Derivative(ret, var16, 1);
-            return ad::Derivative(ret, var17, 1);
+        template<class... Vars>
+        const T WRTValue(const ADNumber<T> &var1, const Vars&... vars) {
+            std::vector<const ADNumber<T>*> wrt = {&var1, &vars...};
+            return this->WRTValue(wrt);
         }
-
-        /**
-         * Derivative with respect to var0....var18 in order.
-         *
-         * @param var1
-         * @param var2
-         * @param var3
-         * @param var4
-         * @param var5
-         * @param var6
-         * @param var7
-         * @param var8
-         * @param var9
-         * @param var10
-         * @param var11
-         * @param var12
-         * @param var13
-         * @param var14
-         * @param var15
-         * @param var16
-         * @param var17
-         * @param var18
-         * @return  derivative
-         */
-        const ADNumber<T> WRT(const ADNumber<T> &var1,
-                const ADNumber<T> &var2,
-                const ADNumber<T> &var3,
-                const ADNumber<T> &var4,
-                const ADNumber<T> &var5,
-                const ADNumber<T> &var6,
-                const ADNumber<T> &var7,
-                const ADNumber<T> &var8,
-                const ADNumber<T> &var9,
-                const ADNumber<T> &var10,
-                const ADNumber<T> &var11,
-                const ADNumber<T> &var12,
-                const ADNumber<T> &var13,
-                const ADNumber<T> &var14,
-                const ADNumber<T> &var15,
-                const ADNumber<T> &var16,
-                const ADNumber<T> &var17,
-                const ADNumber<T> &var18) {
-            ADNumber<T> ret = ad::Derivative(*this, var1, 1);
-            ret = ad::Derivative(ret, var2, 1);
-            ret = ad::Derivative(ret, var3, 1);
-            ret = ad::Derivative(ret, var4, 1);
-            ret = ad::Derivative(ret, var5, 1);
-            ret = ad::Derivative(ret, var6, 1);
-            ret = ad::Derivative(ret, var7, 1);
-            ret = ad::Derivative(ret, var8, 1);
-            ret = ad::Derivative(ret, var9, 1);
-            ret = ad::Derivative(ret, var10, 1);
-            ret = ad::Derivative(ret, var11, 1);
-            ret = ad::Derivative(ret, var12, 1);
-            ret = ad::Derivative(ret, var13, 1);
-            ret = ad::Derivative(ret, var14, 1);
-            ret = ad::Derivative(ret, var15, 1);
-            ret = ad::Derivative(ret, var16, 1);
-            ret = ad::Derivative(ret, var17, 1);
-            return ad::Derivative(ret, var18, 1);
-        }
-
-        /**
-         * Derivative with respect to var0....var19 in order.
-         *
-         * @param var1
-         * @param var2
-         * @param var3
-         * @param var4
-         * @param var5
-         * @param var6
-         * @param var7
-         * @param var8
-         * @param var9
-         * @param var10
-         * @param var11
-         * @param var12
-         * @param var13
-         * @param var14
-         * @param var15
-         * @param var16
-         * @param var17
-         * @param var18
-         * @param var19
-         * @return  derivative
-         */
-        const ADNumber<T> WRT(const ADNumber<T> &var1,
-                const ADNumber<T> &var2,
-                const ADNumber<T> &var3,
-                const ADNumber<T> &var4,
-                const ADNumber<T> &var5,
-                const ADNumber<T> &var6,
-                const ADNumber<T> &var7,
-                const ADNumber<T> &var8,
-                const ADNumber<T> &var9,
-                const ADNumber<T> &var10,
-                const ADNumber<T> &var11,
-                const ADNumber<T> &var12,
-                const ADNumber<T> &var13,
-                const ADNumber<T> &var14,
-                const ADNumber<T> &var15,
-                const ADNumber<T> &var16,
-                const ADNumber<T> &var17,
-                const ADNumber<T> &var18,
-                const ADNumber<T> &var19) {
-            ADNumber<T> ret = ad::Derivative(*this, var1, 1);
-            ret = ad::Derivative(ret, var2, 1);
-            ret = ad::Derivative(ret, var3, 1);
-            ret = ad::Derivative(ret, var4, 1);
-            ret = ad::Derivative(ret, var5, 1);
-            ret = ad::Derivative(ret, var6, 1);
-            ret = ad::Derivative(ret, var7, 1);
-            ret = ad::Derivative(ret, var8, 1);
-            ret = ad::Derivative(ret, var9, 1);
-            ret = ad::Derivative(ret, var10, 1);
-            ret = ad::Derivative(ret, var11, 1);
-            ret = ad::Derivative(ret, var12, 1);
-            ret = ad::Derivative(ret, var13, 1);
-            ret = ad::Derivative(ret, var14, 1);
-            ret = ad::Derivative(ret, var15, 1);
-            ret = ad::Derivative(ret, var16, 1);
-            ret = ad::Derivative(ret, var17, 1);
-            ret = ad::Derivative(ret, var18, 1);
-            return ad::Derivative(ret, var19, 1);
-        }
-
-        /**
-         * Derivative with respect to var0....var20 in order.
-         *
-         * @param var1
-         * @param var2
-         * @param var3
-         * @param var4
-         * @param var5
-         * @param var6
-         * @param var7
-         * @param var8
-         * @param var9
-         * @param var10
-         * @param var11
-         * @param var12
-         * @param var13
-         * @param var14
-         * @param var15
-         * @param var16
-         * @param var17
-         * @param var18
-         * @param var19
-         * @param var20
-         * @return  derivative
+#else
+        /*
+         * Without variadic templates, WRT and WRTValue take up to 20
+         * variables, forwarding them to the vector overloads.
          */
-        const ADNumber<T> WRT(const ADNumber<T> &var1,
-                const ADNumber<T> &var2,
-                const ADNumber<T> &var3,
-                const ADNumber<T> &var4,
-                const ADNumber<T> &var5,
-                const ADNumber<T> &var6,
-                const ADNumber<T> &var7,
-                const ADNumber<T> &var8,
-                const ADNumber<T> &var9,
-                const ADNumber<T> &var10,
-                const ADNumber<T> &var11,
-                const ADNumber<T> &var12,
-                const ADNumber<T> &var13,
-                const ADNumber<T> &var14,
-                const ADNumber<T> &var15,
-                const ADNumber<T> &var16,
-                const ADNumber<T> &var17,
-                const ADNumber<T> &var18,
-                const ADNumber<T> &var19,
-                const ADNumber<T> &var20) {
-            ADNumber<T> ret = ad::Derivative(*this, var1, 1);
-            ret = ad::Derivative(ret, var2, 1);
-            ret = ad::Derivative(ret, var3, 1);
-            ret = ad::Derivative(ret, var4, 1);
-            ret = ad::Derivative(ret, var5, 1);
-            ret = ad::Derivative(ret, var6, 1);
-            ret = ad::Derivative(ret, var7, 1);
-            ret = ad::Derivative(ret, var8, 1);
-            ret = ad::Derivative(ret, var9, 1);
-            ret = ad::Derivative(ret, var10, 1);
-            ret = ad::Derivative(ret, var11, 1);
-            ret = ad::Derivative(ret, var12, 1);
-            ret = ad::Derivative(ret, var13, 1);
-            ret = ad::Derivative(ret, var14, 1);
-            ret = ad::Derivative(ret, var15, 1);
-            ret = ad::Derivative(ret, var16, 1);
-            ret = ad::Derivative(ret, var17, 1);
-            ret = ad::Derivative(ret, var18, 1);
-            ret = ad::Derivative(ret, var19, 1);
-            return ad::Derivative(ret, var20, 1);
-        }
+#define ADNUMBER_WRT_OVERLOADS(N) \
+        const ADNumber<T> WRT(ADNUMBER_WRT_P##N) { \
+            const ADNumber<T>* wrt[] = {ADNUMBER_WRT_A##N}; \
+            return this->WRT(std::vector<const ADNumber<T>*>(wrt, wrt + N)); \
+        } \
+        const T WRTValue(ADNUMBER_WRT_P##N) { \
+            const ADNumber<T>* wrt[] = {ADNUMBER_WRT_A##N}; \
+            return this->WRTValue(std::vector<const ADNumber<T>*>(wrt, wrt + N)); \
+        }
+
+#define ADNUMBER_WRT_P1 const ADNumber<T> &var1
+#define ADNUMBER_WRT_P2 ADNUMBER_WRT_P1, const ADNumber<T> &var2
+#define ADNUMBER_WRT_P3 ADNUMBER_WRT_P2, const ADNumber<T> &var3
+#define ADNUMBER_WRT_P4 ADNUMBER_WRT_P3, const ADNumber<T> &var4
+#define ADNUMBER_WRT_P5 ADNUMBER_WRT_P4, const ADNumber<T> &var5
+#define ADNUMBER_WRT_P6 ADNUMBER_WRT_P5, const ADNumber<T> &var6
+#define ADNUMBER_WRT_P7 ADNUMBER_WRT_P6, const ADNumber<T> &var7
+#define ADNUMBER_WRT_P8 ADNUMBER_WRT_P7, const ADNumber<T> &var8
+#define ADNUMBER_WRT_P9 ADNUMBER_WRT_P8, const ADNumber<T> &var9
+#define ADNUMBER_WRT_P10 ADNUMBER_WRT_P9, const ADNumber<T> &var10
+#define ADNUMBER_WRT_P11 ADNUMBER_WRT_P10, const ADNumber<T> &var11
+#define ADNUMBER_WRT_P12 ADNUMBER_WRT_P11, const ADNumber<T> &var12
+#define ADNUMBER_WRT_P13 ADNUMBER_WRT_P12, const ADNumber<T> &var13
+#define ADNUMBER_WRT_P14 ADNUMBER_WRT_P13, const ADNumber<T> &var14
+#define ADNUMBER_WRT_P15 ADNUMBER_WRT_P14, const ADNumber<T> &var15
+#define ADNUMBER_WRT_P16 ADNUMBER_WRT_P15, const ADNumber<T> &var16
+#define ADNUMBER_WRT_P17 ADNUMBER_WRT_P16, const ADNumber<T> &var17
+#define ADNUMBER_WRT_P18 ADNUMBER_WRT_P17, const ADNumber<T> &var18
+#define ADNUMBER_WRT_P19 ADNUMBER_WRT_P18, const ADNumber<T> &var19
+#define ADNUMBER_WRT_P20 ADNUMBER_WRT_P19, const ADNumber<T> &var20
+#define ADNUMBER_WRT_A1 &var1
+#define ADNUMBER_WRT_A2 ADNUMBER_WRT_A1, &var2
+#define ADNUMBER_WRT_A3 ADNUMBER_WRT_A2, &var3
+#define ADNUMBER_WRT_A4 ADNUMBER_WRT_A3, &var4
+#define ADNUMBER_WRT_A5 ADNUMBER_WRT_A4, &var5
+#define ADNUMBER_WRT_A6 ADNUMBER_WRT_A5, &var6
+#define ADNUMBER_WRT_A7 ADNUMBER_WRT_A6, &var7
+#define ADNUMBER_WRT_A8 ADNUMBER_WRT_A7, &var8
+#define ADNUMBER_WRT_A9 ADNUMBER_WRT_A8, &var9
+#define ADNUMBER_WRT_A10 ADNUMBER_WRT_A9, &var10
+#define ADNUMBER_WRT_A11 ADNUMBER_WRT_A10, &var11
+#define ADNUMBER_WRT_A12 ADNUMBER_WRT_A11, &var12
+#define ADNUMBER_WRT_A13 ADNUMBER_WRT_A12, &var13
+#define ADNUMBER_WRT_A14 ADNUMBER_WRT_A13, &var14
+#define ADNUMBER_WRT_A15 ADNUMBER_WRT_A14, &var15
+#define ADNUMBER_WRT_A16 ADNUMBER_WRT_A15, &var16
+#define ADNUMBER_WRT_A17 ADNUMBER_WRT_A16, &var17
+#define ADNUMBER_WRT_A18 ADNUMBER_WRT_A17, &var18
+#define ADNUMBER_WRT_A19 ADNUMBER_WRT_A18, &var19
+#define ADNUMBER_WRT_A20 ADNUMBER_WRT_A19, &var20
+
+        ADNUMBER_WRT_OVERLOADS(1)
+        ADNUMBER_WRT_OVERLOADS(2)
+        ADNUMBER_WRT_OVERLOADS(3)
+        ADNUMBER_WRT_OVERLOADS(4)
+        ADNUMBER_WRT_OVERLOADS(5)
+        ADNUMBER_WRT_OVERLOADS(6)
+        ADNUMBER_WRT_OVERLOADS(7)
+        ADNUMBER_WRT_OVERLOADS(8)
+        ADNUMBER_WRT_OVERLOADS(9)
+        ADNUMBER_WRT_OVERLOADS(10)
+        ADNUMBER_WRT_OVERLOADS(11)
+        ADNUMBER_WRT_OVERLOADS(12)
+        ADNUMBER_WRT_OVERLOADS(13)
+        ADNUMBER_WRT_OVERLOADS(14)
+        ADNUMBER_WRT_OVERLOADS(15)
+        ADNUMBER_WRT_OVERLOADS(16)
+        ADNUMBER_WRT_OVERLOADS(17)
+        ADNUMBER_WRT_OVERLOADS(18)
+        ADNUMBER_WRT_OVERLOADS(19)
+        ADNUMBER_WRT_OVERLOADS(20)
+
+#undef ADNUMBER_WRT_OVERLOADS
+#undef ADNUMBER_WRT_P1
+#undef ADNUMBER_WRT_P2
+#undef ADNUMBER_WRT_P3
+#undef ADNUMBER_WRT_P4
+#undef ADNUMBER_WRT_P5
+#undef ADNUMBER_WRT_P6
+#undef ADNUMBER_WRT_P7
+#undef ADNUMBER_WRT_P8
+#undef ADNUMBER_WRT_P9
+#undef ADNUMBER_WRT_P10
+#undef ADNUMBER_WRT_P11
+#undef ADNUMBER_WRT_P12
+#undef ADNUMBER_WRT_P13
+#undef ADNUMBER_WRT_P14
+#undef ADNUMBER_WRT_P15
+#undef ADNUMBER_WRT_P16
+#undef ADNUMBER_WRT_P17
+#undef ADNUMBER_WRT_P18
+#undef ADNUMBER_WRT_P19
+#undef ADNUMBER_WRT_P20
+#undef ADNUMBER_WRT_A1
+#undef ADNUMBER_WRT_A2
+#undef ADNUMBER_WRT_A3
+#undef ADNUMBER_WRT_A4
+#undef ADNUMBER_WRT_A5
+#undef ADNUMBER_WRT_A6
+#undef ADNUMBER_WRT_A7
+#undef ADNUMBER_WRT_A8
+#undef ADNUMBER_WRT_A9
+#undef ADNUMBER_WRT_A10
+#undef ADNUMBER_WRT_A11
+#undef ADNUMBER_WRT_A12
+#undef ADNUMBER_WRT_A13
+#undef ADNUMBER_WRT_A14
+#undef ADNUMBER_WRT_A15
+#undef ADNUMBER_WRT_A16
+#undef ADNUMBER_WRT_A17
+#undef ADNUMBER_WRT_A18
+#undef ADNUMBER_WRT_A19
+#undef ADNUMBER_WRT_A20
+#endif
 
         //        
         //        /*!
@@ -1800,23 +1577,25 @@ namespace ad {
         //
         //        }
 
+        /**
+         * Derivative of the given order with respect to wrt, from one Taylor 
+         * sweep of the expression graph.
+         */
         const T NthPartialValue(const ADNumber<T> &wrt, unsigned int order) {
             return ad::DerivativeValue<T > (*this, wrt, order);
         }
 
+        /**
+         * Derivative of the given order with respect to wrt as an expression
+         * graph recorded by one Taylor sweep (see ad::Derivative), so it can
+         * be differentiated again. NthPartialValue is cheaper when only the
+         * value is needed.
+         */
         const ADNumber<T> NthPartial(const ADNumber<T> &wrt, unsigned int order) {
             return ad::Derivative<T > (*this, wrt, order);
         }
 
 
-#ifdef ADNUMBER_C11
-
-        const ADNumber<T> operator ""d(ADNumber<T> &wrt) {
-
-        }
-
-#endif
-
         //Friends
         // relational operators
         template<class TT> friend const int operator==(const ADNumber<TT>& lhs, const ADNumber<TT>& rhs);
@@ -1840,6 +1619,7 @@ namespace ad {
         template<class TT> friend const int operator<=(const ADNumber<TT>& lhs, TT rhs);
         template<class TT> friend const int operator>=(const ADNumber<TT>& lhs, TT rhs);
 
+#ifndef ADNUMBER_EXPRESSION_TEMPLATES
 #ifdef USE_AD_POOL
         // binary
         template<class TT> friend ADNumber<TT>& operator-(const ADNumber<TT>& lhs, const ADNumber<TT>& rhs);
@@ -1877,9 +1657,102 @@ namespace ad {
         template<class TT> friend const ADNumber<TT> operator/(const ADNumber<TT>& lhs, TT rhs);
         template<class TT> friend const ADNumber<TT> operator+(const ADNumber<TT>& lhs, TT rhs);
         template<class TT> friend const ADNumber<TT> operator*(const ADNumber<TT>& lhs, TT rhs);
+#endif
 #endif
     private:
 
+        /**
+         * Returns a new root with the value, id and operation of root that
+         * shares root's operands, holding one reference, or NULL if root
+         * is NULL.
+         */
+        static ExpressionPtr CopyRoot(ExpressionPtr root) {
+            if (root == NULL) {
+                return NULL;
+            }
+            ExpressionPtr copy = NEW_EXPRESSION(T) (root->GetValue(), root->GetId(), root->GetOp(),
+                    root->GetLeft(), root->GetRight());
+            copy->take();
+            return copy;
+        }
+
+        /**
+         * Constructs a taped result. No expression is allocated.
+         */
+        ADNumber(const T &value, int index, unsigned long generation) :
+        value(value),
+        id(0),
+        expression(NULL),
+        bounded(false),
+        min_boundary(std::numeric_limits<T>::min()),
+        max_boundary(std::numeric_limits<T>::max()),
+        tape_index(index),
+        tape_generation(generation),
+        named(false) {
+        }
+
+        /**
+         * Records an in place operation on the active tape.
+         */
+        void TapeAssign(const T &val, Operation op,
+                int left, int right,
+                const T &partial_left, const T &partial_right) {
+            Tape<T>* tape = Tape<T>::Active();
+            tape_index = tape->Push(op, 0, val, left, right, partial_left, partial_right);
+            tape_generation = tape->Generation();
+            value = val;
+            if (expression != NULL) {
+                expression->SetValue(val);
+            }
+        }
+
+#ifdef ADNUMBER_EXPRESSION_TEMPLATES
+
+        /**
+         * Records statement as one FUSED tape entry, or as its expression
+         * graph, or just takes its value, depending on what the calling 
+         * thread records.
+         */
+        template<class E>
+        void RecordStatement(const E &statement) {
+            T val = statement.GetValue();
+
+            if (ADNumber<T>::IsRecordingTape()) {
+                int operands[E::LEAVES > 0 ? E::LEAVES : 1];
+                T partials[E::LEAVES > 0 ? E::LEAVES : 1];
+                int count = 0;
+                statement.Accumulate(T(1.0), operands, partials, count);
+
+                Tape<T>* tape = Tape<T>::Active();
+                tape_index = tape->PushFused(val, operands, partials, count);
+                tape_generation = tape->Generation();
+                value = val;
+                if (expression != NULL) {
+                    expression->SetValue(val);
+                }
+                return;
+            }
+
+            tape_generation = 0;
+            if (ADNumber<T>::IsRecordingExpression()) {
+                //built before the old node is released, statement may read it
+                Expression<T>* exp = statement.Record();
+                if (this->expression != NULL) {
+                    this->expression->release();
+                }
+                this->expression = exp;
+                value = val;
+            } else if (this->expression == NULL) {
+                value = val;
+                this->expression = NEW_EXPRESSION(T)();
+                this->Initialize();
+                this->SetValue(val);
+            } else {
+                this->SetValue(val);
+            }
+        }
+#endif
+
         void Initialize() {
 
             expression->take();
@@ -1888,15 +1761,12 @@ namespace ad {
             expression->SetValue(value);
             expression->SetId(id);
             expression->SetOp(VARIABLE);
-            expression->SetName(GetName());
 
 
         }
 
     };
 
-    template<class T>
-    bool ADNumber<T>::record_expressoion = true;
 
     /*!
      * Equal to comparison operator.
@@ -2114,6 +1984,9 @@ namespace ad {
     }
 
 
+#ifndef ADNUMBER_EXPRESSION_TEMPLATES
+    //with expression templates these are in ExpressionTemplate.hpp
+
     // binary
 
     /*!
@@ -2124,6 +1997,9 @@ namespace ad {
      * @return 
      */
     template<class T> const ADNumber<T> operator-(const ADNumber<T>& lhs, const ADNumber<T>& rhs) {
+        if (ADNumber<T>::IsRecordingTape()) {
+            return ADNumber<T>::TapeOperation(lhs.GetValue() - rhs.GetValue(), MINUS, lhs.GetTapeIndex(), rhs.GetTapeIndex(), T(1.0), T(-1.0));
+        }
         ADNumber<T > ret((lhs.GetValue() - rhs.GetValue()));
         if (ADNumber<T>::IsRecordingExpression()) {
             ret.GetExpression()->SetOp(MINUS);
@@ -2131,6 +2007,7 @@ namespace ad {
             ret.GetExpression()->SetRight(rhs.GetExpression());
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -2143,6 +2020,9 @@ namespace ad {
      * @return 
      */
     template<class T> const ADNumber<T> operator+(const ADNumber<T>& lhs, const ADNumber<T>& rhs) {
+        if (ADNumber<T>::IsRecordingTape()) {
+            return ADNumber<T>::TapeOperation(lhs.GetValue() + rhs.GetValue(), PLUS, lhs.GetTapeIndex(), rhs.GetTapeIndex(), T(1.0), T(1.0));
+        }
         ADNumber<T> ret((lhs.GetValue() + rhs.GetValue()));
         if (ADNumber<T>::IsRecordingExpression()) {
             ret.GetExpression()->SetOp(PLUS);
@@ -2150,6 +2030,7 @@ namespace ad {
             ret.GetExpression()->SetRight(rhs.GetExpression());
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -2162,6 +2043,9 @@ namespace ad {
      * @return 
      */
     template<class T> const ADNumber<T> operator/(const ADNumber<T>& lhs, const ADNumber<T>& rhs) {
+        if (ADNumber<T>::IsRecordingTape()) {
+            return ADNumber<T>::TapeOperation(lhs.GetValue() / rhs.GetValue(), DIVIDE, lhs.GetTapeIndex(), rhs.GetTapeIndex(), T(1.0) / rhs.GetValue(), T(-1.0) * lhs.GetValue() / (rhs.GetValue() * rhs.GetValue()));
+        }
         ADNumber<T > ret((lhs.GetValue() / rhs.GetValue()));
         if (ADNumber<T>::IsRecordingExpression()) {
             ret.GetExpression()->SetOp(DIVIDE);
@@ -2169,6 +2053,7 @@ namespace ad {
             ret.GetExpression()->SetRight(rhs.GetExpression());
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -2181,6 +2066,9 @@ namespace ad {
      * @return 
      */
     template<class T> const ADNumber<T> operator*(const ADNumber<T>& lhs, const ADNumber<T>& rhs) {
+        if (ADNumber<T>::IsRecordingTape()) {
+            return ADNumber<T>::TapeOperation(lhs.GetValue() * rhs.GetValue(), MULTIPLY, lhs.GetTapeIndex(), rhs.GetTapeIndex(), rhs.GetValue(), lhs.GetValue());
+        }
         ADNumber<T > ret((lhs.GetValue() * rhs.GetValue()));
         if (ADNumber<T>::IsRecordingExpression()) {
             ret.GetExpression()->SetOp(MULTIPLY);
@@ -2188,6 +2076,7 @@ namespace ad {
             ret.GetExpression()->SetRight(rhs.GetExpression());
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -2200,6 +2089,9 @@ namespace ad {
      * @return 
      */
     template<class T> const ADNumber<T> operator-(T lhs, const ADNumber<T>& rhs) {
+        if (ADNumber<T>::IsRecordingTape()) {
+            return ADNumber<T>::TapeOperation(lhs - rhs.GetValue(), MINUS, -1, rhs.GetTapeIndex(), T(0.0), T(-1.0));
+        }
         ADNumber<T > ret((lhs - rhs.GetValue()));
         if (ADNumber<T>::IsRecordingExpression()) {
             Expression<T> *exp = NEW_EXPRESSION(T) ();
@@ -2211,6 +2103,7 @@ namespace ad {
             ret.GetExpression()->SetRight(rhs.GetExpression());
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -2223,6 +2116,9 @@ namespace ad {
      * @return 
      */
     template<class T> const ADNumber<T> operator+(T lhs, const ADNumber<T>& rhs) {
+        if (ADNumber<T>::IsRecordingTape()) {
+            return ADNumber<T>::TapeOperation(lhs + rhs.GetValue(), PLUS, -1, rhs.GetTapeIndex(), T(0.0), T(1.0));
+        }
         ADNumber<T > ret((lhs + rhs.GetValue()));
         if (ADNumber<T>::IsRecordingExpression()) {
             Expression<T> *exp = NEW_EXPRESSION(T) ();
@@ -2234,6 +2130,7 @@ namespace ad {
             ret.GetExpression()->SetRight(rhs.GetExpression());
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -2246,6 +2143,9 @@ namespace ad {
      * @return 
      */
     template<class T> const ADNumber<T> operator/(T lhs, const ADNumber<T>& rhs) {
+        if (ADNumber<T>::IsRecordingTape()) {
+            return ADNumber<T>::TapeOperation(lhs / rhs.GetValue(), DIVIDE, -1, rhs.GetTapeIndex(), T(0.0), T(-1.0) * lhs / (rhs.GetValue() * rhs.GetValue()));
+        }
         ADNumber<T > ret((lhs / rhs.GetValue()));
         if (ADNumber<T>::IsRecordingExpression()) {
             Expression<T> *exp = NEW_EXPRESSION(T) ();
@@ -2257,6 +2157,7 @@ namespace ad {
             ret.GetExpression()->SetRight(rhs.GetExpression());
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
 
@@ -2270,6 +2171,9 @@ namespace ad {
      * @return 
      */
     template<class T> const ADNumber<T> operator*(T lhs, const ADNumber<T>& rhs) {
+        if (ADNumber<T>::IsRecordingTape()) {
+            return ADNumber<T>::TapeOperation(lhs * rhs.GetValue(), MULTIPLY, -1, rhs.GetTapeIndex(), T(0.0), lhs);
+        }
         ADNumber<T > ret((lhs * rhs.GetValue()));
         if (ADNumber<T>::IsRecordingExpression()) {
             Expression<T> *exp = NEW_EXPRESSION(T) ();
@@ -2294,6 +2198,9 @@ namespace ad {
      * @return 
      */
     template<class T> const ADNumber<T> operator-(const ADNumber<T>& lhs, T rhs) {
+        if (ADNumber<T>::IsRecordingTape()) {
+            return ADNumber<T>::TapeOperation(lhs.GetValue() - rhs, MINUS, lhs.GetTapeIndex(), -1, T(1.0), T(0.0));
+        }
         ADNumber<T > ret((lhs.GetValue() - rhs));
         if (ADNumber<T>::IsRecordingExpression()) {
             Expression<T> *exp = NEW_EXPRESSION(T) ();
@@ -2305,6 +2212,7 @@ namespace ad {
             ret.GetExpression()->SetRight(exp);
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -2317,6 +2225,9 @@ namespace ad {
      * @return 
      */
     template<class T> const ADNumber<T> operator+(const ADNumber<T>& lhs, T rhs) {
+        if (ADNumber<T>::IsRecordingTape()) {
+            return ADNumber<T>::TapeOperation(lhs.GetValue() + rhs, PLUS, lhs.GetTapeIndex(), -1, T(1.0), T(0.0));
+        }
         ADNumber<T> ret((lhs.GetValue() + rhs));
         if (ADNumber<T>::IsRecordingExpression()) {
             Expression<T> *exp = NEW_EXPRESSION(T) ();
@@ -2328,6 +2239,7 @@ namespace ad {
             ret.GetExpression()->SetRight(exp);
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -2340,6 +2252,9 @@ namespace ad {
      * @return 
      */
     template<class T> const ADNumber<T> operator/(const ADNumber<T>& lhs, T rhs) {
+        if (ADNumber<T>::IsRecordingTape()) {
+            return ADNumber<T>::TapeOperation(lhs.GetValue() / rhs, DIVIDE, lhs.GetTapeIndex(), -1, T(1.0) / rhs, T(0.0));
+        }
         ADNumber<T > ret((lhs.GetValue() / rhs));
         if (ADNumber<T>::IsRecordingExpression()) {
             Expression<T> *exp = NEW_EXPRESSION(T) ();
@@ -2351,6 +2266,7 @@ namespace ad {
             ret.GetExpression()->SetRight(exp);
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -2363,6 +2279,9 @@ namespace ad {
      * @return 
      */
     template<class T> const ADNumber<T> operator*(const ADNumber<T>& lhs, T rhs) {
+        if (ADNumber<T>::IsRecordingTape()) {
+            return ADNumber<T>::TapeOperation(lhs.GetValue() * rhs, MULTIPLY, lhs.GetTapeIndex(), -1, rhs, T(0.0));
+        }
         ADNumber<T > ret((lhs.GetValue() * rhs));
         if (ADNumber<T>::IsRecordingExpression()) {
             Expression<T> *exp = NEW_EXPRESSION(T) ();
@@ -2374,93 +2293,243 @@ namespace ad {
             ret.GetExpression()->SetRight(exp);
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
 
+#endif
+
     template<class T >
     std::ostream & operator<<(std::ostream &out, ADNumber<T> const &t) {
         out << t.GetValue();
         return out;
     }
 
+    /**
+     * Computes the derivatives of x with respect to wrt of orders 0 to order
+     * with one univariate Taylor sweep over x's compiled graph. No
+     * derivative graphs are built. Throws std::logic_error if x was
+     * recorded on a tape rather than as an expression graph.
+     * 
+     * @param x
+     * @param wrt
+     * @param order
+     * @param derivatives - resized to order + 1.
+     */
     template<class T>
-    static T DerivativeValue(const ad::ADNumber<T> &x, const ad::ADNumber<T> &wrt, unsigned int order) {
+    void Derivatives(const ad::ADNumber<T> &x, const ad::ADNumber<T> &wrt, unsigned int order,
+            std::valarray<T> &derivatives) {
+        if (x.GetExpression() == NULL) {
+            throw std::logic_error("ad::Derivatives requires expression recording.");
+        }
+
+        CompiledExpression<T> compiled;
+        compiled.Compile(x.GetExpression());
+        Taylor<T> taylor;
+        taylor.Propagate(compiled, wrt.GetID(), order);
+        taylor.Derivatives(derivatives);
+    }
 
+    template<class T>
+    static T DerivativeValue(const ad::ADNumber<T> &x, const ad::ADNumber<T> &wrt, unsigned int order) {
         if (order == 0) {
             return x.GetValue();
         }
 
-        if (order == 1) {
-            return EvaluateDerivative<T > (x.GetExpression(), wrt.GetID());
-        }
-
-
-
-        ExpressionPtr exp = Differentiate<T > (x.GetExpression(), wrt.GetID());
-        exp->take();
-        ExpressionPtr temp;
-
-        if (order > 1) {
+        std::valarray<T> derivatives;
+        ad::Derivatives(x, wrt, order, derivatives);
+        return derivatives[order];
+    }
 
-            size_t i;
-            for (i = 1; i < order - 1; i++) {
+    /**
+     * Mixed partial derivative of x with respect to the variables in wrt;
+     * a variable listed k times is differentiated k times. Computed by one
+     * multi-directional Taylor sweep over x's compiled graph. Throws
+     * std::logic_error if x was recorded on a tape rather than as an
+     * expression graph.
+     * 
+     * @param x
+     * @param wrt
+     * @return 
+     */
+    template<class T>
+    static T MixedPartialValue(const ADNumber<T> &x, const std::vector<const ADNumber<T>*> &wrt) {
+        if (wrt.empty()) {
+            return x.GetValue();
+        }
+        if (x.GetExpression() == NULL) {
+            throw std::logic_error("ad::MixedPartialValue requires expression recording.");
+        }
 
-                temp = Differentiate<T > (exp, wrt.GetID());
-                temp->take();
+        std::vector<unsigned long> ids;
+        std::vector<std::vector<unsigned int> > indices(1);
+        for (size_t i = 0; i < wrt.size(); i++) {
+            size_t p = std::find(ids.begin(), ids.end(), wrt[i]->GetID()) - ids.begin();
+            if (p == ids.size()) {
+                ids.push_back(wrt[i]->GetID());
+                indices[0].push_back(0);
+            }
+            indices[0][p]++;
+        }
 
-                exp->release();
-                exp = temp;
+        CompiledExpression<T> compiled;
+        compiled.Compile(x.GetExpression());
+        std::vector<T> partials;
+        ad::MixedPartials(compiled, ids, indices, partials);
+        return partials[0];
+    }
 
+    /**
+     * Every partial derivative of x of the given order with respect to the
+     * variables in wrt, from one multi-directional Taylor sweep. On return
+     * indices[m][i] is the order with respect to wrt[i] of derivatives[m].
+     * 
+     * @param x
+     * @param wrt
+     * @param order
+     * @param indices
+     * @param derivatives
+     */
+    template<class T>
+    void DerivativeTensor(const ADNumber<T> &x, const std::vector<ADNumber<T>* > &wrt, unsigned int order,
+            std::vector<std::vector<unsigned int> > &indices, std::vector<T> &derivatives) {
+        std::vector<unsigned long> ids(wrt.size());
+        for (size_t i = 0; i < wrt.size(); i++) {
+            ids[i] = wrt[i]->GetID();
+        }
+        ad::MultiIndices(wrt.size(), order, indices);
 
+        if (x.GetExpression() == NULL) {
+            if (order != 0) {
+                throw std::logic_error("ad::DerivativeTensor requires expression recording.");
             }
-
+            derivatives.assign(indices.size(), x.GetValue());
+            return;
         }
 
-        T ret = ad::EvaluateDerivative<T > (exp, wrt.GetID());
-
-
-        return ret;
+        CompiledExpression<T> compiled;
+        compiled.Compile(x.GetExpression());
+        ad::MixedPartials(compiled, ids, indices, derivatives);
     }
 
+    /**
+     * Derivative of the given order of x with respect to wrt as an
+     * expression graph, so it can be differentiated again. The first
+     * derivative is taken by Differentiate; higher orders are recorded by
+     * one Taylor sweep over x's graph (see ad::TaylorDerivative) instead of
+     * differentiating order times, falling back to that only for
+     * operations the sweep does not cover. Throws std::logic_error if x was
+     * recorded on a tape rather than as an expression graph.
+     * 
+     * @param x
+     * @param wrt
+     * @param order
+     * @return derivative
+     */
     template<class T>
     static const ADNumber<T> Derivative(const ADNumber<T> &x, const ADNumber<T> &wrt, unsigned int order) {
-
-
         if (order == 0) {
             return ADNumber<T > (x);
         }
 
+        if (x.GetExpression() == NULL) {
+            throw std::logic_error("ad::Derivative requires expression recording.");
+        }
 
-        ExpressionPtr exp = Differentiate<T > (x.GetExpression(), wrt.GetID());
-//                exp->take();
-
-        ExpressionPtr temp;
-
+        ExpressionPtr exp = NULL;
         if (order > 1) {
+            exp = ad::TaylorDerivative<T > (x.GetExpression(), wrt.GetID(), order);
+        }
 
-            size_t i;
-            for (i = 1; i < order; i++) {
-
-                temp = Differentiate<T > (exp, wrt.GetID());
-//                                temp->take();
-
+        if (exp == NULL) {
+            exp = Differentiate<T > (x.GetExpression(), wrt.GetID());
+            for (size_t i = 1; i < order; i++) {
+                ExpressionPtr temp = Differentiate<T > (exp, wrt.GetID());
                 exp->release();
                 exp = temp;
-
-
             }
-
         }
 
         ADNumber<T> ret(exp);
         ret.SetValue(Evaluate(ret.GetExpression()));
-//        exp->release();
+        //ret took its own reference
+        exp->release();
 
         return ret;
 
     }
 
+    /**
+     * Computes the gradient of f with respect to each ADNumber in wrt using
+     * a single reverse sweep of f's expression graph, or of the active tape
+     * when f was recorded in tape mode.
+     * 
+     * @param f
+     * @param wrt
+     * @param gradient - resized to wrt.size() if needed.
+     */
+    template<class T>
+    void Gradient(const ADNumber<T> &f, const std::vector<ADNumber<T>* > &wrt, std::valarray<T> &gradient) {
+        std::vector<unsigned long> ids(wrt.size());
+        for (size_t i = 0; i < wrt.size(); i++) {
+            ids[i] = wrt[i]->GetID();
+        }
+
+        if (ADNumber<T>::IsRecordingTape() || f.GetExpression() == NULL) {
+            Tape<T>::Active()->Gradient(f.GetTapeIndex(), ids, gradient);
+            return;
+        }
+
+        ad::EvaluateGradient<T > (f.GetExpression(), ids, gradient);
+    }
+
+    /**
+     * Computes the Jacobian of the functions f with respect to wrt in
+     * compressed sparse row form. Each row keeps only the columns its graph
+     * depends on, found from the graph's structure; the values come from one
+     * reverse sweep of that row's compiled graph. Rows recorded in tape mode
+     * keep their nonzero gradient entries.
+     * 
+     * @param f
+     * @param wrt
+     * @param jacobian
+     */
+    template<class T>
+    void SparseJacobian(const std::vector<ADNumber<T>* > &f, const std::vector<ADNumber<T>* > &wrt,
+            CSRMatrix<T> &jacobian) {
+        std::vector<unsigned long> ids(wrt.size());
+        for (size_t i = 0; i < wrt.size(); i++) {
+            ids[i] = wrt[i]->GetID();
+        }
+
+        std::vector<std::vector<int> > rows(f.size());
+        std::vector<std::valarray<T> > gradients(f.size());
+        CompiledExpression<T> compiled;
+        for (size_t i = 0; i < f.size(); i++) {
+            if (ADNumber<T>::IsRecordingTape() || f[i]->GetExpression() == NULL) {
+                Tape<T>::Active()->Gradient(f[i]->GetTapeIndex(), ids, gradients[i]);
+                for (size_t j = 0; j < gradients[i].size(); j++) {
+                    if (gradients[i][j] != T(0)) {
+                        rows[i].push_back(static_cast<int> (j));
+                    }
+                }
+                continue;
+            }
+            compiled.Compile(f[i]->GetExpression());
+            compiled.Bind(ids);
+            compiled.GradientSparsity(rows[i]);
+            compiled.Gradient(gradients[i]);
+        }
+
+        jacobian.SetPattern(wrt.size(), rows);
+        for (size_t i = 0; i < f.size(); i++) {
+            for (int k = jacobian.row_offsets[i]; k < jacobian.row_offsets[i + 1]; k++) {
+                jacobian.values[k] = gradients[i][jacobian.columns[k]];
+            }
+        }
+    }
+
     template<class T>
     void Update(ad::ADNumber<T> &var, const ad::ADNumber<T> &wrt) {
         var.GetExpression()->Update(wrt.GetID(), wrt.GetValue());
@@ -2489,338 +2558,42 @@ namespace ad {
         return dest.u;
     }
 
+    /**
+     * Writes the graph of expression to out in the GraphFile format.
+     * 
+     * @param expression
+     * @param out
+     * @return false if the stream failed
+     */
     template<class T>
-    static void Serialize(ad::Expression<T>* expression, std::ostream &out) {
-
-
-        bool little_endian = true;
-
-        int num = 1;
-        if (*(char *) &num == 1) {
-            little_endian = true;
-        } else {
-            little_endian = false;
-        }
-
+    static bool Serialize(ad::Expression<T>* expression, std::ostream &out) {
         if (!out.good()) {
-            std::cout << "Expression serialization stream not open!";
-            return;
-        }
-
-        std::queue<Expression<T>* > Q;
-
-        Q.push(expression);
-
-        while (Q.size()) {
-            Expression<T>* exp = (Expression<T>*)Q.front();
-
-            if (exp == NULL) {
-                Q.pop();
-                continue;
-            }
-
-            unsigned long id = exp->GetId();
-
-
-            if (!little_endian) {
-                id = SwapBytes<unsigned long>(id);
-            }
-
-            out.write(reinterpret_cast<const char*> (&id), sizeof (id));
-
-            int op = (int) exp->GetOp();
-
-            if (!little_endian) {
-                op = SwapBytes<int>(op);
-            }
-
-
-            out.write(reinterpret_cast<const char*> (&op), sizeof (int));
-
-            T value = exp->GetValue();
-
-            if (!little_endian) {
-                value = SwapBytes<T > (value);
-            }
-
-            out.write(reinterpret_cast<const char*> (&value), sizeof ( T));
-
-            size_t namesize = exp->GetName().size();
-            out.write(reinterpret_cast<const char*> (&namesize), sizeof (namesize));
-            out << exp->GetName().c_str();
-
-            if (exp->GetLeft()) {
-                out << '1';
-            } else {
-                out << '0';
-            }
-
-            if (exp->GetRight()) {
-                out << '1';
-            } else {
-                out << '0';
-            }
-
-            if (exp->GetLeft() == NULL && exp->GetRight() == NULL) {
-                Q.pop();
-                continue;
-            }
-
-
-            Q.push(exp->GetLeft());
-            Q.push(exp->GetRight());
-            Q.pop();
-
+            return false;
         }
 
+        return ad::GraphFile<T>::Write(expression, out);
     }
 
+    /**
+     * Reads a graph written by Serialize from in, with exp as its root.
+     * exp is left unchanged if in does not hold a valid graph.
+     * 
+     * @param exp
+     * @param in
+     * @return false if the stream failed or is not a graph of T
+     */
     template<class T>
-    static void Deserialize(ad::Expression<T>* exp, std::istream &in) {
-
-        bool little_endian = true;
-
-        int num = 1;
-        if (*(char *) &num == 1) {
-            little_endian = true;
-        } else {
-            little_endian = false;
-        }
-
+    static bool Deserialize(ad::Expression<T>* exp, std::istream &in) {
         if (!in.good()) {
-            std::cout << "Expression serialization stream not open!";
-            return;
-        }
-
-        if (NULL == exp) {
-            exp = new ad::Expression<T > ();
-
-            exp->SetLeft(NULL);
-            exp->SetRight(NULL);
-        }
-
-        unsigned long* id;
-        char idc[sizeof (id)];
-        in.read(idc, sizeof (id));
-        id = reinterpret_cast<unsigned long*> (idc);
-
-        if (!little_endian) {
-            exp->SetId(SwapBytes<unsigned long > (*id));
-        } else {
-            exp->SetId(*id);
-        }
-
-
-
-
-        int* op;
-        char opc[sizeof (int) ];
-        in.read(opc, sizeof (int));
-        op = reinterpret_cast<int*> (opc);
-
-        if (!little_endian) {
-            exp->SetOp(static_cast<ad::Operation> (SwapBytes<int> (*op)));
-        } else {
-            exp->SetOp(static_cast<ad::Operation> (*op));
+            return false;
         }
 
-
-        T* value;
-        char valc[sizeof (T)];
-        in.read(valc, sizeof (T));
-        value = reinterpret_cast<T*> (valc);
-
-
-        if (!little_endian) {
-            exp->SetValue((SwapBytes<T > (*value)));
-        } else {
-            exp->SetValue(*value);
-        }
-
-        size_t* namesize;
-        char namesizec[sizeof (size_t)];
-        in.read(namesizec, sizeof (size_t));
-        namesize = reinterpret_cast<size_t*> (namesizec);
-
-        char namec[*namesize + 1];
-        namec[*namesize] = '\0';
-
-        in.read(namec, *namesize);
-        exp->SetName(std::string(namec));
-
-        char left;
-        in >> left;
-
-        if (left == '1') {
-            exp->SetLeft(new Expression<T > ());
-        }
-
-        char right;
-        in >> right;
-
-        if (right == '1') {
-            exp->SetRight(new Expression<T > ());
-        }
-
-        std::queue<Expression<T>* > Q;
-
-        Q.push(exp);
-
-        while (!Q.empty()) {
-
-
-            Expression<T>* current = Q.front();
-
-
-            Q.pop();
-
-
-
-            if (current->GetLeft() != NULL) {
-
-                Expression<T>* expression = current->GetLeft();
-                expression->SetLeft(NULL);
-                expression->SetRight(NULL);
-                unsigned long* id;
-                char idc[sizeof (id)];
-                in.read(idc, sizeof (id));
-                id = reinterpret_cast<unsigned long*> (idc);
-
-                if (!little_endian) {
-                    expression->SetId(SwapBytes<unsigned long > (*id));
-                } else {
-                    expression->SetId(*id);
-                }
-
-
-
-
-                int* op;
-                char opc[sizeof (int) ];
-                in.read(opc, sizeof (int));
-                op = reinterpret_cast<int*> (opc);
-
-                if (!little_endian) {
-                    expression->SetOp(static_cast<ad::Operation> (SwapBytes<int> (*op)));
-                } else {
-                    expression->SetOp(static_cast<ad::Operation> (*op));
-                }
-
-
-                T* value;
-                char valc[sizeof (T)];
-                in.read(valc, sizeof (T));
-                value = reinterpret_cast<T*> (valc);
-
-
-                if (!little_endian) {
-                    expression->SetValue((SwapBytes<T > (*value)));
-                } else {
-                    expression->SetValue(*value);
-                }
-
-                size_t* namesize;
-                char namesizec[sizeof (size_t)];
-                in.read(namesizec, sizeof (size_t));
-                namesize = reinterpret_cast<size_t*> (namesizec);
-
-                char namec[*namesize + 1];
-                namec[*namesize] = '\0';
-
-                in.read(namec, *namesize);
-                expression->SetName(std::string(namec));
-
-                char left;
-                in >> left;
-
-                if (left == '1') {
-                    expression->SetLeft(new Expression<T > ());
-                }
-
-                char right;
-                in >> right;
-
-                if (right == '1') {
-                    expression->SetRight(new Expression<T > ());
-                }
-
-                Q.push(expression);
-
-            }
-
-
-            if (current->GetRight() != NULL) {
-                Expression<T>* expression = current->GetRight();
-                expression->SetLeft(NULL);
-                expression->SetRight(NULL);
-
-                unsigned long* id;
-                char idc[sizeof (id)];
-                in.read(idc, sizeof (id));
-                id = reinterpret_cast<unsigned long*> (idc);
-
-                if (!little_endian) {
-                    expression->SetId(SwapBytes<unsigned long > (*id));
-                } else {
-                    expression->SetId(*id);
-                }
-
-
-
-
-                int* op;
-                char opc[sizeof (int) ];
-                in.read(opc, sizeof (int));
-                op = reinterpret_cast<int*> (opc);
-
-                if (!little_endian) {
-                    expression->SetOp(static_cast<ad::Operation> (SwapBytes<int> (*op)));
-                } else {
-                    expression->SetOp(static_cast<ad::Operation> (*op));
-                }
-
-
-                T* value;
-                char valc[sizeof (T)];
-                in.read(valc, sizeof (T));
-                value = reinterpret_cast<T*> (valc);
-
-
-                if (!little_endian) {
-                    expression->SetValue((SwapBytes<T > (*value)));
-                } else {
-                    expression->SetValue(*value);
-                }
-
-                size_t* namesize;
-                char namesizec[sizeof (size_t)];
-                in.read(namesizec, sizeof (size_t));
-                namesize = reinterpret_cast<size_t*> (namesizec);
-
-                char namec[*namesize + 1];
-                namec[*namesize] = '\0';
-
-                in.read(namec, *namesize);
-                expression->SetName(std::string(namec));
-
-                char left;
-                in >> left;
-
-                if (left == '1') {
-                    expression->SetLeft(new Expression<T > ());
-                }
-
-                char right;
-                in >> right;
-
-                if (right == '1') {
-                    expression->SetRight(new Expression<T > ());
-                }
-
-                Q.push(expression);
-            }
-
+        ad::GraphFile<T> graph;
+        if (!graph.Read(in)) {
+            return false;
         }
+        graph.Build(exp);
+        return true;
     }
 
     template<class T>
@@ -2846,12 +2619,18 @@ namespace std {
      * @return 
      */
     template<class T> const ad::ADNumber<T> atan(const ad::ADNumber<T> &val) {
+        if (ad::ADNumber<T>::IsRecordingTape()) {
+            T x = val.GetValue();
+            T v = atan(x);
+            return ad::ADNumber<T>::TapeOperation(v, ad::ATAN, val.GetTapeIndex(), -1, T(1.0) / (x * x + T(1.0)), T(0.0));
+        }
         ad::ADNumber<T> ret(atan(val.GetValue()));
         if (ad::ADNumber<T>::IsRecordingExpression()) {
             ret.GetExpression()->SetOp(ad::ATAN);
             ret.GetExpression()->SetLeft(val.GetExpression());
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -2863,6 +2642,12 @@ namespace std {
      * @return 
      */
     template<class T> const ad::ADNumber<T> atan2(const ad::ADNumber<T> &lhs, const ad::ADNumber<T> &rhs) {
+        if (ad::ADNumber<T>::IsRecordingTape()) {
+            T x = lhs.GetValue();
+            T y = rhs.GetValue();
+            T d = x * x + y * y;
+            return ad::ADNumber<T>::TapeOperation(atan2(x, y), ad::ATAN2, lhs.GetTapeIndex(), rhs.GetTapeIndex(), y / d, T(-1.0) * x / d);
+        }
 
         T x = lhs.GetValue();
         T y = rhs.GetValue();
@@ -2874,6 +2659,7 @@ namespace std {
             ret.GetExpression()->SetRight(rhs.GetExpression());
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -2886,6 +2672,12 @@ namespace std {
      * @return 
      */
     template<class T> const ad::ADNumber<T> atan2(T lhs, const ad::ADNumber<T> &rhs) {
+        if (ad::ADNumber<T>::IsRecordingTape()) {
+            T x = lhs;
+            T y = rhs.GetValue();
+            T d = x * x + y * y;
+            return ad::ADNumber<T>::TapeOperation(atan2(x, y), ad::ATAN2, -1, rhs.GetTapeIndex(), T(0.0), T(-1.0) * x / d);
+        }
 
 
         T x = lhs;
@@ -2903,6 +2695,7 @@ namespace std {
             ret.GetExpression()->SetRight(rhs.GetExpression());
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -2915,6 +2708,12 @@ namespace std {
      * @return 
      */
     template<class T> const ad::ADNumber<T> atan2(const ad::ADNumber<T> &lhs, T rhs) {
+        if (ad::ADNumber<T>::IsRecordingTape()) {
+            T x = lhs.GetValue();
+            T y = rhs;
+            T d = x * x + y * y;
+            return ad::ADNumber<T>::TapeOperation(atan2(x, y), ad::ATAN2, lhs.GetTapeIndex(), -1, y / d, T(0.0));
+        }
 
         T x = lhs.GetValue();
         T y = rhs;
@@ -2931,6 +2730,7 @@ namespace std {
             ret.GetExpression()->SetRight(exp);
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -2942,12 +2742,18 @@ namespace std {
      * @return 
      */
     template<class T> const ad::ADNumber<T> cos(const ad::ADNumber<T> &val) {
+        if (ad::ADNumber<T>::IsRecordingTape()) {
+            T x = val.GetValue();
+            T v = cos(x);
+            return ad::ADNumber<T>::TapeOperation(v, ad::COS, val.GetTapeIndex(), -1, T(-1.0) * sin(x), T(0.0));
+        }
         ad::ADNumber<T> ret(cos(val.GetValue()));
         if (ad::ADNumber<T>::IsRecordingExpression()) {
             ret.GetExpression()->SetOp(ad::COS);
             ret.GetExpression()->SetLeft(val.GetExpression());
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -2959,12 +2765,18 @@ namespace std {
      * @return 
      */
     template<class T> const ad::ADNumber<T> exp(const ad::ADNumber<T> &val) {
+        if (ad::ADNumber<T>::IsRecordingTape()) {
+            T x = val.GetValue();
+            T v = exp(x);
+            return ad::ADNumber<T>::TapeOperation(v, ad::EXP, val.GetTapeIndex(), -1, v, T(0.0));
+        }
         ad::ADNumber<T> ret(exp(val.GetValue()));
         if (ad::ADNumber<T>::IsRecordingExpression()) {
             ret.GetExpression()->SetOp(ad::EXP);
             ret.GetExpression()->SetLeft(val.GetExpression());
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -2986,12 +2798,18 @@ namespace std {
      * @return 
      */
     template<class T> const ad::ADNumber<T> log(const ad::ADNumber<T> &val) {
+        if (ad::ADNumber<T>::IsRecordingTape()) {
+            T x = val.GetValue();
+            T v = log(x);
+            return ad::ADNumber<T>::TapeOperation(v, ad::LOG, val.GetTapeIndex(), -1, T(1.0) / x, T(0.0));
+        }
         ad::ADNumber<T> ret(log(val.GetValue()));
         if (ad::ADNumber<T>::IsRecordingExpression()) {
             ret.GetExpression()->SetOp(ad::LOG);
             ret.GetExpression()->SetLeft(val.GetExpression());
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -3002,6 +2820,11 @@ namespace std {
      * @return 
      */
     template<class T> const ad::ADNumber<T> log10(const ad::ADNumber<T> &val) {
+        if (ad::ADNumber<T>::IsRecordingTape()) {
+            T x = val.GetValue();
+            T v = log10(x);
+            return ad::ADNumber<T>::TapeOperation(v, ad::LOG10, val.GetTapeIndex(), -1, T(1.0) / (x * log(T(10.0))), T(0.0));
+        }
         ad::ADNumber<T> ret(log10(val.GetValue()));
 
         if (ad::ADNumber<T>::IsRecordingExpression()) {
@@ -3023,6 +2846,12 @@ namespace std {
      * @return 
      */
     template<class T> const ad::ADNumber<T> pow(const ad::ADNumber<T> &lhs, const ad::ADNumber<T> &rhs) {
+        if (ad::ADNumber<T>::IsRecordingTape()) {
+            T x = lhs.GetValue();
+            T y = rhs.GetValue();
+            T v = pow(x, y);
+            return ad::ADNumber<T>::TapeOperation(v, ad::POW, lhs.GetTapeIndex(), rhs.GetTapeIndex(), y * pow(x, y - T(1.0)), v * log(x));
+        }
         ad::ADNumber<T> ret(pow(lhs.GetValue(), rhs.GetValue()));
         if (ad::ADNumber<T>::IsRecordingExpression()) {
             ret.GetExpression()->SetOp(ad::POW);
@@ -3030,6 +2859,7 @@ namespace std {
             ret.GetExpression()->SetRight(rhs.GetExpression());
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -3042,6 +2872,10 @@ namespace std {
      * @return 
      */
     template<class T> const ad::ADNumber<T> pow(T lhs, const ad::ADNumber<T> & rhs) {
+        if (ad::ADNumber<T>::IsRecordingTape()) {
+            T v = pow(lhs, rhs.GetValue());
+            return ad::ADNumber<T>::TapeOperation(v, ad::POW, -1, rhs.GetTapeIndex(), T(0.0), v * log(lhs));
+        }
         ad::ADNumber<T> ret(pow(lhs, rhs.GetValue()));
         if (ad::ADNumber<T>::IsRecordingExpression()) {
             ad::ExpressionPtr exp = new ad::Expression<T > ();
@@ -3053,6 +2887,7 @@ namespace std {
             ret.GetExpression()->SetRight(rhs.GetExpression());
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -3065,6 +2900,10 @@ namespace std {
      * @return 
      */
     template<class T> const ad::ADNumber<T> pow(const ad::ADNumber<T> &lhs, T rhs) {
+        if (ad::ADNumber<T>::IsRecordingTape()) {
+            T x = lhs.GetValue();
+            return ad::ADNumber<T>::TapeOperation(pow(x, rhs), ad::POW, lhs.GetTapeIndex(), -1, rhs * pow(x, rhs - T(1.0)), T(0.0));
+        }
         T val = std::pow(lhs.GetValue(), rhs);
         if (ad::ADNumber<T>::IsRecordingExpression()) {
 
@@ -3073,6 +2912,7 @@ namespace std {
             ret.GetExpression()->SetOp(ad::POW);
             ret.GetExpression()->SetLeft(lhs.GetExpression());
             ret.GetExpression()->SetRight(NEW_EXPRESSION(T)(rhs, 0, ad::CONSTANT, NULL, NULL));
+            ret.Canonicalize();
             return ret;
             //            
             //            return ad::ADNumber<T > (val,
@@ -3091,12 +2931,18 @@ namespace std {
      * @return 
      */
     template<class T> const ad::ADNumber<T> sin(const ad::ADNumber<T> &val) {
+        if (ad::ADNumber<T>::IsRecordingTape()) {
+            T x = val.GetValue();
+            T v = sin(x);
+            return ad::ADNumber<T>::TapeOperation(v, ad::SIN, val.GetTapeIndex(), -1, cos(x), T(0.0));
+        }
         ad::ADNumber<T> ret(sin(val.GetValue()));
         if (ad::ADNumber<T>::IsRecordingExpression()) {
             ret.GetExpression()->SetOp(ad::SIN);
             ret.GetExpression()->SetLeft(val.GetExpression());
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -3108,6 +2954,11 @@ namespace std {
      * @return 
      */
     template<class T> const ad::ADNumber<T> sqrt(const ad::ADNumber<T> &val) {
+        if (ad::ADNumber<T>::IsRecordingTape()) {
+            T x = val.GetValue();
+            T v = sqrt(x);
+            return ad::ADNumber<T>::TapeOperation(v, ad::SQRT, val.GetTapeIndex(), -1, T(0.5) / v, T(0.0));
+        }
         T temp = sqrt(val.GetValue());
         ad::ADNumber<T> ret(temp);
         if (ad::ADNumber<T>::IsRecordingExpression()) {
@@ -3115,6 +2966,7 @@ namespace std {
             ret.GetExpression()->SetLeft(val.GetExpression());
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -3126,6 +2978,11 @@ namespace std {
      * @return 
      */
     template<class T> const ad::ADNumber<T> tan(const ad::ADNumber<T> &val) {
+        if (ad::ADNumber<T>::IsRecordingTape()) {
+            T x = val.GetValue();
+            T v = tan(x);
+            return ad::ADNumber<T>::TapeOperation(v, ad::TAN, val.GetTapeIndex(), -1, (T(1.0) / cos(x)) * (T(1.0) / cos(x)), T(0.0));
+        }
         T temp = cos(val.GetValue());
         ad::ADNumber<T> ret(tan(val.GetValue()));
         if (ad::ADNumber<T>::IsRecordingExpression()) {
@@ -3133,6 +2990,7 @@ namespace std {
             ret.GetExpression()->SetLeft(val.GetExpression());
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -3144,6 +3002,11 @@ namespace std {
      * @return 
      */
     template<class T> const ad::ADNumber<T> acos(const ad::ADNumber<T> & val) {
+        if (ad::ADNumber<T>::IsRecordingTape()) {
+            T x = val.GetValue();
+            T v = acos(x);
+            return ad::ADNumber<T>::TapeOperation(v, ad::ACOS, val.GetTapeIndex(), -1, T(-1.0) / sqrt(T(1.0) - x * x), T(0.0));
+        }
 
         ad::ADNumber<T> ret(acos(val.GetValue()));
         if (ad::ADNumber<T>::IsRecordingExpression()) {
@@ -3151,6 +3014,7 @@ namespace std {
             ret.GetExpression()->SetLeft(val.GetExpression());
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -3162,12 +3026,18 @@ namespace std {
      * @return 
      */
     template<class T> const ad::ADNumber<T> asin(const ad::ADNumber<T> &val) {
+        if (ad::ADNumber<T>::IsRecordingTape()) {
+            T x = val.GetValue();
+            T v = asin(x);
+            return ad::ADNumber<T>::TapeOperation(v, ad::ASIN, val.GetTapeIndex(), -1, T(1.0) / sqrt(T(1.0) - x * x), T(0.0));
+        }
         ad::ADNumber<T> ret(asin(val.GetValue()));
         if (ad::ADNumber<T>::IsRecordingExpression()) {
             ret.GetExpression()->SetOp(ad::ASIN);
             ret.GetExpression()->SetLeft(val.GetExpression());
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -3179,6 +3049,11 @@ namespace std {
      * @return 
      */
     template<class T> const ad::ADNumber<T> sinh(const ad::ADNumber<T> &val) {
+        if (ad::ADNumber<T>::IsRecordingTape()) {
+            T x = val.GetValue();
+            T v = sinh(x);
+            return ad::ADNumber<T>::TapeOperation(v, ad::SINH, val.GetTapeIndex(), -1, cosh(x), T(0.0));
+        }
 
         ad::ADNumber<T> ret(sinh(val.GetValue()));
         if (ad::ADNumber<T>::IsRecordingExpression()) {
@@ -3186,6 +3061,7 @@ namespace std {
             ret.GetExpression()->SetLeft(val.GetExpression());
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -3196,12 +3072,18 @@ namespace std {
      * @return 
      */
     template<class T> const ad::ADNumber<T> cosh(const ad::ADNumber<T> &val) {
+        if (ad::ADNumber<T>::IsRecordingTape()) {
+            T x = val.GetValue();
+            T v = cosh(x);
+            return ad::ADNumber<T>::TapeOperation(v, ad::COSH, val.GetTapeIndex(), -1, sinh(x), T(0.0));
+        }
         ad::ADNumber<T> ret(cosh(val.GetValue()));
         if (ad::ADNumber<T>::IsRecordingExpression()) {
             ret.GetExpression()->SetOp(ad::COSH);
             ret.GetExpression()->SetLeft(val.GetExpression());
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -3212,6 +3094,11 @@ namespace std {
      * @return 
      */
     template<class T> const ad::ADNumber<T> tanh(const ad::ADNumber<T> &val) {
+        if (ad::ADNumber<T>::IsRecordingTape()) {
+            T x = val.GetValue();
+            T v = tanh(x);
+            return ad::ADNumber<T>::TapeOperation(v, ad::TANH, val.GetTapeIndex(), -1, (T(1.0) / cosh(x)) * (T(1.0) / cosh(x)), T(0.0));
+        }
         T temp = cosh(val.GetValue());
         ad::ADNumber<T> ret(std::tanh(val.GetValue()));
         if (ad::ADNumber<T>::IsRecordingExpression()) {
@@ -3219,6 +3106,7 @@ namespace std {
             ret.GetExpression()->SetLeft(val.GetExpression());
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -3229,6 +3117,11 @@ namespace std {
      * @return 
      */
     template<class T> const ad::ADNumber<T> fabs(const ad::ADNumber<T> &val) {
+        if (ad::ADNumber<T>::IsRecordingTape()) {
+            T x = val.GetValue();
+            T v = fabs(x);
+            return ad::ADNumber<T>::TapeOperation(v, ad::FABS, val.GetTapeIndex(), -1, x / v, T(0.0));
+        }
 
         ad::ADNumber<T> ret(fabs(val.GetValue()));
         if (ad::ADNumber<T>::IsRecordingExpression()) {
@@ -3236,6 +3129,7 @@ namespace std {
             ret.GetExpression()->SetLeft(val.GetExpression());
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -3247,12 +3141,18 @@ namespace std {
      * @return 
      */
     template<class T> const ad::ADNumber<T> floor(const ad::ADNumber<T> &val) {
+        if (ad::ADNumber<T>::IsRecordingTape()) {
+            T x = val.GetValue();
+            T v = floor(x);
+            return ad::ADNumber<T>::TapeOperation(v, ad::FLOOR, val.GetTapeIndex(), -1, T(0.0), T(0.0));
+        }
         ad::ADNumber<T> ret(floor(val.GetValue()));
         if (ad::ADNumber<T>::IsRecordingExpression()) {
             ret.GetExpression()->SetOp(ad::FLOOR);
             ret.GetExpression()->SetLeft(val.GetExpression());
             ret.GetExpression()->SetId(ret.GetID());
             ret.GetExpression()->SetValue(ret.GetValue());
+            ret.Canonicalize();
         }
         return ret;
     }
@@ -3261,6 +3161,43 @@ namespace std {
 
 #ifdef ADNUMBER_MPI_SUPPORT
 
+#include <mpi.h>
+
+namespace ad {
+
+    /**
+     * MPI datatype of T, for reductions of values and gradients.
+     */
+    template<class T>
+    struct MPIType {
+    };
+
+    template<>
+    struct MPIType<float> {
+
+        static MPI_Datatype Get() {
+            return MPI_FLOAT;
+        }
+    };
+
+    template<>
+    struct MPIType<double> {
+
+        static MPI_Datatype Get() {
+            return MPI_DOUBLE;
+        }
+    };
+
+    template<>
+    struct MPIType<long double> {
+
+        static MPI_Datatype Get() {
+            return MPI_LONG_DOUBLE;
+        }
+    };
+
+}
+
 /**
  * Message Passing Interface support. Serializes the ADNumber using
  * ad::Serialize. Sends via char array.
@@ -3277,55 +3214,69 @@ int tag,
 MPI_Comm comm) {
 
     std::stringstream ss;
-    ad::Serialize<T > (x.expression, ss);
-    int size = ss.str().size();
+    ad::Serialize<T > (x.GetExpression(), ss);
+    std::string data = ss.str();
+    int size = static_cast<int> (data.size());
 
     int error = MPI_Send(&size, 1, MPI_INT, dest, tag, comm);
+    if (error != MPI_SUCCESS) {
+        return error;
+    }
 
-    return MPI_Send((void*) ss.str().c_str(), ss.str().size(), MPI_CHAR, dest, tag, comm);
+    return MPI_Send((void*) data.data(), size, MPI_CHAR, dest, tag, comm);
 }
 
-#include <fstream>
-
 /**
  * Deserializes a char array using ad::Serialize and reconstructs a ADNumber.
+ * x is left unchanged if a receive fails or the data is not a graph.
  * 
  * @param x
  * @param source
  * @param tag
  * @param comm
  * @param status
- * @return 
+ * @return MPI_SUCCESS, the error of a failed receive, MPI_ERR_COUNT for
+ * a negative size or MPI_ERR_OTHER if the data is not a graph
  */
 template<class T>
 int MPI_Recv_ADNumber(ad::ADNumber<T> &x,
 int source, int tag,
 MPI_Comm comm, MPI_Status *status) {
-    std::stringstream ss;
     int size = 0;
 
-    MPI_Recv(&size, 1, MPI_INT, source, tag, comm, status);
-
-    char* data = new char[size];
-    int ret = MPI_Recv(data, size, MPI_CHAR, source, tag, comm, status);
+    int error = MPI_Recv(&size, 1, MPI_INT, source, tag, comm, status);
+    if (error != MPI_SUCCESS) {
+        return error;
+    }
+    if (size < 0) {
+        return MPI_ERR_COUNT;
+    }
 
-    for (int i = 0; i < size; i++) {
-        ss << data[i];
+    std::string data(static_cast<size_t> (size), '\0');
+    error = MPI_Recv(size > 0 ? &data[0] : NULL, size, MPI_CHAR, source, tag, comm, status);
+    if (error != MPI_SUCCESS) {
+        return error;
     }
 
+    std::stringstream ss(data);
     ad::Expression<T>* exp = new ad::Expression<T > ();
-    ad::Deserialize<T > (exp, ss);
-
-    delete data;
-    //  std::cout<<exp->ToString();
+    if (!ad::Deserialize<T > (exp, ss)) {
+        delete exp;
+        return MPI_ERR_OTHER;
+    }
 
     x = ad::ADNumber<T > (exp);
-    return ret;
+    return MPI_SUCCESS;
 
 }
 
 #endif
 
+#include "util/Checkpoint.hpp"
+
+#ifdef ADNUMBER_EXPRESSION_TEMPLATES
+#include "util/ExpressionTemplate.hpp"
+#endif
 
 #endif	/* ADNUMBER_HPP */
 
@@ -6,14 +6,902 @@
  */
 
 #include <cstdlib>
+#include <cstddef>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <cstring>
+#include <stdexcept>
+#include <valarray>
+#include <vector>
+#include <stdlib.h>
+#include <dirent.h>
+#include <unistd.h>
 #include "../ADNumber.hpp"
+#include "../FunctionMinimizer.hpp"
+#include "../GradientCalculator.hpp"
 using namespace std;
 
+static int failures = 0;
+
+static void Check(bool passed, const char* what) {
+    if (!passed) {
+        std::cout << "FAILED: " << what << "\n";
+        failures++;
+    }
+}
+
+/*
+ * A simplified result (x * 1) is a number of its own.
+ */
+static void SimplifiedResultOwnsItsRoot() {
+    bool simplify = ad::ADNumber<double>::IsSimplifying();
+    ad::ADNumber<double>::SetSimplify(true);
+    ad::ADNumber<double> x("x", 3.0);
+    ad::ADNumber<double> y = x * 1.0;
+    y.SetValue(7.0);
+    Check(x.GetExpression()->GetValue() == 3.0, "simplify: setting x * 1 changed x");
+
+    ad::ADNumber<double> f = x * x;
+    Check(std::fabs(f.WRTValue(x) - 6.0) < 1e-12, "simplify: d(x * x)/dx");
+
+    ad::ADNumber<double> z("z", 0.0);
+    ad::ADNumber<double> q = 0.0 / z;
+    Check(q.GetValue() != q.GetValue(), "simplify: 0 / 0 is not nan");
+    Check(q.GetExpression()->GetOp() == ad::DIVIDE, "simplify: 0 / z was folded");
+
+    double special[] = {std::numeric_limits<double>::infinity(), std::numeric_limits<double>::quiet_NaN()};
+    for (int i = 0; i < 2; i++) {
+        ad::ADNumber<double> w("w", special[i]);
+        ad::ADNumber<double> m = w * 0.0;
+        ad::ADNumber<double> n = 0.0 * w;
+        ad::CompiledExpression<double> compiled;
+        compiled.Compile(m.GetExpression());
+        Check(m.GetExpression()->GetOp() == ad::MULTIPLY && n.GetExpression()->GetOp() == ad::MULTIPLY,
+                "simplify: w * 0 was folded");
+        Check(compiled.Forward() != compiled.Forward(), "simplify: inf or nan w * 0 is not nan");
+    }
+    ad::ADNumber<double>::SetSimplify(simplify);
+}
+
+/*
+ * Copy construction and copy assignment both give the copy its own root.
+ */
+static void CopiesOwnTheirRoots() {
+    ad::ADNumber<double> x("x", 2.0);
+    ad::ADNumber<double> a = x * x;
+    ad::ADNumber<double> b(a);
+    ad::ADNumber<double> c;
+    c = a;
+    b.SetValue(5.0);
+    c.SetValue(7.0);
+    Check(a.GetExpression()->GetValue() == 4.0, "copies: SetValue on a copy changed the original");
+    Check(std::fabs(c.WRT(x).GetValue() - 4.0) < 1e-12, "copies: d(x * x)/dx through an assigned copy");
+}
+
+/*
+ * Hash consed numbers share subexpressions, never roots.
+ */
+static void HashConsedNumbersAreDistinct() {
+    ad::ADNumber<double>::SetHashConsing(true);
+    ad::ADNumber<double> x("x", 0.5);
+    ad::ADNumber<double> m = x * x;
+    ad::ADNumber<double> a = std::exp(m);
+    ad::ADNumber<double> b = std::exp(m);
+    b.SetValue(99.0);
+    Check(a.GetExpression()->GetValue() == std::exp(0.25), "hash consing: setting b changed a");
+
+    ad::ADNumber<double> c = std::exp(m) + std::exp(m);
+    Check(c.GetExpression()->GetLeft() == c.GetExpression()->GetRight(),
+            "hash consing: exp(m) + exp(m) not shared");
+    Check(std::fabs(c.WRT(x).GetValue() - 2.0 * std::exp(0.25)) < 1e-12, "hash consing: d(2 exp(x * x))/dx");
+    ad::ADNumber<double>::SetHashConsing(false);
+}
+
+/*
+ * A name lives as long as the last number that carries it.
+ */
+static void NamesGoWithTheirNumbers() {
+    size_t before = ad::VariableNames::Size();
+    unsigned long id;
+    {
+        ad::ADNumber<double> x("x", 1.0);
+        id = x.GetID();
+        ad::ADNumber<double> y = x;
+        ad::ADNumber<double> z;
+        z = y;
+        Check(z.GetName() == "x", "names: copy lost the name");
+    }
+    Check(!ad::VariableNames::Has(id), "names: entry outlived its numbers");
+    Check(ad::VariableNames::Size() == before, "names: table grew");
+}
+
+/*
+ * WRT returns a derivative that can be differentiated again; WRTValue
+ * gives the same values from a Taylor sweep. Expected values are those of
+ * the original chained WRT.
+ */
+static void ChainedWRT() {
+    ad::ADNumber<double> x("x", 0.7);
+    ad::ADNumber<double> y("y", 2.0);
+    ad::ADNumber<double> f = x * x * y + std::sin(x * y);
+
+    ad::ADNumber<double> d = f.WRT(x);
+    ad::ADNumber<double> dd = d.WRT(y);
+    ad::ADNumber<double> ddd = dd.WRT(x);
+    Check(std::fabs(d.GetValue() - 3.1399342858004817) < 1e-12, "wrt: df/dx");
+    Check(std::fabs(dd.GetValue() - 0.19033752091639666) < 1e-12, "wrt: d(df/dx)/dy");
+    Check(std::fabs(ddd.GetValue() + 2.4177069200745152) < 1e-12, "wrt: d(d(df/dx)/dy)/dx");
+    Check(std::fabs(f.WRT(x, y).GetValue() - 0.19033752091639666) < 1e-12, "wrt: f.WRT(x, y)");
+    Check(std::fabs(f.WRTValue(x, y) - 0.19033752091639666) < 1e-12, "wrt: f.WRTValue(x, y)");
+    Check(std::fabs(f.WRTValue(x, y, x) + 2.4177069200745152) < 1e-12, "wrt: f.WRTValue(x, y, x)");
+    ad::ADNumber<double> fxyx = f.WRT(x, y, x);
+    Check(std::fabs(fxyx.GetValue() + 2.4177069200745152) < 1e-12, "wrt: f.WRT(x, y, x)");
+    Check(std::fabs(fxyx.WRT(y).GetValue() - f.WRTValue(x, y, x, y)) < 1e-12, "wrt: f.WRT(x, y, x).WRT(y)");
+}
+
+/*
+ * Number of nodes in the graph of x.
+ */
+static size_t GraphSize(const ad::ADNumber<double> &x) {
+    std::vector<ad::Expression<double>* > nodes;
+    ad::TopologicalOrder<double>(x.GetExpression(), nodes);
+    return nodes.size();
+}
+
+/*
+ * NthPartial records one Taylor sweep: its values match the value sweep,
+ * it can be differentiated again, and its graph stays far smaller than
+ * differentiating the same number of times.
+ */
+static void NthPartialFromOneSweep() {
+    ad::ADNumber<double> x("x", 0.7);
+    ad::ADNumber<double> y("y", 2.0);
+    ad::ADNumber<double> z(1.0);
+    ad::ADNumber<double> f = x * x * y + std::sin(x * y) + std::exp(x) / y + std::pow(x, 3.0) * std::log(y)
+            + std::atan2(x, y) + std::tan(x) * std::sqrt(y) + std::tanh(x) * std::cosh(y)
+            + std::log10(x * y) + std::fabs(x - y) + std::pow(y, x);
+
+    bool same = true;
+    for (unsigned int k = 2; k <= 5; k++) {
+        double expected = f.NthPartialValue(x, k);
+        same = same && std::fabs(f.NthPartial(x, k).GetValue() - expected) < 1e-12 * std::fabs(expected);
+    }
+    Check(same, "nth partial: differs from NthPartialValue");
+
+    ad::ADNumber<double> fxxx = f.NthPartial(x, 3);
+    Check(std::fabs(fxxx.WRT(y).GetValue() - f.WRTValue(x, x, x, y)) < 1e-10, "nth partial: d/dy of d3f/dx3");
+    Check(std::fabs(fxxx.NthPartial(x, 2).GetValue() - f.NthPartialValue(x, 5)) < 1e-10, "nth partial: d2/dx2 of d3f/dx3");
+    Check(f.NthPartial(z, 3).GetValue() == 0.0, "nth partial: variable not in the graph");
+
+    ad::ADNumber<double> repeated = f.WRT(x);
+    for (int k = 1; k < 4; k++) {
+        repeated = repeated.WRT(x);
+    }
+    Check(GraphSize(f.NthPartial(x, 4)) * 4 < GraphSize(repeated), "nth partial: graph not smaller than repeated");
+}
+
+/*
+ * Taylor derivatives need the expression graph and say so for a taped
+ * number.
+ */
+static void TaylorRejectsTapedNumbers() {
+    ad::ADNumber<double> x("x", 1.5);
+    ad::ADNumber<double>::SetRecordTape(true);
+    ad::ADNumber<double> g = x * x;
+    ad::ADNumber<double>::SetRecordTape(false);
+
+    bool thrown = false;
+    try {
+        g.NthPartialValue(x, 2);
+    } catch (const std::logic_error &) {
+        thrown = true;
+    }
+    Check(thrown, "taylor: taped number did not throw");
+
+    thrown = false;
+    try {
+        g.WRTValue(x);
+    } catch (const std::logic_error &) {
+        thrown = true;
+    }
+    Check(thrown, "taylor: taped number did not throw from WRTValue");
+    ad::Tape<double>::Active()->Clear();
+}
+
+/*
+ * Writes the graph of x * y + sin(x) and returns the file contents.
+ */
+static std::string WrittenGraph(ad::ADNumber<double> &x, ad::ADNumber<double> &y) {
+    ad::ADNumber<double> f = x * y + std::sin(x);
+    std::stringstream out;
+    ad::GraphFile<double>::Write(f.GetExpression(), out);
+    return out.str();
+}
+
+/*
+ * A graph read back has the value and gradient it was written with.
+ */
+static void GraphFileRoundTrips() {
+    ad::ADNumber<double> x("x", 0.5);
+    ad::ADNumber<double> y("y", 3.0);
+    std::stringstream in(WrittenGraph(x, y));
+
+    ad::GraphFile<double> graph;
+    Check(graph.Read(in), "graph file: round trip not read");
+    Check(graph.Value() == 0.5 * 3.0 + std::sin(0.5), "graph file: value");
+
+    std::vector<unsigned long> ids;
+    ids.push_back(x.GetID());
+    ids.push_back(y.GetID());
+    std::valarray<double> gradient;
+    graph.Gradient(ids, gradient);
+    Check(gradient.size() == 2 && std::fabs(gradient[0] - (3.0 + std::cos(0.5))) < 1e-12
+            && std::fabs(gradient[1] - 0.5) < 1e-12, "graph file: gradient");
+
+    ad::ADNumber<double> g(graph.Build());
+    Check(g.GetValue() == graph.Value(), "graph file: built graph value");
+}
+
+/*
+ * Malformed files are rejected rather than read or allocated.
+ */
+static void GraphFileRejectsMalformed() {
+    ad::ADNumber<double> x("x", 0.5);
+    ad::ADNumber<double> y("y", 3.0);
+    std::string file = WrittenGraph(x, y);
+    ad::GraphFileHeader header;
+    std::memcpy(&header, file.data(), sizeof (header));
+
+    //the root, x * y + sin(x), loses its right operand
+    std::string dropped(file);
+    int32_t none = -1;
+    std::memcpy(&dropped[header.right + (header.nodes - 1) * sizeof (int32_t)], &none, sizeof (none));
+    std::stringstream a(dropped);
+    ad::GraphFile<double> graph;
+    Check(!graph.Read(a), "graph file: binary op without a right operand read");
+
+    //a size far past the end of the stream
+    std::string huge(file);
+    uint64_t size = static_cast<uint64_t> (1) << 60;
+    std::memcpy(&huge[offsetof(ad::GraphFileHeader, size)], &size, sizeof (size));
+    std::stringstream b(huge);
+    bool read = true;
+    try {
+        read = graph.Read(b);
+    } catch (...) {
+    }
+    Check(!read, "graph file: oversized header read");
+
+    std::string magic(file);
+    magic[0] = 'X';
+    std::stringstream c(magic);
+    Check(!graph.Read(c), "graph file: bad magic read");
+
+    std::stringstream d(file.substr(0, file.size() / 2));
+    Check(!graph.Read(d), "graph file: truncated file read");
+}
+
+/*
+ * Records a least squares sum of 100000 terms on the active tape and
+ * takes its gradient with respect to a and b.
+ */
+static void TapedLeastSquares(std::valarray<double> &gradient) {
+    ad::ADNumber<double> a("a", 1.5);
+    ad::ADNumber<double> b("b", 0.5);
+
+    ad::ADNumber<double>::SetRecordTape(true);
+    ad::ADNumber<double> f = 0.0;
+    for (int i = 0; i < 100000; i++) {
+        double x = 1e-5 * i;
+        ad::ADNumber<double> r = a * x + b - (2.0 * x + 1.0);
+        f += r * r;
+    }
+
+    std::vector<ad::ADNumber<double>* > wrt;
+    wrt.push_back(&a);
+    wrt.push_back(&b);
+    ad::Gradient(f, wrt, gradient);
+    ad::ADNumber<double>::SetRecordTape(false);
+}
+
+static bool SameGradient(const std::valarray<double> &a, const std::valarray<double> &b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (std::fabs(a[i] - b[i]) > 1e-10 * std::fabs(b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * A tape past its memory budget spills to file and gives the gradient of
+ * a tape held in memory, also when recorded again after Clear.
+ */
+static void SpilledTapeMatchesMemory() {
+    ad::Tape<double>* tape = ad::Tape<double>::Active();
+    std::valarray<double> expected;
+    TapedLeastSquares(expected);
+    tape->Clear();
+
+    tape->SetMemoryBudget(1 << 20);
+    std::valarray<double> gradient;
+    TapedLeastSquares(gradient);
+    Check(tape->SpilledBytes() > 0, "spill: nothing spilled past the budget");
+    Check(SameGradient(gradient, expected), "spill: gradient differs from the in memory tape");
+
+    tape->Clear();
+    Check(tape->SpilledBytes() == 0, "spill: Clear left records on file");
+    TapedLeastSquares(gradient);
+    Check(tape->SpilledBytes() > 0, "spill: nothing spilled after Clear");
+    Check(SameGradient(gradient, expected), "spill: gradient differs after Clear");
+
+    tape->SetMemoryBudget(0);
+    tape->Clear();
+}
+
+/*
+ * One step of a logistic model with a Gaussian error, state {n, nll}.
+ */
+struct LogisticStep {
+
+    void operator()(int t, std::vector<ad::ADNumber<double> > &state,
+            const std::vector<ad::ADNumber<double> > &parameters) const {
+        const ad::ADNumber<double> &r = parameters[0];
+        const ad::ADNumber<double> &k = parameters[1];
+        ad::ADNumber<double> n = state[0] + r * state[0] * (1.0 - state[0] / k);
+        ad::ADNumber<double> e = std::log(n) - std::log(10.0 + 0.5 * t);
+        state[1] = state[1] + e * e;
+        state[0] = n;
+    }
+};
+
+static void LogisticGradient(int snapshots, bool checkpoint, std::valarray<double> &gradient) {
+    ad::ADNumber<double> r("r", 0.3);
+    ad::ADNumber<double> k("k", 80.0);
+    std::vector<ad::ADNumber<double> > parameters;
+    parameters.push_back(r);
+    parameters.push_back(k);
+
+    ad::ADNumber<double>::SetRecordTape(true);
+    std::vector<ad::ADNumber<double> > state;
+    state.push_back(ad::ADNumber<double>(5.0));
+    state.push_back(ad::ADNumber<double>(0.0));
+    if (checkpoint) {
+        ad::Checkpoint<double > (LogisticStep(), 0, 40, state, parameters, snapshots);
+    } else {
+        for (int t = 0; t < 40; t++) {
+            LogisticStep()(t, state, parameters);
+        }
+    }
+
+    std::vector<ad::ADNumber<double>* > wrt;
+    wrt.push_back(&parameters[0]);
+    wrt.push_back(&parameters[1]);
+    ad::Gradient(state[1], wrt, gradient);
+    ad::ADNumber<double>::SetRecordTape(false);
+    ad::Tape<double>::Active()->Clear();
+}
+
+/*
+ * A checkpointed loop has the gradient of the loop recorded in full.
+ */
+static void CheckpointMatchesTape() {
+    std::valarray<double> expected;
+    LogisticGradient(0, false, expected);
+
+    int snapshots[] = {1, 2, 0};
+    for (int i = 0; i < 3; i++) {
+        std::valarray<double> gradient;
+        LogisticGradient(snapshots[i], true, gradient);
+        bool same = gradient.size() == 2 && expected[0] != 0.0;
+        for (size_t j = 0; same && j < 2; j++) {
+            same = std::fabs(gradient[j] - expected[j]) <= 1e-10 * std::fabs(expected[j]);
+        }
+        Check(same, "checkpoint: gradient differs from the plain tape");
+    }
+}
+
+/*
+ * The concurrent gradient matches the serial one, also when the worker
+ * pool is reused.
+ */
+static void ConcurrentGradientMatchesSerial() {
+    std::vector<ad::ADNumber<double> > x;
+    std::vector<int> ids;
+    for (int i = 0; i < 13; i++) {
+        x.push_back(ad::ADNumber<double>(0.1 * (i + 1)));
+        ids.push_back(static_cast<int> (x.back().GetID()));
+    }
+    ad::ADNumber<double> f = std::exp(x[0]);
+    for (int i = 0; i + 1 < 13; i++) {
+        f = f + std::sin(x[i] * x[i + 1]);
+    }
+
+    GradientCalculator<double> calculator;
+    calculator.SetConcurrency(4);
+    std::vector<double> serial(ids.size());
+    calculator.GradientCPU(f, ids, serial);
+    for (int k = 0; k < 2; k++) {
+        std::vector<double> concurrent;
+        calculator.GradientConcurrentCPU(f, ids, concurrent);
+        bool same = concurrent.size() == serial.size();
+        for (size_t i = 0; same && i < serial.size(); i++) {
+            same = std::fabs(concurrent[i] - serial[i]) <= 1e-12 * std::fabs(serial[i]) && serial[i] != 0.0;
+        }
+        Check(same, "concurrent gradient: differs from GradientCPU");
+    }
+    Check(std::fabs(serial[0] - (std::exp(0.1) + 0.2 * std::cos(0.1 * 0.2))) < 1e-12,
+            "concurrent gradient: df/dx0");
+}
+
+/*
+ * Least squares with local constants, which get new ids on every
+ * recording.
+ */
+class LeastSquares : public ad::FunctionMinimizer<double> {
+public:
+    ad::ADNumber<double> a;
+    ad::ADNumber<double> b;
+
+    LeastSquares() : a(0.5), b(0.5) {
+        this->Register(a);
+        this->Register(b);
+        this->SetVerbose(false);
+    }
+
+    void ObjectiveFunction(ad::ADNumber<double> &f) {
+        f = 0.0;
+        for (int i = 0; i < 50; i++) {
+            ad::ADNumber<double> x(0.1 * i);
+            ad::ADNumber<double> r = a * x + b - (2.0 * 0.1 * i + 1.0);
+            f += r * r;
+        }
+    }
+};
+
+/*
+ * A compiled layout puts operands before their nodes, gives the gradient
+ * of the graph and is reused when the model is recorded again.
+ */
+static void CompiledLayoutIsReused() {
+    LeastSquares model;
+    std::vector<unsigned long> ids;
+    ids.push_back(model.a.GetID());
+    ids.push_back(model.b.GetID());
+    std::vector<ad::ADNumber<double>* > wrt;
+    wrt.push_back(&model.a);
+    wrt.push_back(&model.b);
+
+    ad::CompiledExpression<double> compiled;
+    for (int k = 0; k < 2; k++) {
+        ad::ADNumber<double> f;
+        model.ObjectiveFunction(f);
+        compiled.Compile(f.GetExpression());
+
+        bool ordered = true;
+        for (size_t i = 0; i < compiled.Size(); i++) {
+            ordered = ordered && compiled.Left()[i] < static_cast<int> (i) && compiled.Right()[i] < static_cast<int> (i);
+        }
+        Check(ordered, "compiled layout: operand after its node");
+
+        std::valarray<double> expected;
+        std::valarray<double> gradient;
+        ad::Gradient(f, wrt, expected);
+        compiled.Gradient(ids, gradient);
+        Check(SameGradient(gradient, expected), "compiled layout: gradient");
+        model.a.SetValue(1.0 + k);
+    }
+    Check(compiled.Compilations() == 1 && compiled.Reuses() == 1, "compiled layout: not reused");
+
+    model.Run();
+    Check(std::fabs(model.a.GetValue() - 2.0) < 1e-4 && std::fabs(model.b.GetValue() - 1.0) < 1e-4,
+            "compiled layout: wrong minimum");
+}
+
+/*
+ * Removes directory and the cache entries in it.
+ */
+static void RemoveCacheDirectory(const std::string &directory) {
+    DIR* dir = opendir(directory.c_str());
+    if (dir != NULL) {
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            std::string name = entry->d_name;
+            if (name != "." && name != "..") {
+                std::remove((directory + "/" + name).c_str());
+            }
+        }
+        closedir(dir);
+    }
+    rmdir(directory.c_str());
+}
+
+/*
+ * A layout stored by one compiled graph is loaded by another with the
+ * same structure, which still takes its leaf values from its own
+ * recording. A minimizer looks the layout up once per Run.
+ */
+static void CompiledCacheIsShared() {
+    char directory[] = "/tmp/adnumber_main.XXXXXX";
+    if (mkdtemp(directory) == NULL) {
+        Check(false, "compiled cache: mkdtemp");
+        return;
+    }
+
+    LeastSquares model;
+    std::vector<unsigned long> ids;
+    ids.push_back(model.a.GetID());
+    ids.push_back(model.b.GetID());
+    std::vector<ad::ADNumber<double>* > wrt;
+    wrt.push_back(&model.a);
+    wrt.push_back(&model.b);
+
+    ad::CompiledCache cache(directory);
+    for (int k = 0; k < 2; k++) {
+        ad::CompiledExpression<double> compiled;
+        compiled.SetCache(&cache);
+        model.a.SetValue(1.5 + k);
+        ad::ADNumber<double> f;
+        model.ObjectiveFunction(f);
+        compiled.Compile(f.GetExpression());
+
+        std::valarray<double> expected;
+        std::valarray<double> gradient;
+        ad::Gradient(f, wrt, expected);
+        compiled.Gradient(ids, gradient);
+        Check(SameGradient(gradient, expected), "compiled cache: gradient");
+        Check(compiled.Value() == f.GetValue(), "compiled cache: value");
+    }
+    ad::CompiledCacheStatistics stats = cache.GetStatistics();
+    Check(stats.misses == 1 && stats.hits == 1, "compiled cache: layout not loaded");
+
+    model.a.SetValue(0.5);
+    model.SetCompiledCache(directory);
+    model.Run();
+    stats = model.GetCompiledCacheStatistics();
+    Check(stats.hits + stats.misses == 1, "compiled cache: looked up more than once");
+    Check(std::fabs(model.a.GetValue() - 2.0) < 1e-4 && std::fabs(model.b.GetValue() - 1.0) < 1e-4,
+            "compiled cache: wrong minimum");
+
+    RemoveCacheDirectory(directory);
+}
+
+/*
+ * Least squares that counts how often its objective function is recorded.
+ */
+class CountedLeastSquares : public LeastSquares {
+public:
+    int recordings;
+
+    CountedLeastSquares() : recordings(0) {
+    }
+
+    void ObjectiveFunction(ad::ADNumber<double> &f) {
+        this->recordings++;
+        LeastSquares::ObjectiveFunction(f);
+    }
+};
+
+/*
+ * Recording into the arena finds the same minimum as the heap, and the
+ * arena cannot be reset while a number still holds one of its nodes.
+ */
+static void ArenaMatchesHeap() {
+    LeastSquares heap;
+    heap.Run();
+    LeastSquares arena;
+    arena.SetUseArena(true);
+    arena.Run();
+    Check(std::fabs(arena.a.GetValue() - heap.a.GetValue()) < 1e-10
+            && std::fabs(arena.b.GetValue() - heap.b.GetValue()) < 1e-10,
+            "arena: minimum differs from heap recording");
+
+    ad::RecordingContext<double>* context = ad::RecordingContext<double>::Active();
+    ad::ADNumber<double> x(3.0);
+    context->ResetArena();
+    bool threw = false;
+    {
+        context->BeginArena();
+        ad::ADNumber<double> held = x * x + 1.0;
+        context->EndArena();
+        Check(context->ArenaBytesUsed() > 0, "arena: node not allocated from the arena");
+        try {
+            context->ResetArena();
+        } catch (std::logic_error &) {
+            threw = true;
+        }
+        Check(held.GetValue() == 10.0, "arena: held node reclaimed");
+    }
+    Check(threw, "arena: reset with a held node");
+    Check(context->ArenaHolds() == 0, "arena: reference not released");
+    context->ResetArena();
+}
+
+/*
+ * Replaying the compiled graph finds the same minimum as recording every
+ * evaluation, while calling ObjectiveFunction far less often.
+ */
+static void ReplayMatchesRecording() {
+    CountedLeastSquares recorded;
+    recorded.Run();
+    CountedLeastSquares replayed;
+    replayed.SetReplay(true);
+    replayed.Run();
+    Check(std::fabs(replayed.a.GetValue() - recorded.a.GetValue()) < 1e-10
+            && std::fabs(replayed.b.GetValue() - recorded.b.GetValue()) < 1e-10,
+            "replay: minimum differs from recording");
+    Check(replayed.recordings < recorded.recordings, "replay: objective function recorded every evaluation");
+}
+
+/*
+ * Both tangent lanes of a Dual carry the reverse mode gradient.
+ */
+static void DualMatchesGradient() {
+    ad::Dual<double, 2> dx(0.7, 0);
+    ad::Dual<double, 2> dy(2.0, 1);
+    ad::Dual<double, 2> df = dx * dy + std::sin(dx) * std::exp(dy) / dy - std::log(dy);
+
+    ad::ADNumber<double> x(0.7);
+    ad::ADNumber<double> y(2.0);
+    ad::ADNumber<double> f = x * y + std::sin(x) * std::exp(y) / y - std::log(y);
+    std::vector<ad::ADNumber<double>* > wrt;
+    wrt.push_back(&x);
+    wrt.push_back(&y);
+    std::valarray<double> expected;
+    ad::Gradient(f, wrt, expected);
+
+    Check(std::fabs(df.GetValue() - f.GetValue()) < 1e-12, "dual: value");
+    Check(std::fabs(df.GetTangent(0) - expected[0]) < 1e-12
+            && std::fabs(df.GetTangent(1) - expected[1]) < 1e-12, "dual: tangents differ from the gradient");
+}
+
+/*
+ * The least squares model written over Dual numbers.
+ */
+class DualLeastSquares : public ad::DualFunctionMinimizer<double, 2> {
+public:
+    ad::ADNumber<double> a;
+    ad::ADNumber<double> b;
+
+    DualLeastSquares() : a(0.5), b(0.5) {
+        this->Register(a);
+        this->Register(b);
+        this->SetVerbose(false);
+    }
+
+    void ObjectiveFunction(ad::Dual<double, 2> &f) {
+        const ad::Dual<double, 2> &da = this->Value(a);
+        const ad::Dual<double, 2> &db = this->Value(b);
+        f = 0.0;
+        for (int i = 0; i < 50; i++) {
+            ad::Dual<double, 2> r = da * (0.1 * i) + db - (2.0 * 0.1 * i + 1.0);
+            f += r * r;
+        }
+    }
+};
+
+/*
+ * The forward mode minimizer finds the same minimum as the recorded one,
+ * and refuses to replay.
+ */
+static void DualMinimizerMatchesRecording() {
+    LeastSquares recorded;
+    recorded.Run();
+    DualLeastSquares dual;
+    dual.Run();
+    Check(std::fabs(dual.a.GetValue() - recorded.a.GetValue()) < 1e-8
+            && std::fabs(dual.b.GetValue() - recorded.b.GetValue()) < 1e-8,
+            "dual minimizer: minimum differs from recording");
+
+    bool threw = false;
+    try {
+        dual.SetReplay(true);
+    } catch (std::invalid_argument &) {
+        threw = true;
+    }
+    Check(threw && !dual.IsReplaying(), "dual minimizer: replay accepted");
+}
+
+/*
+ * Chained Rosenbrock, whose Hessian is tridiagonal.
+ */
+class ChainedRosenbrock : public ad::FunctionMinimizer<double> {
+public:
+    using ad::FunctionMinimizer<double>::CalculateHessian;
+    using ad::FunctionMinimizer<double>::CalculateHessianVector;
+    using ad::FunctionMinimizer<double>::CalculateSparseHessian;
+    std::vector<ad::ADNumber<double> > x;
+
+    ChainedRosenbrock(size_t n) : x(n) {
+        for (size_t i = 0; i < n; i++) {
+            x[i] = ad::ADNumber<double>(i % 2 == 0 ? -1.2 : 1.0);
+            this->Register(x[i]);
+        }
+        this->SetVerbose(false);
+    }
+
+    void ObjectiveFunction(ad::ADNumber<double> &f) {
+        f = 0.0;
+        for (size_t i = 0; i + 1 < x.size(); i++) {
+            ad::ADNumber<double> a = 1.0 - x[i];
+            ad::ADNumber<double> b = x[i + 1] - x[i] * x[i];
+            f += a * a + 100.0 * b * b;
+        }
+    }
+
+    void AnalyticHessian(std::valarray<std::valarray<double> > &hessian) const {
+        size_t n = x.size();
+        hessian.resize(n, std::valarray<double>(0.0, n));
+        for (size_t i = 0; i + 1 < n; i++) {
+            double xi = x[i].GetValue();
+            hessian[i][i] += 2.0 - 400.0 * x[i + 1].GetValue() + 1200.0 * xi * xi;
+            hessian[i + 1][i + 1] += 200.0;
+            hessian[i][i + 1] = -400.0 * xi;
+            hessian[i + 1][i] = -400.0 * xi;
+        }
+    }
+};
+
+static bool SameMatrix(const std::valarray<std::valarray<double> > &a, const std::valarray<std::valarray<double> > &b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].size() != b[i].size()) {
+            return false;
+        }
+        for (size_t j = 0; j < a[i].size(); j++) {
+            if (std::fabs(a[i][j] - b[i][j]) > 1e-9 * (1.0 + std::fabs(b[i][j]))) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * The dense Hessian and the Hessian vector product match the analytic
+ * Hessian at the minimizer's final point.
+ */
+static void HessianMatchesAnalytic() {
+    ChainedRosenbrock model(6);
+    model.Run();
+    std::valarray<std::valarray<double> > expected;
+    model.AnalyticHessian(expected);
+
+    std::valarray<std::valarray<double> > hessian = model.CalculateHessian();
+    Check(SameMatrix(hessian, expected), "hessian: dense differs from analytic");
+
+    std::valarray<double> v(expected.size());
+    for (size_t i = 0; i < v.size(); i++) {
+        v[i] = 1.0 + 0.5 * i;
+    }
+    std::valarray<double> hv = model.CalculateHessianVector(v);
+    bool same = hv.size() == v.size();
+    for (size_t i = 0; same && i < v.size(); i++) {
+        double e = (expected[i] * v).sum();
+        same = std::fabs(hv[i] - e) <= 1e-9 * (1.0 + std::fabs(e));
+    }
+    Check(same, "hessian: H * v differs from analytic");
+}
+
+/*
+ * The sparse Hessian and Jacobian hold the dense results, with only the
+ * tridiagonal or per row entries stored.
+ */
+static void SparseMatchesDense() {
+    ChainedRosenbrock model(8);
+    model.Run();
+    std::valarray<std::valarray<double> > dense = model.CalculateHessian();
+    ad::CSRMatrix<double> sparse = model.CalculateSparseHessian();
+    std::valarray<std::valarray<double> > expanded;
+    sparse.ToDense(expanded);
+    Check(SameMatrix(expanded, dense), "sparse hessian: differs from dense");
+    Check(sparse.NonZeros() == 3 * 8 - 2, "sparse hessian: pattern not tridiagonal");
+
+    std::vector<ad::ADNumber<double>* > wrt;
+    for (size_t i = 0; i < model.x.size(); i++) {
+        wrt.push_back(&model.x[i]);
+    }
+    std::vector<ad::ADNumber<double> > residuals;
+    for (size_t i = 0; i + 1 < model.x.size(); i++) {
+        residuals.push_back(1.0 - model.x[i]);
+        residuals.push_back(10.0 * (model.x[i + 1] - model.x[i] * model.x[i]));
+    }
+    std::vector<ad::ADNumber<double>* > f;
+    for (size_t i = 0; i < residuals.size(); i++) {
+        f.push_back(&residuals[i]);
+    }
+    ad::CSRMatrix<double> jacobian;
+    ad::SparseJacobian(f, wrt, jacobian);
+    std::valarray<std::valarray<double> > rows(residuals.size());
+    for (size_t i = 0; i < residuals.size(); i++) {
+        ad::Gradient(residuals[i], wrt, rows[i]);
+    }
+    jacobian.ToDense(expanded);
+    Check(SameMatrix(expanded, rows), "sparse jacobian: differs from dense");
+    Check(jacobian.NonZeros() == 3 * (model.x.size() - 1), "sparse jacobian: pattern");
+}
+
+/*
+ * Values and gradients from the batched sweeps match recording the model
+ * at each point, including a partly filled last batch.
+ */
+static void BatchMatchesGradient() {
+    ad::ADNumber<double> a(0.5);
+    ad::ADNumber<double> b(1.5);
+    std::vector<ad::ADNumber<double>* > wrt;
+    wrt.push_back(&a);
+    wrt.push_back(&b);
+    std::vector<unsigned long> ids;
+    ids.push_back(a.GetID());
+    ids.push_back(b.GetID());
+
+    ad::ADNumber<double> f = std::sin(a * b) + std::exp(a) / b - std::pow(b, 2.5) * std::log(b);
+    ad::CompiledExpression<double> compiled;
+    compiled.Compile(f.GetExpression());
+    compiled.Bind(ids);
+
+    std::vector<std::valarray<double> > points(2 * ADNUMBER_BATCH_LANES + 3, std::valarray<double>(2));
+    for (size_t i = 0; i < points.size(); i++) {
+        points[i][0] = -1.0 + 0.1 * i;
+        points[i][1] = 0.5 + 0.05 * i;
+    }
+    std::valarray<double> values;
+    compiled.EvaluateBatch(points, values, 2);
+    std::valarray<double> gradient_values;
+    std::vector<std::valarray<double> > gradients;
+    compiled.GradientBatch(points, gradient_values, gradients, 2);
+
+    bool same = values.size() == points.size() && gradients.size() == points.size();
+    for (size_t i = 0; same && i < points.size(); i++) {
+        a.SetValue(points[i][0]);
+        b.SetValue(points[i][1]);
+        ad::ADNumber<double> g = std::sin(a * b) + std::exp(a) / b - std::pow(b, 2.5) * std::log(b);
+        std::valarray<double> expected;
+        ad::Gradient(g, wrt, expected);
+        same = std::fabs(values[i] - g.GetValue()) < 1e-12
+                && std::fabs(gradient_values[i] - g.GetValue()) < 1e-12
+                && SameGradient(gradients[i], expected);
+    }
+    Check(same, "batch: differs from ad::Gradient");
+}
+
 /*
  * 
  */
 int main(int argc, char** argv) {
+    SimplifiedResultOwnsItsRoot();
+    CopiesOwnTheirRoots();
+    HashConsedNumbersAreDistinct();
+    NamesGoWithTheirNumbers();
+    ChainedWRT();
+    NthPartialFromOneSweep();
+    TaylorRejectsTapedNumbers();
+    GraphFileRoundTrips();
+    GraphFileRejectsMalformed();
+    SpilledTapeMatchesMemory();
+    CheckpointMatchesTape();
+    ConcurrentGradientMatchesSerial();
+    CompiledLayoutIsReused();
+    CompiledCacheIsShared();
+    ArenaMatchesHeap();
+    ReplayMatchesRecording();
+    DualMatchesGradient();
+    DualMinimizerMatchesRecording();
+    HessianMatchesAnalytic();
+    SparseMatchesDense();
+    BatchMatchesGradient();
 
+    if (failures != 0) {
+        return EXIT_FAILURE;
+    }
+    std::cout << "all checks passed\n";
     return 0;
 }
-
@@ -0,0 +1,94 @@
+/* 
+ * File:   main.cpp
+ * Author: matthewsupernaw
+ *
+ * Created on October 17, 2026
+ *
+ * Distributed least squares with FunctionMinimizer::SetDistributed. Each
+ * rank records every size-th observation; the fit must match the fit of
+ * all the data on one rank, in expression, tape and replay modes. Build 
+ * and run with "make mpi-test NP=4".
+ */
+
+#include <cstdlib>
+#include <cmath>
+#include <iostream>
+#include <mpi.h>
+#include "../../ADNumber.hpp"
+#include "../../FunctionMinimizer.hpp"
+
+static const int observations = 200;
+
+/*
+ * y = a * x + b + noise, for the observations i with i % stride == offset.
+ */
+class LeastSquares : public ad::FunctionMinimizer<double> {
+    int offset;
+    int stride;
+public:
+    ad::ADNumber<double> a;
+    ad::ADNumber<double> b;
+
+    LeastSquares(int offset, int stride) : offset(offset), stride(stride), a(0.5), b(0.5) {
+        this->Register(a);
+        this->Register(b);
+        this->SetVerbose(false);
+    }
+
+    void ObjectiveFunction(ad::ADNumber<double> &f) {
+        f = 0.0;
+        for (int i = offset; i < observations; i += stride) {
+            double x = 0.05 * i;
+            double y = 2.0 * x + 1.0 + 0.1 * std::sin(3.0 * i);
+            ad::ADNumber<double> r = a * x + b - y;
+            f += r * r;
+        }
+    }
+};
+
+/*
+ * Fits on one rank and on all ranks, and compares the two.
+ */
+static bool Compare(const char* mode, bool tape, bool replay, int rank, int size) {
+    ad::ADNumber<double>::SetRecordTape(tape);
+
+    LeastSquares serial(0, 1);
+    serial.SetReplay(replay);
+    serial.Run();
+
+    LeastSquares distributed(rank, size);
+    distributed.SetReplay(replay);
+    distributed.SetDistributed(true);
+    distributed.Run();
+
+    ad::ADNumber<double>::SetRecordTape(false);
+
+    bool same = std::fabs(distributed.a.GetValue() - serial.a.GetValue()) < 1e-6
+            && std::fabs(distributed.b.GetValue() - serial.b.GetValue()) < 1e-6
+            && distributed.GetAllreduceCalls() > 0;
+    if (rank == 0) {
+        std::cout << mode << ": a = " << distributed.a.GetValue() << ", b = " << distributed.b.GetValue()
+                << " on " << size << " ranks in " << distributed.GetAllreduceCalls() << " reductions, "
+                << "a = " << serial.a.GetValue() << ", b = " << serial.b.GetValue() << " on one"
+                << (same ? "\n" : " - FAILED\n");
+    }
+    return same;
+}
+
+int main(int argc, char** argv) {
+    MPI_Init(&argc, &argv);
+    int rank;
+    int size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    int failures = 0;
+    failures += !Compare("expression", false, false, rank, size);
+    failures += !Compare("tape", true, false, rank, size);
+    failures += !Compare("replay", false, true, rank, size);
+
+    int total = 0;
+    MPI_Allreduce(&failures, &total, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Finalize();
+    return total == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,156 @@
+/*
+ * File:   main.cpp
+ * Author: matthewsupernaw
+ *
+ * Created on October 17, 2026
+ *
+ * Checks ADNumber built with ADNUMBER_EXPRESSION_TEMPLATES. Statements are
+ * recorded as expression graphs and as fused tape entries; values and
+ * derivatives must match central finite differences of the same statement
+ * in double. Kept apart from ../main.cpp because the macro changes the
+ * ADNumber operators for the whole program. Build and run with
+ * "make templates-test".
+ */
+
+#include <cstdlib>
+#include <cmath>
+#include <iostream>
+#include <valarray>
+#include <vector>
+#include "../../ADNumber.hpp"
+#include "../../FunctionMinimizer.hpp"
+
+static int failures = 0;
+
+static void Check(bool passed, const char* what) {
+    if (!passed) {
+        std::cout << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+/*
+ * One statement, so the whole right hand side is a single template tree.
+ */
+template<class N>
+static N Statement(const N &a, const N &b, const N &c, const N &d) {
+    N f = a * b + c * d - a / d + std::sin(a * c) * std::exp(b)
+            - std::sqrt(c) * std::log(d) + (-b) * 2.0 + std::tanh(a - c) / (1.0 + d * d);
+    return f;
+}
+
+static double Partial(std::valarray<double> x, size_t i, double h) {
+    std::valarray<double> lo(x);
+    std::valarray<double> hi(x);
+    lo[i] -= h;
+    hi[i] += h;
+    return (Statement(hi[0], hi[1], hi[2], hi[3]) - Statement(lo[0], lo[1], lo[2], lo[3])) / (2.0 * h);
+}
+
+static bool Near(double a, double b, double tolerance) {
+    return std::fabs(a - b) <= tolerance * (1.0 + std::fabs(b));
+}
+
+/*
+ * Value and gradient of the statement against finite differences, and
+ * for expression graphs also a second derivative.
+ */
+static void StatementMatchesFiniteDifferences(bool tape) {
+    ad::ADNumber<double>::SetRecordTape(tape);
+    if (tape) {
+        ad::Tape<double>::Active()->Clear();
+    }
+    std::valarray<double> x(4);
+    x[0] = 0.7;
+    x[1] = -0.4;
+    x[2] = 1.3;
+    x[3] = 2.1;
+    ad::ADNumber<double> a(x[0]);
+    ad::ADNumber<double> b(x[1]);
+    ad::ADNumber<double> c(x[2]);
+    ad::ADNumber<double> d(x[3]);
+    std::vector<ad::ADNumber<double>* > wrt;
+    wrt.push_back(&a);
+    wrt.push_back(&b);
+    wrt.push_back(&c);
+    wrt.push_back(&d);
+
+    ad::ADNumber<double> f = Statement(a, b, c, d);
+    if (tape) {
+        //the operands are on the tape now, the statement adds one entry
+        size_t entries = ad::Tape<double>::Active()->Size();
+        ad::ADNumber<double> g = a * b + c * d - std::tanh(a - c) / (1.0 + d * d);
+        Check(ad::Tape<double>::Active()->Size() == entries + 1, "tape: statement not fused");
+    }
+    Check(Near(f.GetValue(), Statement(x[0], x[1], x[2], x[3]), 1e-14),
+            tape ? "tape: value" : "expression: value");
+
+    std::valarray<double> gradient;
+    ad::Gradient(f, wrt, gradient);
+    bool same = gradient.size() == 4;
+    for (size_t i = 0; same && i < 4; i++) {
+        same = Near(gradient[i], Partial(x, i, 1e-6), 1e-7);
+    }
+    Check(same, tape ? "tape: gradient" : "expression: gradient");
+
+    if (!tape) {
+        double h = 1e-4;
+        std::valarray<double> lo(x);
+        std::valarray<double> hi(x);
+        lo[0] -= h;
+        hi[0] += h;
+        double second = (Partial(hi, 2, 1e-6) - Partial(lo, 2, 1e-6)) / (2.0 * h);
+        ad::ADNumber<double> fac = ad::Derivative(ad::Derivative(f, a, 1), c, 1);
+        Check(Near(fac.GetValue(), second, 1e-5), "expression: d2f/dadc");
+    }
+    ad::ADNumber<double>::SetRecordTape(false);
+}
+
+/*
+ * Least squares written with compound statements.
+ */
+class LeastSquares : public ad::FunctionMinimizer<double> {
+public:
+    ad::ADNumber<double> a;
+    ad::ADNumber<double> b;
+
+    LeastSquares() : a(0.5), b(0.5) {
+        this->Register(a);
+        this->Register(b);
+        this->SetVerbose(false);
+    }
+
+    void ObjectiveFunction(ad::ADNumber<double> &f) {
+        f = 0.0;
+        for (int i = 0; i < 50; i++) {
+            double x = 0.1 * i;
+            double y = 2.0 * x + 1.0;
+            f += (a * x + b - y) * (a * x + b - y);
+        }
+    }
+};
+
+/*
+ * The minimizer finds the known minimum from either recording.
+ */
+static void MinimizerFindsMinimum(bool tape) {
+    ad::ADNumber<double>::SetRecordTape(tape);
+    LeastSquares model;
+    model.Run();
+    ad::ADNumber<double>::SetRecordTape(false);
+    Check(std::fabs(model.a.GetValue() - 2.0) < 1e-4 && std::fabs(model.b.GetValue() - 1.0) < 1e-4,
+            tape ? "tape: wrong minimum" : "expression: wrong minimum");
+}
+
+int main(int argc, char** argv) {
+    StatementMatchesFiniteDifferences(false);
+    StatementMatchesFiniteDifferences(true);
+    MinimizerFindsMinimum(false);
+    MinimizerFindsMinimum(true);
+
+    if (failures != 0) {
+        return EXIT_FAILURE;
+    }
+    std::cout << "all checks passed" << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,436 @@
+/*
+ * File:   Dual.hpp
+ * Author: matthewsupernaw
+ *
+ * Created on October 17, 2026
+ *
+ * Vector forward mode. A Dual<T, N> carries a value and the N directional
+ * derivatives (tangents) of that value in a fixed array. Nothing
+ * is recorded: every operation updates the value and all N tangents at
+ * once, so for small problems (N up to about 16) the full gradient comes
+ * out of a single evaluation with no graph, tape or allocation. The
+ * tangent loops have a compile time trip count and no dependencies, so
+ * the compiler maps them onto SIMD lanes.
+ *
+ * Parameter i is seeded with Dual(value, i); constants have zero tangents.
+ * The math functions supported for ADNumber are overloaded in namespace std
+ * the same way.
+ */
+
+#ifndef AD_DUAL_HPP
+#define	AD_DUAL_HPP
+
+#include <cmath>
+#include <iostream>
+
+namespace ad {
+
+    template<class T, int N>
+    class Dual {
+        //contiguous and naturally aligned; util/clfmalloc.h only guarantees 8
+        //byte blocks, so over-aligning would break Duals held in containers
+        T tangent_m[N];
+        T value_m;
+
+    public:
+
+        /*!
+         * Constant zero.
+         */
+        Dual() : value_m(T(0)) {
+            for (int i = 0; i < N; i++) {
+                tangent_m[i] = T(0);
+            }
+        }
+
+        /*!
+         * Constant value.
+         *
+         * @param value
+         */
+        Dual(const T &value) : value_m(value) {
+            for (int i = 0; i < N; i++) {
+                tangent_m[i] = T(0);
+            }
+        }
+
+        /*!
+         * Independent variable with tangent 1 in lane and 0 elsewhere.
+         *
+         * @param value
+         * @param lane
+         */
+        Dual(const T &value, int lane) : value_m(value) {
+            for (int i = 0; i < N; i++) {
+                tangent_m[i] = T(0);
+            }
+            if (lane >= 0 && lane < N) {
+                tangent_m[lane] = T(1);
+            }
+        }
+
+        Dual<T, N>& operator=(const T &value) {
+            value_m = value;
+            for (int i = 0; i < N; i++) {
+                tangent_m[i] = T(0);
+            }
+            return *this;
+        }
+
+        inline const T GetValue() const {
+            return value_m;
+        }
+
+        /*!
+         * Sets the value, keeping the tangents.
+         */
+        inline void SetValue(const T &value) {
+            value_m = value;
+        }
+
+        /*!
+         * Derivative with respect to the variable seeded in lane i.
+         */
+        inline const T GetTangent(int i) const {
+            return tangent_m[i];
+        }
+
+        inline void SetTangent(int i, const T &tangent) {
+            tangent_m[i] = tangent;
+        }
+
+        inline T* Tangents() {
+            return tangent_m;
+        }
+
+        inline const T* Tangents() const {
+            return tangent_m;
+        }
+
+        static inline int Lanes() {
+            return N;
+        }
+
+        /*!
+         * Returns f(x) given f(x) and f'(x).
+         */
+        static inline const Dual<T, N> Chain(const Dual<T, N> &x, const T &value, const T &dx) {
+            Dual<T, N> ret(value);
+            const T* a = x.tangent_m;
+            T* r = ret.tangent_m;
+            for (int i = 0; i < N; i++) {
+                r[i] = dx * a[i];
+            }
+            return ret;
+        }
+
+        /*!
+         * Returns f(x, y) given f(x, y) and its partials.
+         */
+        static inline const Dual<T, N> Chain(const Dual<T, N> &x, const Dual<T, N> &y,
+                const T &value, const T &dx, const T &dy) {
+            Dual<T, N> ret(value);
+            const T* a = x.tangent_m;
+            const T* b = y.tangent_m;
+            T* r = ret.tangent_m;
+            for (int i = 0; i < N; i++) {
+                r[i] = dx * a[i] + dy * b[i];
+            }
+            return ret;
+        }
+
+        const Dual<T, N> operator-() const {
+            return Dual<T, N>::Chain(*this, -value_m, T(-1));
+        }
+
+        const Dual<T, N> operator+() const {
+            return *this;
+        }
+
+        Dual<T, N>& operator+=(const Dual<T, N> &rhs) {
+            value_m += rhs.value_m;
+            for (int i = 0; i < N; i++) {
+                tangent_m[i] += rhs.tangent_m[i];
+            }
+            return *this;
+        }
+
+        Dual<T, N>& operator-=(const Dual<T, N> &rhs) {
+            value_m -= rhs.value_m;
+            for (int i = 0; i < N; i++) {
+                tangent_m[i] -= rhs.tangent_m[i];
+            }
+            return *this;
+        }
+
+        Dual<T, N>& operator*=(const Dual<T, N> &rhs) {
+            for (int i = 0; i < N; i++) {
+                tangent_m[i] = tangent_m[i] * rhs.value_m + value_m * rhs.tangent_m[i];
+            }
+            value_m *= rhs.value_m;
+            return *this;
+        }
+
+        Dual<T, N>& operator/=(const Dual<T, N> &rhs) {
+            T inv = T(1) / rhs.value_m;
+            value_m *= inv;
+            for (int i = 0; i < N; i++) {
+                tangent_m[i] = (tangent_m[i] - value_m * rhs.tangent_m[i]) * inv;
+            }
+            return *this;
+        }
+
+        Dual<T, N>& operator+=(const T &rhs) {
+            value_m += rhs;
+            return *this;
+        }
+
+        Dual<T, N>& operator-=(const T &rhs) {
+            value_m -= rhs;
+            return *this;
+        }
+
+        Dual<T, N>& operator*=(const T &rhs) {
+            value_m *= rhs;
+            for (int i = 0; i < N; i++) {
+                tangent_m[i] *= rhs;
+            }
+            return *this;
+        }
+
+        Dual<T, N>& operator/=(const T &rhs) {
+            return *this *= T(1) / rhs;
+        }
+    };
+
+    template<class T, int N>
+    inline const Dual<T, N> operator+(const Dual<T, N> &lhs, const Dual<T, N> &rhs) {
+        Dual<T, N> ret(lhs);
+        return ret += rhs;
+    }
+
+    template<class T, int N>
+    inline const Dual<T, N> operator+(const Dual<T, N> &lhs, const T &rhs) {
+        Dual<T, N> ret(lhs);
+        return ret += rhs;
+    }
+
+    template<class T, int N>
+    inline const Dual<T, N> operator+(const T &lhs, const Dual<T, N> &rhs) {
+        Dual<T, N> ret(rhs);
+        return ret += lhs;
+    }
+
+    template<class T, int N>
+    inline const Dual<T, N> operator-(const Dual<T, N> &lhs, const Dual<T, N> &rhs) {
+        Dual<T, N> ret(lhs);
+        return ret -= rhs;
+    }
+
+    template<class T, int N>
+    inline const Dual<T, N> operator-(const Dual<T, N> &lhs, const T &rhs) {
+        Dual<T, N> ret(lhs);
+        return ret -= rhs;
+    }
+
+    template<class T, int N>
+    inline const Dual<T, N> operator-(const T &lhs, const Dual<T, N> &rhs) {
+        return Dual<T, N>::Chain(rhs, lhs - rhs.GetValue(), T(-1));
+    }
+
+    template<class T, int N>
+    inline const Dual<T, N> operator*(const Dual<T, N> &lhs, const Dual<T, N> &rhs) {
+        Dual<T, N> ret(lhs);
+        return ret *= rhs;
+    }
+
+    template<class T, int N>
+    inline const Dual<T, N> operator*(const Dual<T, N> &lhs, const T &rhs) {
+        Dual<T, N> ret(lhs);
+        return ret *= rhs;
+    }
+
+    template<class T, int N>
+    inline const Dual<T, N> operator*(const T &lhs, const Dual<T, N> &rhs) {
+        Dual<T, N> ret(rhs);
+        return ret *= lhs;
+    }
+
+    template<class T, int N>
+    inline const Dual<T, N> operator/(const Dual<T, N> &lhs, const Dual<T, N> &rhs) {
+        Dual<T, N> ret(lhs);
+        return ret /= rhs;
+    }
+
+    template<class T, int N>
+    inline const Dual<T, N> operator/(const Dual<T, N> &lhs, const T &rhs) {
+        Dual<T, N> ret(lhs);
+        return ret /= rhs;
+    }
+
+    template<class T, int N>
+    inline const Dual<T, N> operator/(const T &lhs, const Dual<T, N> &rhs) {
+        T value = lhs / rhs.GetValue();
+        return Dual<T, N>::Chain(rhs, value, -value / rhs.GetValue());
+    }
+
+#define AD_DUAL_COMPARISON(OP) \
+    template<class T, int N> \
+    inline bool operator OP(const Dual<T, N> &lhs, const Dual<T, N> &rhs) { \
+        return lhs.GetValue() OP rhs.GetValue(); \
+    } \
+    template<class T, int N> \
+    inline bool operator OP(const Dual<T, N> &lhs, const T &rhs) { \
+        return lhs.GetValue() OP rhs; \
+    } \
+    template<class T, int N> \
+    inline bool operator OP(const T &lhs, const Dual<T, N> &rhs) { \
+        return lhs OP rhs.GetValue(); \
+    }
+
+    AD_DUAL_COMPARISON(==)
+    AD_DUAL_COMPARISON(!=)
+    AD_DUAL_COMPARISON(<)
+    AD_DUAL_COMPARISON(<=)
+    AD_DUAL_COMPARISON(>)
+    AD_DUAL_COMPARISON(>=)
+
+#undef AD_DUAL_COMPARISON
+
+    template<class T, int N>
+    std::ostream& operator<<(std::ostream &out, const Dual<T, N> &x) {
+        out << x.GetValue();
+        return out;
+    }
+
+}
+
+namespace std {
+
+    template<class T, int N> const ad::Dual<T, N> atan(const ad::Dual<T, N> &x) {
+        T a = x.GetValue();
+        return ad::Dual<T, N>::Chain(x, atan(a), T(1) / (a * a + T(1)));
+    }
+
+    template<class T, int N> const ad::Dual<T, N> atan2(const ad::Dual<T, N> &y, const ad::Dual<T, N> &x) {
+        T a = y.GetValue();
+        T b = x.GetValue();
+        T d = a * a + b * b;
+        return ad::Dual<T, N>::Chain(y, x, atan2(a, b), b / d, -a / d);
+    }
+
+    template<class T, int N> const ad::Dual<T, N> atan2(T y, const ad::Dual<T, N> &x) {
+        T b = x.GetValue();
+        return ad::Dual<T, N>::Chain(x, atan2(y, b), -y / (y * y + b * b));
+    }
+
+    template<class T, int N> const ad::Dual<T, N> atan2(const ad::Dual<T, N> &y, T x) {
+        T a = y.GetValue();
+        return ad::Dual<T, N>::Chain(y, atan2(a, x), x / (a * a + x * x));
+    }
+
+    template<class T, int N> const ad::Dual<T, N> cos(const ad::Dual<T, N> &x) {
+        T a = x.GetValue();
+        return ad::Dual<T, N>::Chain(x, cos(a), -sin(a));
+    }
+
+    template<class T, int N> const ad::Dual<T, N> exp(const ad::Dual<T, N> &x) {
+        T v = exp(x.GetValue());
+        return ad::Dual<T, N>::Chain(x, v, v);
+    }
+
+    template<class T, int N> const ad::Dual<T, N> mfexp(const ad::Dual<T, N> &x) {
+        T b = T(60);
+        if (x <= b && x >= T(-1) * b) {
+            return std::exp(x);
+        } else if (x > b) {
+            return std::exp(b)*(T(1.) + T(2.) * (x - b)) / (T(1.) + x - b);
+        } else {
+            return std::exp(T(-1) * b)*(T(1.) - x - b) / (T(1.) + T(2.) * (T(-1) * x - b));
+        }
+    }
+
+    template<class T, int N> const ad::Dual<T, N> log(const ad::Dual<T, N> &x) {
+        T a = x.GetValue();
+        return ad::Dual<T, N>::Chain(x, log(a), T(1) / a);
+    }
+
+    template<class T, int N> const ad::Dual<T, N> log10(const ad::Dual<T, N> &x) {
+        T a = x.GetValue();
+        return ad::Dual<T, N>::Chain(x, log10(a), T(1) / (a * log(T(10))));
+    }
+
+    template<class T, int N> const ad::Dual<T, N> pow(const ad::Dual<T, N> &x, const ad::Dual<T, N> &y) {
+        T a = x.GetValue();
+        T b = y.GetValue();
+        T v = pow(a, b);
+        //log(a) only matters where y varies; keep a <= 0 finite
+        T dy = a > T(0) ? v * log(a) : T(0);
+        return ad::Dual<T, N>::Chain(x, y, v, b * pow(a, b - T(1)), dy);
+    }
+
+    template<class T, int N> const ad::Dual<T, N> pow(T x, const ad::Dual<T, N> &y) {
+        T v = pow(x, y.GetValue());
+        return ad::Dual<T, N>::Chain(y, v, x > T(0) ? v * log(x) : T(0));
+    }
+
+    template<class T, int N> const ad::Dual<T, N> pow(const ad::Dual<T, N> &x, T y) {
+        T a = x.GetValue();
+        return ad::Dual<T, N>::Chain(x, pow(a, y), y * pow(a, y - T(1)));
+    }
+
+    template<class T, int N> const ad::Dual<T, N> sin(const ad::Dual<T, N> &x) {
+        T a = x.GetValue();
+        return ad::Dual<T, N>::Chain(x, sin(a), cos(a));
+    }
+
+    template<class T, int N> const ad::Dual<T, N> sqrt(const ad::Dual<T, N> &x) {
+        T v = sqrt(x.GetValue());
+        return ad::Dual<T, N>::Chain(x, v, T(0.5) / v);
+    }
+
+    template<class T, int N> const ad::Dual<T, N> tan(const ad::Dual<T, N> &x) {
+        T a = x.GetValue();
+        T sec = T(1) / cos(a);
+        return ad::Dual<T, N>::Chain(x, tan(a), sec * sec);
+    }
+
+    template<class T, int N> const ad::Dual<T, N> acos(const ad::Dual<T, N> &x) {
+        T a = x.GetValue();
+        return ad::Dual<T, N>::Chain(x, acos(a), T(-1) / sqrt(T(1) - a * a));
+    }
+
+    template<class T, int N> const ad::Dual<T, N> asin(const ad::Dual<T, N> &x) {
+        T a = x.GetValue();
+        return ad::Dual<T, N>::Chain(x, asin(a), T(1) / sqrt(T(1) - a * a));
+    }
+
+    template<class T, int N> const ad::Dual<T, N> sinh(const ad::Dual<T, N> &x) {
+        T a = x.GetValue();
+        return ad::Dual<T, N>::Chain(x, sinh(a), cosh(a));
+    }
+
+    template<class T, int N> const ad::Dual<T, N> cosh(const ad::Dual<T, N> &x) {
+        T a = x.GetValue();
+        return ad::Dual<T, N>::Chain(x, cosh(a), sinh(a));
+    }
+
+    template<class T, int N> const ad::Dual<T, N> tanh(const ad::Dual<T, N> &x) {
+        T a = x.GetValue();
+        T sech = T(1) / cosh(a);
+        return ad::Dual<T, N>::Chain(x, tanh(a), sech * sech);
+    }
+
+    template<class T, int N> const ad::Dual<T, N> fabs(const ad::Dual<T, N> &x) {
+        T a = x.GetValue();
+        return ad::Dual<T, N>::Chain(x, fabs(a), a < T(0) ? T(-1) : (a > T(0) ? T(1) : T(0)));
+    }
+
+    template<class T, int N> const ad::Dual<T, N> floor(const ad::Dual<T, N> &x) {
+        return ad::Dual<T, N>(floor(x.GetValue()));
+    }
+
+}
+
+#endif	/* AD_DUAL_HPP */
+
@@ -22,6 +22,7 @@
 #include <valarray>
 #include <iomanip>
 #include <sys/timeb.h>
+#include <stdexcept>
 
 //#define HAVE_GSL
 
@@ -34,6 +35,7 @@
 
 
 #include "ADNumber.hpp"
+#include "Dual.hpp"
 #include <fstream>
 
 #if defined(WIN32) || defined(WIN64)
@@ -202,6 +204,25 @@ namespace ad {
 
         T max_c;
         int unrecorded_calls_m;
+        bool use_arena_m;
+
+        //compiled objective graph, rebuilt only when its shape changes
+        ad::CompiledExpression<T> compiled_m;
+        std::vector<unsigned long> parameter_ids_m;
+        bool replay_m;
+        bool replay_ready_m;
+        bool use_hash_consing_m;
+        ad::HashConsStatistics hash_cons_stats_m;
+        ad::CompiledCache compiled_cache_m;
+
+#ifdef ADNUMBER_MPI_SUPPORT
+        MPI_Comm communicator_m;
+        bool distributed_m;
+        //sum over the ranks of the gradient of the last objective
+        std::valarray<T> reduced_gradient_m;
+        bool reduced_gradient_ready_m;
+        unsigned long allreduce_calls_m;
+#endif
 
     public:
 
@@ -216,9 +237,21 @@ namespace ad {
         iprint_m(25),
         max_history_m(50),
         unrecorded_calls_m(0),
+        use_arena_m(false),
+        replay_m(false),
+        replay_ready_m(false),
+        use_hash_consing_m(false),
         minimizer_type_m(DUBOUT_LBFGS),
         max_c(std::numeric_limits<T>::min()) {
-
+            this->hash_cons_stats_m.lookups = 0;
+            this->hash_cons_stats_m.hits = 0;
+            this->hash_cons_stats_m.size = 0;
+#ifdef ADNUMBER_MPI_SUPPORT
+            this->communicator_m = MPI_COMM_WORLD;
+            this->distributed_m = false;
+            this->reduced_gradient_ready_m = false;
+            this->allreduce_calls_m = 0;
+#endif
         }
 
         virtual ~FunctionMinimizer() {
@@ -230,7 +263,7 @@ namespace ad {
             //            for (int i = 0; i < this->active_parameters_m.size(); i++) {
             //                grad<<this->gradient_m[i]<<"\n";
             //                for (int j = 0; j < this->active_parameters_m.size(); j++) {
-            //                    hess<<this->function_result_m.WRT(*this->active_parameters_m[i],*this->active_parameters_m[j]).GetValue()<<",";
+            //                    hess<<this->function_result_m.WRT(*this->active_parameters_m[i],*this->active_parameters_m[j])<<",";
             //                }
             //                hess<<"\n";
             //            }
@@ -329,6 +362,143 @@ namespace ad {
             this->verbose_m = verbose;
         }
 
+        /**
+         * Is each objective function evaluation recorded into the
+         * RecordingContext arena.
+         * 
+         * @return 
+         */
+        bool IsUsingArena() const {
+            return use_arena_m;
+        }
+
+        /**
+         * When set, each call to ObjectiveFunction records its graph into the
+         * calling thread's RecordingContext arena, and the previous
+         * evaluation's graph is discarded with one ResetArena instead of 
+         * being released node by node. Registered parameters must not be
+         * reassigned inside ObjectiveFunction, and no number may keep a
+         * value computed there past the evaluation (see
+         * RecordingContext::ResetArena). Default is false.
+         * 
+         * @param use_arena
+         */
+        void SetUseArena(bool use_arena) {
+            this->use_arena_m = use_arena;
+        }
+
+        /**
+         * Is each objective function evaluation recorded with hash consing.
+         * 
+         * @return 
+         */
+        bool IsUsingHashConsing() const {
+            return use_hash_consing_m;
+        }
+
+        /**
+         * When set, each call to ObjectiveFunction is recorded with hash 
+         * consing, so repeated subexpressions are stored and differentiated
+         * once. The table is dropped after every evaluation. Default is 
+         * false.
+         * 
+         * @param use_hash_consing
+         */
+        void SetUseHashConsing(bool use_hash_consing) {
+            this->use_hash_consing_m = use_hash_consing;
+        }
+
+        /**
+         * Hash consing counters accumulated over the current Run.
+         * 
+         * @return 
+         */
+        const ad::HashConsStatistics GetHashConsStatistics() const {
+            return this->hash_cons_stats_m;
+        }
+
+        /**
+         * Keeps the layouts of compiled objective graphs in directory, so a
+         * later run of a model with the same structure skips ordering the
+         * graph before its first replay. See CompiledCache.hpp. Empty, the
+         * default, turns the cache off.
+         * 
+         * @param directory
+         */
+        void SetCompiledCache(const std::string &directory) {
+            this->compiled_cache_m.SetDirectory(directory);
+            this->compiled_m.SetCache(directory.empty() ? NULL : &this->compiled_cache_m);
+        }
+
+        /**
+         * Compiled graph cache hits and misses accumulated over the current
+         * Run.
+         * 
+         * @return 
+         */
+        const ad::CompiledCacheStatistics GetCompiledCacheStatistics() const {
+            return this->compiled_cache_m.GetStatistics();
+        }
+
+#ifdef ADNUMBER_MPI_SUPPORT
+
+        /**
+         * When set, the function minimized is the sum over the ranks of 
+         * communicator of their ObjectiveFunction, each rank recording 
+         * only its own share of the data. After every evaluation each rank
+         * takes the gradient of its local graph, and the values and 
+         * gradients are summed in one MPI_Allreduce, so every rank takes 
+         * the same steps and no graph leaves its rank. All ranks must call 
+         * Run with the same recording modes. Newton steps and Hessians 
+         * use the local graph only. Default is false.
+         * 
+         * @param distributed
+         * @param communicator
+         */
+        void SetDistributed(bool distributed, MPI_Comm communicator = MPI_COMM_WORLD) {
+            this->distributed_m = distributed;
+            this->communicator_m = communicator;
+            this->reduced_gradient_ready_m = false;
+        }
+
+        bool IsDistributed() const {
+            return this->distributed_m;
+        }
+
+        /**
+         * Number of MPI_Allreduce calls over the current Run.
+         * 
+         * @return 
+         */
+        unsigned long GetAllreduceCalls() const {
+            return this->allreduce_calls_m;
+        }
+#endif
+
+        /**
+         * Is the objective function recorded once per phase and replayed.
+         * 
+         * @return 
+         */
+        bool IsReplaying() const {
+            return replay_m;
+        }
+
+        /**
+         * When set, ObjectiveFunction is recorded once per phase. Later 
+         * evaluations push the active parameter values into the compiled 
+         * graph and re-evaluate it without calling ObjectiveFunction or 
+         * allocating nodes. Only valid when the operations performed by 
+         * ObjectiveFunction do not depend on the parameter values (no 
+         * branching on them). Default is false.
+         * 
+         * @param replay
+         */
+        virtual void SetReplay(bool replay) {
+            this->replay_m = replay;
+            this->replay_ready_m = false;
+        }
+
         /**
          * Current phase.
          * 
@@ -417,6 +587,9 @@ namespace ad {
          * @return 
          */
         bool Run(MinimizerType type = DUBOUT_LBFGS) {
+            if (type == NEWTON) {
+                this->RequireExpressionGraph("FunctionMinimizer::Run(NEWTON)");
+            }
             this->minimizer_type_m = type;
             this->Initialize();
             this->max_phase_m = 1;
@@ -428,6 +601,15 @@ namespace ad {
             this->sum_time_in_grad_calc_m = 0;
             this->average_time_in_grad_calc_m = 0;
             this->has_constraints_m = false;
+            this->replay_ready_m = false;
+            this->hash_cons_stats_m.lookups = 0;
+            this->hash_cons_stats_m.hits = 0;
+            this->hash_cons_stats_m.size = 0;
+            this->compiled_cache_m.ResetStatistics();
+#ifdef ADNUMBER_MPI_SUPPORT
+            this->reduced_gradient_ready_m = false;
+            this->allreduce_calls_m = 0;
+#endif
 
             bool ret = false;
 
@@ -532,9 +714,17 @@ namespace ad {
          */
         virtual void Gradient(const ad::ADNumber<T> &fx, const std::vector<ad::ADNumber<T>* > &parameters, std::valarray<T> &gradient) {
 
+            if (this->replay_ready_m && this->IsBound(parameters)) {
+                //values are current from the last replay
+                this->compiled_m.Gradient(gradient);
+            } else if (ad::ADNumber<T>::IsRecordingTape() || fx.GetExpression() == NULL) {
+                ad::Gradient<T > (fx, parameters, gradient);
+            } else {
+                this->compiled_m.Compile(fx.GetExpression());
+                this->compiled_m.Gradient(this->ParameterIds(parameters), gradient);
+            }
+
             for (int i = 0; i < parameters.size(); i++) {
-                // std::cout<<"Gradient i = "<<i<<std::endl;
-                gradient[i] = ad::EvaluateDerivative<T > (fx.GetExpression(), parameters[i]->GetID());
                 this->gradient_m[i] = gradient[i];
                 // this->gradient_m[i] = gradient[i];
                 if (std::fabs(gradient[i]) > max_c) {
@@ -544,6 +734,17 @@ namespace ad {
 
         }
 
+        /**
+         * Whether ObjectiveFunction(ad::ADNumber<T>&) records the objective
+         * as an expression graph of the parameters. Newton, Hessians and
+         * batches are computed from that graph and are refused without it.
+         * 
+         * @return 
+         */
+        virtual bool HasExpressionGraph() const {
+            return true;
+        }
+
         const ad::ADNumber<T> GetCurrentFunctionValue() {
             ad::ADNumber<T> ret;
             this->ObjectiveFunction(ret);
@@ -555,48 +756,162 @@ namespace ad {
         const std::valarray<T> CalculateGradient(){
             std::valarray<T> gradient(this->active_parameters_m.size());
             ad::ADNumber<T> f;
-            this->ObjectiveFunction(f);
-            
-            for (int i = 0; i < this->active_parameters_m.size(); i++) {
-                gradient[i] =ad::EvaluateDerivative(f.GetExpression(),active_parameters_m[i]->GetID());
-            
+            if (ad::ADNumber<T>::IsRecordingTape()) {
+                ad::Tape<T>::Active()->Clear();
             }
-            
+            this->ObjectiveFunction(f);
+
+            ad::Gradient<T > (f, this->active_parameters_m, gradient);
+
             return gradient;
         }
         /**
-         * Calculates the true Hessian matrix to machine precision.
+         * Calculates the true Hessian matrix to machine precision. Each 
+         * column is a forward over reverse Hessian vector product on the 
+         * compiled objective; columns are computed in parallel.
          * 
          * @return 
          */
         const std::valarray<std::valarray<T> > CalculateHessian() {
-            std::valarray<std::valarray<T> > hessian(
-                    std::valarray<T > (this->active_parameters_m.size()),this->active_parameters_m.size());
-            ad::ADNumber<T> f;
-            this->ObjectiveFunction(f);
-            std::cout<<"Hessian:\n";
-            for (int i = 0; i < this->active_parameters_m.size(); i++) {
-                std::cout<<"Calculating hessian row "<<i<<".\n";
-                for (int j = 0; j < this->active_parameters_m.size(); j++) {
-                    ad::Expression<T> * exp =ad::Differentiate(f.GetExpression(),active_parameters_m[i]->GetID());
-                    exp->take();
-                    
-                    hessian[i][j] =//f.WRT(*active_parameters_m[i],*active_parameters_m[j]);
-                    ad::EvaluateDerivative(exp,active_parameters_m[j]->GetID());
-                    exp->release();
-                }
-            }
+            std::valarray<std::valarray<T> > hessian;
+            this->RequireExpressionGraph("FunctionMinimizer::CalculateHessian");
+            this->CompileHessianGraph();
+            this->compiled_m.Hessian(hessian);
+            return hessian;
+        }
 
+        /**
+         * Calculates the Hessian in compressed sparse row form. The nonzero 
+         * pattern is detected from the recorded graph and star colored, so 
+         * the cost grows with the number of colors rather than the number of 
+         * parameters. Suited to separable models with many parameters.
+         * 
+         * @return 
+         */
+        const ad::CSRMatrix<T> CalculateSparseHessian() {
+            ad::CSRMatrix<T> hessian;
+            this->RequireExpressionGraph("FunctionMinimizer::CalculateSparseHessian");
+            this->CompileHessianGraph();
+            this->compiled_m.SparseHessian(hessian);
             return hessian;
         }
 
+        /**
+         * Calculates H * v with respect to the active parameters at about 
+         * the cost of a few gradients, without forming H.
+         * 
+         * @param v
+         * @return 
+         */
+        const std::valarray<T> CalculateHessianVector(const std::valarray<T> &v) {
+            std::valarray<T> hv(this->active_parameters_m.size());
+            this->RequireExpressionGraph("FunctionMinimizer::CalculateHessianVector");
+            this->CompileHessianGraph();
+            this->compiled_m.HessianVector(v, hv);
+            return hv;
+        }
+
+        /**
+         * Values of the objective at every parameter vector, each holding
+         * one value per active parameter. The objective is recorded once 
+         * and the compiled graph is evaluated several vectors per SIMD 
+         * sweep, so profiles, bootstraps and grid scans do not call 
+         * ObjectiveFunction per point. Only valid when the objective does 
+         * not branch on the parameter values, as for SetReplay.
+         * 
+         * @param parameters
+         * @return 
+         */
+        const std::valarray<T> CalculateBatch(const std::vector<std::valarray<T> > &parameters) {
+            std::valarray<T> values;
+            this->RequireExpressionGraph("FunctionMinimizer::CalculateBatch");
+            this->CompileHessianGraph();
+            this->compiled_m.EvaluateBatch(parameters, values);
+            return values;
+        }
+
+        /**
+         * As CalculateBatch, also filling the gradient at every vector.
+         * 
+         * @param parameters
+         * @param gradients
+         * @return 
+         */
+        const std::valarray<T> CalculateBatch(const std::vector<std::valarray<T> > &parameters,
+                std::vector<std::valarray<T> > &gradients) {
+            std::valarray<T> values;
+            this->RequireExpressionGraph("FunctionMinimizer::CalculateBatch");
+            this->CompileHessianGraph();
+            this->compiled_m.GradientBatch(parameters, values, gradients);
+            return values;
+        }
+
     private:
 
+        void RequireExpressionGraph(const char* caller) const {
+            if (!this->HasExpressionGraph()) {
+                throw std::logic_error(std::string(caller) + ": the objective is not recorded as an expression graph.");
+            }
+        }
+
+        /**
+         * Records the objective as an expression graph, whatever the 
+         * recording mode, and compiles it bound to the active parameters.
+         */
+        void CompileHessianGraph() {
+            bool record_expression = ad::ADNumber<T>::IsRecordingExpression();
+            bool record_tape = ad::ADNumber<T>::IsRecordingTape();
+            ad::ADNumber<T>::SetRecordTape(false);
+            ad::ADNumber<T>::SetRecordExpression(true);
+
+            ad::ADNumber<T> f;
+            this->ObjectiveFunction(f);
+
+            ad::ADNumber<T>::SetRecordExpression(record_expression);
+            ad::ADNumber<T>::SetRecordTape(record_tape);
+
+            this->compiled_m.Compile(f.GetExpression());
+            this->compiled_m.Bind(this->ParameterIds(this->active_parameters_m));
+            this->replay_ready_m = false;
+        }
+
+        const std::vector<unsigned long>& ParameterIds(const std::vector<ad::ADNumber<T>* > &parameters) {
+            this->parameter_ids_m.resize(parameters.size());
+            for (size_t i = 0; i < parameters.size(); i++) {
+                this->parameter_ids_m[i] = parameters[i]->GetID();
+            }
+            return this->parameter_ids_m;
+        }
+
+        /**
+         * Is the compiled graph bound to exactly these parameters.
+         */
+        bool IsBound(const std::vector<ad::ADNumber<T>* > &parameters) const {
+            const std::vector<unsigned long> &ids = this->compiled_m.BoundIds();
+            if (ids.size() != parameters.size()) {
+                return false;
+            }
+            for (size_t i = 0; i < parameters.size(); i++) {
+                if (ids[i] != parameters[i]->GetID()) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
         void CallGradient(ad::ADNumber<T> &fx, std::vector<ad::ADNumber<T>* > &parameters, std::valarray<T> &gradient) {
             this->gradient_calls_m++;
             this->max_c = 0;
             size_t start = this->GetMilliCount();
+#ifdef ADNUMBER_MPI_SUPPORT
+            if (this->distributed_m) {
+                this->ReduceGradient(fx, parameters, gradient);
+            } else {
+                Gradient(fx, parameters, gradient);
+            }
+#else
             Gradient(fx, parameters, gradient);
+#endif
             size_t end = this->GetMilliCount();
             this->sum_time_in_grad_calc_m += (end - start);
             this->average_time_in_grad_calc_m = sum_time_in_grad_calc_m / this->gradient_calls_m;
@@ -612,18 +927,138 @@ namespace ad {
         void CallObjectiveFunction(ad::ADNumber<T> &f) {
             //std::cout<<"called "<<__func__<<":"<<__LINE__<<std::endl;
             this->function_calls_m++;
+            bool replay = this->replay_m && ad::ADNumber<T>::IsRecordingExpression()
+                    && !ad::ADNumber<T>::IsRecordingTape();
+            if (replay && this->replay_ready_m && this->IsBound(this->active_parameters_m)) {
+                clock_t start = GetMilliCount();
+                for (size_t i = 0; i < this->active_parameters_m.size(); i++) {
+                    this->compiled_m.SetParameter(i, this->active_parameters_m[i]->GetValue());
+                }
+                f.SetValue(this->compiled_m.Forward());
+                clock_t end = GetMilliCount();
+                sum_time_in_user_function_m += (end - start);
+                average_time_in_user_function_m = sum_time_in_user_function_m / function_calls_m;
+#ifdef ADNUMBER_MPI_SUPPORT
+                if (this->distributed_m) {
+                    this->ReduceObjective(f);
+                }
+#endif
+                return;
+            }
             if (!ad::ADNumber<T>::IsRecordingExpression()) {
                 this->unrecorded_calls_m++;
             }
+            if (ad::ADNumber<T>::IsRecordingTape()) {
+                //each evaluation starts a fresh Wengert list
+                ad::Tape<T>::Active()->Clear();
+            }
+            bool use_arena = this->use_arena_m && ad::ADNumber<T>::IsRecordingExpression()
+                    && !ad::ADNumber<T>::IsRecordingTape();
+            ad::RecordingContext<T>* context = ad::RecordingContext<T>::Active();
+            bool hash_consing = this->use_hash_consing_m && ad::ADNumber<T>::IsRecordingExpression()
+                    && !ad::ADNumber<T>::IsRecordingTape() && !context->IsHashConsing();
+            if (hash_consing) {
+                context->ResetHashConsStatistics();
+                context->SetHashConsing(true);
+            }
             clock_t start = GetMilliCount();
-            this->ObjectiveFunction(f);
+            if (use_arena) {
+                //the last gradient has been extracted, drop the previous graph
+                f = T(0.0);
+                context->ResetArena();
+                context->BeginArena();
+                this->ObjectiveFunction(f);
+                context->EndArena();
+            } else {
+                this->ObjectiveFunction(f);
+            }
+            if (hash_consing) {
+                ad::HashConsStatistics stats = context->GetHashConsStatistics();
+                this->hash_cons_stats_m.lookups += stats.lookups;
+                this->hash_cons_stats_m.hits += stats.hits;
+                this->hash_cons_stats_m.size = stats.size;
+                context->SetHashConsing(false);
+            }
+            if (replay && f.GetExpression() != NULL) {
+                this->compiled_m.Compile(f.GetExpression());
+                this->compiled_m.Bind(this->ParameterIds(this->active_parameters_m));
+                this->replay_ready_m = true;
+            }
             clock_t end = GetMilliCount();
             //            this->function_result_m = ad::ADNumber<T > (f);
 
             sum_time_in_user_function_m += (end - start);
             average_time_in_user_function_m = sum_time_in_user_function_m / function_calls_m;
+#ifdef ADNUMBER_MPI_SUPPORT
+            if (this->distributed_m) {
+                this->ReduceObjective(f);
+            }
+#endif
+        }
+
+#ifdef ADNUMBER_MPI_SUPPORT
+
+        /**
+         * Sums f over the ranks, together with the gradient of the local 
+         * graph when one was recorded, in a single MPI_Allreduce. 
+         * 
+         * @param f
+         */
+        void ReduceObjective(ad::ADNumber<T> &f) {
+            size_t n = this->active_parameters_m.size();
+            bool gradient = ad::ADNumber<T>::IsRecordingTape() || ad::ADNumber<T>::IsRecordingExpression();
+
+            std::valarray<T> buffer(gradient ? n + 1 : 1);
+            buffer[0] = f.GetValue();
+            if (gradient) {
+                std::valarray<T> local(n);
+                this->Gradient(f, this->active_parameters_m, local);
+                for (size_t i = 0; i < n; i++) {
+                    buffer[i + 1] = local[i];
+                }
+            }
+
+            MPI_Allreduce(MPI_IN_PLACE, &buffer[0], static_cast<int> (buffer.size()),
+                    ad::MPIType<T>::Get(), MPI_SUM, this->communicator_m);
+            this->allreduce_calls_m++;
+
+            f.SetValue(buffer[0]);
+            this->reduced_gradient_ready_m = gradient;
+            if (gradient) {
+                this->reduced_gradient_m.resize(n);
+                this->reduced_gradient_m = buffer[std::slice(1, n, 1)];
+            }
         }
 
+        /**
+         * The summed gradient of the last objective, reduced on its own 
+         * when it was not taken with the value.
+         */
+        void ReduceGradient(const ad::ADNumber<T> &fx, const std::vector<ad::ADNumber<T>* > &parameters, std::valarray<T> &gradient) {
+            if (this->reduced_gradient_ready_m && parameters == this->active_parameters_m) {
+                if (gradient.size() != parameters.size()) {
+                    gradient.resize(parameters.size());
+                }
+                gradient = this->reduced_gradient_m;
+            } else {
+                Gradient(fx, parameters, gradient);
+                if (gradient.size() > 0) {
+                    MPI_Allreduce(MPI_IN_PLACE, &gradient[0], static_cast<int> (gradient.size()),
+                            ad::MPIType<T>::Get(), MPI_SUM, this->communicator_m);
+                }
+                this->allreduce_calls_m++;
+            }
+
+            this->max_c = 0;
+            for (size_t i = 0; i < parameters.size(); i++) {
+                this->gradient_m[i] = gradient[i];
+                if (std::fabs(gradient[i]) > max_c) {
+                    max_c = std::fabs(gradient[i]);
+                }
+            }
+        }
+#endif
+
         bool Newton(std::vector<ad::ADNumber<T>* > &parameters, size_t iterations = 10000, T tolerance = (T(1e-5))) {
 
 
@@ -686,21 +1121,24 @@ namespace ad {
 
 
                 this->max_c = T(0);
-                //                ad::ADNumber<T> diff;
+                //gradient and Hessian from the compiled graph of this
+                //evaluation; a replayed graph already holds current values
+                if (!(this->replay_ready_m && this->IsBound(parameters))) {
+                    if (this->function_result_m.GetExpression() != NULL) {
+                        this->compiled_m.Compile(this->function_result_m.GetExpression());
+                        this->compiled_m.Bind(this->ParameterIds(parameters));
+                    } else {
+                        this->CompileHessianGraph();
+                    }
+                }
+                this->compiled_m.Gradient(gradient);
+                this->compiled_m.Hessian(hessian);
                 for (int i = 0; i < parameters.size(); i++) {
-                    ad::ADNumber<T> diff(this->function_result_m.WRT(*parameters[i]));
-
-                    gradient[i] = diff.GetValue();
-                    this->gradient_m[i] = diff.GetValue();
+                    this->gradient_m[i] = gradient[i];
 
                     if (std::fabs(gradient[i]) > std::fabs(this->max_c)) {
                         this->max_c = gradient_m[i];
                     }
-                    for (int j = 0; j < parameters.size(); j++) {
-                        hessian[i][j] = ad::EvaluateDerivative(diff.GetExpression(), parameters[j]->GetID());
-                        //   std::cout << hessian[i][j] << " ";
-                    }
-                    // std::cout << std::endl;
                 }
 
 
@@ -1546,6 +1984,18 @@ namespace ad {
             std::cout << "Average Time Calculating Gradients: " << BOLD
                     << static_cast<long> (this->average_time_in_grad_calc_m)
                     << " ms\n" << DEFAULT_IO;
+            if (this->use_hash_consing_m) {
+                std::cout << "Hash Consing Dedup Ratio: " << BOLD
+                        << this->hash_cons_stats_m.DedupRatio()
+                        << DEFAULT_IO << " (" << this->hash_cons_stats_m.hits
+                        << " of " << this->hash_cons_stats_m.lookups << " nodes)\n";
+            }
+            if (this->compiled_cache_m.IsEnabled()) {
+                ad::CompiledCacheStatistics stats = this->compiled_cache_m.GetStatistics();
+                std::cout << "Compiled Graph Cache: " << BOLD << stats.hits
+                        << DEFAULT_IO << " hits, " << BOLD << stats.misses
+                        << DEFAULT_IO << " misses\n";
+            }
             int prec = std::cout.precision();
             std::cout.precision(50);
             std::cout << "Function Value = " << BOLD << ret
@@ -1646,6 +2096,123 @@ namespace ad {
 
     };
 
+    /**
+     * A FunctionMinimizer for small problems whose objective is written over
+     * ad::Dual numbers. Each evaluation seeds active parameter k in lane k
+     * and returns the value and the full gradient at once, so no expression
+     * graph or tape is built. At most N parameters may be active in a phase.
+     *
+     * Only gradient based methods are supported. NEWTON, the Hessians and
+     * CalculateBatch need the expression graph and throw std::logic_error
+     * here. Replay is always off.
+     */
+    template<class T, int N>
+    class DualFunctionMinimizer : public FunctionMinimizer<T> {
+        std::vector<ad::Dual<T, N> > duals_m;
+        std::valarray<T> dual_gradient_m;
+
+    public:
+
+        /**
+         * Abstract function. The function to be minimized, evaluated in
+         * vector forward mode. Read registered parameters through Value.
+         * 
+         * @param f -the value that is minimized.
+         */
+        virtual void ObjectiveFunction(ad::Dual<T, N> &f) = 0;
+
+        /**
+         * The forward mode copy of a registered parameter for the current
+         * evaluation.
+         * 
+         * @param parameter
+         * @return 
+         */
+        const ad::Dual<T, N>& Value(const ad::ADNumber<T> &parameter) const {
+            for (size_t i = 0; i < this->parameters_m.size(); i++) {
+                if (this->parameters_m[i] == &parameter) {
+                    return this->duals_m[i];
+                }
+            }
+            throw std::invalid_argument("DualFunctionMinimizer::Value: parameter is not registered.");
+        }
+
+        /**
+         * Replay records an expression graph, which this minimizer never
+         * builds; true throws std::invalid_argument.
+         *
+         * @param replay
+         */
+        virtual void SetReplay(bool replay) {
+            if (replay) {
+                throw std::invalid_argument("DualFunctionMinimizer::SetReplay: replay needs an expression graph.");
+            }
+            FunctionMinimizer<T>::SetReplay(false);
+        }
+
+        /**
+         * Evaluates the objective in forward mode. The value is returned in
+         * f as a constant and the gradient is kept for Gradient.
+         * 
+         * @param f
+         */
+        virtual void ObjectiveFunction(ad::ADNumber<T> &f) {
+            ad::Dual<T, N> fx;
+            this->Evaluate(fx);
+            f = fx.GetValue();
+        }
+
+    protected:
+
+        virtual bool HasExpressionGraph() const {
+            return false;
+        }
+
+        virtual void Gradient(const ad::ADNumber<T> &, const std::vector<ad::ADNumber<T>* > &parameters, std::valarray<T> &gradient) {
+            for (int i = 0; i < parameters.size(); i++) {
+                gradient[i] = this->dual_gradient_m[i];
+                this->gradient_m[i] = gradient[i];
+                if (std::fabs(gradient[i]) > this->max_c) {
+                    this->max_c = std::fabs(gradient[i]);
+                }
+            }
+        }
+
+        const std::valarray<T> CalculateGradient() {
+            ad::Dual<T, N> fx;
+            this->Evaluate(fx);
+            return this->dual_gradient_m;
+        }
+
+    private:
+
+        void Evaluate(ad::Dual<T, N> &fx) {
+            const std::vector<ad::ADNumber<T>* > &active = this->active_parameters_m;
+            if (active.size() > static_cast<size_t> (N)) {
+                throw std::length_error("DualFunctionMinimizer: more active parameters than tangent lanes.");
+            }
+
+            //active parameters keep the order of parameters_m
+            this->duals_m.resize(this->parameters_m.size());
+            size_t lane = 0;
+            for (size_t i = 0; i < this->parameters_m.size(); i++) {
+                T value = this->parameters_m[i]->GetValue();
+                if (lane < active.size() && active[lane] == this->parameters_m[i]) {
+                    this->duals_m[i] = ad::Dual<T, N > (value, static_cast<int> (lane++));
+                } else {
+                    this->duals_m[i] = ad::Dual<T, N > (value);
+                }
+            }
+
+            this->ObjectiveFunction(fx);
+
+            this->dual_gradient_m.resize(active.size());
+            for (size_t i = 0; i < active.size(); i++) {
+                this->dual_gradient_m[i] = fx.GetTangent(static_cast<int> (i));
+            }
+        }
+    };
+
 
 
     //gsl
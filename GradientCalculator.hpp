@@ -8,6 +8,11 @@
 #ifndef GRADIENTCALCULATOR_HPP
 #define	GRADIENTCALCULATOR_HPP
 
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
 #include "ADNumber.hpp"
 
 #ifdef AD_OPENCL_SUPPORT
@@ -143,16 +148,90 @@ class GradientCalculator {
 
     T max_gradient_component;
 
+    /**
+     * Work for one thread of GradientConcurrentCPU. Each task is allocated
+     * on its own and padded, and its stacks and gradient block live in one
+     * cache line aligned buffer whose sections are padded to whole lines,
+     * so threads never write to a cache line another thread touches.
+     */
+    struct ConcurrentTask {
+        char pad_front[64];
+        GradientCalculator<T>* owner;
+        size_t begin;
+        size_t end;
+        unsigned long generation;
+        T max_component;
+        char* block;
+        T* buffer;
+        size_t buffer_size;
+        T* values;
+        T* derivatives;
+        T* gradient;
+        char pad_back[64];
+    };
+
+    unsigned int concurrency;
+    std::vector<pthread_t> workers;
+    std::vector<ConcurrentTask*> tasks;
+    pthread_mutex_t pool_mutex;
+    pthread_cond_t pool_start;
+    pthread_cond_t pool_done;
+    unsigned long pool_generation;
+    unsigned int pool_pending;
+    bool pool_shutdown;
+    bool pool_failed;
+    const CExp* shared_expression;
+    size_t shared_expression_size;
+    const int* shared_parameters;
+
 public:
 
     GradientCalculator():
+     max_gradient_component(0),
+    concurrency(GradientCalculator<T>::HardwareConcurrency()),
+    pool_generation(0),
+    pool_pending(0),
+    pool_shutdown(false),
+    pool_failed(false),
+    shared_expression(NULL),
+    shared_expression_size(0),
+    shared_parameters(NULL)
 #ifdef AD_OPENCL_SUPPORT
-     gpu_initialized(false),
+    , gpu_initialized(false),
     expression_size(0),
     stack_size(0)
 #endif
-     max_gradient_component(0){
+     {
+        pthread_mutex_init(&pool_mutex, NULL);
+        pthread_cond_init(&pool_start, NULL);
+        pthread_cond_init(&pool_done, NULL);
+    }
+
+    ~GradientCalculator() {
+        this->StopWorkers();
+        pthread_cond_destroy(&pool_done);
+        pthread_cond_destroy(&pool_start);
+        pthread_mutex_destroy(&pool_mutex);
+    }
 
+    /**
+     * Sets the number of threads used by GradientConcurrentCPU, including
+     * the calling thread. Defaults to the number of online processors.
+     * 
+     * @param threads
+     */
+    void SetConcurrency(unsigned int threads) {
+        if (threads == 0) {
+            threads = 1;
+        }
+        if (threads != this->concurrency) {
+            this->StopWorkers();
+            this->concurrency = threads;
+        }
+    }
+
+    const unsigned int GetConcurrency() const {
+        return this->concurrency;
     }
 
     const T GetMaxGradientComponent(){
@@ -765,8 +844,93 @@ public:
         //        this->gradient_cpu_p(array.id.data(), array.op.data(), array.value.data(), array.left.data(), array.right.data(), array.size, parameter_ids.data(), gradient.data(), parameter_ids.size());
 
 
-        ad::PostOrderIterator<T> it(f.GetExpression());
         std::vector<CExp> cxep;
+        this->postorder_(f, cxep);
+
+        this->gradient_(cxep, parameter_ids, gradient);
+
+
+    }
+
+    /**
+     * Computes the same gradient as GradientCPU, with the parameter list
+     * split into contiguous blocks across GetConcurrency() threads. The
+     * calling thread works the first block, a persistent pool of workers 
+     * the rest. Throws std::bad_alloc, after every worker has finished,
+     * if a thread cannot allocate its stacks.
+     * 
+     * @param f
+     * @param parameter_ids
+     * @param gradient
+     */
+    void GradientConcurrentCPU(const ad::ADNumber<T> &f,
+            std::vector<int> &parameter_ids,
+            std::vector<T> &gradient) {
+
+        std::vector<CExp> cxep;
+        this->postorder_(f, cxep);
+
+        this->gradient_concurrent_(cxep, parameter_ids, gradient);
+    }
+
+    /**
+     * Runs GradientCPU and GradientConcurrentCPU on the same postorder array
+     * and reports both times and the speedup to out. 
+     * 
+     * @param f
+     * @param parameter_ids
+     * @param gradient receives the concurrent result
+     * @param out
+     * @return the speedup, serial time / concurrent time.
+     */
+    T BenchmarkConcurrentCPU(const ad::ADNumber<T> &f,
+            std::vector<int> &parameter_ids,
+            std::vector<T> &gradient,
+            std::ostream &out = std::cout) {
+
+        std::vector<CExp> cxep;
+        this->postorder_(f, cxep);
+
+        std::vector<int> &p = parameter_ids;
+        std::vector<T> serial(p.size());
+        gradient.resize(p.size());
+
+        double start = GradientCalculator<T>::Now();
+        this->gradient_(cxep, p, serial);
+        double serial_time = GradientCalculator<T>::Now() - start;
+
+        start = GradientCalculator<T>::Now();
+        this->gradient_concurrent_(cxep, p, gradient);
+        double concurrent_time = GradientCalculator<T>::Now() - start;
+
+        T max_difference = 0;
+        for (size_t i = 0; i < p.size(); i++) {
+            max_difference = std::max(max_difference, static_cast<T> (std::fabs(serial[i] - gradient[i])));
+        }
+
+        T speedup = concurrent_time > 0 ? static_cast<T> (serial_time / concurrent_time) : T(0);
+        out << "GradientCPU:           " << serial_time << " s\n";
+        out << "GradientConcurrentCPU: " << concurrent_time << " s (" << this->concurrency << " threads)\n";
+        out << "Speedup:               " << speedup << "\n";
+        out << "Max difference:        " << max_difference << "\n";
+        return speedup;
+    }
+
+private:
+
+    static unsigned int HardwareConcurrency() {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        return n > 0 ? static_cast<unsigned int> (n) : 1;
+    }
+
+    static double Now() {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec * 1e-6;
+    }
+
+    void postorder_(const ad::ADNumber<T> &f, std::vector<CExp> &cxep) {
+        ad::PostOrderIterator<T> it(f.GetExpression());
         while (it) {
 
             ad::Expression<T> * exp = (ad::Expression<T>*)it;
@@ -778,19 +942,227 @@ public:
 
             it++;
         }
+    }
 
-        this->gradient_(cxep, parameter_ids, gradient);
+    void gradient_concurrent_(std::vector<CExp> &expr, std::vector<int> &p, std::vector<T> &gradient) {
+        size_t p_size = p.size();
+        if (gradient.size() != p_size) {
+            gradient.resize(p_size);
+        }
+
+        size_t threads = std::min<size_t>(this->concurrency, p_size);
+        if (threads <= 1 || expr.size() == 0) {
+            this->gradient_(expr, p, gradient);
+            return;
+        }
+
+        this->StartWorkers();
+
+        size_t block = p_size / threads;
+        size_t extra = p_size % threads;
+        size_t begin = 0;
+        for (size_t t = 0; t < this->tasks.size(); t++) {
+            ConcurrentTask* task = this->tasks[t];
+            size_t count = t < threads ? block + (t < extra ? 1 : 0) : 0;
+            task->begin = begin;
+            task->end = begin + count;
+            begin += count;
+        }
+
+        pthread_mutex_lock(&this->pool_mutex);
+        this->shared_expression = &expr.front();
+        this->shared_expression_size = expr.size();
+        this->shared_parameters = &p.front();
+        this->pool_pending = static_cast<unsigned int> (this->workers.size());
+        this->pool_failed = false;
+        this->pool_generation++;
+        pthread_cond_broadcast(&this->pool_start);
+        pthread_mutex_unlock(&this->pool_mutex);
+
+        //the workers read expr and p, so they must finish before either
+        //goes out of scope, even when this thread's share throws
+        try {
+            GradientCalculator<T>::RunTask(this->tasks[0]);
+        } catch (...) {
+            this->WaitForWorkers();
+            throw;
+        }
 
+        if (this->WaitForWorkers()) {
+            throw std::bad_alloc();
+        }
+
+        this->max_gradient_component = 0;
+        for (size_t t = 0; t < this->tasks.size(); t++) {
+            ConcurrentTask* task = this->tasks[t];
+            if (task->end > task->begin) {
+                std::copy(task->gradient, task->gradient + (task->end - task->begin),
+                        gradient.begin() + task->begin);
+                if (std::fabs(task->max_component) > std::fabs(this->max_gradient_component)) {
+                    this->max_gradient_component = task->max_component;
+                }
+            }
+        }
+    }
 
+    /**
+     * Blocks until every worker has finished the current generation.
+     * Returns true if one of them failed.
+     */
+    bool WaitForWorkers() {
+        pthread_mutex_lock(&this->pool_mutex);
+        while (this->pool_pending != 0) {
+            pthread_cond_wait(&this->pool_done, &this->pool_mutex);
+        }
+        bool failed = this->pool_failed;
+        pthread_mutex_unlock(&this->pool_mutex);
+        return failed;
     }
 
-    void GradientConcurrentCPU(const ad::ADNumber<T> &f,
-            const std::vector<unsigned int> &parameter_ids,
-            std::vector<T> &gradient) {
+    static void RunTask(ConcurrentTask* task) {
+        GradientCalculator<T>* owner = task->owner;
+        size_t count = task->end - task->begin;
+        task->max_component = 0;
+        if (count == 0) {
+            return;
+        }
 
+        size_t e_size = owner->shared_expression_size;
+        size_t stack_size = GradientCalculator<T>::CacheLines(e_size);
+        size_t size = 2 * stack_size + GradientCalculator<T>::CacheLines(count);
+        if (task->buffer_size < size) {
+            //allocated here, on the thread that uses it; the replacement
+            //malloc has no posix_memalign, so the start is aligned by hand
+            free(task->block);
+            task->block = static_cast<char*> (malloc(size * sizeof (T) + 63));
+            if (task->block == NULL) {
+                task->buffer = NULL;
+                task->buffer_size = 0;
+                throw std::bad_alloc();
+            }
+            uintptr_t start = (reinterpret_cast<uintptr_t> (task->block) + 63) & ~static_cast<uintptr_t> (63);
+            task->buffer = reinterpret_cast<T*> (start);
+            task->buffer_size = size;
+        }
+        task->values = task->buffer;
+        task->derivatives = task->buffer + stack_size;
+        task->gradient = task->buffer + 2 * stack_size;
+
+        task->max_component = GradientCalculator<T>::gradient_range_(owner->shared_expression, e_size,
+                owner->shared_parameters, task->begin, task->end,
+                task->values, task->derivatives, task->gradient);
     }
 
-private:
+    /**
+     * Number of T in the whole 64 byte lines that hold n of them.
+     */
+    static size_t CacheLines(size_t n) {
+        size_t bytes = ((n * sizeof (T) + 63) / 64) * 64;
+        return (bytes + sizeof (T) - 1) / sizeof (T);
+    }
+
+    static void DeleteTask(ConcurrentTask* task) {
+        free(task->block);
+        delete task;
+    }
+
+    static void* WorkerLoop(void* arg) {
+        ConcurrentTask* task = static_cast<ConcurrentTask*> (arg);
+        GradientCalculator<T>* owner = task->owner;
+        unsigned long seen = task->generation;
+
+        pthread_mutex_lock(&owner->pool_mutex);
+        while (true) {
+            while (owner->pool_generation == seen && !owner->pool_shutdown) {
+                pthread_cond_wait(&owner->pool_start, &owner->pool_mutex);
+            }
+            if (owner->pool_shutdown) {
+                break;
+            }
+            seen = owner->pool_generation;
+            pthread_mutex_unlock(&owner->pool_mutex);
+
+            bool failed = false;
+            try {
+                GradientCalculator<T>::RunTask(task);
+            } catch (...) {
+                failed = true;
+            }
+
+            pthread_mutex_lock(&owner->pool_mutex);
+            if (failed) {
+                owner->pool_failed = true;
+            }
+            if (--owner->pool_pending == 0) {
+                pthread_cond_signal(&owner->pool_done);
+            }
+        }
+        pthread_mutex_unlock(&owner->pool_mutex);
+        return NULL;
+    }
+
+    /**
+     * Creates the task blocks and GetConcurrency() - 1 workers if they are
+     * not already running.
+     */
+    void StartWorkers() {
+        if (this->tasks.size() == this->concurrency) {
+            return;
+        }
+
+        this->StopWorkers();
+        pthread_mutex_lock(&this->pool_mutex);
+        this->pool_shutdown = false;
+        pthread_mutex_unlock(&this->pool_mutex);
+
+        for (unsigned int t = 0; t < this->concurrency; t++) {
+            ConcurrentTask* task = new ConcurrentTask();
+            task->owner = this;
+            task->begin = 0;
+            task->end = 0;
+            task->generation = this->pool_generation;
+            task->max_component = 0;
+            task->block = NULL;
+            task->buffer = NULL;
+            task->buffer_size = 0;
+            task->values = task->derivatives = task->gradient = NULL;
+            this->tasks.push_back(task);
+        }
+
+        for (unsigned int t = 1; t < this->concurrency; t++) {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, &GradientCalculator<T>::WorkerLoop, this->tasks[t]) != 0) {
+                // continue with the threads that did start
+                for (size_t u = t; u < this->tasks.size(); u++) {
+                    GradientCalculator<T>::DeleteTask(this->tasks[u]);
+                }
+                this->tasks.resize(t);
+                this->concurrency = t;
+                break;
+            }
+            this->workers.push_back(thread);
+        }
+    }
+
+    void StopWorkers() {
+        pthread_mutex_lock(&this->pool_mutex);
+        this->pool_shutdown = true;
+        pthread_cond_broadcast(&this->pool_start);
+        pthread_mutex_unlock(&this->pool_mutex);
+
+        for (size_t t = 0; t < this->workers.size(); t++) {
+            pthread_join(this->workers[t], NULL);
+        }
+        this->workers.clear();
+
+        for (size_t t = 0; t < this->tasks.size(); t++) {
+            GradientCalculator<T>::DeleteTask(this->tasks[t]);
+        }
+        this->tasks.clear();
+    }
+
+    GradientCalculator(const GradientCalculator<T>& other);
+    GradientCalculator<T>& operator=(const GradientCalculator<T>& other);
 
     /**
      * Evaluates an expression for the derivative with respect to wrt using a
@@ -1261,15 +1633,30 @@ private:
             this->derivative_stack = std::vector<T > (e_size);
         }
 
-        this->max_gradient_component =0;
-
         T* values = (value_stack.size() != 0) ? &value_stack.front() : NULL;
         T* derivatives = (derivative_stack.size() != 0) ? &derivative_stack.front() : NULL;
         CExp* expression = (e_size != 0) ? &expr.front() : NULL;
 
-        int g;
-        int i;
-        for (g = 0; g < p_size; g++) {
+        this->max_gradient_component = GradientCalculator<T>::gradient_range_(expression, e_size,
+                (p_size != 0) ? &p.front() : NULL, 0, p_size,
+                values, derivatives,
+                (gradient.size() != 0) ? &gradient.front() : NULL);
+    }
+
+    /**
+     * Computes the gradient components for parameters p[begin] to p[end - 1]
+     * over the postorder array expression, using the caller's stacks.
+     * Component g is written to gradient[g - begin]. 
+     * 
+     * @return the component with the largest magnitude.
+     */
+    static T gradient_range_(const CExp* expression, size_t e_size,
+            const int* p, size_t begin, size_t end,
+            T* values, T* derivatives, T* gradient) {
+        T max_component = 0;
+        size_t g;
+        size_t i;
+        for (g = begin; g < end; g++) {
 
             int wrt = p[g];
             int found, j;
@@ -1718,13 +2105,14 @@ private:
 
             }
 
-            if(std::fabs(derivatives[0])> std::fabs(this->max_gradient_component)){
-                this->max_gradient_component = derivatives[0];
+            if(std::fabs(derivatives[0])> std::fabs(max_component)){
+                max_component = derivatives[0];
             }
             
            
-            gradient[g] = derivatives[0];
+            gradient[g - begin] = derivatives[0];
         }
+        return max_component;
     }
 
     int has_id_p(int *id, int*left, int *right, int root, int has, int size) {
@@ -0,0 +1,455 @@
+/*
+ * File:   Batch.hpp
+ * Author: matthewsupernaw
+ *
+ * Created on October 17, 2026
+ *
+ * A Batch<T, N> holds the values of one quantity for N independent
+ * inputs, one per lane. Every operation works on all lanes at once in a
+ * loop with a compile time trip count and no dependencies, so the
+ * compiler maps a batch onto SIMD registers: N = 4 doubles fill an AVX2
+ * register and N = 8 an AVX-512 one (build with -mavx2 or -mavx512f, or
+ * -march=native). ADNUMBER_BATCH_LANES is the width matching the target.
+ *
+ * With AVX2, exp, log, log10 and pow of double are branch free polynomial
+ * kernels (see BatchMath), so they vectorize too instead of calling libm
+ * once per lane. exp and log are accurate to an ulp; pow is computed as
+ * exp(y * log|x|), so its relative error grows with |y * log(x)|. Without
+ * AVX2 the kernels do not vectorize well (no 256 bit integer lanes, and
+ * SSE2 has no 64 bit lane blends) and lose to libm, so every function is
+ * evaluated lane by lane with <cmath>.
+ */
+
+#ifndef AD_BATCH_HPP
+#define	AD_BATCH_HPP
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdint.h>
+
+#ifndef ADNUMBER_BATCH_LANES
+#if defined(__AVX512F__)
+#define ADNUMBER_BATCH_LANES 8
+#elif defined(__AVX__)
+#define ADNUMBER_BATCH_LANES 4
+#else
+#define ADNUMBER_BATCH_LANES 2
+#endif
+#endif
+
+/**
+ * The double kernels must be inlined into the lane loops to vectorize,
+ * which the inliner declines at -O2 for bodies the size of Log and Pow.
+ */
+#ifdef __GNUC__
+#define ADNUMBER_BATCH_INLINE inline __attribute__((always_inline))
+#else
+#define ADNUMBER_BATCH_INLINE inline
+#endif
+
+namespace ad {
+
+    /**
+     * Lane wise exp, log and pow over n values. The generic version calls
+     * <cmath>; with AVX2, double has vectorizable kernels.
+     */
+    template<class T>
+    struct BatchMath {
+
+        static inline void Exp(const T* x, T* y, int n) {
+            for (int i = 0; i < n; i++) {
+                y[i] = std::exp(x[i]);
+            }
+        }
+
+        static inline void Log(const T* x, T* y, int n) {
+            for (int i = 0; i < n; i++) {
+                y[i] = std::log(x[i]);
+            }
+        }
+
+        static inline void Pow(const T* x, const T* p, T* y, int n) {
+            for (int i = 0; i < n; i++) {
+                y[i] = std::pow(x[i], p[i]);
+            }
+        }
+    };
+
+#ifdef __AVX2__
+
+    template<>
+    struct BatchMath<double> {
+
+        static ADNUMBER_BATCH_INLINE int64_t Bits(double x) {
+            int64_t b;
+            std::memcpy(&b, &x, sizeof (b));
+            return b;
+        }
+
+        static ADNUMBER_BATCH_INLINE double FromBits(int64_t b) {
+            double x;
+            std::memcpy(&x, &b, sizeof (x));
+            return x;
+        }
+
+        /**
+         * c ? a : b as a bit mask blend. Both operands are always computed,
+         * so the compiler cannot move one behind a branch, which it must
+         * otherwise keep under the default -ftrapping-math and which stops
+         * the lane loops from vectorizing.
+         */
+        static ADNUMBER_BATCH_INLINE double Select(bool c, double a, double b) {
+            int64_t mask = -static_cast<int64_t> (c);
+            return FromBits((Bits(a) & mask) | (Bits(b) & ~mask));
+        }
+
+        /**
+         * Adding and subtracting 1.5 * 2^52 rounds to the nearest integer
+         * and leaves that integer in the low bits of the sum.
+         */
+        static ADNUMBER_BATCH_INLINE double Shifter() {
+            return 6755399441055744.0;
+        }
+
+        /**
+         * 2^k for -1022 <= k <= 1023, built from its exponent bits.
+         */
+        static ADNUMBER_BATCH_INLINE double Scale(int64_t k) {
+            return FromBits((k + 1023) << 52);
+        }
+
+        /**
+         * exp(x) = 2^k * exp(r), with k = round(x / ln 2) and |r| <= ln 2 / 2
+         * by Cody and Waite reduction; exp(r) is its Taylor polynomial to
+         * degree 13, evaluated by Estrin's scheme. 2^k is applied as two factors so that overflow and
+         * gradual underflow come out of the multiplications.
+         */
+        static ADNUMBER_BATCH_INLINE double Exp(double x) {
+            const double ln2_hi = 6.93147180369123816490e-01;
+            const double ln2_lo = 1.90821492927058770002e-10;
+            const double log2e = 1.44269504088896338700e+00;
+
+            double c = Select(x < -746.0, -746.0, x);
+            c = Select(c > 710.0, 710.0, c);
+            double t = c * log2e + Shifter();
+            double k = t - Shifter();
+            int64_t ki = Bits(t) - Bits(Shifter());
+            double r = (c - k * ln2_hi) - k * ln2_lo;
+
+            //Estrin's scheme: the partial sums are independent, so the
+            //dependency chain is four multiplies long instead of thirteen
+            double r2 = r * r;
+            double r4 = r2 * r2;
+            double r8 = r4 * r4;
+            double p23 = 0.5 + r * (1.0 / 6.0);
+            double p45 = 1.0 / 24.0 + r * (1.0 / 120.0);
+            double p67 = 1.0 / 720.0 + r * (1.0 / 5040.0);
+            double p89 = 1.0 / 40320.0 + r * (1.0 / 362880.0);
+            double p1011 = 1.0 / 3628800.0 + r * (1.0 / 39916800.0);
+            double p1213 = 1.0 / 479001600.0 + r * (1.0 / 6227020800.0);
+            double p29 = (p23 + r2 * p45) + r4 * (p67 + r2 * p89);
+            double p213 = p29 + r8 * (p1011 + r2 * p1213);
+            //1 + r last, so that the small terms round once
+            double p = 1.0 + (r + r2 * p213);
+
+            int64_t k1 = ki >> 1;
+            double y = p * Scale(k1) * Scale(ki - k1);
+            return Select(x != x, x, y);
+        }
+
+        /**
+         * log(x) = e * ln 2 + log(m) with m in [sqrt(2) / 2, sqrt(2)), and
+         * log(m) = 2 atanh(s), s = (m - 1) / (m + 1), as an odd series in s
+         * to s^21. Subnormals are scaled by 2^52 first.
+         */
+        static ADNUMBER_BATCH_INLINE double Log(double x) {
+            const double ln2_hi = 6.93147180369123816490e-01;
+            const double ln2_lo = 1.90821492927058770002e-10;
+
+            bool tiny = x < 2.2250738585072014e-308;
+            double xs = Select(tiny, x * 4503599627370496.0, x);
+            int64_t b = Bits(xs);
+            //exponent field as a double: 2^52 + field - 2^52
+            double e = FromBits((b >> 52 & 0x7ff) | Bits(4503599627370496.0)) - 4503599627370496.0;
+            e = e - Select(tiny, 1075.0, 1023.0);
+            double m = FromBits((b & 0x000fffffffffffffLL) | 0x3ff0000000000000LL);
+            bool high = m > 1.4142135623730951;
+            m = Select(high, m * 0.5, m);
+            e = Select(high, e + 1.0, e);
+
+            double f = m - 1.0;
+            double s = f / (2.0 + f);
+            double z = s * s;
+            double z2 = z * z;
+            double z4 = z2 * z2;
+            double z8 = z4 * z4;
+            double p01 = 1.0 / 3.0 + z * (1.0 / 5.0);
+            double p23 = 1.0 / 7.0 + z * (1.0 / 9.0);
+            double p45 = 1.0 / 11.0 + z * (1.0 / 13.0);
+            double p67 = 1.0 / 15.0 + z * (1.0 / 17.0);
+            double p89 = 1.0 / 19.0 + z * (1.0 / 21.0);
+            double p03 = p01 + z2 * p23;
+            double p47 = p45 + z2 * p67;
+            double p = (p03 + z4 * p47) + z8 * p89;
+            //log(m) = f - 2 s * (f / 2 - z * p), kept in this order for the
+            //small f cancellation
+            double h = 0.5 * f * f;
+            double y = e * ln2_hi + ((s * (h + z * p * 2.0) + e * ln2_lo) - h + f);
+
+            y = Select(x == 0.0, -std::numeric_limits<double>::infinity(), y);
+            y = Select(x < 0.0, std::numeric_limits<double>::quiet_NaN(), y);
+            y = Select(x == std::numeric_limits<double>::infinity(), x, y);
+            return Select(x != x, x, y);
+        }
+
+        /**
+         * Sign and special cases of std::pow for x^p, given y = |x|^p, for
+         * negative x, zero, nan p, x = 1, x = -1 with infinite p, and 
+         * p = 0.
+         */
+        static ADNUMBER_BATCH_INLINE double PowSign(double x, double p, double y) {
+            const double inf = std::numeric_limits<double>::infinity();
+            const double nan = std::numeric_limits<double>::quiet_NaN();
+
+            //p is an integer when rounding leaves it unchanged (always for
+            //|p| >= 2^52, where it is even), and odd when p / 2 is not
+            double h = 0.5 * p;
+            bool big = std::fabs(p) >= 4503599627370496.0;
+            bool integer = big | (((p + Shifter()) - Shifter()) == p);
+            bool odd = integer & !big & (((h + Shifter()) - Shifter()) != h);
+
+            //(-inf)^p is +-inf or +-0 for any p
+            double negative = Select(integer | (x == -inf), y, nan);
+            negative = Select(odd, -y, negative);
+            //1 / x for x = +-0
+            double signed_inf = FromBits(Bits(inf) | (Bits(x) & Bits(-0.0)));
+            double zero = Select(p > 0.0, 0.0, inf);
+            zero = Select(odd, Select(p > 0.0, x, signed_inf), zero);
+
+            y = Select(x < 0.0, negative, y);
+            y = Select(x == 0.0, zero, y);
+            y = Select(p != p, p, y);
+            //1^p and (-1)^+-inf are 1, even for a nan p
+            y = Select((std::fabs(x) == 1.0) & (std::fabs(p) == inf), 1.0, y);
+            y = Select(x == 1.0, 1.0, y);
+            return Select(p == 0.0, 1.0, y);
+        }
+
+        static ADNUMBER_BATCH_INLINE double Pow(double x, double p) {
+            return PowSign(x, p, Exp(p * Log(std::fabs(x))));
+        }
+
+        static ADNUMBER_BATCH_INLINE void Exp(const double* x, double* y, int n) {
+            for (int i = 0; i < n; i++) {
+                y[i] = Exp(x[i]);
+            }
+        }
+
+        static ADNUMBER_BATCH_INLINE void Log(const double* x, double* y, int n) {
+            for (int i = 0; i < n; i++) {
+                y[i] = Log(x[i]);
+            }
+        }
+
+        static ADNUMBER_BATCH_INLINE void Pow(const double* x, const double* p, double* y, int n) {
+            for (int i = 0; i < n; i++) {
+                y[i] = Pow(x[i], p[i]);
+            }
+        }
+    };
+
+#endif
+
+    template<class T, int N>
+    class Batch {
+        //naturally aligned only, see Dual
+        T lane_m[N];
+
+    public:
+
+        /*!
+         * All lanes zero.
+         */
+        Batch() {
+            for (int i = 0; i < N; i++) {
+                lane_m[i] = T(0);
+            }
+        }
+
+        /*!
+         * value in every lane.
+         *
+         * @param value
+         */
+        Batch(const T &value) {
+            for (int i = 0; i < N; i++) {
+                lane_m[i] = value;
+            }
+        }
+
+        inline T& operator[](int i) {
+            return lane_m[i];
+        }
+
+        inline const T& operator[](int i) const {
+            return lane_m[i];
+        }
+
+        inline T* Data() {
+            return lane_m;
+        }
+
+        inline const T* Data() const {
+            return lane_m;
+        }
+
+        static inline int Lanes() {
+            return N;
+        }
+
+        /*!
+         * Returns f applied to every lane of x.
+         */
+        template<class F>
+        static inline const Batch<T, N> Map(const Batch<T, N> &x, F f) {
+            Batch<T, N> ret;
+            for (int i = 0; i < N; i++) {
+                ret.lane_m[i] = f(x.lane_m[i]);
+            }
+            return ret;
+        }
+
+        const Batch<T, N> operator-() const {
+            Batch<T, N> ret;
+            for (int i = 0; i < N; i++) {
+                ret.lane_m[i] = -lane_m[i];
+            }
+            return ret;
+        }
+
+        Batch<T, N>& operator+=(const Batch<T, N> &rhs) {
+            for (int i = 0; i < N; i++) {
+                lane_m[i] += rhs.lane_m[i];
+            }
+            return *this;
+        }
+
+        Batch<T, N>& operator-=(const Batch<T, N> &rhs) {
+            for (int i = 0; i < N; i++) {
+                lane_m[i] -= rhs.lane_m[i];
+            }
+            return *this;
+        }
+
+        Batch<T, N>& operator*=(const Batch<T, N> &rhs) {
+            for (int i = 0; i < N; i++) {
+                lane_m[i] *= rhs.lane_m[i];
+            }
+            return *this;
+        }
+
+        Batch<T, N>& operator/=(const Batch<T, N> &rhs) {
+            for (int i = 0; i < N; i++) {
+                lane_m[i] /= rhs.lane_m[i];
+            }
+            return *this;
+        }
+    };
+
+#define AD_BATCH_OPERATOR(SYMBOL) \
+    template<class T, int N> \
+    inline const Batch<T, N> operator SYMBOL(const Batch<T, N> &lhs, const Batch<T, N> &rhs) { \
+        Batch<T, N> ret; \
+        for (int i = 0; i < N; i++) { \
+            ret[i] = lhs[i] SYMBOL rhs[i]; \
+        } \
+        return ret; \
+    } \
+    template<class T, int N> \
+    inline const Batch<T, N> operator SYMBOL(const Batch<T, N> &lhs, const T &rhs) { \
+        Batch<T, N> ret; \
+        for (int i = 0; i < N; i++) { \
+            ret[i] = lhs[i] SYMBOL rhs; \
+        } \
+        return ret; \
+    } \
+    template<class T, int N> \
+    inline const Batch<T, N> operator SYMBOL(const T &lhs, const Batch<T, N> &rhs) { \
+        Batch<T, N> ret; \
+        for (int i = 0; i < N; i++) { \
+            ret[i] = lhs SYMBOL rhs[i]; \
+        } \
+        return ret; \
+    }
+
+    AD_BATCH_OPERATOR(+)
+    AD_BATCH_OPERATOR(-)
+    AD_BATCH_OPERATOR(*)
+    AD_BATCH_OPERATOR(/)
+
+#undef AD_BATCH_OPERATOR
+
+}
+
+namespace std {
+
+    template<class T, int N> ADNUMBER_BATCH_INLINE const ad::Batch<T, N> exp(const ad::Batch<T, N> &x) {
+        ad::Batch<T, N> ret;
+        ad::BatchMath<T>::Exp(x.Data(), ret.Data(), N);
+        return ret;
+    }
+
+    template<class T, int N> ADNUMBER_BATCH_INLINE const ad::Batch<T, N> log(const ad::Batch<T, N> &x) {
+        ad::Batch<T, N> ret;
+        ad::BatchMath<T>::Log(x.Data(), ret.Data(), N);
+        return ret;
+    }
+
+    template<class T, int N> ADNUMBER_BATCH_INLINE const ad::Batch<T, N> log10(const ad::Batch<T, N> &x) {
+        ad::Batch<T, N> ret;
+        ad::BatchMath<T>::Log(x.Data(), ret.Data(), N);
+        return ret * (T(1.0) / std::log(T(10.0)));
+    }
+
+    template<class T, int N> ADNUMBER_BATCH_INLINE const ad::Batch<T, N> pow(const ad::Batch<T, N> &x, const ad::Batch<T, N> &p) {
+        ad::Batch<T, N> ret;
+        ad::BatchMath<T>::Pow(x.Data(), p.Data(), ret.Data(), N);
+        return ret;
+    }
+
+    template<class T, int N> const ad::Batch<T, N> atan2(const ad::Batch<T, N> &y, const ad::Batch<T, N> &x) {
+        ad::Batch<T, N> ret;
+        for (int i = 0; i < N; i++) {
+            ret[i] = atan2(y[i], x[i]);
+        }
+        return ret;
+    }
+
+#define AD_BATCH_FUNCTION(NAME) \
+    template<class T, int N> const ad::Batch<T, N> NAME(const ad::Batch<T, N> &x) { \
+        ad::Batch<T, N> ret; \
+        for (int i = 0; i < N; i++) { \
+            ret[i] = NAME(x[i]); \
+        } \
+        return ret; \
+    }
+
+    AD_BATCH_FUNCTION(sqrt)
+    AD_BATCH_FUNCTION(fabs)
+    AD_BATCH_FUNCTION(floor)
+    AD_BATCH_FUNCTION(sin)
+    AD_BATCH_FUNCTION(cos)
+    AD_BATCH_FUNCTION(tan)
+    AD_BATCH_FUNCTION(asin)
+    AD_BATCH_FUNCTION(acos)
+    AD_BATCH_FUNCTION(atan)
+    AD_BATCH_FUNCTION(sinh)
+    AD_BATCH_FUNCTION(cosh)
+    AD_BATCH_FUNCTION(tanh)
+
+#undef AD_BATCH_FUNCTION
+
+}
+
+#endif	/* AD_BATCH_HPP */
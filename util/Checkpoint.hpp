@@ -0,0 +1,319 @@
+/*
+ * File:   Checkpoint.hpp
+ * Author: matthewsupernaw
+ *
+ * Created on October 17, 2026
+ *
+ * Binomial checkpointing for time stepped models. ad::Checkpoint runs a
+ * loop of steps without keeping their record and puts a single segment on
+ * the tape in their place, whose inputs are the initial state and the
+ * parameters and whose outputs are the final state. When the backward pass
+ * reaches the segment it reverses the steps last to first. Each step is
+ * recorded on its own on a scratch tape from a state that is recomputed
+ * from the nearest stored snapshot. The snapshot positions follow the
+ * binomial schedule of revolve (Griewank and Walther, "Algorithm 799:
+ * revolve", ACM TOMS 26(1), 2000). With c snapshots and n steps, no step
+ * is recomputed more than r times, r being the least value with
+ * C(c + r, c) >= n.
+ *
+ * Memory is c states plus the tape of one step, instead of the tape of
+ * all n steps. The default of about log2(n) snapshots gives logarithmic
+ * memory for logarithmic extra work per step.
+ *
+ * Only the tape is checkpointed. When recording expression graphs the
+ * steps are recorded as usual, and without recording they simply run.
+ */
+
+#ifndef CHECKPOINT_HPP
+#define	CHECKPOINT_HPP
+
+#include <vector>
+#include <map>
+#include <cmath>
+#include <algorithm>
+
+#include "Tape.hpp"
+#include "RecordingContext.hpp"
+
+namespace ad {
+
+    /**
+     * Sets the calling thread's recording mode for the lifetime of the
+     * object. With a tape, operations are recorded on it alone; without
+     * one, nothing is recorded.
+     */
+    template<class T>
+    class CheckpointMode {
+        RecordingContext<T>* context_m;
+        bool record_expression_m;
+        bool record_tape_m;
+        Tape<T>* previous_m;
+        bool swapped_m;
+
+    public:
+
+        CheckpointMode(Tape<T>* tape = NULL) :
+        context_m(RecordingContext<T>::Active()),
+        record_expression_m(context_m->IsRecordingExpression()),
+        record_tape_m(context_m->IsRecordingTape()),
+        previous_m(NULL),
+        swapped_m(tape != NULL) {
+            context_m->SetRecordExpression(false);
+            context_m->SetRecordTape(tape != NULL);
+            if (swapped_m) {
+                previous_m = context_m->SwapTape(tape);
+            }
+        }
+
+        ~CheckpointMode() {
+            if (swapped_m) {
+                context_m->SwapTape(previous_m);
+            }
+            context_m->SetRecordExpression(record_expression_m);
+            context_m->SetRecordTape(record_tape_m);
+        }
+
+    private:
+        CheckpointMode(const CheckpointMode<T>& other);
+        CheckpointMode<T>& operator=(const CheckpointMode<T>& other);
+    };
+
+    /**
+     * The tape segment of one ad::Checkpoint call. It keeps the initial
+     * state and parameter values and a copy of the step function.
+     */
+    template<class T, class F>
+    class CheckpointSegment : public TapeSegment<T> {
+        F step_m;
+        int begin_m;
+        int end_m;
+        int snapshots_m;
+        std::vector<T> initial_m;
+        //stand ins for the parameters, by id
+        std::vector<ADNumber<T> > parameters_m;
+        std::map<unsigned long, size_t> positions_m;
+        Tape<T> tape_m;
+
+    public:
+
+        CheckpointSegment(const F &step, int begin, int end, int snapshots,
+                const std::vector<T> &initial, const std::vector<T> &parameters) :
+        step_m(step),
+        begin_m(begin),
+        end_m(end),
+        snapshots_m(snapshots),
+        initial_m(initial),
+        parameters_m(parameters.begin(), parameters.end()),
+        tape_m(64) {
+            for (size_t j = 0; j < parameters_m.size(); j++) {
+                positions_m[parameters_m[j].GetID()] = j;
+            }
+        }
+
+        /**
+         * Advances values from step from to step to. The steps are recorded
+         * on the scratch tape, cleared after each one, which is cheaper than
+         * evaluating without recording.
+         */
+        void Advance(std::vector<T> &values, int from, int to) {
+            if (from >= to) {
+                return;
+            }
+
+            CheckpointMode<T> mode(&tape_m);
+            std::vector<ADNumber<T> > state(values.begin(), values.end());
+            for (int t = from; t < to; t++) {
+                tape_m.Clear();
+                step_m(t, state, parameters_m);
+            }
+            for (size_t i = 0; i < values.size(); i++) {
+                values[i] = state[i].GetValue();
+            }
+        }
+
+        /**
+         * Inputs are the initial state followed by the parameters, outputs
+         * the final state.
+         */
+        void Reverse(const std::vector<T> &output_adjoints, std::vector<T> &input_adjoints) {
+            size_t n = initial_m.size();
+            std::vector<T> adjoint(output_adjoints);
+            std::vector<T> parameter_adjoint(parameters_m.size(), T(0));
+
+            this->ReverseRange(begin_m, end_m, initial_m, snapshots_m, adjoint, parameter_adjoint);
+
+            for (size_t i = 0; i < n; i++) {
+                input_adjoints[i] += adjoint[i];
+            }
+            for (size_t j = 0; j < parameter_adjoint.size(); j++) {
+                input_adjoints[n + j] += parameter_adjoint[j];
+            }
+        }
+
+        /**
+         * C(c + r, c), the most steps that c snapshots reverse with no step
+         * recomputed more than r times. Saturates instead of overflowing.
+         */
+        static double Binomial(int c, int r) {
+            double beta = 1.0;
+            for (int k = 1; k <= c; k++) {
+                beta = beta * static_cast<double> (r + k) / static_cast<double> (k);
+                if (beta > 1e18) {
+                    return 1e18;
+                }
+            }
+            return beta;
+        }
+
+        /**
+         * Length of the first part of n steps reversed with c snapshots,
+         * so that the first part can be reversed with c snapshots and one
+         * recomputation fewer, and the rest with c - 1 snapshots.
+         */
+        static int Split(int n, int c) {
+            int r = 0;
+            while (CheckpointSegment<T, F>::Binomial(c, r) < static_cast<double> (n)) {
+                r++;
+            }
+            double left = static_cast<double> (n) - CheckpointSegment<T, F>::Binomial(c - 1, r);
+            if (left < 1.0) {
+                return 1;
+            }
+            return left > static_cast<double> (n - 1) ? n - 1 : static_cast<int> (left);
+        }
+
+    private:
+
+        /**
+         * Reverses steps [a, b) given the state at a, with c snapshots
+         * including the one holding that state. adjoint comes in for the
+         * state at b and leaves for the state at a.
+         */
+        void ReverseRange(int a, int b, const std::vector<T> &state, int c,
+                std::vector<T> &adjoint, std::vector<T> &parameter_adjoint) {
+            while (b - a > 1 && c > 1) {
+                int m = a + CheckpointSegment<T, F>::Split(b - a, c);
+                std::vector<T> snapshot(state);
+                this->Advance(snapshot, a, m);
+                this->ReverseRange(m, b, snapshot, c - 1, adjoint, parameter_adjoint);
+                b = m;
+            }
+
+            //one snapshot left, recompute each step from it
+            std::vector<T> current;
+            for (int t = b - 1; t >= a; t--) {
+                current = state;
+                this->Advance(current, a, t);
+                this->ReverseStep(t, current, adjoint, parameter_adjoint);
+            }
+        }
+
+        /**
+         * Records step t from values on the scratch tape and moves adjoint
+         * from the state after the step to the state before it.
+         */
+        void ReverseStep(int t, const std::vector<T> &values,
+                std::vector<T> &adjoint, std::vector<T> &parameter_adjoint) {
+            size_t n = values.size();
+            std::vector<int> seeds(n);
+
+            {
+                tape_m.Clear();
+                CheckpointMode<T> mode(&tape_m);
+                //the state takes entries [0, n), parameters go on the tape
+                //as they are read
+                std::vector<ADNumber<T> > state(values.begin(), values.end());
+                for (size_t i = 0; i < n; i++) {
+                    state[i].GetTapeIndex();
+                }
+
+                step_m(t, state, parameters_m);
+                for (size_t i = 0; i < n; i++) {
+                    seeds[i] = state[i].GetTapeIndex();
+                }
+            }
+
+            tape_m.Reverse(seeds, adjoint);
+            for (size_t i = 0; i < n; i++) {
+                adjoint[i] = tape_m.Adjoint(i);
+            }
+            for (size_t i = n; i < tape_m.Size(); i++) {
+                if (tape_m[i].op == VARIABLE) {
+                    typename std::map<unsigned long, size_t>::const_iterator it = positions_m.find(tape_m[i].id);
+                    if (it != positions_m.end()) {
+                        parameter_adjoint[it->second] += tape_m.Adjoint(i);
+                    }
+                }
+            }
+        }
+    };
+
+    /**
+     * Runs step for t = begin, ..., end - 1, where step(t, state,
+     * parameters) advances state from t to t + 1, and records the loop on
+     * the tape as one checkpointed segment; see Checkpoint.hpp. step is
+     * copied and called again during the backward pass, so it must not
+     * depend on anything that changes in between, must keep the size of
+     * state, and must read every active value other than the state through
+     * parameters: values it reaches some other way count as constants.
+     * Quantities accumulated over the steps, such as a likelihood, belong
+     * in the state. Outside tape mode the steps are simply run.
+     *
+     * @param step - function object with
+     * void operator()(int t, std::vector<ADNumber<T> > &state,
+     * const std::vector<ADNumber<T> > &parameters) const
+     * @param begin - first step
+     * @param end - one past the last step
+     * @param state - the state at begin, replaced by the state at end
+     * @param parameters - values read by step that do not change
+     * @param snapshots - states held at once during the backward pass,
+     * including the initial one; 0 for about log2(end - begin)
+     */
+    template<class T, class F>
+    void Checkpoint(const F &step, int begin, int end, std::vector<ADNumber<T> > &state,
+            const std::vector<ADNumber<T> > &parameters, int snapshots = 0) {
+        if (!ADNumber<T>::IsRecordingTape()) {
+            for (int t = begin; t < end; t++) {
+                step(t, state, parameters);
+            }
+            return;
+        }
+        if (end <= begin) {
+            return;
+        }
+
+        if (snapshots <= 0) {
+            snapshots = 1 + static_cast<int> (std::ceil(std::log(static_cast<double> (end - begin)) / std::log(2.0)));
+        }
+        //the backward pass recurses once per snapshot, more than one per
+        //step are never used
+        snapshots = std::min(snapshots, end - begin);
+
+        size_t n = state.size();
+        std::vector<T> initial(n);
+        std::vector<T> values(parameters.size());
+        std::vector<int> inputs;
+        inputs.reserve(n + parameters.size());
+        for (size_t i = 0; i < n; i++) {
+            initial[i] = state[i].GetValue();
+            inputs.push_back(state[i].GetTapeIndex());
+        }
+        for (size_t j = 0; j < parameters.size(); j++) {
+            values[j] = parameters[j].GetValue();
+            inputs.push_back(parameters[j].GetTapeIndex());
+        }
+
+        CheckpointSegment<T, F>* segment = new CheckpointSegment<T, F > (step, begin, end, snapshots, initial, values);
+        std::vector<T> final(initial);
+        segment->Advance(final, begin, end);
+
+        Tape<T>* tape = Tape<T>::Active();
+        int index = tape->AddSegment(segment, inputs, static_cast<int> (n));
+        for (size_t i = 0; i < n; i++) {
+            state[i] = ADNumber<T>::TapeOperation(final[i], SEGMENT, index, static_cast<int> (i), T(0), T(0));
+        }
+    }
+
+}
+
+#endif	/* CHECKPOINT_HPP */
@@ -0,0 +1,212 @@
+/*
+ * File:   CompiledCache.hpp
+ * Author: matthewsupernaw
+ *
+ * Created on October 17, 2026
+ *
+ * On disk cache of compiled layouts. Compiling a large graph is dominated
+ * by ordering its nodes by level and op code (see
+ * CompiledExpression::Layout), and a model recorded again in a later run
+ * usually has the same structure. The cache keeps that ordering, 4 bytes
+ * per node, in a directory under the graph's structural hash, a hash of
+ * the op codes and operand positions in topological order that ignores
+ * values and variable ids. A layout read back is checked against the
+ * graph before it is used, so a stale or colliding entry only costs the
+ * work the cache would have saved.
+ */
+
+#ifndef COMPILEDCACHE_HPP
+#define	COMPILEDCACHE_HPP
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace ad {
+
+    /**
+     * Structural hash of a graph given as columns in topological order.
+     *
+     * @param op
+     * @param left - operand positions, -1 when absent
+     * @param right
+     * @param size
+     * @return
+     */
+    static inline uint64_t StructuralHash(const int *op, const int *left, const int *right, size_t size) {
+        const uint64_t prime = 1099511628211ULL;
+        uint64_t h = 14695981039346656037ULL ^ static_cast<uint64_t> (size);
+        for (size_t i = 0; i < size; i++) {
+            h = (h ^ static_cast<uint32_t> (op[i])) * prime;
+            h = (h ^ static_cast<uint32_t> (left[i])) * prime;
+            h = (h ^ static_cast<uint32_t> (right[i])) * prime;
+        }
+        //final mix, so nearby graphs spread over the whole range
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    /**
+     * Lookups of a CompiledCache.
+     */
+    struct CompiledCacheStatistics {
+        unsigned long long hits; //layouts read and used
+        unsigned long long misses; //layouts computed and stored
+    };
+
+    class CompiledCache {
+        std::string directory_m;
+        unsigned long long hits_m;
+        unsigned long long misses_m;
+
+        struct Header {
+            char magic[8]; //"ADCACHE"
+            uint32_t version;
+            uint32_t reserved;
+            uint64_t hash;
+            uint64_t nodes;
+        };
+
+    public:
+
+        CompiledCache(const std::string &directory = "") :
+        hits_m(0),
+        misses_m(0) {
+            this->SetDirectory(directory);
+        }
+
+        /**
+         * Sets the cache directory, created if missing. Empty turns the
+         * cache off.
+         *
+         * @param directory
+         */
+        void SetDirectory(const std::string &directory) {
+            directory_m = directory;
+            if (!directory_m.empty()) {
+                ::mkdir(directory_m.c_str(), 0755);
+            }
+        }
+
+        const std::string& GetDirectory() const {
+            return directory_m;
+        }
+
+        bool IsEnabled() const {
+            return !directory_m.empty();
+        }
+
+        /**
+         * Reads the layout stored for hash, if there is one for a graph of
+         * nodes nodes.
+         *
+         * @param hash
+         * @param nodes
+         * @param layout
+         * @return
+         */
+        bool Load(uint64_t hash, size_t nodes, std::vector<int> &layout) const {
+            if (!this->IsEnabled()) {
+                return false;
+            }
+
+            std::ifstream in(this->Path(hash).c_str(), std::ios::binary);
+            Header header;
+            if (!in.read(reinterpret_cast<char*> (&header), sizeof (header))
+                    || std::memcmp(header.magic, "ADCACHE", 8) != 0 || header.version != 1
+                    || header.hash != hash || header.nodes != nodes) {
+                return false;
+            }
+
+            layout.resize(nodes);
+            if (nodes > 0 && !in.read(reinterpret_cast<char*> (&layout[0]),
+                    static_cast<std::streamsize> (nodes * sizeof (int)))) {
+                layout.clear();
+                return false;
+            }
+            return true;
+        }
+
+        /**
+         * Stores layout under hash. The file is written aside and renamed
+         * into place, so concurrent runs never see a partial entry.
+         *
+         * @param hash
+         * @param layout
+         * @return
+         */
+        bool Store(uint64_t hash, const std::vector<int> &layout) const {
+            if (!this->IsEnabled()) {
+                return false;
+            }
+
+            Header header;
+            std::memset(&header, 0, sizeof (header));
+            std::memcpy(header.magic, "ADCACHE", 8);
+            header.version = 1;
+            header.hash = hash;
+            header.nodes = layout.size();
+
+            std::string path = this->Path(hash);
+            std::stringstream temporary;
+            temporary << path << "." << ::getpid() << ".tmp";
+
+            {
+                std::ofstream out(temporary.str().c_str(), std::ios::binary | std::ios::trunc);
+                out.write(reinterpret_cast<const char*> (&header), sizeof (header));
+                if (!layout.empty()) {
+                    out.write(reinterpret_cast<const char*> (&layout[0]),
+                            static_cast<std::streamsize> (layout.size() * sizeof (int)));
+                }
+                if (!out.flush().good()) {
+                    std::remove(temporary.str().c_str());
+                    return false;
+                }
+            }
+            return std::rename(temporary.str().c_str(), path.c_str()) == 0;
+        }
+
+        /**
+         * Counts a lookup as a hit or a miss.
+         */
+        void Count(bool hit) {
+            if (hit) {
+                hits_m++;
+            } else {
+                misses_m++;
+            }
+        }
+
+        const CompiledCacheStatistics GetStatistics() const {
+            CompiledCacheStatistics stats;
+            stats.hits = hits_m;
+            stats.misses = misses_m;
+            return stats;
+        }
+
+        void ResetStatistics() {
+            hits_m = 0;
+            misses_m = 0;
+        }
+
+    private:
+
+        std::string Path(uint64_t hash) const {
+            std::stringstream ss;
+            ss << directory_m << "/" << std::hex << std::setw(16) << std::setfill('0') << hash << ".layout";
+            return ss.str();
+        }
+    };
+
+}
+
+#endif	/* COMPILEDCACHE_HPP */
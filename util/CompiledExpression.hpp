@@ -0,0 +1,1378 @@
+/*
+ * File:   CompiledExpression.hpp
+ * Author: matthewsupernaw
+ *
+ * Created on October 17, 2026
+ *
+ * Structure of arrays form of an expression graph. Nodes are stored in
+ * separate contiguous arrays of op codes, operand indices, variable ids,
+ * values and adjoints, ordered by level (distance from the leaves) and then
+ * by op code. Nodes on the same level never depend on each other, so each
+ * run of equal op codes within a level is a branch free loop with no loop
+ * carried dependency in the forward sweep.
+ *
+ * Compiling walks the graph once. When a graph with the same shape is
+ * compiled again, as happens when an objective function is re-recorded
+ * with new parameter values, only the leaf values and ids are copied and the
+ * layout is reused. With a CompiledCache (see SetCache) the ordering of a
+ * new graph is also looked up on disk by its structural hash, so another
+ * run of the same model skips computing it.
+ *
+ * A compiled graph can also be replayed without recording again: Bind
+ * builds a table from parameter ids to their leaves, SetParameters pushes
+ * a new parameter vector through it in O(#parameters) and Forward
+ * refreshes every intermediate value. Replaying is only valid while the
+ * recorded control flow does not depend on the parameter values.
+ *
+ * HessianVectors runs the same kernels over ad::Dual numbers (forward over
+ * reverse): a tangent sweep followed by an adjoint sweep gives H * v for up
+ * to N directions at a few times the cost of one gradient, without
+ * building derivative graphs. SparseHessian detects the Hessian's nonzero
+ * pattern from the graph and star colors it, so a separable objective needs
+ * only a handful of those products.
+ *
+ * EvaluateBatch and GradientBatch run the same kernels over ad::Batch
+ * values, one parameter vector per SIMD lane, to evaluate a model at many
+ * parameter vectors (profiles, bootstraps, grid scans) without recording
+ * it again.
+ */
+
+#ifndef COMPILEDEXPRESSION_HPP
+#define	COMPILEDEXPRESSION_HPP
+
+#include <vector>
+#include <valarray>
+#include <map>
+#include <algorithm>
+#include <iterator>
+#include <cmath>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "Expression.hpp"
+#include "SparseMatrix.hpp"
+#include "Batch.hpp"
+#include "CompiledCache.hpp"
+#include "../Dual.hpp"
+
+namespace ad {
+
+    template<class T>
+    class CompiledExpression {
+    public:
+
+        /**
+         * A contiguous range of nodes on one level sharing one op code.
+         */
+        struct Run {
+            int op;
+            int begin;
+            int end;
+        };
+
+    private:
+
+        //compiled layout, indexed by compiled position
+        std::vector<int> op_m;
+        std::vector<int> left_m;
+        std::vector<int> right_m;
+        std::vector<unsigned long> id_m;
+        std::vector<T> value_m;
+        std::vector<T> adjoint_m;
+        std::vector<Run> runs_m;
+        std::vector<int> variables_m;
+        int root_m;
+
+        //shape of the last compiled graph in topological order, used to
+        //recognize a graph with the same shape
+        std::vector<int> topo_op_m;
+        std::vector<int> topo_left_m;
+        std::vector<int> topo_right_m;
+        std::vector<unsigned long> topo_id_m;
+        std::vector<int> position_m;
+        std::vector<Expression<T>* > order_m;
+
+        //leaves of bound parameter i are
+        //binding_m[binding_offsets_m[i]..binding_offsets_m[i + 1])
+        std::vector<unsigned long> bound_ids_m;
+        std::vector<unsigned long> sorted_bound_ids_m;
+        std::vector<int> binding_offsets_m;
+        std::vector<int> binding_m;
+
+        unsigned long compilations_m;
+        unsigned long reuses_m;
+        CompiledCache* cache_m;
+
+        struct NodeKey {
+            int level;
+            int op;
+            int topo;
+
+            bool operator<(const NodeKey &other) const {
+                if (level != other.level) {
+                    return level < other.level;
+                }
+                if (op != other.op) {
+                    return op < other.op;
+                }
+                return topo < other.topo;
+            }
+        };
+
+        static inline bool IsLeaf(int op) {
+            return op == CONSTANT || op == VARIABLE || op == NONE;
+        }
+
+        /**
+         * Does the graph in order_m have the op codes and operands of the
+         * graph compiled last. Leaf ids and values are not compared; Compile
+         * copies them, since every recording gives its local constants new
+         * ids.
+         */
+        bool SameShape() const {
+            size_t size = order_m.size();
+            if (size != topo_op_m.size()) {
+                return false;
+            }
+
+            for (size_t i = 0; i < size; i++) {
+                Expression<T>* n = order_m[i];
+                int l = n->GetLeft() != NULL ? static_cast<int> (n->GetLeft()->GetIndex()) : -1;
+                int r = n->GetRight() != NULL ? static_cast<int> (n->GetRight()->GetIndex()) : -1;
+                if (topo_op_m[i] != n->GetOp() || topo_left_m[i] != l || topo_right_m[i] != r) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        inline bool IsBound(unsigned long id) const {
+            return std::binary_search(sorted_bound_ids_m.begin(), sorted_bound_ids_m.end(), id);
+        }
+
+        /**
+         * Is sorted an ordering of the topological positions by level and
+         * then op code, as Layout needs.
+         */
+        bool IsOrdered(const std::vector<int> &sorted, const std::vector<int> &level) const {
+            size_t size = level.size();
+            if (sorted.size() != size) {
+                return false;
+            }
+
+            std::vector<bool> seen(size, false);
+            for (size_t i = 0; i < size; i++) {
+                int t = sorted[i];
+                if (t < 0 || static_cast<size_t> (t) >= size || seen[t]) {
+                    return false;
+                }
+                seen[t] = true;
+                if (i > 0) {
+                    int p = sorted[i - 1];
+                    if (level[p] > level[t] || (level[p] == level[t] && topo_op_m[p] > topo_op_m[t])) {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+
+        /**
+         * Orders the nodes by level and op code, taking the order from the
+         * cache when it holds one for this structure.
+         */
+        void Layout() {
+            size_t size = order_m.size();
+
+            topo_op_m.resize(size);
+            topo_left_m.resize(size);
+            topo_right_m.resize(size);
+            topo_id_m.resize(size);
+
+            std::vector<int> level(size, 0);
+
+            for (size_t i = 0; i < size; i++) {
+                Expression<T>* n = order_m[i];
+                int l = n->GetLeft() != NULL ? static_cast<int> (n->GetLeft()->GetIndex()) : -1;
+                int r = n->GetRight() != NULL ? static_cast<int> (n->GetRight()->GetIndex()) : -1;
+                topo_op_m[i] = n->GetOp();
+                topo_left_m[i] = l;
+                topo_right_m[i] = r;
+                topo_id_m[i] = n->GetId();
+
+                int lv = 0;
+                if (l > -1) {
+                    lv = std::max(lv, level[l] + 1);
+                }
+                if (r > -1) {
+                    lv = std::max(lv, level[r] + 1);
+                }
+                level[i] = lv;
+            }
+
+            std::vector<int> sorted;
+            uint64_t hash = 0;
+            if (cache_m != NULL && cache_m->IsEnabled() && size > 0) {
+                hash = ad::StructuralHash(&topo_op_m[0], &topo_left_m[0], &topo_right_m[0], size);
+                bool hit = cache_m->Load(hash, size, sorted) && this->IsOrdered(sorted, level);
+                cache_m->Count(hit);
+                if (!hit) {
+                    sorted.clear();
+                }
+            }
+
+            if (sorted.empty()) {
+                std::vector<NodeKey> keys(size);
+                for (size_t i = 0; i < size; i++) {
+                    keys[i].level = level[i];
+                    keys[i].op = topo_op_m[i];
+                    keys[i].topo = static_cast<int> (i);
+                }
+                std::sort(keys.begin(), keys.end());
+
+                sorted.resize(size);
+                for (size_t i = 0; i < size; i++) {
+                    sorted[i] = keys[i].topo;
+                }
+                if (cache_m != NULL && cache_m->IsEnabled() && size > 0) {
+                    cache_m->Store(hash, sorted);
+                }
+            }
+
+            position_m.resize(size);
+            for (size_t i = 0; i < size; i++) {
+                position_m[sorted[i]] = static_cast<int> (i);
+            }
+
+            op_m.resize(size);
+            left_m.resize(size);
+            right_m.resize(size);
+            id_m.resize(size);
+            value_m.resize(size);
+            adjoint_m.resize(size);
+            runs_m.clear();
+            variables_m.clear();
+
+            for (size_t i = 0; i < size; i++) {
+                int t = sorted[i];
+                op_m[i] = topo_op_m[t];
+                left_m[i] = topo_left_m[t] > -1 ? position_m[topo_left_m[t]] : -1;
+                right_m[i] = topo_right_m[t] > -1 ? position_m[topo_right_m[t]] : -1;
+                id_m[i] = topo_id_m[t];
+
+                if (op_m[i] == VARIABLE) {
+                    variables_m.push_back(static_cast<int> (i));
+                }
+
+                if (runs_m.empty() || runs_m.back().op != op_m[i] || level[sorted[runs_m.back().begin]] != level[t]) {
+                    Run run;
+                    run.op = op_m[i];
+                    run.begin = static_cast<int> (i);
+                    run.end = static_cast<int> (i) + 1;
+                    runs_m.push_back(run);
+                } else {
+                    runs_m.back().end++;
+                }
+            }
+
+            root_m = position_m[size - 1];
+
+            //leaf positions moved, rebuild the binding table
+            std::vector<unsigned long> ids;
+            ids.swap(bound_ids_m);
+            this->Bind(ids);
+        }
+
+        /**
+         * Forward kernel over one run. U is T, or ad::Dual for the
+         * directional sweeps of HessianVectors.
+         */
+        template<class U>
+        static void ForwardRun(const Run &run, const int* l, const int* r, U* v) {
+            int b = run.begin;
+            int e = run.end;
+
+            switch (run.op) {
+                case MINUS:
+                    for (int i = b; i < e; i++) {
+                        v[i] = v[l[i]] - v[r[i]];
+                    }
+                    break;
+                case PLUS:
+                    for (int i = b; i < e; i++) {
+                        v[i] = v[l[i]] + v[r[i]];
+                    }
+                    break;
+                case MULTIPLY:
+                    for (int i = b; i < e; i++) {
+                        v[i] = v[l[i]] * v[r[i]];
+                    }
+                    break;
+                case DIVIDE:
+                    for (int i = b; i < e; i++) {
+                        v[i] = v[l[i]] / v[r[i]];
+                    }
+                    break;
+                case SIN:
+                    for (int i = b; i < e; i++) {
+                        v[i] = std::sin(v[l[i]]);
+                    }
+                    break;
+                case COS:
+                    for (int i = b; i < e; i++) {
+                        v[i] = std::cos(v[l[i]]);
+                    }
+                    break;
+                case TAN:
+                    for (int i = b; i < e; i++) {
+                        v[i] = std::tan(v[l[i]]);
+                    }
+                    break;
+                case ASIN:
+                    for (int i = b; i < e; i++) {
+                        v[i] = std::asin(v[l[i]]);
+                    }
+                    break;
+                case ACOS:
+                    for (int i = b; i < e; i++) {
+                        v[i] = std::acos(v[l[i]]);
+                    }
+                    break;
+                case ATAN:
+                    for (int i = b; i < e; i++) {
+                        v[i] = std::atan(v[l[i]]);
+                    }
+                    break;
+                case ATAN2:
+                    for (int i = b; i < e; i++) {
+                        v[i] = std::atan2(v[l[i]], v[r[i]]);
+                    }
+                    break;
+                case SQRT:
+                    for (int i = b; i < e; i++) {
+                        v[i] = std::sqrt(v[l[i]]);
+                    }
+                    break;
+                case POW:
+                    for (int i = b; i < e; i++) {
+                        v[i] = std::pow(v[l[i]], v[r[i]]);
+                    }
+                    break;
+                case LOG:
+                    for (int i = b; i < e; i++) {
+                        v[i] = std::log(v[l[i]]);
+                    }
+                    break;
+                case LOG10:
+                    for (int i = b; i < e; i++) {
+                        v[i] = std::log10(v[l[i]]);
+                    }
+                    break;
+                case EXP:
+                    for (int i = b; i < e; i++) {
+                        v[i] = std::exp(v[l[i]]);
+                    }
+                    break;
+                case SINH:
+                    for (int i = b; i < e; i++) {
+                        v[i] = std::sinh(v[l[i]]);
+                    }
+                    break;
+                case COSH:
+                    for (int i = b; i < e; i++) {
+                        v[i] = std::cosh(v[l[i]]);
+                    }
+                    break;
+                case TANH:
+                    for (int i = b; i < e; i++) {
+                        v[i] = std::tanh(v[l[i]]);
+                    }
+                    break;
+                case FABS:
+                case ABS:
+                    for (int i = b; i < e; i++) {
+                        v[i] = std::fabs(v[l[i]]);
+                    }
+                    break;
+                case FLOOR:
+                    for (int i = b; i < e; i++) {
+                        v[i] = std::floor(v[l[i]]);
+                    }
+                    break;
+                default:
+                    //leaves keep their values
+                    break;
+            }
+        }
+
+        template<class U>
+        static void ReverseRun(const Run &run, const int* l, const int* r, const int* op,
+                const U* v, U* adj) {
+            int b = run.begin;
+            int e = run.end;
+            U temp;
+
+            switch (run.op) {
+                case MINUS:
+                    for (int i = b; i < e; i++) {
+                        adj[l[i]] += adj[i];
+                        adj[r[i]] -= adj[i];
+                    }
+                    break;
+                case PLUS:
+                    for (int i = b; i < e; i++) {
+                        adj[l[i]] += adj[i];
+                        adj[r[i]] += adj[i];
+                    }
+                    break;
+                case MULTIPLY:
+                    for (int i = b; i < e; i++) {
+                        adj[l[i]] += adj[i] * v[r[i]];
+                        adj[r[i]] += adj[i] * v[l[i]];
+                    }
+                    break;
+                case DIVIDE:
+                    for (int i = b; i < e; i++) {
+                        temp = v[r[i]];
+                        adj[l[i]] += adj[i] / temp;
+                        adj[r[i]] -= adj[i] * v[l[i]] / (temp * temp);
+                    }
+                    break;
+                case SIN:
+                    for (int i = b; i < e; i++) {
+                        adj[l[i]] += adj[i] * std::cos(v[l[i]]);
+                    }
+                    break;
+                case COS:
+                    for (int i = b; i < e; i++) {
+                        adj[l[i]] -= adj[i] * std::sin(v[l[i]]);
+                    }
+                    break;
+                case TAN:
+                    for (int i = b; i < e; i++) {
+                        temp = T(1.0) / std::cos(v[l[i]]);
+                        adj[l[i]] += adj[i] * temp * temp;
+                    }
+                    break;
+                case ASIN:
+                    for (int i = b; i < e; i++) {
+                        adj[l[i]] += adj[i] / std::sqrt(T(1.0) - v[l[i]] * v[l[i]]);
+                    }
+                    break;
+                case ACOS:
+                    for (int i = b; i < e; i++) {
+                        adj[l[i]] -= adj[i] / std::sqrt(T(1.0) - v[l[i]] * v[l[i]]);
+                    }
+                    break;
+                case ATAN:
+                    for (int i = b; i < e; i++) {
+                        adj[l[i]] += adj[i] / (v[l[i]] * v[l[i]] + T(1.0));
+                    }
+                    break;
+                case ATAN2:
+                    for (int i = b; i < e; i++) {
+                        temp = v[l[i]] * v[l[i]] + v[r[i]] * v[r[i]];
+                        adj[l[i]] += adj[i] * v[r[i]] / temp;
+                        adj[r[i]] -= adj[i] * v[l[i]] / temp;
+                    }
+                    break;
+                case SQRT:
+                    for (int i = b; i < e; i++) {
+                        adj[l[i]] += adj[i] * T(0.5) / v[i];
+                    }
+                    break;
+                case POW:
+                    for (int i = b; i < e; i++) {
+                        adj[l[i]] += adj[i] * v[r[i]] * std::pow(v[l[i]], v[r[i]] - T(1.0));
+                        if (op[r[i]] != CONSTANT) {
+                            adj[r[i]] += adj[i] * v[i] * std::log(v[l[i]]);
+                        }
+                    }
+                    break;
+                case LOG:
+                    for (int i = b; i < e; i++) {
+                        adj[l[i]] += adj[i] / v[l[i]];
+                    }
+                    break;
+                case LOG10:
+                    temp = std::log(T(10.0));
+                    for (int i = b; i < e; i++) {
+                        adj[l[i]] += adj[i] / (v[l[i]] * temp);
+                    }
+                    break;
+                case EXP:
+                    for (int i = b; i < e; i++) {
+                        adj[l[i]] += adj[i] * v[i];
+                    }
+                    break;
+                case SINH:
+                    for (int i = b; i < e; i++) {
+                        adj[l[i]] += adj[i] * std::cosh(v[l[i]]);
+                    }
+                    break;
+                case COSH:
+                    for (int i = b; i < e; i++) {
+                        adj[l[i]] += adj[i] * std::sinh(v[l[i]]);
+                    }
+                    break;
+                case TANH:
+                    for (int i = b; i < e; i++) {
+                        temp = T(1.0) / std::cosh(v[l[i]]);
+                        adj[l[i]] += adj[i] * temp * temp;
+                    }
+                    break;
+                case FABS:
+                case ABS:
+                    for (int i = b; i < e; i++) {
+                        adj[l[i]] += adj[i] * v[l[i]] / std::fabs(v[l[i]]);
+                    }
+                    break;
+                default:
+                    //leaves and FLOOR pass nothing on
+                    break;
+            }
+        }
+
+        /**
+         * Work for one thread: columns [begin, end) of a dense Hessian,
+         * products [begin, end) for the given directions, or evaluations
+         * [begin, end) of a batch of parameter vectors.
+         */
+        struct SweepTask {
+            const CompiledExpression<T>* owner;
+            std::valarray<std::valarray<T> >* hessian;
+            const std::vector<std::valarray<T> >* directions;
+            std::vector<std::valarray<T> >* products;
+            const std::vector<std::valarray<T> >* parameters;
+            std::valarray<T>* values;
+            std::vector<std::valarray<T> >* gradients;
+            size_t begin;
+            size_t end;
+
+            SweepTask(const CompiledExpression<T>* owner) : owner(owner),
+            hessian(NULL), directions(NULL), products(NULL),
+            parameters(NULL), values(NULL), gradients(NULL),
+            begin(0), end(0) {
+            }
+        };
+
+        static const int HESSIAN_LANES = 4;
+        static const int BATCH_LANES = ADNUMBER_BATCH_LANES;
+
+        void HessianColumns(std::valarray<std::valarray<T> > &hessian, size_t begin, size_t end) const {
+            size_t n = bound_ids_m.size();
+            std::valarray<T> directions[HESSIAN_LANES];
+            std::valarray<T> products[HESSIAN_LANES];
+            for (int k = 0; k < HESSIAN_LANES; k++) {
+                directions[k].resize(n, T(0));
+            }
+
+            for (size_t j = begin; j < end; j += HESSIAN_LANES) {
+                int count = static_cast<int> (std::min<size_t>(HESSIAN_LANES, end - j));
+                for (int k = 0; k < count; k++) {
+                    directions[k][j + k] = T(1);
+                }
+                HessianVectors<HESSIAN_LANES > (directions, products, count);
+                for (int k = 0; k < count; k++) {
+                    directions[k][j + k] = T(0);
+                    for (size_t i = 0; i < n; i++) {
+                        hessian[i][j + k] = products[k][i];
+                    }
+                }
+            }
+        }
+
+        void HessianProductRange(const std::vector<std::valarray<T> > &directions,
+                std::vector<std::valarray<T> > &products, size_t begin, size_t end) const {
+            for (size_t j = begin; j < end; j += HESSIAN_LANES) {
+                int count = static_cast<int> (std::min<size_t>(HESSIAN_LANES, end - j));
+                HessianVectors<HESSIAN_LANES > (&directions[j], &products[j], count);
+            }
+        }
+
+        /**
+         * Values, and gradients when gradients is not NULL, at parameter
+         * vectors [begin, end), BATCH_LANES vectors per sweep. The first
+         * vector of a partial block fills its unused lanes.
+         */
+        void BatchRange(const std::vector<std::valarray<T> > &parameters, std::valarray<T> &values,
+                std::vector<std::valarray<T> >* gradients, size_t begin, size_t end) const {
+            typedef Batch<T, BATCH_LANES> Lanes;
+            size_t n = bound_ids_m.size();
+            size_t size = op_m.size();
+
+            //unbound leaves keep their recorded values in every lane
+            std::vector<Lanes> v(size);
+            std::vector<Lanes> adj(gradients != NULL ? size : 0);
+            for (size_t i = 0; i < size; i++) {
+                v[i] = value_m[i];
+            }
+
+            const int* l = &left_m.front();
+            const int* r = &right_m.front();
+            const int* op = &op_m.front();
+            for (size_t j = begin; j < end; j += BATCH_LANES) {
+                int count = static_cast<int> (std::min<size_t>(BATCH_LANES, end - j));
+                for (size_t p = 0; p < n; p++) {
+                    for (int b = binding_offsets_m[p]; b < binding_offsets_m[p + 1]; b++) {
+                        Lanes &leaf = v[binding_m[b]];
+                        for (int k = 0; k < BATCH_LANES; k++) {
+                            leaf[k] = parameters[j + (k < count ? k : 0)][p];
+                        }
+                    }
+                }
+
+                for (size_t i = 0; i < runs_m.size(); i++) {
+                    CompiledExpression<T>::ForwardRun(runs_m[i], l, r, &v.front());
+                }
+                for (int k = 0; k < count; k++) {
+                    values[j + k] = v[root_m][k];
+                }
+
+                if (gradients == NULL) {
+                    continue;
+                }
+                std::fill(adj.begin(), adj.end(), Lanes(T(0)));
+                adj[root_m] = T(1);
+                for (size_t i = runs_m.size(); i-- > 0;) {
+                    CompiledExpression<T>::ReverseRun(runs_m[i], l, r, op, &v.front(), &adj.front());
+                }
+                for (int k = 0; k < count; k++) {
+                    std::valarray<T> &gradient = (*gradients)[j + k];
+                    if (gradient.size() != n) {
+                        gradient.resize(n);
+                    }
+                    for (size_t p = 0; p < n; p++) {
+                        T sum = T(0);
+                        for (int b = binding_offsets_m[p]; b < binding_offsets_m[p + 1]; b++) {
+                            sum += adj[binding_m[b]][k];
+                        }
+                        gradient[p] = sum;
+                    }
+                }
+            }
+        }
+
+        static void* SweepWorker(void* arg) {
+            SweepTask* task = static_cast<SweepTask*> (arg);
+            if (task->hessian != NULL) {
+                task->owner->HessianColumns(*task->hessian, task->begin, task->end);
+            } else if (task->directions != NULL) {
+                task->owner->HessianProductRange(*task->directions, *task->products, task->begin, task->end);
+            } else {
+                task->owner->BatchRange(*task->parameters, *task->values, task->gradients, task->begin, task->end);
+            }
+            return NULL;
+        }
+
+        /**
+         * Splits [0, size) into blocks of block items, spreads them over
+         * threads and runs task on each share.
+         */
+        void RunSweepTasks(const SweepTask &task, size_t size, size_t block, unsigned int threads) const {
+            if (threads == 0) {
+                long online = sysconf(_SC_NPROCESSORS_ONLN);
+                threads = online > 0 ? static_cast<unsigned int> (online) : 1;
+            }
+            size_t blocks = (size + block - 1) / block;
+            threads = static_cast<unsigned int> (std::min<size_t>(threads, blocks));
+            if (threads <= 1) {
+                SweepTask all(task);
+                all.begin = 0;
+                all.end = size;
+                CompiledExpression<T>::SweepWorker(&all);
+                return;
+            }
+
+            std::vector<SweepTask> tasks(threads, task);
+            std::vector<pthread_t> workers;
+            size_t begin = 0;
+            for (unsigned int t = 0; t < threads; t++) {
+                size_t count = blocks / threads + (t < blocks % threads ? 1 : 0);
+                tasks[t].begin = begin;
+                tasks[t].end = std::min(size, begin + count * block);
+                begin = tasks[t].end;
+            }
+
+            for (unsigned int t = 1; t < threads; t++) {
+                pthread_t thread;
+                if (pthread_create(&thread, NULL, &CompiledExpression<T>::SweepWorker, &tasks[t]) != 0) {
+                    break;
+                }
+                workers.push_back(thread);
+            }
+
+            //the calling thread takes the first block and any whose thread
+            //did not start
+            CompiledExpression<T>::SweepWorker(&tasks[0]);
+            for (size_t t = workers.size() + 1; t < threads; t++) {
+                CompiledExpression<T>::SweepWorker(&tasks[t]);
+            }
+
+            for (size_t t = 0; t < workers.size(); t++) {
+                pthread_join(workers[t], NULL);
+            }
+        }
+
+        void RunBatch(const std::vector<std::valarray<T> > &parameters, std::valarray<T> &values,
+                std::vector<std::valarray<T> >* gradients, unsigned int threads) const {
+            if (values.size() != parameters.size()) {
+                values.resize(parameters.size());
+            }
+            if (root_m < 0) {
+                values = this->Value();
+                for (size_t i = 0; gradients != NULL && i < gradients->size(); i++) {
+                    (*gradients)[i].resize(bound_ids_m.size());
+                    (*gradients)[i] = T(0);
+                }
+                return;
+            }
+
+            SweepTask task(this);
+            task.parameters = &parameters;
+            task.values = &values;
+            task.gradients = gradients;
+            this->RunSweepTasks(task, parameters.size(), BATCH_LANES, threads);
+        }
+
+        static void Union(const std::vector<int> &a, const std::vector<int> &b, std::vector<int> &out) {
+            out.clear();
+            std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(out));
+        }
+
+        /**
+         * Records that every parameter in a may interact with every one in
+         * b. Rows are compacted as they grow so repeated pairs do not pile
+         * up.
+         */
+        static void Interact(const std::vector<int> &a, const std::vector<int> &b,
+                std::vector<std::vector<int> > &pattern, std::vector<size_t> &compact) {
+            for (size_t i = 0; i < a.size(); i++) {
+                std::vector<int> &row = pattern[a[i]];
+                row.insert(row.end(), b.begin(), b.end());
+                if (row.size() > 2 * compact[a[i]] + 16) {
+                    std::sort(row.begin(), row.end());
+                    row.erase(std::unique(row.begin(), row.end()), row.end());
+                    compact[a[i]] = row.size();
+                }
+            }
+        }
+
+        /**
+         * Forward propagation of the bound parameters each node depends on.
+         * When pattern is not NULL, also collects the pairs of parameters
+         * joined by a nonlinear operation, the nonzeros of the Hessian.
+         */
+        void Dependencies(std::vector<std::vector<int> > &sets, std::vector<std::vector<int> >* pattern) const {
+            size_t size = op_m.size();
+            size_t n = bound_ids_m.size();
+            sets.assign(size, std::vector<int>());
+            std::vector<size_t> compact(n, 0);
+            if (pattern != NULL) {
+                pattern->assign(n, std::vector<int>());
+            }
+
+            for (size_t p = 0; p < n; p++) {
+                for (int j = binding_offsets_m[p]; j < binding_offsets_m[p + 1]; j++) {
+                    sets[binding_m[j]].push_back(static_cast<int> (p));
+                }
+            }
+
+            //sets are only needed where a nonlinear operation, or the root
+            //for a gradient, can see them; skipping the rest keeps long
+            //chains of sums from costing O(n) per link
+            std::vector<char> needed(size, 0);
+            if (pattern == NULL && root_m > -1) {
+                needed[root_m] = 1;
+            }
+            for (size_t k = runs_m.size(); k-- > 0;) {
+                const Run &run = runs_m[k];
+                if (IsLeaf(run.op) || run.op == FLOOR) {
+                    continue;
+                }
+                bool linear = run.op == PLUS || run.op == MINUS || run.op == FABS || run.op == ABS;
+                for (int i = run.begin; i < run.end; i++) {
+                    if (!linear || needed[i]) {
+                        needed[left_m[i]] = 1;
+                        if (right_m[i] > -1) {
+                            needed[right_m[i]] = 1;
+                        }
+                    }
+                }
+            }
+
+            for (size_t k = 0; k < runs_m.size(); k++) {
+                const Run &run = runs_m[k];
+                if (IsLeaf(run.op)) {
+                    continue;
+                }
+                bool linear = run.op == PLUS || run.op == MINUS || run.op == FABS || run.op == ABS;
+                for (int i = run.begin; i < run.end; i++) {
+                    if (linear && !needed[i]) {
+                        continue;
+                    }
+                    const std::vector<int> &l = sets[left_m[i]];
+                    const std::vector<int> &r = right_m[i] > -1 ? sets[right_m[i]] : sets[i];
+
+                    switch (run.op) {
+                        case PLUS:
+                        case MINUS:
+                            Union(l, r, sets[i]);
+                            break;
+                        case MULTIPLY:
+                            Union(l, r, sets[i]);
+                            if (pattern != NULL) {
+                                Interact(l, r, *pattern, compact);
+                                Interact(r, l, *pattern, compact);
+                            }
+                            break;
+                        case DIVIDE:
+                            Union(l, r, sets[i]);
+                            if (pattern != NULL) {
+                                Interact(l, r, *pattern, compact);
+                                Interact(r, l, *pattern, compact);
+                                Interact(r, r, *pattern, compact);
+                            }
+                            break;
+                        case POW:
+                        case ATAN2:
+                            Union(l, r, sets[i]);
+                            if (pattern != NULL) {
+                                Interact(sets[i], sets[i], *pattern, compact);
+                            }
+                            break;
+                        case FABS:
+                        case ABS:
+                            //piecewise linear
+                            sets[i] = l;
+                            break;
+                        case FLOOR:
+                            //zero derivative
+                            break;
+                        default:
+                            sets[i] = l;
+                            if (pattern != NULL) {
+                                Interact(l, l, *pattern, compact);
+                            }
+                            break;
+                    }
+                }
+            }
+        }
+
+    public:
+
+        CompiledExpression() : root_m(-1), compilations_m(0), reuses_m(0), cache_m(NULL) {
+        }
+
+        /**
+         * Layouts are looked up in and added to cache, which the caller
+         * owns; NULL for none.
+         *
+         * @param cache
+         */
+        void SetCache(CompiledCache* cache) {
+            cache_m = cache;
+        }
+
+        CompiledCache* GetCache() const {
+            return cache_m;
+        }
+
+        /**
+         * Compiles the graph rooted at exp. If it has the same shape as the
+         * graph compiled last, only the leaf values and ids are copied, and
+         * the parameters are bound again only when the id of one of their
+         * leaves changed.
+         *
+         * @param exp
+         * @return true if the previous layout was reused.
+         */
+        bool Compile(Expression<T>* exp) {
+            order_m.clear();
+            if (exp == NULL) {
+                this->Clear();
+                return false;
+            }
+
+            ad::TopologicalOrder<T > (exp, order_m);
+
+            bool reuse = this->SameShape();
+            if (reuse) {
+                reuses_m++;
+            } else {
+                this->Layout();
+                compilations_m++;
+            }
+
+            T* v = &value_m.front();
+            const int* position = &position_m.front();
+            bool rebind = false;
+            for (size_t i = 0; i < order_m.size(); i++) {
+                if (IsLeaf(topo_op_m[i])) {
+                    v[position[i]] = order_m[i]->GetValue();
+
+                    unsigned long id = order_m[i]->GetId();
+                    if (topo_id_m[i] != id) {
+                        if (topo_op_m[i] == VARIABLE && (this->IsBound(topo_id_m[i]) || this->IsBound(id))) {
+                            rebind = true;
+                        }
+                        topo_id_m[i] = id;
+                        id_m[position[i]] = id;
+                    }
+                }
+            }
+            order_m.clear();
+
+            if (rebind) {
+                std::vector<unsigned long> ids;
+                ids.swap(bound_ids_m);
+                this->Bind(ids);
+            }
+
+            this->Forward();
+            return reuse;
+        }
+
+        void Clear() {
+            op_m.clear();
+            left_m.clear();
+            right_m.clear();
+            id_m.clear();
+            value_m.clear();
+            adjoint_m.clear();
+            runs_m.clear();
+            variables_m.clear();
+            topo_op_m.clear();
+            topo_left_m.clear();
+            topo_right_m.clear();
+            topo_id_m.clear();
+            position_m.clear();
+            bound_ids_m.clear();
+            sorted_bound_ids_m.clear();
+            binding_offsets_m.clear();
+            binding_m.clear();
+            root_m = -1;
+        }
+
+        /**
+         * Recomputes every node from the leaf values.
+         *
+         * @return the value of the root.
+         */
+        const T Forward() {
+            if (runs_m.empty()) {
+                return this->Value();
+            }
+            const int* l = &left_m.front();
+            const int* r = &right_m.front();
+            T* v = &value_m.front();
+            for (size_t i = 0; i < runs_m.size(); i++) {
+                CompiledExpression<T>::ForwardRun(runs_m[i], l, r, v);
+            }
+            return this->Value();
+        }
+
+        /**
+         * Computes the adjoint of every node with respect to the root.
+         */
+        void Reverse() {
+            if (root_m < 0) {
+                return;
+            }
+            std::fill(adjoint_m.begin(), adjoint_m.end(), T(0));
+            adjoint_m[root_m] = T(1);
+            const int* l = &left_m.front();
+            const int* r = &right_m.front();
+            const int* op = &op_m.front();
+            const T* v = &value_m.front();
+            T* adj = &adjoint_m.front();
+            for (size_t i = runs_m.size(); i-- > 0;) {
+                CompiledExpression<T>::ReverseRun(runs_m[i], l, r, op, v, adj);
+            }
+        }
+
+        /**
+         * Builds the table from each id in ids to the leaves recorded for
+         * it. Parameter i of SetParameters and Gradient is ids[i]. Ids
+         * that do not occur in the graph get no leaves.
+         *
+         * @param ids
+         */
+        void Bind(const std::vector<unsigned long> &ids) {
+            std::map<unsigned long, int> positions;
+            for (size_t i = 0; i < ids.size(); i++) {
+                positions.insert(std::pair<unsigned long, int>(ids[i], static_cast<int> (i)));
+            }
+
+            binding_offsets_m.assign(ids.size() + 1, 0);
+            std::vector<int> owner(variables_m.size(), -1);
+            for (size_t i = 0; i < variables_m.size(); i++) {
+                std::map<unsigned long, int>::iterator it = positions.find(id_m[variables_m[i]]);
+                if (it != positions.end()) {
+                    owner[i] = it->second;
+                    binding_offsets_m[it->second + 1]++;
+                }
+            }
+            for (size_t i = 0; i < ids.size(); i++) {
+                binding_offsets_m[i + 1] += binding_offsets_m[i];
+            }
+
+            binding_m.resize(binding_offsets_m[ids.size()]);
+            std::vector<int> next(binding_offsets_m.begin(), binding_offsets_m.end() - 1);
+            for (size_t i = 0; i < variables_m.size(); i++) {
+                if (owner[i] > -1) {
+                    binding_m[next[owner[i]]++] = variables_m[i];
+                }
+            }
+            bound_ids_m = ids;
+            sorted_bound_ids_m = ids;
+            std::sort(sorted_bound_ids_m.begin(), sorted_bound_ids_m.end());
+        }
+
+        const std::vector<unsigned long>& BoundIds() const {
+            return bound_ids_m;
+        }
+
+        /**
+         * Sets the leaves of bound parameter i to value. Call Forward to
+         * refresh the rest of the graph.
+         *
+         * @param i
+         * @param value
+         */
+        inline void SetParameter(size_t i, const T &value) {
+            for (int j = binding_offsets_m[i]; j < binding_offsets_m[i + 1]; j++) {
+                value_m[binding_m[j]] = value;
+            }
+        }
+
+        /**
+         * Pushes a whole parameter vector, in the order given to Bind.
+         *
+         * @param values
+         */
+        void SetParameters(const std::valarray<T> &values) {
+            size_t size = std::min(values.size(), bound_ids_m.size());
+            for (size_t i = 0; i < size; i++) {
+                this->SetParameter(i, values[i]);
+            }
+        }
+
+        /**
+         * Reverse sweep, then collects the adjoints of the bound parameters.
+         *
+         * @param gradient
+         */
+        void Gradient(std::valarray<T> &gradient) {
+            if (gradient.size() != bound_ids_m.size()) {
+                gradient.resize(bound_ids_m.size());
+            }
+            gradient = T(0);
+
+            this->Reverse();
+
+            for (size_t i = 0; i < bound_ids_m.size(); i++) {
+                T sum = T(0);
+                for (int j = binding_offsets_m[i]; j < binding_offsets_m[i + 1]; j++) {
+                    sum += adjoint_m[binding_m[j]];
+                }
+                gradient[i] = sum;
+            }
+        }
+
+        /**
+         * Gradient with respect to the variables in ids, binding them first
+         * if they differ from the bound ids.
+         *
+         * @param ids
+         * @param gradient
+         */
+        void Gradient(const std::vector<unsigned long> &ids, std::valarray<T> &gradient) {
+            if (ids != bound_ids_m) {
+                this->Bind(ids);
+            }
+            this->Gradient(gradient);
+        }
+
+        /**
+         * Forward over reverse Hessian vector products with respect to the
+         * bound parameters: products[k] = H * directions[k] for k < count,
+         * all in one tangent and one adjoint sweep over Dual<T, N> values.
+         * Uses the current values; the graph itself is not modified, so
+         * several threads may call this at once.
+         *
+         * @param directions count vectors of BoundIds().size()
+         * @param products receives count vectors
+         * @param count number of directions, at most N
+         */
+        template<int N>
+        void HessianVectors(const std::valarray<T>* directions, std::valarray<T>* products, int count = N) const {
+            size_t n = bound_ids_m.size();
+            count = std::min(count, N);
+            for (int k = 0; k < count; k++) {
+                if (products[k].size() != n) {
+                    products[k].resize(n);
+                }
+                products[k] = T(0);
+            }
+            if (root_m < 0 || count <= 0) {
+                return;
+            }
+
+            size_t size = op_m.size();
+            std::vector<Dual<T, N> > v(size);
+            std::vector<Dual<T, N> > adj(size);
+            for (size_t i = 0; i < size; i++) {
+                v[i] = value_m[i];
+            }
+            for (size_t p = 0; p < n; p++) {
+                for (int j = binding_offsets_m[p]; j < binding_offsets_m[p + 1]; j++) {
+                    for (int k = 0; k < count; k++) {
+                        v[binding_m[j]].SetTangent(k, directions[k][p]);
+                    }
+                }
+            }
+
+            const int* l = &left_m.front();
+            const int* r = &right_m.front();
+            const int* op = &op_m.front();
+            for (size_t i = 0; i < runs_m.size(); i++) {
+                CompiledExpression<T>::ForwardRun(runs_m[i], l, r, &v.front());
+            }
+            adj[root_m] = T(1);
+            for (size_t i = runs_m.size(); i-- > 0;) {
+                CompiledExpression<T>::ReverseRun(runs_m[i], l, r, op, &v.front(), &adj.front());
+            }
+
+            for (size_t p = 0; p < n; p++) {
+                for (int j = binding_offsets_m[p]; j < binding_offsets_m[p + 1]; j++) {
+                    for (int k = 0; k < count; k++) {
+                        products[k][p] += adj[binding_m[j]].GetTangent(k);
+                    }
+                }
+            }
+        }
+
+        /**
+         * H * direction with respect to the bound parameters.
+         *
+         * @param direction
+         * @param product
+         */
+        void HessianVector(const std::valarray<T> &direction, std::valarray<T> &product) const {
+            HessianVectors<1 > (&direction, &product, 1);
+        }
+
+        /**
+         * Dense Hessian with respect to the bound parameters, one column per
+         * unit direction. Columns are computed HESSIAN_LANES at a time and
+         * spread over threads.
+         *
+         * @param hessian
+         * @param threads threads to use, 0 for the number of online
+         * processors
+         */
+        void Hessian(std::valarray<std::valarray<T> > &hessian, unsigned int threads = 0) const {
+            size_t n = bound_ids_m.size();
+            if (hessian.size() != n) {
+                hessian.resize(n);
+            }
+            for (size_t i = 0; i < n; i++) {
+                if (hessian[i].size() != n) {
+                    hessian[i].resize(n);
+                }
+            }
+
+            SweepTask task(this);
+            task.hessian = &hessian;
+            this->RunSweepTasks(task, n, HESSIAN_LANES, threads);
+        }
+
+        /**
+         * H * directions[k] for every k, HESSIAN_LANES directions per sweep,
+         * spread over threads.
+         *
+         * @param directions
+         * @param products resized to directions.size()
+         * @param threads threads to use, 0 for the number of online
+         * processors
+         */
+        void HessianProducts(const std::vector<std::valarray<T> > &directions,
+                std::vector<std::valarray<T> > &products, unsigned int threads = 0) const {
+            products.resize(directions.size());
+
+            SweepTask task(this);
+            task.directions = &directions;
+            task.products = &products;
+            this->RunSweepTasks(task, directions.size(), HESSIAN_LANES, threads);
+        }
+
+        /**
+         * Evaluates the graph at every parameter vector, each of
+         * BoundIds().size() values in the order given to Bind.
+         * BATCH_LANES vectors go through one sweep over Batch values and
+         * the sweeps are spread over threads. The graph itself is not
+         * modified. Only valid while the recorded control flow does not
+         * depend on the parameter values, as for replay.
+         *
+         * @param parameters
+         * @param values resized to parameters.size()
+         * @param threads threads to use, 0 for the number of online
+         * processors
+         */
+        void EvaluateBatch(const std::vector<std::valarray<T> > &parameters,
+                std::valarray<T> &values, unsigned int threads = 0) const {
+            this->RunBatch(parameters, values, NULL, threads);
+        }
+
+        /**
+         * Values and gradients with respect to the bound parameters at
+         * every parameter vector; see EvaluateBatch. The adjoint sweep runs
+         * over the same lanes as the forward one.
+         *
+         * @param parameters
+         * @param values resized to parameters.size()
+         * @param gradients resized to parameters.size()
+         * @param threads threads to use, 0 for the number of online
+         * processors
+         */
+        void GradientBatch(const std::vector<std::valarray<T> > &parameters,
+                std::valarray<T> &values, std::vector<std::valarray<T> > &gradients,
+                unsigned int threads = 0) const {
+            gradients.resize(parameters.size());
+            this->RunBatch(parameters, values, &gradients, threads);
+        }
+
+        /**
+         * The bound parameters the root depends on, as indices into
+         * BoundIds(), sorted. Found from the structure of the graph, not
+         * from derivative values.
+         *
+         * @param columns
+         */
+        void GradientSparsity(std::vector<int> &columns) const {
+            columns.clear();
+            if (root_m < 0) {
+                return;
+            }
+            std::vector<std::vector<int> > sets;
+            this->Dependencies(sets, NULL);
+            columns = sets[root_m];
+        }
+
+        /**
+         * Symmetric nonzero pattern of the Hessian with respect to the bound
+         * parameters, found from the structure of the graph. Entry (i, j) is
+         * present when parameters i and j meet in a nonlinear operation.
+         * Values are zero.
+         *
+         * @param pattern
+         */
+        void HessianSparsity(CSRMatrix<T> &pattern) const {
+            std::vector<std::vector<int> > sets;
+            std::vector<std::vector<int> > rows;
+            this->Dependencies(sets, &rows);
+            sets.clear();
+            pattern.SetPattern(bound_ids_m.size(), rows);
+        }
+
+        /**
+         * Sparse Hessian with respect to the bound parameters. The pattern
+         * is detected from the graph and star colored; one Hessian vector
+         * product per color then determines every nonzero, so the cost
+         * depends on the number of colors rather than on the number of
+         * parameters.
+         *
+         * @param hessian
+         * @param threads threads to use, 0 for the number of online
+         * processors
+         * @return the number of colors, i.e. Hessian vector products
+         */
+        int SparseHessian(CSRMatrix<T> &hessian, unsigned int threads = 0) const {
+            this->HessianSparsity(hessian);
+
+            std::vector<int> colors;
+            int count = StarColoring(hessian, colors);
+
+            size_t n = bound_ids_m.size();
+            std::vector<std::valarray<T> > directions(count, std::valarray<T > (T(0), n));
+            for (size_t i = 0; i < n; i++) {
+                directions[colors[i]][i] = T(1);
+            }
+
+            std::vector<std::valarray<T> > products;
+            this->HessianProducts(directions, products, threads);
+            RecoverStarColored(hessian, colors, products);
+            return count;
+        }
+
+        const T Value() const {
+            return root_m < 0 ? T(0) : value_m[root_m];
+        }
+
+        const size_t Size() const {
+            return op_m.size();
+        }
+
+        const int Root() const {
+            return root_m;
+        }
+
+        const std::vector<Run>& Runs() const {
+            return runs_m;
+        }
+
+        const std::vector<int>& Ops() const {
+            return op_m;
+        }
+
+        const std::vector<int>& Left() const {
+            return left_m;
+        }
+
+        const std::vector<int>& Right() const {
+            return right_m;
+        }
+
+        const std::vector<unsigned long>& Ids() const {
+            return id_m;
+        }
+
+        /**
+         * Positions of the VARIABLE nodes.
+         */
+        const std::vector<int>& Variables() const {
+            return variables_m;
+        }
+
+        std::vector<T>& Values() {
+            return value_m;
+        }
+
+        const std::vector<T>& Values() const {
+            return value_m;
+        }
+
+        const std::vector<T>& Adjoints() const {
+            return adjoint_m;
+        }
+
+        /**
+         * Number of times a layout was built.
+         */
+        const unsigned long Compilations() const {
+            return compilations_m;
+        }
+
+        /**
+         * Number of times a layout was reused for a graph of the same shape.
+         */
+        const unsigned long Reuses() const {
+            return reuses_m;
+        }
+    };
+}
+
+#endif	/* COMPILEDEXPRESSION_HPP */
+
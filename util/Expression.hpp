@@ -9,86 +9,142 @@
 #define	EXPRESSION_HPP
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
 #include <stack>
 #include <string>
 #include <sstream>
 #include <cmath>
 #include <vector>
+#include <valarray>
+#include <map>
 #include <iostream>
+#include <pthread.h>
 
 
 
 #include "Stack.hpp"
+#include "Operation.hpp"
+#include "RecordingContext.hpp"
+#include "Pool.hpp"
 
 
-#define USE_CLFMALLOC
-//#define USE_POOL
-#ifdef USE_POOL
+#define ExpressionPtr Expression<T>*
+#define NEW_EXPRESSION(T) new ad::Expression<T>
+#define ExpressionStack ad::Stack<ad::Expression<T>* >
+#define TypeStack ad::Stack<T>
+#define PairStack ad::Stack<std::pair<T, T> > stack;
 
-#ifndef DEFAULT_POOL_SIZE
-#define DEFAULT_POOL_SIZE 10000000
-#endif
+namespace ad {
 
-#include "Pool.hpp"
+    template<class T> class ADNumber;
 
+    /**
+     * Side table of variable names keyed by variable id. Names are interned
+     * once, when a variable is named, so expression nodes and ADNumbers
+     * carry no string storage of their own. Named ADNumbers hold a
+     * reference on their entry, which goes away with the last of them;
+     * unnamed variables never touch the table.
+     */
+    class VariableNames {
+    public:
 
+        /**
+         * Interns name for id, or drops the entry if name is empty. The
+         * entry keeps its references.
+         */
+        static void Set(const unsigned long &id, const std::string &name) {
+            pthread_mutex_lock(&VariableNames::Mutex());
+            if (name.empty()) {
+                VariableNames::Table().erase(id);
+            } else {
+                VariableNames::Table()[id].name = name;
+            }
+            pthread_mutex_unlock(&VariableNames::Mutex());
+        }
 
+        /**
+         * Takes a reference on the entry for id, if there is one.
+         */
+        static void Retain(const unsigned long &id) {
+            pthread_mutex_lock(&VariableNames::Mutex());
+            std::map<unsigned long, Entry>::iterator it = VariableNames::Table().find(id);
+            if (it != VariableNames::Table().end()) {
+                it->second.references++;
+            }
+            pthread_mutex_unlock(&VariableNames::Mutex());
+        }
 
+        /**
+         * Drops a reference on the entry for id and erases the entry with
+         * the last one.
+         */
+        static void Release(const unsigned long &id) {
+            pthread_mutex_lock(&VariableNames::Mutex());
+            std::map<unsigned long, Entry>::iterator it = VariableNames::Table().find(id);
+            if (it != VariableNames::Table().end() && it->second.references > 0) {
+                if (--it->second.references == 0) {
+                    VariableNames::Table().erase(it);
+                }
+            }
+            pthread_mutex_unlock(&VariableNames::Mutex());
+        }
 
+        /**
+         * Returns the name interned for id, or "x<id>" if there is none.
+         */
+        static const std::string Get(const unsigned long &id) {
+            pthread_mutex_lock(&VariableNames::Mutex());
+            std::map<unsigned long, Entry>::const_iterator it = VariableNames::Table().find(id);
+            bool found = it != VariableNames::Table().end();
+            std::string name = found ? it->second.name : std::string();
+            pthread_mutex_unlock(&VariableNames::Mutex());
+
+            if (!found) {
+                std::stringstream ss;
+                ss << "x" << id;
+                return ss.str();
+            }
+            return name;
+        }
 
-#endif
+        static bool Has(const unsigned long &id) {
+            pthread_mutex_lock(&VariableNames::Mutex());
+            bool found = VariableNames::Table().find(id) != VariableNames::Table().end();
+            pthread_mutex_unlock(&VariableNames::Mutex());
+            return found;
+        }
 
+        static size_t Size() {
+            pthread_mutex_lock(&VariableNames::Mutex());
+            size_t size = VariableNames::Table().size();
+            pthread_mutex_unlock(&VariableNames::Mutex());
+            return size;
+        }
 
-#define ExpressionPtr Expression<T>*
-#define NEW_EXPRESSION(T) new ad::Expression<T>
-#define ExpressionStack ad::Stack<ad::Expression<T>* >
-#define TypeStack ad::Stack<T>
-#define PairStack ad::Stack<std::pair<T, T> > stack;
+    private:
 
-namespace ad {
+        struct Entry {
+            std::string name;
+            unsigned long references;
 
-    enum Operation {
-        MINUS = 0,
-        PLUS,
-        MULTIPLY,
-        DIVIDE,
-        SIN,
-        COS,
-        TAN,
-        ASIN,
-        ACOS,
-        ATAN,
-        ATAN2, //atan(adnumber,adnumber)
-        ATAN3, //atan(T,adnumber)
-        ATAN4, //atan(adnumber,T)
-        SQRT,
-        POW, //pow(adnumber,adnumber)
-        POW1, //pow(T,adnumber)
-        POW2, //pow(adnumber,T)
-        LOG,
-        LOG10,
-        EXP,
-        SINH,
-        COSH,
-        TANH,
-        ABS,
-        FABS,
-        FLOOR,
-        CONSTANT,
-        VARIABLE,
-        NONE
-    };
+            Entry() : references(0) {
+            }
+        };
 
+        static std::map<unsigned long, Entry>& Table() {
+            static std::map<unsigned long, Entry> table;
+            return table;
+        }
 
-    template<class T> class ADNumber;
+        static pthread_mutex_t& Mutex() {
+            static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+            return mutex;
+        }
+    };
 
     template<class T>
     class Expression {
-#ifdef USE_POOL
-        static Pool<Expression<T> > pool_m;
-#endif
-        std::string name_m;
         T value_m;
         ExpressionPtr left_m;
         ExpressionPtr right_m;
@@ -96,15 +152,15 @@ namespace ad {
         Operation op_m;
         mutable int count_m;
         unsigned int index;
-        static bool use_recusion_m;
+        bool arena_m;
         template<class TT> friend class ADNumber;
 
-        bool IsUsingRecursion() {
-            return Expression<T>::use_recusion_m;
+        static bool IsUsingRecursion() {
+            return RecordingContext<T>::Active()->IsUsingRecursion();
         }
 
-        void SetUseRecurion(bool use_recursion) {
-            Expression<T>::use_recusion_m = use_recursion;
+        static void SetUseRecurion(bool use_recursion) {
+            RecordingContext<T>::Active()->SetUseRecursion(use_recursion);
         }
 
     public:
@@ -113,41 +169,30 @@ namespace ad {
         : right_m(NULL),
         left_m(NULL),
         op_m(CONSTANT),
-        //        name_m(std::string("na")),
         id_m(0),
         value_m(T(0.0)),
-        count_m(0) {
+        count_m(0),
+        index(0),
+        arena_m(RecordingContext<T>::Active()->IsArenaActive()) {
 
 
         }
 
-        Expression(const T &value, const unsigned long &id, const std::string &name, const Operation &op, ExpressionPtr left, ExpressionPtr right)
-        : right_m(right),
-        left_m(left),
-        op_m(op),
-        name_m(name),
-        id_m(id),
-        value_m(value),
-        count_m(0) {
-
-            if (left != NULL) {
-                left->take();
-            }
-
-            if (right != NULL) {
-                right->take();
-            }
-        }
-
         Expression(const T &value, const unsigned long &id, const Operation &op, ExpressionPtr left, ExpressionPtr right)
         : op_m(op),
         id_m(id),
         right_m(right),
         left_m(left),
         value_m(value),
-        //        name_m(std::string("na")),
-        count_m(0) {
+        count_m(0),
+        index(0),
+        arena_m(RecordingContext<T>::Active()->IsArenaActive()) {
             //            std::cout << __func__ << ":" << __LINE__ << "\n";
+            //arena nodes are reclaimed in bulk and hold no references
+            if (arena_m) {
+                return;
+            }
+
             if (left != NULL) {
                 left->take();
             }
@@ -162,19 +207,29 @@ namespace ad {
 
         }
 
+        /**
+         * Sets the number of nodes in slabs the node pool allocates from
+         * now on.
+         */
         static void SetPoolResizePolicy(uint32_t size) {
-#ifdef USE_POOL
-            Expression<T>::pool_m.SetResize(size);
-#endif
+            Pool<Expression<T> >::Instance().SetResize(size);
 
         }
 
         inline void take() const {
             ++count_m;
+            if (arena_m) {
+                RecordingContext<T>::Active()->HoldArena();
+            }
         }
 
         inline void release(bool ignore_delete = false) {
 
+            if (arena_m) {
+                //owned by the RecordingContext arena, see ResetArena
+                RecordingContext<T>::Active()->ReleaseArena();
+                return;
+            }
 
             //std::cout<<count_m<<std::endl;
             assert(count_m > 0);
@@ -196,72 +251,38 @@ namespace ad {
 
                 if (count_m == 0 && !ignore_delete) {
 
-                    //                                std::stack<Expression<T>*, std::vector<Expression<T>* > > stack;
+                    //nodes are pushed once, when their count reaches zero, so
+                    //shared operands are deleted exactly once
                     ad::Stack<Expression<T>* > stack;
+                    stack.push(this);
 
-                    ExpressionPtr n = this;
-                    bool do_delete = false;
-                    //ExpressionPtr exp;
+                    while (!stack.empty()) {
+                        ExpressionPtr n = stack.top();
+                        stack.pop();
 
-                    while (!stack.empty() || n != NULL) {
-
-                        do_delete = false;
-
-                        if (n != NULL) {
-
-                            //visit
-                            if (n->count_m == 0) {
-                                do_delete = true;
-
-                                if (n->GetLeft() != NULL) {
-                                    n->GetLeft()->release(true);
-                                }
-
-                                if (n->GetRight() != NULL) {
-                                    n->GetRight()->release(true);
-                                }
+                        ExpressionPtr l = n->GetLeft();
+                        ExpressionPtr r = n->GetRight();
 
+                        if (l != NULL && l->arena_m) {
+                            l->release();
+                        } else if (l != NULL) {
+                            assert(l->count_m > 0);
+                            if (--l->count_m == 0) {
+                                stack.push(l);
                             }
+                        }
 
-
-                            if (n->GetRight() != NULL) {
-                                stack.push(n->GetRight());
-                            }
-
-                            if (do_delete) {
-                                ExpressionPtr exp = n;
-                                //                             exp = n;
-                                n = n->GetLeft();
-
-                                if (exp != this) {
-#ifdef USE_POOL
-                                    Expression<T>::pool_m.free(exp);
-#else
-
-                                    delete exp;
-#endif
-                                }
-                            } else {
-                                n = n->GetLeft();
+                        if (r != NULL && r->arena_m) {
+                            r->release();
+                        } else if (r != NULL) {
+                            assert(r->count_m > 0);
+                            if (--r->count_m == 0) {
+                                stack.push(r);
                             }
-
-
-
-                        } else {
-                            n = stack.top();
-                            stack.pop();
                         }
 
-
+                        delete n;
                     }
-
-#ifdef USE_POOL
-                    Expression<T>::pool_m.free(this);
-#else
-
-                    delete this;
-#endif
-                    //                 free(this);
                 }
             }
         }
@@ -269,32 +290,24 @@ namespace ad {
         inline int References() const {
             return count_m;
         }
-#ifdef USE_POOL
-
-        void* operator new (size_t size) throw () {
-
-            //            void* ptr = (void*) Expression<T>::pool_m.malloc();
-
-            return Expression<T>::pool_m.malloc();
-        }
-
-        void operator delete (void* ptr) throw () {
-
-            Expression<T>::pool_m.free((Expression<T>*)ptr);
-
+        /**
+         * Nodes come from the RecordingContext arena inside an arena scope
+         * and from the shared node Pool otherwise.
+         */
+        inline void* operator new (size_t size) {
+            return RecordingContext<T>::Active()->AllocateNode(size);
         }
-#endif
 
-#ifdef USE_CLFMALLOC
-
-        inline void* operator new (size_t size) throw (std::bad_alloc) {
-            return malloc(size);
+        inline void operator delete (void* ptr) {
+            Pool<Expression<T> >::Instance().Free(ptr);
         }
 
-        inline void operator delete (void* ptr)throw () {
-            free(ptr);
+        /**
+         * Returns the node pool's counters.
+         */
+        static const PoolStatistics GetPoolStatistics() {
+            return Pool<Expression<T> >::Instance().Statistics();
         }
-#endif
 
         bool HasID(const uint32_t &id) {
             //     std::cout << this->id_ << " ?= " << id << "\n";
@@ -1503,11 +1516,28 @@ namespace ad {
             id_m = id;
         }
 
+        /**
+         * Position of this node in the most recent topological ordering
+         * built by a graph sweep. Only meaningful during that sweep.
+         */
+        inline const unsigned int GetIndex() const {
+            return index;
+        }
+
+        inline void SetIndex(const unsigned int &i) {
+            index = i;
+        }
+
         ExpressionPtr GetLeft() const {
             return left_m;
         }
 
         void SetLeft(ExpressionPtr left) {
+            if (arena_m) {
+                left_m = left;
+                return;
+            }
+
             if (GetLeft() != NULL) {
                 GetLeft()->release();
             }
@@ -1519,18 +1549,17 @@ namespace ad {
 
         }
 
-        virtual const std::string GetName() const {
-
-            if (name_m == "") {
-                std::stringstream ss;
-                ss << "x" << GetId();
-                return ss.str();
-            }
-            return name_m;
+        /**
+         * Returns the name interned for this node's id, see VariableNames.
+         */
+        const std::string GetName() const {
+            return VariableNames::Get(GetId());
         }
 
-        virtual void SetName(const std::string &name) {
-            //            name_m = name;
+        void SetName(const std::string &name) {
+            if (!name.empty()) {
+                VariableNames::Set(GetId(), name);
+            }
         }
 
         const Operation GetOp() const {
@@ -1546,6 +1575,11 @@ namespace ad {
         }
 
         void SetRight(ExpressionPtr right) {
+            if (arena_m) {
+                right_m = right;
+                return;
+            }
+
             if (GetRight() != NULL) {
                 GetRight()->release();
             }
@@ -1825,12 +1859,6 @@ namespace ad {
 
 
 
-#ifdef USE_POOL
-    template<class T>
-    Pool<Expression<T> > Expression<T>::pool_m(DEFAULT_POOL_SIZE);
-#endif
-    template<class T>
-    bool Expression<T>::use_recusion_m = false;
 
     template<class T>
     static ExpressionPtr Clone(ExpressionPtr exp) {
@@ -1845,7 +1873,7 @@ namespace ad {
         std::stack<Expression<T>* > q2;
         Expression<T>* fresh;
         //(T value, unsigned long id, std::string name, Operation op, ExpressionPtr left, ExpressionPtr right)
-        Expression<T>* root2 = NEW_EXPRESSION(T) (exp->GetValue(), exp->GetId(), exp->GetName(), exp->GetOp(), NULL, NULL);
+        Expression<T>* root2 = NEW_EXPRESSION(T) (exp->GetValue(), exp->GetId(), exp->GetOp(), NULL, NULL);
 
         q2.push(root2);
 
@@ -1860,7 +1888,6 @@ namespace ad {
                 Expression<T>* exp = NEW_EXPRESSION(T) ();
 
                 exp->SetId(n->GetLeft()->GetId());
-                exp->SetName(n->GetLeft()->GetName());
                 exp->SetOp(n->GetLeft()->GetOp());
                 exp->SetValue(n->GetLeft()->GetValue());
                 fresh->SetLeft(exp);
@@ -1871,7 +1898,6 @@ namespace ad {
                 Expression<T>* exp = NEW_EXPRESSION(T) ();
 
                 exp->SetId(n->GetRight()->GetId());
-                exp->SetName(n->GetRight()->GetName());
                 exp->SetOp(n->GetRight()->GetOp());
                 exp->SetValue(n->GetRight()->GetValue());
                 fresh->SetRight(exp);
@@ -2066,10 +2092,11 @@ namespace ad {
 
         virtual int Intitialize() {
 
-
-            this->stack_m.push(this->root);
+            if (this->root != NULL) {
+                this->stack_m.push(this->root);
+                state_m.push(0);
+            }
             currNode = NULL;
-            prevNode = NULL;
             has_more = 1;
             Next();
 
@@ -2081,48 +2108,44 @@ namespace ad {
 
     private:
 
-        Expression<T>* n;
-        Expression<T>* prevNode;
+        //per node on stack_m: 0 = left operand next, 1 = right operand
+        //next, 2 = emit. Operands are tracked by position, not by
+        //comparing with the previous node, so a node whose operands are
+        //the same node (x - x) visits it twice and terminates.
+        ad::Stack<int> state_m;
         Expression<T>* currNode;
         int has_more;
 
         inline void Next() {
-            if (this->stack_m.empty()) {
-                has_more = 0;
-                return;
-            }
-
-            bool breakout = false;
-
             while (!this->stack_m.empty()) {
-                currNode = this->stack_m.top();
-
+                Expression<T>* node = this->stack_m.top();
+                int &state = state_m.top();
 
-                if (prevNode == NULL || prevNode->GetLeft() == currNode || prevNode->GetRight() == currNode) {
-                    if (currNode->GetLeft() != NULL) {
-                        this->stack_m.push(currNode->GetLeft());
-                    } else if (currNode->GetRight() != NULL) {
-                        this->stack_m.push(currNode->GetRight());
+                if (state == 0) {
+                    state = 1;
+                    if (node->GetLeft() != NULL) {
+                        this->stack_m.push(node->GetLeft());
+                        state_m.push(0);
+                        continue;
                     }
-                } else if (currNode->GetLeft() == prevNode) {
-                    if (currNode->GetRight() != NULL) {
-                        this->stack_m.push(currNode->GetRight());
-                    }
-                } else {
-                    n = currNode;
-                    this->stack_m.pop();
-                    breakout = true;
-                    //  
                 }
 
-                prevNode = currNode;
-
-                if (breakout) {
-                    break;
+                if (state == 1) {
+                    state = 2;
+                    if (node->GetRight() != NULL) {
+                        this->stack_m.push(node->GetRight());
+                        state_m.push(0);
+                        continue;
+                    }
                 }
 
+                currNode = node;
+                this->stack_m.pop();
+                state_m.pop();
+                return;
             }
 
+            has_more = 0;
         }
 
     };
@@ -2573,6 +2596,606 @@ namespace ad {
 
     }
 
+    /**
+     * Builds a topological ordering (children before parents) of the unique
+     * nodes reachable from exp. Shared subexpressions appear once. Each
+     * node's index is set to its position in the returned ordering, so
+     * a node n has been visited iff order[n->GetIndex()] == n.
+     * 
+     * @param exp
+     * @param order
+     */
+    template<class T>
+    static void TopologicalOrder(ExpressionPtr exp, std::vector<Expression<T>* > &order) {
+        order.clear();
+
+        if (exp == NULL) {
+            return;
+        }
+
+        std::vector<std::pair<Expression<T>*, bool> > stack;
+        stack.push_back(std::pair<Expression<T>*, bool>(exp, false));
+
+        while (!stack.empty()) {
+            Expression<T>* n = stack.back().first;
+            bool expanded = stack.back().second;
+            stack.pop_back();
+
+            if (n->GetIndex() < order.size() && order[n->GetIndex()] == n) {
+                continue; //already visited
+            }
+
+            if (expanded) {
+                n->SetIndex(order.size());
+                order.push_back(n);
+            } else {
+                stack.push_back(std::pair<Expression<T>*, bool>(n, true));
+
+                if (n->GetRight() != NULL) {
+                    stack.push_back(std::pair<Expression<T>*, bool>(n->GetRight(), false));
+                }
+
+                if (n->GetLeft() != NULL) {
+                    stack.push_back(std::pair<Expression<T>*, bool>(n->GetLeft(), false));
+                }
+            }
+        }
+    }
+
+    /**
+     * A topological ordering of expression nodes seen through the accessors
+     * of GradientSweep.
+     */
+    template<class T>
+    struct NodeOrder {
+        Expression<T>* const* nodes;
+
+        inline int Op(size_t i) const {
+            return nodes[i]->GetOp();
+        }
+
+        inline int Left(size_t i) const {
+            return nodes[i]->GetLeft() != NULL ? static_cast<int> (nodes[i]->GetLeft()->GetIndex()) : -1;
+        }
+
+        inline int Right(size_t i) const {
+            return nodes[i]->GetRight() != NULL ? static_cast<int> (nodes[i]->GetRight()->GetIndex()) : -1;
+        }
+
+        inline unsigned long Id(size_t i) const {
+            return nodes[i]->GetId();
+        }
+
+        inline const T Value(size_t i) const {
+            return nodes[i]->GetValue();
+        }
+    };
+
+    /**
+     * A graph stored as columns, see GraphFile.
+     */
+    template<class T>
+    struct NodeColumns {
+        const int32_t* ops;
+        const int32_t* left;
+        const int32_t* right;
+        const uint64_t* ids;
+        const T* values;
+
+        inline int Op(size_t i) const {
+            return ops[i];
+        }
+
+        inline int Left(size_t i) const {
+            return left[i];
+        }
+
+        inline int Right(size_t i) const {
+            return right[i];
+        }
+
+        inline unsigned long Id(size_t i) const {
+            return static_cast<unsigned long> (ids[i]);
+        }
+
+        inline const T Value(size_t i) const {
+            return values[i];
+        }
+    };
+
+    /**
+     * Gradient sweep over size nodes in topological order (operands before
+     * results), the last node being the root. graph gives each node's op,
+     * operand positions (-1 when absent), id and recorded value; see
+     * NodeOrder and NodeColumns. Intermediate values are recomputed from
+     * the leaves.
+     * 
+     * @param graph
+     * @param size
+     * @param wrt
+     * @param gradient
+     */
+    template<class T, class Graph>
+    static void GradientSweep(const Graph &graph, size_t size,
+            const std::vector<unsigned long> &wrt, std::valarray<T> &gradient) {
+
+        if (gradient.size() != wrt.size()) {
+            gradient.resize(wrt.size());
+        }
+        gradient = T(0);
+
+        if (size == 0) {
+            return;
+        }
+
+        std::map<unsigned long, size_t> positions;
+        for (size_t i = 0; i < wrt.size(); i++) {
+            positions.insert(std::pair<unsigned long, size_t>(wrt[i], i));
+        }
+
+        std::vector<T> values(size);
+        std::vector<T> adjoints(size, T(0));
+
+        //forward sweep, values of intermediate nodes may be stale.
+        for (size_t i = 0; i < size; i++) {
+            int li = graph.Left(i);
+            int ri = graph.Right(i);
+            T l = (li > -1) ? values[li] : T(0);
+            T r = (ri > -1) ? values[ri] : T(0);
+
+            switch (graph.Op(i)) {
+                case CONSTANT:
+                case VARIABLE:
+                case NONE:
+                    values[i] = graph.Value(i);
+                    break;
+                case MINUS:
+                    values[i] = l - r;
+                    break;
+                case PLUS:
+                    values[i] = l + r;
+                    break;
+                case MULTIPLY:
+                    values[i] = l * r;
+                    break;
+                case DIVIDE:
+                    values[i] = l / r;
+                    break;
+                case SIN:
+                    values[i] = std::sin(l);
+                    break;
+                case COS:
+                    values[i] = std::cos(l);
+                    break;
+                case TAN:
+                    values[i] = std::tan(l);
+                    break;
+                case ASIN:
+                    values[i] = std::asin(l);
+                    break;
+                case ACOS:
+                    values[i] = std::acos(l);
+                    break;
+                case ATAN:
+                    values[i] = std::atan(l);
+                    break;
+                case ATAN2:
+                    values[i] = std::atan2(l, r);
+                    break;
+                case SQRT:
+                    values[i] = std::sqrt(l);
+                    break;
+                case POW:
+                    values[i] = std::pow(l, r);
+                    break;
+                case LOG:
+                    values[i] = std::log(l);
+                    break;
+                case LOG10:
+                    values[i] = std::log10(l);
+                    break;
+                case EXP:
+                    values[i] = std::exp(l);
+                    break;
+                case SINH:
+                    values[i] = std::sinh(l);
+                    break;
+                case COSH:
+                    values[i] = std::cosh(l);
+                    break;
+                case TANH:
+                    values[i] = std::tanh(l);
+                    break;
+                case FABS:
+                case ABS:
+                    values[i] = std::fabs(l);
+                    break;
+                case FLOOR:
+                    values[i] = std::floor(l);
+                    break;
+                default:
+                    values[i] = graph.Value(i);
+                    break;
+            }
+        }
+
+        //reverse sweep
+        adjoints[size - 1] = T(1);
+
+        for (size_t i = size; i-- > 0;) {
+            T a = adjoints[i];
+
+            if (a == T(0)) {
+                continue;
+            }
+
+            int left = graph.Left(i);
+            int right = graph.Right(i);
+            size_t li = (left > -1) ? left : 0;
+            size_t ri = (right > -1) ? right : 0;
+            T l = (left > -1) ? values[li] : T(0);
+            T r = (right > -1) ? values[ri] : T(0);
+            T temp;
+
+            switch (graph.Op(i)) {
+                case VARIABLE:
+                {
+                    std::map<unsigned long, size_t>::iterator it = positions.find(graph.Id(i));
+                    if (it != positions.end()) {
+                        gradient[it->second] += a;
+                    }
+                }
+                    break;
+                case MINUS:
+                    adjoints[li] += a;
+                    adjoints[ri] -= a;
+                    break;
+                case PLUS:
+                    adjoints[li] += a;
+                    adjoints[ri] += a;
+                    break;
+                case MULTIPLY:
+                    adjoints[li] += a * r;
+                    adjoints[ri] += a * l;
+                    break;
+                case DIVIDE:
+                    adjoints[li] += a / r;
+                    adjoints[ri] -= a * l / (r * r);
+                    break;
+                case SIN:
+                    adjoints[li] += a * std::cos(l);
+                    break;
+                case COS:
+                    adjoints[li] -= a * std::sin(l);
+                    break;
+                case TAN:
+                    temp = T(1.0) / std::cos(l);
+                    adjoints[li] += a * temp * temp;
+                    break;
+                case ASIN:
+                    adjoints[li] += a / std::sqrt(T(1.0) - l * l);
+                    break;
+                case ACOS:
+                    adjoints[li] -= a / std::sqrt(T(1.0) - l * l);
+                    break;
+                case ATAN:
+                    adjoints[li] += a / (l * l + T(1.0));
+                    break;
+                case ATAN2:
+                    temp = l * l + r * r;
+                    adjoints[li] += a * r / temp;
+                    adjoints[ri] -= a * l / temp;
+                    break;
+                case SQRT:
+                    adjoints[li] += a * T(0.5) / values[i];
+                    break;
+                case POW:
+                    adjoints[li] += a * r * std::pow(l, r - T(1.0));
+                    if (graph.Op(ri) != CONSTANT) {
+                        adjoints[ri] += a * values[i] * std::log(l);
+                    }
+                    break;
+                case LOG:
+                    adjoints[li] += a / l;
+                    break;
+                case LOG10:
+                    adjoints[li] += a / (l * std::log(T(10.0)));
+                    break;
+                case EXP:
+                    adjoints[li] += a * values[i];
+                    break;
+                case SINH:
+                    adjoints[li] += a * std::cosh(l);
+                    break;
+                case COSH:
+                    adjoints[li] += a * std::sinh(l);
+                    break;
+                case TANH:
+                    temp = T(1.0) / std::cosh(l);
+                    adjoints[li] += a * temp * temp;
+                    break;
+                case FABS:
+                case ABS:
+                    adjoints[li] += a * l / std::fabs(l);
+                    break;
+                case FLOOR:
+                case CONSTANT:
+                case NONE:
+                default:
+                    break;
+            }
+        }
+    }
+
+    /**
+     * Computes the gradient of exp with respect to the variables in ids
+     * with a single reverse (adjoint) sweep over the expression graph.
+     * 
+     * Unlike calling EvaluateDerivative once per variable, the cost is 
+     * proportional to the size of the graph, not the size of the graph 
+     * times the number of variables.
+     * 
+     * @param exp
+     * @param ids
+     * @param gradient
+     */
+    template<class T>
+    static void EvaluateGradient(ExpressionPtr exp, const std::vector<unsigned long> &ids, std::valarray<T> &gradient) {
+        std::vector<Expression<T>* > order;
+        ad::TopologicalOrder<T > (exp, order);
+
+        NodeOrder<T> graph;
+        graph.nodes = order.empty() ? NULL : &order[0];
+        ad::GradientSweep<T > (graph, order.size(), ids, gradient);
+    }
+
+    /**
+     * Is exp a constant. Besides CONSTANT nodes this includes the anonymous
+     * VARIABLE nodes (id 0) that Differentiate uses for 0 and 1.
+     */
+    template<class T>
+    static inline bool IsConstant(const Expression<T>* exp) {
+        return exp->GetOp() == CONSTANT || (exp->GetOp() == VARIABLE && exp->GetId() == 0);
+    }
+
+    /**
+     * Applies op to operand values.
+     */
+    template<class T>
+    static T ApplyOperation(int op, const T &l, const T &r) {
+        switch (op) {
+            case MINUS:
+                return l - r;
+            case PLUS:
+                return l + r;
+            case MULTIPLY:
+                return l * r;
+            case DIVIDE:
+                return l / r;
+            case SIN:
+                return std::sin(l);
+            case COS:
+                return std::cos(l);
+            case TAN:
+                return std::tan(l);
+            case ASIN:
+                return std::asin(l);
+            case ACOS:
+                return std::acos(l);
+            case ATAN:
+                return std::atan(l);
+            case ATAN2:
+                return std::atan2(l, r);
+            case SQRT:
+                return std::sqrt(l);
+            case POW:
+                return std::pow(l, r);
+            case LOG:
+                return std::log(l);
+            case LOG10:
+                return std::log10(l);
+            case EXP:
+                return std::exp(l);
+            case SINH:
+                return std::sinh(l);
+            case COSH:
+                return std::cosh(l);
+            case TANH:
+                return std::tanh(l);
+            case ABS:
+            case FABS:
+                return std::fabs(l);
+            case FLOOR:
+                return std::floor(l);
+            default:
+                return l;
+        }
+    }
+
+    /**
+     * Rewrites a single node whose operands are already simplified:
+     * operations on constants only are folded, and x*1, 1*x, x+0, 0+x, 
+     * x-0, x/1, pow(x,1), pow(x,0) and 0-(0-x) are reduced. x*0, 0*x and
+     * 0/x are left alone, since folding them to 0 would turn an inf or nan
+     * x into 0 and hide a nan objective from the minimizers.
+     * 
+     * node carries one reference owned by the caller; if it is replaced,
+     * that reference moves to the returned node.
+     * 
+     * @param node
+     * @return node or its replacement
+     */
+    template<class T>
+    static Expression<T>* SimplifyNode(Expression<T>* node) {
+        Expression<T>* l = node->GetLeft();
+        Expression<T>* r = node->GetRight();
+        int op = node->GetOp();
+
+        if (l == NULL || op == CONSTANT || op == VARIABLE || op == NONE) {
+            return node;
+        }
+
+        bool lc = ad::IsConstant(l);
+        bool rc = r != NULL && ad::IsConstant(r);
+        T lv = l->GetValue();
+        T rv = r != NULL ? r->GetValue() : T(0);
+
+        Expression<T>* replacement = NULL;
+        bool fold = false;
+        T value = T(0);
+
+        if (lc && (r == NULL || rc)) {
+            fold = true;
+            value = ad::ApplyOperation<T > (op, lv, rv);
+        } else {
+            switch (op) {
+                case MULTIPLY:
+                    if (lc && lv == T(1)) {
+                        replacement = r;
+                    } else if (rc && rv == T(1)) {
+                        replacement = l;
+                    }
+                    break;
+                case PLUS:
+                    if (lc && lv == T(0)) {
+                        replacement = r;
+                    } else if (rc && rv == T(0)) {
+                        replacement = l;
+                    }
+                    break;
+                case MINUS:
+                    if (rc && rv == T(0)) {
+                        replacement = l;
+                    } else if (lc && lv == T(0) && r->GetOp() == MINUS
+                            && r->GetLeft() != NULL && ad::IsConstant(r->GetLeft())
+                            && r->GetLeft()->GetValue() == T(0) && r->GetRight() != NULL) {
+                        //0 - (0 - x)
+                        replacement = r->GetRight();
+                    }
+                    break;
+                case DIVIDE:
+                    if (rc && rv == T(1)) {
+                        replacement = l;
+                    }
+                    break;
+                case POW:
+                    if (rc && rv == T(0)) {
+                        fold = true;
+                        value = T(1);
+                    } else if (rc && rv == T(1)) {
+                        replacement = l;
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        if (fold) {
+            replacement = new Expression<T > (value, 0, CONSTANT, NULL, NULL);
+        }
+
+        if (replacement == NULL) {
+            return node;
+        }
+
+        replacement->take();
+        node->release();
+        return replacement;
+    }
+
+    /**
+     * Rewrites a node just recorded: SimplifyNode, then hash consing, as
+     * switched on the calling thread's context. Ownership of the caller's
+     * reference is as in SimplifyNode. The result is always a root of its
+     * own: where SimplifyNode hands back an operand (x * 1, x + 0, ...),
+     * it is wrapped in a fresh copy, so setting the value of the result
+     * never changes the operand.
+     * 
+     * @param node
+     * @return node or its replacement
+     */
+    template<class T>
+    static Expression<T>* CanonicalizeNode(Expression<T>* node) {
+        RecordingContext<T>* context = RecordingContext<T>::Active();
+        if (context->IsSimplifying()) {
+            Expression<T>* left = node->GetLeft();
+            Expression<T>* right = node->GetRight();
+            node = ad::SimplifyNode<T > (node);
+            if (node != NULL && (node == left || node == right)) {
+                Expression<T>* root = new Expression<T > (node->GetValue(), node->GetId(),
+                        node->GetOp(), node->GetLeft(), node->GetRight());
+                root->take();
+                node->release();
+                node = root;
+            }
+        }
+        if (context->IsHashConsing()) {
+            node = context->Intern(node);
+        }
+        return node;
+    }
+
+    /**
+     * Returns a simplified copy of exp. Every node is rewritten with
+     * SimplifyNode after its operands; unchanged subgraphs are shared with
+     * exp rather than copied.
+     * 
+     * note: Return expression is already taken once.
+     * @param exp
+     * @return 
+     */
+    template<class T>
+    static Expression<T>* Simplify(Expression<T>* exp) {
+        if (exp == NULL) {
+            return NULL;
+        }
+
+        std::vector<Expression<T>*> order;
+        ad::TopologicalOrder<T > (exp, order);
+
+        std::vector<Expression<T>*> simplified(order.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            Expression<T>* n = order[i];
+            Expression<T>* l = n->GetLeft() != NULL ? simplified[n->GetLeft()->GetIndex()] : NULL;
+            Expression<T>* r = n->GetRight() != NULL ? simplified[n->GetRight()->GetIndex()] : NULL;
+
+            Expression<T>* s = n;
+            if (l != n->GetLeft() || r != n->GetRight()) {
+                s = new Expression<T > (n->GetValue(), n->GetId(), n->GetOp(), l, r);
+            }
+            s->take();
+            simplified[i] = ad::SimplifyNode<T > (s);
+        }
+
+        Expression<T>* ret = simplified.back();
+        ret->take();
+        for (size_t i = 0; i < simplified.size(); i++) {
+            simplified[i]->release();
+        }
+        return ret;
+    }
+
+    /**
+     * Whether the variable id appears in exp.
+     * 
+     * @param exp
+     * @param id
+     * @return 
+     */
+    template<class T>
+    static bool DependsOn(ad::Expression<T>* exp, unsigned long id) {
+        ad::PostOrderIterator<T> it(exp);
+        while (it) {
+            ad::Expression<T>* node = it;
+            if (node->GetOp() == ad::VARIABLE && node->GetId() == id) {
+                return true;
+            }
+            it++;
+        }
+        return false;
+    }
+
     /**
      * Returns an expression representing the derivative of the input expression
      * w.r.t id.
@@ -2711,7 +3334,7 @@ namespace ad {
                     temp->SetRight(new ad::Expression<T > ());
                     temp->GetRight()->SetOp(ad::MULTIPLY);
                     temp->GetRight()->SetLeft(rhs.first);
-                    temp->GetRight()->SetRight(ad::Clone(rhs.first));
+                    temp->GetRight()->SetRight(rhs.first);
 
                     temp->take();
                     temps.push_back(temp);
@@ -2802,7 +3425,7 @@ namespace ad {
                         temp->GetRight()->GetLeft()->GetRight()->SetOp(ad::COS);
                         temp->GetRight()->GetLeft()->GetRight()->SetLeft(lhs.first);
 
-                        temp->GetRight()->SetRight(ad::Clone(temp->GetRight()->GetLeft()));
+                        temp->GetRight()->SetRight(temp->GetRight()->GetLeft());
 
                         temp->take();
                         temps.push_back(temp);
@@ -2963,25 +3586,32 @@ namespace ad {
 
 
                     if (found) {
+                        //f(x) = atan2(u, v)
+                        //f'(x) = (u'v - uv') / (uu + vv)
                         temp = new ad::Expression<T > ();
-                        temp->SetOp(ad::MULTIPLY);
-
-                        temp->SetLeft(ad::Clone(rhs.second/*ad::Clone(rhs.second)*/));
-                        temp->SetRight(new ad::Expression<T > ());
-                        temp->GetRight()->SetOp(ad::DIVIDE);
-                        temp->GetRight()->SetLeft(ad::Clone(lhs.second/*ad::Clone(lhs.second)*/));
+                        temp->SetOp(ad::DIVIDE);
 
+                        temp->SetLeft(new ad::Expression<T > ());
+                        temp->GetLeft()->SetOp(ad::MINUS);
+                        temp->GetLeft()->SetLeft(new ad::Expression<T > ());
+                        temp->GetLeft()->GetLeft()->SetOp(ad::MULTIPLY);
+                        temp->GetLeft()->GetLeft()->SetLeft(lhs.second);
+                        temp->GetLeft()->GetLeft()->SetRight(rhs.first);
+                        temp->GetLeft()->SetRight(new ad::Expression<T > ());
+                        temp->GetLeft()->GetRight()->SetOp(ad::MULTIPLY);
+                        temp->GetLeft()->GetRight()->SetLeft(lhs.first);
+                        temp->GetLeft()->GetRight()->SetRight(rhs.second);
 
+                        temp->SetRight(new ad::Expression<T > ());
+                        temp->GetRight()->SetOp(ad::PLUS);
+                        temp->GetRight()->SetLeft(new ad::Expression<T > ());
+                        temp->GetRight()->GetLeft()->SetOp(ad::MULTIPLY);
+                        temp->GetRight()->GetLeft()->SetLeft(lhs.first);
+                        temp->GetRight()->GetLeft()->SetRight(lhs.first);
                         temp->GetRight()->SetRight(new ad::Expression<T > ());
-                        temp->GetRight()->GetRight()->SetOp(ad::PLUS);
-                        temp->GetRight()->GetRight()->SetLeft(new ad::Expression<T > ());
-                        temp->GetRight()->GetRight()->GetLeft()->SetOp(ad::MULTIPLY);
-                        temp->GetRight()->GetRight()->GetLeft()->SetLeft(ad::Clone(lhs.first));
-                        temp->GetRight()->GetRight()->GetLeft()->SetRight(ad::Clone(lhs.first));
-                        temp->GetRight()->GetRight()->SetRight(new ad::Expression<T > ());
-                        temp->GetRight()->GetRight()->GetRight()->SetOp(ad::MULTIPLY);
-                        temp->GetRight()->GetRight()->GetRight()->SetLeft(ad::Clone(rhs.first));
-                        temp->GetRight()->GetRight()->GetRight()->SetRight(ad::Clone(rhs.first));
+                        temp->GetRight()->GetRight()->SetOp(ad::MULTIPLY);
+                        temp->GetRight()->GetRight()->SetLeft(rhs.first);
+                        temp->GetRight()->GetRight()->SetRight(rhs.first);
 
                         temp->take();
                         temps.push_back(temp);
@@ -3012,7 +3642,8 @@ namespace ad {
                         temp->GetRight()->GetLeft()->SetOp(ad::CONSTANT);
                         temp->GetRight()->GetLeft()->SetValue(.5);
 
-                        temp->GetRight()->SetRight(lhs.first);
+                        //f'(x) = u' * .5 / sqrt(u)
+                        temp->GetRight()->SetRight(currNode);
 
                         temp->take();
                         temps.push_back(temp);
@@ -3056,6 +3687,25 @@ namespace ad {
                         temp->GetRight()->GetRight()->GetRight()->SetOp(ad::CONSTANT);
                         temp->GetRight()->GetRight()->GetRight()->SetValue(1.0);
 
+                        //f(x) = u^v, with v depending on x
+                        //f'(x) = v u' u^(v - 1) + u^v log(u) v'
+                        //added only then, as log(u) is undefined for u <= 0
+                        if (ad::DependsOn<T > (rhs.first, id)) {
+                            ad::Expression<T>* power = temp;
+                            temp = new ad::Expression<T > ();
+                            temp->SetOp(ad::PLUS);
+                            temp->SetLeft(power);
+                            temp->SetRight(new ad::Expression<T > ());
+                            temp->GetRight()->SetOp(ad::MULTIPLY);
+                            temp->GetRight()->SetLeft(new ad::Expression<T > ());
+                            temp->GetRight()->GetLeft()->SetOp(ad::MULTIPLY);
+                            temp->GetRight()->GetLeft()->SetLeft(currNode);
+                            temp->GetRight()->GetLeft()->SetRight(new ad::Expression<T > ());
+                            temp->GetRight()->GetLeft()->GetRight()->SetOp(ad::LOG);
+                            temp->GetRight()->GetLeft()->GetRight()->SetLeft(lhs.first);
+                            temp->GetRight()->SetRight(rhs.second);
+                        }
+
                         temp->take();
                         temps.push_back(temp);
                         stack.push_front(std::pair<ad::Expression<T>*, ad::Expression<T>*> (currNode, temp));
@@ -3237,7 +3887,7 @@ namespace ad {
                         temp->GetRight()->GetLeft()->GetRight()->SetOp(ad::COSH);
                         temp->GetRight()->GetLeft()->GetRight()->SetLeft(lhs.first);
 
-                        temp->GetRight()->SetRight(ad::Clone(temp->GetRight()->GetLeft()));
+                        temp->GetRight()->SetRight(temp->GetRight()->GetLeft());
 
                         temp->take();
                         temps.push_back(temp);
@@ -3343,8 +3993,11 @@ namespace ad {
             //            //            }
         }
 
+        //drop the 0 and 1 terms so repeated differentiation stays small
+        ad::Expression<T>* simplified = ad::Simplify<T > (ret);
+        ret->release();
 
-        return ret;
+        return simplified;
 
 
     }
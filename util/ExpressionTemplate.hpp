@@ -0,0 +1,440 @@
+/*
+ * File:   ExpressionTemplate.hpp
+ * Author: matthewsupernaw
+ *
+ * Created on October 17, 2026
+ *
+ * Expression templates for ADNumber arithmetic, enabled by defining
+ * ADNUMBER_EXPRESSION_TEMPLATES before including ADNumber.hpp. With them
+ * a statement such as
+ *
+ *      f = a * b + c * d - e / f;
+ *
+ * builds a tree of small stack objects whose shape is known at compile
+ * time, and nothing is recorded until the tree is assigned to an ADNumber.
+ * The intermediate results get no id, no expression node of their own and
+ * no reference counting. On assignment:
+ *
+ *  - when recording a tape, the partials of the result with respect to
+ *    each operand are accumulated inline, in reverse over the tree, and the
+ *    statement becomes one FUSED tape entry (see Tape::PushFused);
+ *  - when recording expressions, the interior nodes are built directly,
+ *    simplified and hash consed as usual (see CanonicalizeNode), so the
+ *    graph is the same as with ordinary operators and higher derivatives
+ *    keep working;
+ *  - otherwise only the value is computed.
+ *
+ * The trees hold references to the ADNumbers they read, so, as with any
+ * expression templates, they must not outlive the statement; do not keep
+ * them in auto variables. Functions that take ADNumbers by template
+ * (ad::Derivative, ...) need the statement converted first, e.g.
+ * ad::ADNumber<T>(a * b).
+ */
+
+#ifndef EXPRESSIONTEMPLATE_HPP
+#define	EXPRESSIONTEMPLATE_HPP
+
+#include <cmath>
+#include <iostream>
+
+#include "Expression.hpp"
+
+namespace ad {
+
+    template<class T> class ADNumber;
+
+    /**
+     * Base of every statement node, E is the node type. A node provides
+     *
+     *  - enum LEAVES, the number of ADNumber operands in its tree;
+     *  - GetValue(), computed when the node is built;
+     *  - Accumulate(adjoint, operands, partials, count), which appends the
+     *    tape index of each operand and adjoint * d(node)/d(operand);
+     *  - Record(), which returns its expression node holding one reference
+     *    owned by the caller.
+     */
+    template<class T, class E>
+    class ADExpression {
+    public:
+
+        inline const E& Cast() const {
+            return static_cast<const E&> (*this);
+        }
+
+        inline const T GetValue() const {
+            return this->Cast().GetValue();
+        }
+    };
+
+    /**
+     * An ADNumber operand.
+     */
+    template<class T>
+    class ADTerm : public ADExpression<T, ADTerm<T> > {
+        const ADNumber<T>* number_m;
+    public:
+
+        enum {
+            LEAVES = 1
+        };
+
+        explicit ADTerm(const ADNumber<T> &number) : number_m(&number) {
+        }
+
+        inline const T GetValue() const {
+            return number_m->GetValue();
+        }
+
+        inline void Accumulate(const T &adjoint, int *operands, T *partials, int &count) const {
+            operands[count] = number_m->GetTapeIndex();
+            partials[count] = adjoint;
+            count++;
+        }
+
+        inline Expression<T>* Record() const {
+            Expression<T>* exp = number_m->GetExpression();
+            if (exp != NULL) {
+                exp->take();
+            }
+            return exp;
+        }
+    };
+
+    /**
+     * A constant operand.
+     */
+    template<class T>
+    class ADScalar : public ADExpression<T, ADScalar<T> > {
+        T value_m;
+    public:
+
+        enum {
+            LEAVES = 0
+        };
+
+        explicit ADScalar(const T &value) : value_m(value) {
+        }
+
+        inline const T GetValue() const {
+            return value_m;
+        }
+
+        inline void Accumulate(const T &adjoint, int *operands, T *partials, int &count) const {
+        }
+
+        inline Expression<T>* Record() const {
+            Expression<T>* exp = NEW_EXPRESSION(T)(value_m, 0, CONSTANT, NULL, NULL);
+            exp->take();
+            return exp;
+        }
+    };
+
+    /**
+     * Builds the node op(left, right), taking over the caller's references
+     * to left and right, and canonicalizes it.
+     */
+    template<class T>
+    static Expression<T>* RecordOperation(const T &value, Operation op,
+            Expression<T>* left, Expression<T>* right) {
+        Expression<T>* exp = NEW_EXPRESSION(T)(value, 0, op, left, right);
+        exp->take();
+        if (left != NULL) {
+            left->release();
+        }
+        if (right != NULL) {
+            right->release();
+        }
+        return ad::CanonicalizeNode<T > (exp);
+    }
+
+    /**
+     * left OP right for OP one of PLUS, MINUS, MULTIPLY and DIVIDE.
+     */
+    template<class T, class L, class R, int OP>
+    class ADBinaryExpression : public ADExpression<T, ADBinaryExpression<T, L, R, OP> > {
+        L left_m;
+        R right_m;
+        T value_m;
+    public:
+
+        enum {
+            LEAVES = L::LEAVES + R::LEAVES
+        };
+
+        ADBinaryExpression(const L &left, const R &right) :
+        left_m(left), right_m(right),
+        value_m(ad::ApplyOperation<T > (OP, left.GetValue(), right.GetValue())) {
+        }
+
+        inline const T GetValue() const {
+            return value_m;
+        }
+
+        inline void Accumulate(const T &adjoint, int *operands, T *partials, int &count) const {
+            switch (OP) {
+                case PLUS:
+                    left_m.Accumulate(adjoint, operands, partials, count);
+                    right_m.Accumulate(adjoint, operands, partials, count);
+                    break;
+                case MINUS:
+                    left_m.Accumulate(adjoint, operands, partials, count);
+                    right_m.Accumulate(-adjoint, operands, partials, count);
+                    break;
+                case MULTIPLY:
+                    left_m.Accumulate(adjoint * right_m.GetValue(), operands, partials, count);
+                    right_m.Accumulate(adjoint * left_m.GetValue(), operands, partials, count);
+                    break;
+                case DIVIDE:
+                    left_m.Accumulate(adjoint / right_m.GetValue(), operands, partials, count);
+                    right_m.Accumulate(-adjoint * value_m / right_m.GetValue(), operands, partials, count);
+                    break;
+            }
+        }
+
+        inline Expression<T>* Record() const {
+            return ad::RecordOperation<T > (value_m, static_cast<Operation> (OP),
+                    left_m.Record(), right_m.Record());
+        }
+    };
+
+    /**
+     * OP(operand) for the elementary functions of one argument; -operand is
+     * MINUS with a left operand of zero, as SimplifyNode expects.
+     */
+    template<class T, class E, int OP>
+    class ADUnaryExpression : public ADExpression<T, ADUnaryExpression<T, E, OP> > {
+        E operand_m;
+        T value_m;
+    public:
+
+        enum {
+            LEAVES = E::LEAVES
+        };
+
+        explicit ADUnaryExpression(const E &operand) :
+        operand_m(operand),
+        value_m(OP == MINUS ? -operand.GetValue() :
+        ad::ApplyOperation<T > (OP, operand.GetValue(), T(0))) {
+        }
+
+        inline const T GetValue() const {
+            return value_m;
+        }
+
+        inline void Accumulate(const T &adjoint, int *operands, T *partials, int &count) const {
+            operand_m.Accumulate(adjoint * this->Partial(), operands, partials, count);
+        }
+
+        inline Expression<T>* Record() const {
+            if (OP == MINUS) {
+                return ad::RecordOperation<T > (value_m, MINUS,
+                        ADScalar<T > (T(0)).Record(), operand_m.Record());
+            }
+            return ad::RecordOperation<T > (value_m, static_cast<Operation> (OP),
+                    operand_m.Record(), NULL);
+        }
+
+    private:
+
+        /**
+         * d(value)/d(operand), as recorded by the matching ADNumber
+         * function.
+         */
+        inline const T Partial() const {
+            T x = operand_m.GetValue();
+            switch (OP) {
+                case MINUS:
+                    return T(-1.0);
+                case SIN:
+                    return std::cos(x);
+                case COS:
+                    return T(-1.0) * std::sin(x);
+                case TAN:
+                    return (T(1.0) / std::cos(x)) * (T(1.0) / std::cos(x));
+                case ASIN:
+                    return T(1.0) / std::sqrt(T(1.0) - x * x);
+                case ACOS:
+                    return T(-1.0) / std::sqrt(T(1.0) - x * x);
+                case ATAN:
+                    return T(1.0) / (x * x + T(1.0));
+                case SQRT:
+                    return T(0.5) / value_m;
+                case LOG:
+                    return T(1.0) / x;
+                case LOG10:
+                    return T(1.0) / (x * std::log(T(10.0)));
+                case EXP:
+                    return value_m;
+                case SINH:
+                    return std::cosh(x);
+                case COSH:
+                    return std::sinh(x);
+                case TANH:
+                    return (T(1.0) / std::cosh(x)) * (T(1.0) / std::cosh(x));
+                case FABS:
+                    return x / value_m;
+                default:
+                    return T(0.0);
+            }
+        }
+    };
+
+#define AD_STATEMENT_OPERATOR(SYMBOL, OP) \
+    template<class T, class L, class R> \
+    inline const ADBinaryExpression<T, L, R, OP> operator SYMBOL(const ADExpression<T, L> &lhs, const ADExpression<T, R> &rhs) { \
+        return ADBinaryExpression<T, L, R, OP > (lhs.Cast(), rhs.Cast()); \
+    } \
+    template<class T, class L> \
+    inline const ADBinaryExpression<T, L, ADTerm<T>, OP> operator SYMBOL(const ADExpression<T, L> &lhs, const ADNumber<T> &rhs) { \
+        return ADBinaryExpression<T, L, ADTerm<T>, OP > (lhs.Cast(), ADTerm<T > (rhs)); \
+    } \
+    template<class T, class R> \
+    inline const ADBinaryExpression<T, ADTerm<T>, R, OP> operator SYMBOL(const ADNumber<T> &lhs, const ADExpression<T, R> &rhs) { \
+        return ADBinaryExpression<T, ADTerm<T>, R, OP > (ADTerm<T > (lhs), rhs.Cast()); \
+    } \
+    template<class T> \
+    inline const ADBinaryExpression<T, ADTerm<T>, ADTerm<T>, OP> operator SYMBOL(const ADNumber<T> &lhs, const ADNumber<T> &rhs) { \
+        return ADBinaryExpression<T, ADTerm<T>, ADTerm<T>, OP > (ADTerm<T > (lhs), ADTerm<T > (rhs)); \
+    } \
+    template<class T, class L> \
+    inline const ADBinaryExpression<T, L, ADScalar<T>, OP> operator SYMBOL(const ADExpression<T, L> &lhs, T rhs) { \
+        return ADBinaryExpression<T, L, ADScalar<T>, OP > (lhs.Cast(), ADScalar<T > (rhs)); \
+    } \
+    template<class T, class R> \
+    inline const ADBinaryExpression<T, ADScalar<T>, R, OP> operator SYMBOL(T lhs, const ADExpression<T, R> &rhs) { \
+        return ADBinaryExpression<T, ADScalar<T>, R, OP > (ADScalar<T > (lhs), rhs.Cast()); \
+    } \
+    template<class T> \
+    inline const ADBinaryExpression<T, ADTerm<T>, ADScalar<T>, OP> operator SYMBOL(const ADNumber<T> &lhs, T rhs) { \
+        return ADBinaryExpression<T, ADTerm<T>, ADScalar<T>, OP > (ADTerm<T > (lhs), ADScalar<T > (rhs)); \
+    } \
+    template<class T> \
+    inline const ADBinaryExpression<T, ADScalar<T>, ADTerm<T>, OP> operator SYMBOL(T lhs, const ADNumber<T> &rhs) { \
+        return ADBinaryExpression<T, ADScalar<T>, ADTerm<T>, OP > (ADScalar<T > (lhs), ADTerm<T > (rhs)); \
+    }
+
+    AD_STATEMENT_OPERATOR(+, PLUS)
+    AD_STATEMENT_OPERATOR(-, MINUS)
+    AD_STATEMENT_OPERATOR(*, MULTIPLY)
+    AD_STATEMENT_OPERATOR(/, DIVIDE)
+
+#undef AD_STATEMENT_OPERATOR
+
+    template<class T, class E>
+    inline const ADUnaryExpression<T, E, MINUS> operator-(const ADExpression<T, E> &val) {
+        return ADUnaryExpression<T, E, MINUS > (val.Cast());
+    }
+
+    template<class T>
+    inline const ADUnaryExpression<T, ADTerm<T>, MINUS> operator-(const ADNumber<T> &val) {
+        return ADUnaryExpression<T, ADTerm<T>, MINUS > (ADTerm<T > (val));
+    }
+
+    //comparisons are on values, as for ADNumber
+#define AD_STATEMENT_COMPARISON(SYMBOL) \
+    template<class T, class L, class R> \
+    inline const int operator SYMBOL(const ADExpression<T, L> &lhs, const ADExpression<T, R> &rhs) { \
+        return lhs.GetValue() SYMBOL rhs.GetValue(); \
+    } \
+    template<class T, class L> \
+    inline const int operator SYMBOL(const ADExpression<T, L> &lhs, const ADNumber<T> &rhs) { \
+        return lhs.GetValue() SYMBOL rhs.GetValue(); \
+    } \
+    template<class T, class R> \
+    inline const int operator SYMBOL(const ADNumber<T> &lhs, const ADExpression<T, R> &rhs) { \
+        return lhs.GetValue() SYMBOL rhs.GetValue(); \
+    } \
+    template<class T, class L> \
+    inline const int operator SYMBOL(const ADExpression<T, L> &lhs, T rhs) { \
+        return lhs.GetValue() SYMBOL rhs; \
+    } \
+    template<class T, class R> \
+    inline const int operator SYMBOL(T lhs, const ADExpression<T, R> &rhs) { \
+        return lhs SYMBOL rhs.GetValue(); \
+    }
+
+    AD_STATEMENT_COMPARISON(==)
+    AD_STATEMENT_COMPARISON(!=)
+    AD_STATEMENT_COMPARISON(<)
+    AD_STATEMENT_COMPARISON(>)
+    AD_STATEMENT_COMPARISON(<=)
+    AD_STATEMENT_COMPARISON(>=)
+
+#undef AD_STATEMENT_COMPARISON
+
+    template<class T, class E>
+    std::ostream & operator<<(std::ostream &out, const ADExpression<T, E> &val) {
+        out << val.GetValue();
+        return out;
+    }
+
+}
+
+namespace std {
+
+    //elementary functions of a statement are fused into it
+#define AD_STATEMENT_FUNCTION(NAME, OP) \
+    template<class T, class E> \
+    inline const ad::ADUnaryExpression<T, E, OP> NAME(const ad::ADExpression<T, E> &val) { \
+        return ad::ADUnaryExpression<T, E, OP > (val.Cast()); \
+    }
+
+    AD_STATEMENT_FUNCTION(sin, ad::SIN)
+    AD_STATEMENT_FUNCTION(cos, ad::COS)
+    AD_STATEMENT_FUNCTION(tan, ad::TAN)
+    AD_STATEMENT_FUNCTION(asin, ad::ASIN)
+    AD_STATEMENT_FUNCTION(acos, ad::ACOS)
+    AD_STATEMENT_FUNCTION(atan, ad::ATAN)
+    AD_STATEMENT_FUNCTION(sqrt, ad::SQRT)
+    AD_STATEMENT_FUNCTION(log, ad::LOG)
+    AD_STATEMENT_FUNCTION(log10, ad::LOG10)
+    AD_STATEMENT_FUNCTION(exp, ad::EXP)
+    AD_STATEMENT_FUNCTION(sinh, ad::SINH)
+    AD_STATEMENT_FUNCTION(cosh, ad::COSH)
+    AD_STATEMENT_FUNCTION(tanh, ad::TANH)
+    AD_STATEMENT_FUNCTION(fabs, ad::FABS)
+
+#undef AD_STATEMENT_FUNCTION
+
+    //the rest record their argument as an ADNumber first
+
+    template<class T, class E>
+    inline const ad::ADNumber<T> floor(const ad::ADExpression<T, E> &val) {
+        return std::floor(ad::ADNumber<T > (val));
+    }
+
+    template<class T, class E>
+    inline const ad::ADNumber<T> mfexp(const ad::ADExpression<T, E> &val) {
+        return std::mfexp(ad::ADNumber<T > (val));
+    }
+
+#define AD_STATEMENT_BINARY_FUNCTION(NAME) \
+    template<class T, class L, class R> \
+    inline const ad::ADNumber<T> NAME(const ad::ADExpression<T, L> &lhs, const ad::ADExpression<T, R> &rhs) { \
+        return std::NAME(ad::ADNumber<T > (lhs), ad::ADNumber<T > (rhs)); \
+    } \
+    template<class T, class L> \
+    inline const ad::ADNumber<T> NAME(const ad::ADExpression<T, L> &lhs, const ad::ADNumber<T> &rhs) { \
+        return std::NAME(ad::ADNumber<T > (lhs), rhs); \
+    } \
+    template<class T, class R> \
+    inline const ad::ADNumber<T> NAME(const ad::ADNumber<T> &lhs, const ad::ADExpression<T, R> &rhs) { \
+        return std::NAME(lhs, ad::ADNumber<T > (rhs)); \
+    } \
+    template<class T, class L> \
+    inline const ad::ADNumber<T> NAME(const ad::ADExpression<T, L> &lhs, T rhs) { \
+        return std::NAME(ad::ADNumber<T > (lhs), rhs); \
+    } \
+    template<class T, class R> \
+    inline const ad::ADNumber<T> NAME(T lhs, const ad::ADExpression<T, R> &rhs) { \
+        return std::NAME(lhs, ad::ADNumber<T > (rhs)); \
+    }
+
+    AD_STATEMENT_BINARY_FUNCTION(pow)
+    AD_STATEMENT_BINARY_FUNCTION(atan2)
+
+#undef AD_STATEMENT_BINARY_FUNCTION
+
+}
+
+#endif	/* EXPRESSIONTEMPLATE_HPP */
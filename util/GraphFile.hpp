@@ -0,0 +1,564 @@
+/*
+ * File:   GraphFile.hpp
+ * Author: matthewsupernaw
+ *
+ * Created on October 17, 2026
+ *
+ * Binary file format for expression graphs. A file is a fixed header
+ * followed by columns, each starting on a 64 byte boundary:
+ *
+ *    ops      int32    op code of each node
+ *    left     int32    position of the left operand, -1 if none
+ *    right    int32    position of the right operand, -1 if none
+ *    ids      uint64   variable id of each node
+ *    values   T        recorded value of each node
+ *    name_ids uint64   ids of the named variables
+ *    name_offsets uint64   start of each name in strings, plus the end
+ *    strings  char     the names, back to back
+ *
+ * Nodes are in topological order, operands first and the root last, and a
+ * shared subexpression is stored once. Everything is little endian.
+ *
+ * Writing takes one write per column. A GraphFile opened from a path maps
+ * the file and points into it, so loading does no per node work and the
+ * gradient sweep (see ad::GradientSweep) runs on the mapped columns.
+ * Expression nodes are only built when asked for. Loading checks the
+ * header, the extents of the columns, the op codes, that every node has
+ * the operands its op needs and that every operand comes before its node;
+ * values and ids are taken as written.
+ */
+
+#ifndef GRAPHFILE_HPP
+#define	GRAPHFILE_HPP
+
+#include <vector>
+#include <valarray>
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "Expression.hpp"
+
+namespace ad {
+
+    /**
+     * Column offsets are in bytes from the start of the file.
+     */
+    struct GraphFileHeader {
+        char magic[8]; //"ADGRAPH"
+        uint32_t version;
+        uint32_t value_size; //sizeof(T) of the writer
+        uint64_t nodes;
+        uint64_t names;
+        uint64_t ops;
+        uint64_t left;
+        uint64_t right;
+        uint64_t ids;
+        uint64_t values;
+        uint64_t name_ids;
+        uint64_t name_offsets;
+        uint64_t strings;
+        uint64_t size; //of the whole file
+    };
+
+    static const uint32_t GraphFileVersion = 1;
+
+    static inline bool IsLittleEndian() {
+        int num = 1;
+        return *(char *) &num == 1;
+    }
+
+    /**
+     * Reverses the bytes of count elements of width bytes in place.
+     */
+    static inline void SwapColumn(char *data, size_t count, size_t width) {
+        for (size_t i = 0; i < count; i++) {
+            std::reverse(data + i * width, data + (i + 1) * width);
+        }
+    }
+
+    template<class T>
+    class GraphFile {
+        GraphFileHeader header_m;
+        const int32_t* ops_m;
+        const int32_t* left_m;
+        const int32_t* right_m;
+        const uint64_t* ids_m;
+        const T* values_m;
+        const uint64_t* name_ids_m;
+        const uint64_t* name_offsets_m;
+        const char* strings_m;
+        //file contents when read from a stream or converted
+        std::vector<char> buffer_m;
+        void* mapped_m;
+        size_t mapped_size_m;
+
+    public:
+
+        GraphFile() :
+        ops_m(NULL),
+        left_m(NULL),
+        right_m(NULL),
+        ids_m(NULL),
+        values_m(NULL),
+        name_ids_m(NULL),
+        name_offsets_m(NULL),
+        strings_m(NULL),
+        mapped_m(NULL),
+        mapped_size_m(0) {
+            std::memset(&header_m, 0, sizeof (header_m));
+        }
+
+        ~GraphFile() {
+            this->Close();
+        }
+
+        /**
+         * Maps the file at path. Returns false if it cannot be read or is
+         * not a graph of T.
+         *
+         * @param path
+         * @return
+         */
+        bool Open(const std::string &path) {
+            this->Close();
+
+            int file = ::open(path.c_str(), O_RDONLY);
+            if (file == -1) {
+                return false;
+            }
+
+            struct stat info;
+            if (::fstat(file, &info) != 0 || info.st_size < static_cast<off_t> (sizeof (GraphFileHeader))) {
+                ::close(file);
+                return false;
+            }
+
+            size_t size = static_cast<size_t> (info.st_size);
+            void* data = ::mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+            ::close(file);
+            if (data == MAP_FAILED) {
+                return false;
+            }
+            ::madvise(data, size, MADV_WILLNEED);
+
+            mapped_m = data;
+            mapped_size_m = size;
+            if (!this->Attach(static_cast<const char*> (data), size)) {
+                this->Close();
+                return false;
+            }
+            return true;
+        }
+
+        /**
+         * Reads a graph written by Write from the rest of in.
+         *
+         * @param in
+         * @return
+         */
+        bool Read(std::istream &in) {
+            this->Close();
+
+            GraphFileHeader header;
+            if (!in.read(reinterpret_cast<char*> (&header), sizeof (header))) {
+                return false;
+            }
+            uint64_t size = IsLittleEndian() ? header.size : SwapBytes(header.size);
+            if (size < sizeof (header)) {
+                return false;
+            }
+
+            //a corrupt size must not be allocated: check it against what
+            //is left of a seekable stream, and read any other in chunks
+            std::streampos here = in.tellg();
+            if (here != std::streampos(-1)) {
+                in.seekg(0, std::ios::end);
+                std::streampos end = in.tellg();
+                in.seekg(here);
+                if (end == std::streampos(-1) || !in.good()
+                        || static_cast<uint64_t> (end - here) < size - sizeof (header)) {
+                    return false;
+                }
+            }
+
+            buffer_m.assign(reinterpret_cast<const char*> (&header),
+                    reinterpret_cast<const char*> (&header) + sizeof (header));
+            while (buffer_m.size() < size) {
+                size_t offset = buffer_m.size();
+                size_t chunk = static_cast<size_t> (std::min<uint64_t> (size - offset, static_cast<uint64_t> (1) << 24));
+                buffer_m.resize(offset + chunk);
+                if (!in.read(&buffer_m[offset], static_cast<std::streamsize> (chunk))) {
+                    buffer_m.clear();
+                    return false;
+                }
+            }
+            if (!this->Attach(&buffer_m[0], buffer_m.size())) {
+                this->Close();
+                return false;
+            }
+            return true;
+        }
+
+        void Close() {
+            if (mapped_m != NULL) {
+                ::munmap(mapped_m, mapped_size_m);
+                mapped_m = NULL;
+                mapped_size_m = 0;
+            }
+            buffer_m.clear();
+            std::memset(&header_m, 0, sizeof (header_m));
+            ops_m = left_m = right_m = NULL;
+            ids_m = name_ids_m = name_offsets_m = NULL;
+            values_m = NULL;
+            strings_m = NULL;
+        }
+
+        const size_t Size() const {
+            return static_cast<size_t> (header_m.nodes);
+        }
+
+        const int32_t* Ops() const {
+            return ops_m;
+        }
+
+        const int32_t* Left() const {
+            return left_m;
+        }
+
+        const int32_t* Right() const {
+            return right_m;
+        }
+
+        const uint64_t* Ids() const {
+            return ids_m;
+        }
+
+        const T* Values() const {
+            return values_m;
+        }
+
+        /**
+         * Value of the root as recorded.
+         */
+        const T Value() const {
+            return this->Size() > 0 ? values_m[this->Size() - 1] : T(0);
+        }
+
+        /**
+         * Gradient of the root with respect to the variables in ids, swept
+         * over the columns as they are.
+         *
+         * @param ids
+         * @param gradient
+         */
+        void Gradient(const std::vector<unsigned long> &ids, std::valarray<T> &gradient) const {
+            NodeColumns<T> graph;
+            graph.ops = ops_m;
+            graph.left = left_m;
+            graph.right = right_m;
+            graph.ids = ids_m;
+            graph.values = values_m;
+            ad::GradientSweep<T > (graph, this->Size(), ids, gradient);
+        }
+
+        /**
+         * Builds the graph as expression nodes, with root the root node or
+         * NULL for a new one, and interns the stored names. Returns the
+         * root.
+         *
+         * @param root
+         * @return
+         */
+        Expression<T>* Build(Expression<T>* root = NULL) const {
+            size_t size = this->Size();
+            if (size == 0) {
+                return root;
+            }
+
+            for (uint64_t k = 0; k < header_m.names; k++) {
+                VariableNames::Set(static_cast<unsigned long> (name_ids_m[k]),
+                        std::string(strings_m + name_offsets_m[k], strings_m + name_offsets_m[k + 1]));
+            }
+
+            std::vector<Expression<T>* > nodes(size);
+            for (size_t i = 0; i + 1 < size; i++) {
+                nodes[i] = new Expression<T > (values_m[i], static_cast<unsigned long> (ids_m[i]),
+                        static_cast<Operation> (ops_m[i]),
+                        left_m[i] > -1 ? nodes[left_m[i]] : NULL,
+                        right_m[i] > -1 ? nodes[right_m[i]] : NULL);
+            }
+
+            size_t i = size - 1;
+            if (root == NULL) {
+                root = new Expression<T > ();
+            }
+            root->SetValue(values_m[i]);
+            root->SetId(static_cast<unsigned long> (ids_m[i]));
+            root->SetOp(static_cast<Operation> (ops_m[i]));
+            root->SetLeft(left_m[i] > -1 ? nodes[left_m[i]] : NULL);
+            root->SetRight(right_m[i] > -1 ? nodes[right_m[i]] : NULL);
+            return root;
+        }
+
+        /**
+         * Writes the graph of exp to out.
+         *
+         * @param exp
+         * @param out
+         * @return false if the stream failed
+         */
+        static bool Write(Expression<T>* exp, std::ostream &out) {
+            std::vector<Expression<T>* > order;
+            ad::TopologicalOrder<T > (exp, order);
+
+            size_t size = order.size();
+            std::vector<int32_t> ops(size);
+            std::vector<int32_t> left(size);
+            std::vector<int32_t> right(size);
+            std::vector<uint64_t> ids(size);
+            std::vector<T> values(size);
+            std::vector<uint64_t> name_ids;
+            std::vector<uint64_t> name_offsets(1, 0);
+            std::string strings;
+
+            for (size_t i = 0; i < size; i++) {
+                Expression<T>* n = order[i];
+                ops[i] = n->GetOp();
+                left[i] = (n->GetLeft() != NULL) ? static_cast<int32_t> (n->GetLeft()->GetIndex()) : -1;
+                right[i] = (n->GetRight() != NULL) ? static_cast<int32_t> (n->GetRight()->GetIndex()) : -1;
+                ids[i] = n->GetId();
+                values[i] = n->GetValue();
+
+                if (n->GetOp() == VARIABLE && VariableNames::Has(n->GetId())) {
+                    name_ids.push_back(n->GetId());
+                    strings += VariableNames::Get(n->GetId());
+                    name_offsets.push_back(strings.size());
+                }
+            }
+
+            GraphFileHeader header;
+            std::memset(&header, 0, sizeof (header));
+            std::memcpy(header.magic, "ADGRAPH", 8);
+            header.version = GraphFileVersion;
+            header.value_size = sizeof (T);
+            header.nodes = size;
+            header.names = name_ids.size();
+
+            uint64_t offset = GraphFile<T>::Align(sizeof (header));
+            header.ops = offset;
+            offset = GraphFile<T>::Align(offset + size * sizeof (int32_t));
+            header.left = offset;
+            offset = GraphFile<T>::Align(offset + size * sizeof (int32_t));
+            header.right = offset;
+            offset = GraphFile<T>::Align(offset + size * sizeof (int32_t));
+            header.ids = offset;
+            offset = GraphFile<T>::Align(offset + size * sizeof (uint64_t));
+            header.values = offset;
+            offset = GraphFile<T>::Align(offset + size * sizeof (T));
+            header.name_ids = offset;
+            offset = GraphFile<T>::Align(offset + name_ids.size() * sizeof (uint64_t));
+            header.name_offsets = offset;
+            offset = offset + name_offsets.size() * sizeof (uint64_t);
+            header.strings = offset;
+            header.size = offset + strings.size();
+
+            if (!IsLittleEndian()) {
+                GraphFile<T>::SwapHeader(header);
+                GraphFile<T>::Swap(ops);
+                GraphFile<T>::Swap(left);
+                GraphFile<T>::Swap(right);
+                GraphFile<T>::Swap(ids);
+                GraphFile<T>::Swap(values);
+                GraphFile<T>::Swap(name_ids);
+                GraphFile<T>::Swap(name_offsets);
+            }
+
+            uint64_t position = 0;
+            GraphFile<T>::Put(out, position, 0, &header, sizeof (header));
+            GraphFile<T>::Put(out, position, GraphFile<T>::Align(sizeof (header)), ops);
+            GraphFile<T>::Put(out, position, GraphFile<T>::Align(position), left);
+            GraphFile<T>::Put(out, position, GraphFile<T>::Align(position), right);
+            GraphFile<T>::Put(out, position, GraphFile<T>::Align(position), ids);
+            GraphFile<T>::Put(out, position, GraphFile<T>::Align(position), values);
+            GraphFile<T>::Put(out, position, GraphFile<T>::Align(position), name_ids);
+            GraphFile<T>::Put(out, position, GraphFile<T>::Align(position), name_offsets);
+            GraphFile<T>::Put(out, position, position, strings.data(), strings.size());
+            return out.good();
+        }
+
+        /**
+         * Writes the graph of exp to the file at path.
+         *
+         * @param exp
+         * @param path
+         * @return
+         */
+        static bool Write(Expression<T>* exp, const std::string &path) {
+            std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+            if (!out.good()) {
+                return false;
+            }
+            return GraphFile<T>::Write(exp, out) && out.flush().good();
+        }
+
+    private:
+
+        /**
+         * Points the columns into data after checking the header. Data in
+         * the other byte order is converted into buffer_m.
+         */
+        bool Attach(const char *data, size_t size) {
+            std::memcpy(&header_m, data, sizeof (header_m));
+            bool swap = !IsLittleEndian();
+            if (swap) {
+                GraphFile<T>::SwapHeader(header_m);
+            }
+
+            const GraphFileHeader &h = header_m;
+            if (std::memcmp(h.magic, "ADGRAPH", 8) != 0 || h.version != GraphFileVersion
+                    || h.value_size != sizeof (T) || h.size > size) {
+                return false;
+            }
+            //every column within the file
+            if (!GraphFile<T>::Fits(h.ops, h.nodes, sizeof (int32_t), h.size)
+                    || !GraphFile<T>::Fits(h.left, h.nodes, sizeof (int32_t), h.size)
+                    || !GraphFile<T>::Fits(h.right, h.nodes, sizeof (int32_t), h.size)
+                    || !GraphFile<T>::Fits(h.ids, h.nodes, sizeof (uint64_t), h.size)
+                    || !GraphFile<T>::Fits(h.values, h.nodes, sizeof (T), h.size)
+                    || !GraphFile<T>::Fits(h.name_ids, h.names, sizeof (uint64_t), h.size)
+                    || !GraphFile<T>::Fits(h.name_offsets, h.names + 1, sizeof (uint64_t), h.size)
+                    || h.strings > h.size) {
+                return false;
+            }
+
+            if (swap) {
+                if (buffer_m.empty()) {
+                    buffer_m.assign(data, data + size);
+                }
+                char* b = &buffer_m[0];
+                size_t nodes = static_cast<size_t> (h.nodes);
+                size_t names = static_cast<size_t> (h.names);
+                ad::SwapColumn(b + h.ops, nodes, sizeof (int32_t));
+                ad::SwapColumn(b + h.left, nodes, sizeof (int32_t));
+                ad::SwapColumn(b + h.right, nodes, sizeof (int32_t));
+                ad::SwapColumn(b + h.ids, nodes, sizeof (uint64_t));
+                ad::SwapColumn(b + h.values, nodes, sizeof (T));
+                ad::SwapColumn(b + h.name_ids, names, sizeof (uint64_t));
+                ad::SwapColumn(b + h.name_offsets, names + 1, sizeof (uint64_t));
+                data = b;
+            }
+
+            ops_m = reinterpret_cast<const int32_t*> (data + h.ops);
+            left_m = reinterpret_cast<const int32_t*> (data + h.left);
+            right_m = reinterpret_cast<const int32_t*> (data + h.right);
+            ids_m = reinterpret_cast<const uint64_t*> (data + h.ids);
+            values_m = reinterpret_cast<const T*> (data + h.values);
+            name_ids_m = reinterpret_cast<const uint64_t*> (data + h.name_ids);
+            name_offsets_m = reinterpret_cast<const uint64_t*> (data + h.name_offsets);
+            strings_m = data + h.strings;
+
+            //operands come before their node, so Build and the sweeps
+            //never index past it
+            for (uint64_t i = 0; i < h.nodes; i++) {
+                int32_t op = ops_m[i];
+                int64_t l = left_m[i];
+                int64_t r = right_m[i];
+                if (op < MINUS || op > NONE || l < -1 || r < -1
+                        || l >= static_cast<int64_t> (i) || r >= static_cast<int64_t> (i)) {
+                    return false;
+                }
+                int arity = GraphFile<T>::Arity(op);
+                if ((arity > 0 && l == -1) || (arity > 1 && r == -1)) {
+                    return false;
+                }
+            }
+
+            //names must lie in the string table
+            for (uint64_t k = 0; k < h.names; k++) {
+                if (name_offsets_m[k] > name_offsets_m[k + 1] || h.strings + name_offsets_m[k + 1] > h.size) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        /**
+         * Number of operands a node with op must have.
+         */
+        static int Arity(int32_t op) {
+            switch (op) {
+                case CONSTANT:
+                case VARIABLE:
+                case NONE:
+                    return 0;
+                case MINUS:
+                case PLUS:
+                case MULTIPLY:
+                case DIVIDE:
+                case ATAN2:
+                case ATAN3:
+                case ATAN4:
+                case POW:
+                case POW1:
+                case POW2:
+                    return 2;
+                default:
+                    return 1;
+            }
+        }
+
+        static bool Fits(uint64_t offset, uint64_t count, uint64_t width, uint64_t size) {
+            return offset <= size && count <= (size - offset) / width;
+        }
+
+        static uint64_t Align(uint64_t offset) {
+            return (offset + 63) & ~static_cast<uint64_t> (63);
+        }
+
+        template<class X>
+        static void Swap(std::vector<X> &column) {
+            if (!column.empty()) {
+                ad::SwapColumn(reinterpret_cast<char*> (&column[0]), column.size(), sizeof (X));
+            }
+        }
+
+        static void SwapHeader(GraphFileHeader &header) {
+            ad::SwapColumn(reinterpret_cast<char*> (&header.version), 2, sizeof (uint32_t));
+            ad::SwapColumn(reinterpret_cast<char*> (&header.nodes), 11, sizeof (uint64_t));
+        }
+
+        static uint64_t SwapBytes(uint64_t x) {
+            ad::SwapColumn(reinterpret_cast<char*> (&x), 1, sizeof (x));
+            return x;
+        }
+
+        /**
+         * Pads out to offset and writes bytes.
+         */
+        static void Put(std::ostream &out, uint64_t &position, uint64_t offset, const void *data, size_t bytes) {
+            static const char zeros[64] = {0};
+            out.write(zeros, static_cast<std::streamsize> (offset - position));
+            out.write(static_cast<const char*> (data), static_cast<std::streamsize> (bytes));
+            position = offset + bytes;
+        }
+
+        template<class X>
+        static void Put(std::ostream &out, uint64_t &position, uint64_t offset, const std::vector<X> &column) {
+            GraphFile<T>::Put(out, position, offset, column.empty() ? NULL : &column[0], column.size() * sizeof (X));
+        }
+
+        GraphFile(const GraphFile<T>& other);
+        GraphFile<T>& operator=(const GraphFile<T>& other);
+    };
+
+}
+
+#endif	/* GRAPHFILE_HPP */
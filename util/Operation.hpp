@@ -0,0 +1,53 @@
+/*
+ * File:   Operation.hpp
+ * Author: matthewsupernaw
+ *
+ * Created on October 17, 2026
+ *
+ * Op codes of expression nodes, shared by the expression graph and the
+ * recording context.
+ */
+
+#ifndef OPERATION_HPP
+#define	OPERATION_HPP
+
+namespace ad {
+
+    enum Operation {
+        MINUS = 0,
+        PLUS,
+        MULTIPLY,
+        DIVIDE,
+        SIN,
+        COS,
+        TAN,
+        ASIN,
+        ACOS,
+        ATAN,
+        ATAN2, //atan(adnumber,adnumber)
+        ATAN3, //atan(T,adnumber)
+        ATAN4, //atan(adnumber,T)
+        SQRT,
+        POW, //pow(adnumber,adnumber)
+        POW1, //pow(T,adnumber)
+        POW2, //pow(adnumber,T)
+        LOG,
+        LOG10,
+        EXP,
+        SINH,
+        COSH,
+        TANH,
+        ABS,
+        FABS,
+        FLOOR,
+        CONSTANT,
+        VARIABLE,
+        NONE,
+        FUSED, //n-ary tape entry, see Tape::PushFused
+        SEGMENT //output of a tape segment, see Tape::AddSegment
+    };
+
+}
+
+#endif	/* OPERATION_HPP */
+
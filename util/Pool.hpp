@@ -1,83 +1,337 @@
-/* 
+/*
  * File:   Pool.hpp
  * Author: matthewsupernaw
  *
  * Created on March 20, 2014, 11:54 AM
+ *
+ * Fixed-size object pool. Storage is carved from large slabs and threaded
+ * through intrusive free lists, so Allocate and Free are O(1) and never
+ * search for the slab a pointer came from. Each thread keeps its own cache
+ * of free slots; caches trade slots with a global, mutex protected depot in
+ * batches, so the lock is taken once per batch rather than once per object.
+ *
+ * The pool hands out raw storage; constructing and destroying objects is
+ * the caller's business (see Expression<T>::operator new).
  */
 
 #ifndef POOL_HPP
 #define	POOL_HPP
 
 #include <stdlib.h>
+#include <new>
 #include <vector>
-#include <iostream>
+#include <algorithm>
+#include <pthread.h>
 
 
 namespace ad {
 
+    /**
+     * Snapshot of a pool's counters.
+     */
+    struct PoolStatistics {
+        size_t live; //objects currently allocated, see Pool::Statistics
+        size_t high_water; //most objects live at once, as published, see Pool::Statistics
+        size_t slabs; //slabs allocated
+        size_t capacity; //slots in all slabs
+    };
+
     template<class T>
     class Pool {
-        std::vector<T> pool; //actual heap of objects
-        std::vector<T* > free_list; //available objects
-        long long index;
-        size_t size_m, next_size_m;
-        Pool<T >* next_m;
-
-        inline void* extend() {
-            if (next_m == NULL) {
-                //             std::cout<<"extending...               \r";
-                this->next_m = new Pool<T> ( this->next_size_m );
+
+        struct FreeSlot {
+            FreeSlot* next;
+        };
+
+        struct Batch {
+            FreeSlot* head;
+            size_t count;
+        };
+
+        struct Cache {
+            Pool<T>* owner;
+            FreeSlot* head;
+            size_t count;
+            unsigned long long allocated;
+            unsigned long long freed;
+            //copies of allocated and freed, written under the lock
+            unsigned long long published_allocated;
+            unsigned long long published_freed;
+        };
+
+        size_t slot_size_m;
+        size_t slab_objects_m;
+        size_t batch_size_m;
+
+        pthread_mutex_t mutex_m;
+        pthread_key_t key_m;
+
+        std::vector<char*> slabs_m;
+        std::vector<Batch> depot_m;
+        std::vector<Cache*> caches_m;
+        char* carve_m;
+        size_t carve_left_m;
+        size_t capacity_m;
+        //sums of the published counts of every cache, live or retired
+        unsigned long long published_allocated_m;
+        unsigned long long published_freed_m;
+        size_t high_water_m;
+
+        static void ReleaseCache(void* ptr) {
+            Cache* cache = static_cast<Cache*> (ptr);
+            cache->owner->Retire(cache);
+        }
+
+        inline Cache* GetCache() {
+            Cache* cache = static_cast<Cache*> (pthread_getspecific(key_m));
+            if (cache == NULL) {
+                cache = new Cache();
+                cache->owner = this;
+                cache->head = NULL;
+                cache->count = 0;
+                cache->allocated = 0;
+                cache->freed = 0;
+                cache->published_allocated = 0;
+                cache->published_freed = 0;
+                pthread_setspecific(key_m, cache);
+
+                pthread_mutex_lock(&mutex_m);
+                caches_m.push_back(cache);
+                pthread_mutex_unlock(&mutex_m);
+            }
+            return cache;
+        }
+
+        /**
+         * Hands a thread cache a batch from the depot, carving a new one
+         * from the current slab if the depot is empty.
+         */
+        void Refill(Cache* cache) {
+            pthread_mutex_lock(&mutex_m);
+            Batch batch;
+            if (!depot_m.empty()) {
+                batch = depot_m.back();
+                depot_m.pop_back();
+            } else {
+                batch = this->Carve();
             }
+            this->Publish(cache);
+            pthread_mutex_unlock(&mutex_m);
 
-            return next_m->malloc();
+            cache->head = batch.head;
+            cache->count = batch.count;
         }
 
-    public:
+        /**
+         * Moves one batch of a thread cache back to the depot.
+         */
+        void Flush(Cache* cache) {
+            Batch batch;
+            batch.head = cache->head;
+            batch.count = batch_size_m;
 
-        Pool(uint32_t size) : next_size_m(size), size_m(size),pool(size), free_list(size), index(size - 1), next_m(NULL) {
-//            std::cout<<__func__<<std::endl;
-//            pool = new T[size];
-            for (int i = 0; i < size; i++) {
-                free_list[i] = (&pool[i]);
+            FreeSlot* last = cache->head;
+            for (size_t i = 1; i < batch_size_m; i++) {
+                last = last->next;
             }
+            cache->head = last->next;
+            cache->count -= batch_size_m;
+            last->next = NULL;
+
+            pthread_mutex_lock(&mutex_m);
+            depot_m.push_back(batch);
+            this->Publish(cache);
+            pthread_mutex_unlock(&mutex_m);
         }
 
-        ~Pool() {
-            //        free_list.clear();
+        /**
+         * Adds what cache counted since its last trade to the pool's
+         * totals and raises the high water mark. Called with the lock held.
+         */
+        void Publish(Cache* cache) {
+            published_allocated_m += cache->allocated - cache->published_allocated;
+            published_freed_m += cache->freed - cache->published_freed;
+            cache->published_allocated = cache->allocated;
+            cache->published_freed = cache->freed;
+            this->RaiseHighWater(published_allocated_m, published_freed_m);
+        }
+
+        /**
+         * Called with the lock held.
+         */
+        inline void RaiseHighWater(unsigned long long allocated, unsigned long long freed) {
+            //frees on one thread of objects allocated on another can be
+            //published first
+            if (allocated > freed) {
+                high_water_m = std::max(high_water_m, static_cast<size_t> (allocated - freed));
+            }
+        }
 
-            if (next_m != NULL) {
-                delete next_m;
+        /**
+         * Called with the lock held.
+         */
+        Batch Carve() {
+            if (carve_left_m == 0) {
+                char* slab = static_cast<char*> (::malloc(slot_size_m * slab_objects_m));
+                if (slab == NULL) {
+                    pthread_mutex_unlock(&mutex_m);
+                    throw std::bad_alloc();
+                }
+                slabs_m.push_back(slab);
+                carve_m = slab;
+                carve_left_m = slab_objects_m;
+                capacity_m += slab_objects_m;
+            }
+
+            Batch batch;
+            batch.count = std::min(batch_size_m, carve_left_m);
+            batch.head = reinterpret_cast<FreeSlot*> (carve_m);
+
+            FreeSlot* slot = batch.head;
+            for (size_t i = 1; i < batch.count; i++) {
+                FreeSlot* next = reinterpret_cast<FreeSlot*> (carve_m + i * slot_size_m);
+                slot->next = next;
+                slot = next;
             }
-//            delete[] pool;
+            slot->next = NULL;
+
+            carve_m += batch.count * slot_size_m;
+            carve_left_m -= batch.count;
+            return batch;
         }
-        
-        void SetResize(uint32_t resize){
-            this->next_size_m = resize;
+
+        /**
+         * Returns an exiting thread's cache to the depot.
+         */
+        void Retire(Cache* cache) {
+            pthread_mutex_lock(&mutex_m);
+            if (cache->head != NULL) {
+                Batch batch;
+                batch.head = cache->head;
+                batch.count = cache->count;
+                depot_m.push_back(batch);
+            }
+            this->Publish(cache);
+            caches_m.erase(std::remove(caches_m.begin(), caches_m.end(), cache), caches_m.end());
+            pthread_mutex_unlock(&mutex_m);
+            delete cache;
         }
-        
-        
-        inline void* malloc() {
-            if (index <= 0) {
 
-                return this->extend();
+        Pool(const Pool<T>& other);
+        Pool<T>& operator=(const Pool<T>& other);
+
+    public:
+
+        /**
+         * @param slab_objects objects per slab
+         * @param batch_size objects moved between a thread cache and the
+         * depot at a time
+         */
+        Pool(size_t slab_objects = 4096, size_t batch_size = 64) :
+        slot_size_m(((std::max(sizeof (T), sizeof (FreeSlot)) + 15) / 16) * 16),
+        slab_objects_m(std::max<size_t>(slab_objects, 1)),
+        batch_size_m(std::max<size_t>(batch_size, 1)),
+        carve_m(NULL),
+        carve_left_m(0),
+        capacity_m(0),
+        published_allocated_m(0),
+        published_freed_m(0),
+        high_water_m(0) {
+            pthread_mutex_init(&mutex_m, NULL);
+            pthread_key_create(&key_m, &Pool<T>::ReleaseCache);
+        }
+
+        /**
+         * Frees all slabs. Objects still allocated from this pool become
+         * invalid.
+         */
+        ~Pool() {
+            pthread_key_delete(key_m);
+            for (size_t i = 0; i < caches_m.size(); i++) {
+                delete caches_m[i];
             }
-            return free_list[index--];
+            for (size_t i = 0; i < slabs_m.size(); i++) {
+                ::free(slabs_m[i]);
+            }
+            pthread_mutex_destroy(&mutex_m);
         }
 
-        inline void free(void* ptr) {
+        /**
+         * Returns the process wide pool for T. It is never destroyed, so
+         * objects may be freed during static destruction.
+         */
+        static Pool<T>& Instance() {
+            static Pool<T>* instance = new Pool<T > ();
+            return *instance;
+        }
 
-            if (ptr < &pool[0] || ptr > &pool[size_m - 1]) {
-                if(next_m != NULL){
-                    next_m->free(ptr);
-                }else{
-                    std::cout<<"pointer not freed...\n";
-                }
-             
-            } else {
-                if(ptr)
-                free_list[++index] = (T*) ptr;
+        /**
+         * Sets the number of objects in slabs allocated from now on.
+         *
+         * @param slab_objects
+         */
+        void SetResize(size_t slab_objects) {
+            pthread_mutex_lock(&mutex_m);
+            slab_objects_m = std::max<size_t>(slab_objects, 1);
+            pthread_mutex_unlock(&mutex_m);
+        }
+
+        inline void* Allocate() {
+            Cache* cache = this->GetCache();
+            if (cache->head == NULL) {
+                this->Refill(cache);
             }
+            FreeSlot* slot = cache->head;
+            cache->head = slot->next;
+            cache->count--;
+            cache->allocated++;
+            return slot;
+        }
+
+        /**
+         * Returns ptr to the calling thread's cache. ptr may have been
+         * allocated on any thread.
+         *
+         * @param ptr
+         */
+        inline void Free(void* ptr) {
+            if (ptr == NULL) {
+                return;
+            }
+            Cache* cache = this->GetCache();
+            FreeSlot* slot = static_cast<FreeSlot*> (ptr);
+            slot->next = cache->head;
+            cache->head = slot;
+            cache->count++;
+            cache->freed++;
+            if (cache->count >= 2 * batch_size_m) {
+                this->Flush(cache);
+            }
+        }
 
+        /**
+         * Returns a snapshot of the pool's counters, read under the depot
+         * lock. Other threads publish their counts when they trade with the
+         * depot, so live is exact for the calling thread and, for each other
+         * thread, as of its last trade, within two batches of the truth.
+         */
+        const PoolStatistics Statistics() {
+            PoolStatistics stats;
+            Cache* own = static_cast<Cache*> (pthread_getspecific(key_m));
+            pthread_mutex_lock(&mutex_m);
+            unsigned long long allocated = published_allocated_m;
+            unsigned long long freed = published_freed_m;
+            if (own != NULL) {
+                allocated += own->allocated - own->published_allocated;
+                freed += own->freed - own->published_freed;
+            }
+            this->RaiseHighWater(allocated, freed);
+            stats.live = allocated > freed ? static_cast<size_t> (allocated - freed) : 0;
+            stats.high_water = high_water_m;
+            stats.slabs = slabs_m.size();
+            stats.capacity = capacity_m;
+            pthread_mutex_unlock(&mutex_m);
+            return stats;
         }
 
     };
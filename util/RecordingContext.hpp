@@ -0,0 +1,646 @@
+/*
+ * File:   RecordingContext.hpp
+ * Author: matthewsupernaw
+ *
+ * Created on October 17, 2026
+ *
+ * Per-thread recording state. A RecordingContext owns everything an
+ * ADNumber needs while it records: variable id allocation, the expression
+ * and tape recording switches, the recursion switch used when releasing
+ * expression graphs, the flat tape and the allocator for expression nodes.
+ * Outside an arena scope nodes come from the process wide ad::Pool.
+ *
+ * Between BeginArena and EndArena expression nodes come from an arena of
+ * large slabs instead of the heap. Arena nodes are never freed one by one;
+ * ResetArena discards all of them at once in O(1) and keeps the slabs for
+ * the next evaluation.
+ *
+ * Each recorded operation node is simplified as it is created: operations
+ * on constants are folded and identities such as x*1 and x+0 return the
+ * operand instead of a new node.
+ *
+ * With hash consing on, each new operation node is looked up by its op and
+ * operands (constants compare by value) and an equal node recorded earlier
+ * is reused instead, so repeated subexpressions such as exp(-M*t) are
+ * stored and differentiated once.
+ *
+ * Each thread gets its own default context on first use, so independent
+ * objective functions can be built and differentiated on several threads
+ * at once. A graph belongs to the thread that recorded it; to hand one to
+ * another thread, give that thread an ad::Clone of it.
+ */
+
+#ifndef RECORDINGCONTEXT_HPP
+#define	RECORDINGCONTEXT_HPP
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <new>
+#include <stdexcept>
+#include <vector>
+#include <pthread.h>
+
+#include "Pool.hpp"
+#include "Operation.hpp"
+
+namespace ad {
+
+    template<class T> class Tape;
+    template<class T> class Expression;
+
+    /**
+     * Process wide source of variable ids. Contexts reserve ids in blocks so
+     * the lock is taken once per block rather than once per variable, and
+     * ids stay unique across threads.
+     */
+    class IDAllocator {
+    public:
+
+        /**
+         * Reserves count consecutive ids and returns the first.
+         */
+        static unsigned long Reserve(unsigned long count) {
+            pthread_mutex_lock(&IDAllocator::Mutex());
+            unsigned long first = IDAllocator::Last() + 1;
+            IDAllocator::Last() += count;
+            pthread_mutex_unlock(&IDAllocator::Mutex());
+            return first;
+        }
+
+    private:
+
+        static unsigned long& Last() {
+            static unsigned long last = 0;
+            return last;
+        }
+
+        static pthread_mutex_t& Mutex() {
+            static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+            return mutex;
+        }
+    };
+
+    /**
+     * Hash consing counters of a RecordingContext.
+     */
+    struct HashConsStatistics {
+        unsigned long long lookups; //operation nodes looked up
+        unsigned long long hits; //lookups answered with an existing node
+        size_t size; //nodes in the table
+
+        /**
+         * Fraction of looked up nodes that were deduplicated.
+         */
+        double DedupRatio() const {
+            return lookups == 0 ? 0.0 : static_cast<double> (hits) / static_cast<double> (lookups);
+        }
+    };
+
+    template<class T>
+    class RecordingContext {
+        unsigned long next_id_m;
+        unsigned long last_id_m;
+        unsigned long id_block_size_m;
+        bool record_expression_m;
+        bool record_tape_m;
+        bool use_recursion_m;
+        bool simplify_m;
+        Tape<T>* tape_m;
+        bool arena_active_m;
+        std::vector<char*> slabs_m;
+        std::vector<char*> slab_blocks_m;
+        std::vector<size_t> slab_sizes_m;
+        size_t slab_size_m;
+        size_t slab_m;
+        size_t slab_offset_m;
+        size_t arena_holds_m;
+        bool hash_consing_m;
+        std::vector<Expression<T>*> cons_table_m;
+        size_t cons_size_m;
+        unsigned long long cons_lookups_m;
+        unsigned long long cons_hits_m;
+
+        static pthread_key_t active_key_m;
+        static pthread_key_t default_key_m;
+
+        static void CreateKeys() {
+            pthread_key_create(&RecordingContext<T>::active_key_m, NULL);
+            pthread_key_create(&RecordingContext<T>::default_key_m, &RecordingContext<T>::Destroy);
+        }
+
+        static void Destroy(void* context) {
+            pthread_setspecific(RecordingContext<T>::active_key_m, NULL);
+            delete static_cast<RecordingContext<T>*> (context);
+        }
+
+        static void InitializeKeys() {
+            static pthread_once_t once = PTHREAD_ONCE_INIT;
+            pthread_once(&once, &RecordingContext<T>::CreateKeys);
+        }
+
+    public:
+
+        RecordingContext(unsigned long id_block_size = 1024)
+        : next_id_m(1),
+        last_id_m(0),
+        id_block_size_m(id_block_size > 0 ? id_block_size : 1),
+        record_expression_m(true),
+        record_tape_m(false),
+        use_recursion_m(false),
+        simplify_m(true),
+        tape_m(NULL),
+        arena_active_m(false),
+        slab_size_m(1 << 20),
+        slab_m(0),
+        slab_offset_m(0),
+        arena_holds_m(0),
+        hash_consing_m(false),
+        cons_size_m(0),
+        cons_lookups_m(0),
+        cons_hits_m(0) {
+        }
+
+        ~RecordingContext() {
+            this->ClearHashCons();
+            delete tape_m;
+            for (size_t i = 0; i < slab_blocks_m.size(); i++) {
+                free(slab_blocks_m[i]);
+            }
+        }
+
+        /**
+         * Returns the context of the calling thread. Unless a context was
+         * bound with SetActive, this is the thread's default context, which
+         * is created on first use and destroyed when the thread exits.
+         * @return
+         */
+        static RecordingContext<T>* Active() {
+            RecordingContext<T>::InitializeKeys();
+
+            RecordingContext<T>* context = static_cast<RecordingContext<T>*> (pthread_getspecific(RecordingContext<T>::active_key_m));
+            if (context == NULL) {
+                context = RecordingContext<T>::Default();
+                pthread_setspecific(RecordingContext<T>::active_key_m, context);
+            }
+            return context;
+        }
+
+        /**
+         * Binds context to the calling thread. The caller keeps ownership.
+         * Passing NULL restores the thread's default context.
+         *
+         * @param context
+         */
+        static void SetActive(RecordingContext<T>* context) {
+            RecordingContext<T>::InitializeKeys();
+            pthread_setspecific(RecordingContext<T>::active_key_m,
+                    context != NULL ? context : RecordingContext<T>::Default());
+        }
+
+        /**
+         * Returns a new variable id.
+         */
+        inline unsigned long NextID() {
+            if (next_id_m > last_id_m) {
+                next_id_m = IDAllocator::Reserve(id_block_size_m);
+                last_id_m = next_id_m + id_block_size_m - 1;
+            }
+            return next_id_m++;
+        }
+
+        inline bool IsRecordingExpression() const {
+            return record_expression_m;
+        }
+
+        void SetRecordExpression(bool record) {
+            record_expression_m = record;
+        }
+
+        inline bool IsRecordingTape() const {
+            return record_tape_m;
+        }
+
+        void SetRecordTape(bool record) {
+            record_tape_m = record;
+        }
+
+        inline bool IsUsingRecursion() const {
+            return use_recursion_m;
+        }
+
+        void SetUseRecursion(bool use_recursion) {
+            use_recursion_m = use_recursion;
+        }
+
+        inline bool IsSimplifying() const {
+            return simplify_m;
+        }
+
+        /**
+         * Switches record time simplification (constant folding and the
+         * identities of ad::SimplifyNode). Default is true.
+         *
+         * @param simplify
+         */
+        void SetSimplifying(bool simplify) {
+            simplify_m = simplify;
+        }
+
+        /**
+         * Returns this context's tape, creating it on first use.
+         */
+        Tape<T>* GetTape() {
+            if (tape_m == NULL) {
+                tape_m = new Tape<T > ();
+            }
+            return tape_m;
+        }
+
+        /**
+         * Makes tape this context's tape and returns the previous one, which
+         * may be NULL. The context deletes the tape it holds when destroyed,
+         * so swap the previous one back before then.
+         *
+         * @param tape
+         * @return
+         */
+        Tape<T>* SwapTape(Tape<T>* tape) {
+            Tape<T>* previous = tape_m;
+            tape_m = tape;
+            return previous;
+        }
+
+        /**
+         * Starts allocating expression nodes from the arena. Nodes recorded
+         * until EndArena do not hold references on their operands and are
+         * only reclaimed by ResetArena, so anything they point to that was
+         * recorded before BeginArena (e.g. parameters) must outlive the
+         * reset.
+         */
+        void BeginArena() {
+            arena_active_m = true;
+        }
+
+        /**
+         * Stops allocating from the arena. Nodes already in the arena stay
+         * valid until ResetArena.
+         */
+        void EndArena() {
+            arena_active_m = false;
+        }
+
+        inline bool IsArenaActive() const {
+            return arena_active_m;
+        }
+
+        /**
+         * Discards every node allocated from the arena. Every reference
+         * taken on an arena node from outside the arena (an ADNumber, a
+         * node recorded after EndArena) must be released first, as it would
+         * point into memory the next evaluation reuses; otherwise this
+         * throws std::logic_error and keeps the arena.
+         */
+        void ResetArena() {
+            //the table may point into the arena
+            this->ClearHashCons();
+            if (arena_holds_m != 0) {
+                throw std::logic_error("RecordingContext::ResetArena: arena nodes are still referenced.");
+            }
+            slab_m = 0;
+            slab_offset_m = 0;
+        }
+
+        /**
+         * Counts a reference taken on an arena node, see ResetArena.
+         */
+        inline void HoldArena() {
+            arena_holds_m++;
+        }
+
+        inline void ReleaseArena() {
+            assert(arena_holds_m > 0);
+            arena_holds_m--;
+        }
+
+        /**
+         * Returns the number of references held on arena nodes.
+         */
+        size_t ArenaHolds() const {
+            return arena_holds_m;
+        }
+
+        /**
+         * Sets the size in bytes of slabs allocated from now on.
+         */
+        void SetArenaSlabSize(size_t size) {
+            slab_size_m = size;
+        }
+
+        /**
+         * Returns the number of bytes handed out by the arena since the last
+         * reset.
+         */
+        size_t ArenaBytesUsed() const {
+            size_t used = slab_offset_m;
+            for (size_t i = 0; i < slab_m && i < slab_sizes_m.size(); i++) {
+                used += slab_sizes_m[i];
+            }
+            return used;
+        }
+
+        size_t ArenaSlabCount() const {
+            return slabs_m.size();
+        }
+
+        /**
+         * Allocates storage for one expression node. Inside an arena scope
+         * the node is carved from the current slab, otherwise it comes from
+         * the node pool and is returned there by Expression's operator
+         * delete.
+         *
+         * @param size
+         * @return
+         */
+        inline void* AllocateNode(size_t size) {
+            if (arena_active_m) {
+                return AllocateFromArena(size);
+            }
+            return Pool<Expression<T> >::Instance().Allocate();
+        }
+
+        inline bool IsHashConsing() const {
+            return hash_consing_m;
+        }
+
+        /**
+         * Turns hash consing on or off. Turning it off empties the table.
+         *
+         * @param hash_consing
+         */
+        void SetHashConsing(bool hash_consing) {
+            hash_consing_m = hash_consing;
+            if (!hash_consing) {
+                this->ClearHashCons();
+            }
+        }
+
+        /**
+         * Records node in the table, first replacing each interior operand
+         * with the equal node stored earlier, so equal subexpressions reached
+         * through different numbers become one node in the graphs built on
+         * them. node itself stays the root of the number it was recorded
+         * for, and a node already in the table is never modified, so setting
+         * the value of one number never changes another. The table holds a
+         * reference on every node it stores until ClearHashCons, so a
+         * recorded graph stays alive while hash consing is on; clear the
+         * table once per evaluation.
+         *
+         * @param node
+         * @return node
+         */
+        Expression<T>* Intern(Expression<T>* node) {
+            int op = node->GetOp();
+            if (op == CONSTANT || op == VARIABLE || op == NONE) {
+                return node;
+            }
+
+            Expression<T>* left = this->Find(node->GetLeft());
+            if (left != NULL && left != node->GetLeft()) {
+                node->SetLeft(left);
+            }
+            Expression<T>* right = this->Find(node->GetRight());
+            if (right != NULL && right != node->GetRight()) {
+                node->SetRight(right);
+            }
+
+            cons_lookups_m++;
+            if (cons_size_m * 2 >= cons_table_m.size()) {
+                this->GrowHashCons();
+            }
+
+            size_t mask = cons_table_m.size() - 1;
+            size_t i = RecordingContext<T>::Hash(node) & mask;
+            while (cons_table_m[i] != NULL) {
+                Expression<T>* existing = cons_table_m[i];
+                if (existing == node || RecordingContext<T>::Equal(existing, node)) {
+                    if (existing != node) {
+                        cons_hits_m++;
+                    }
+                    return node;
+                }
+                i = (i + 1) & mask;
+            }
+
+            node->take();
+            cons_table_m[i] = node;
+            cons_size_m++;
+            return node;
+        }
+
+        /**
+         * Drops the table and its references. Nodes still used by the
+         * recorded graph are unaffected.
+         */
+        void ClearHashCons() {
+            for (size_t i = 0; i < cons_table_m.size(); i++) {
+                if (cons_table_m[i] != NULL) {
+                    cons_table_m[i]->release();
+                    cons_table_m[i] = NULL;
+                }
+            }
+            cons_size_m = 0;
+        }
+
+        const HashConsStatistics GetHashConsStatistics() const {
+            HashConsStatistics stats;
+            stats.lookups = cons_lookups_m;
+            stats.hits = cons_hits_m;
+            stats.size = cons_size_m;
+            return stats;
+        }
+
+        void ResetHashConsStatistics() {
+            cons_lookups_m = 0;
+            cons_hits_m = 0;
+        }
+
+    private:
+
+        /**
+         * Operands are identified by address, constants by value, so
+         * separately allocated equal constants match.
+         */
+        static size_t OperandHash(const Expression<T>* operand) {
+            if (operand == NULL) {
+                return 0;
+            }
+            if (operand->GetOp() == CONSTANT) {
+                //equal values with different bytes (0.0 and -0.0) only miss
+                T value = operand->GetValue();
+                unsigned char bytes[sizeof (T)];
+                memcpy(bytes, &value, sizeof (T));
+                size_t h = 14695981039346656037ULL;
+                for (size_t i = 0; i < sizeof (T); i++) {
+                    h = (h ^ bytes[i]) * 1099511628211ULL;
+                }
+                return h;
+            }
+            size_t h = reinterpret_cast<size_t> (operand);
+            return (h >> 4) * 0x9E3779B97F4A7C15ULL;
+        }
+
+        static bool SameOperand(const Expression<T>* a, const Expression<T>* b) {
+            if (a == b) {
+                return true;
+            }
+            return a != NULL && b != NULL && a->GetOp() == CONSTANT
+                    && b->GetOp() == CONSTANT && a->GetValue() == b->GetValue();
+        }
+
+        static bool IsCommutative(int op) {
+            return op == PLUS || op == MULTIPLY;
+        }
+
+        static size_t Hash(const Expression<T>* node) {
+            size_t l = RecordingContext<T>::OperandHash(node->GetLeft());
+            size_t r = RecordingContext<T>::OperandHash(node->GetRight());
+            size_t h = static_cast<size_t> (node->GetOp()) * 0x9E3779B97F4A7C15ULL;
+            if (RecordingContext<T>::IsCommutative(node->GetOp())) {
+                return h ^ (l + r);
+            }
+            return h ^ (l + (r << 1) + (r >> 1));
+        }
+
+        static bool Equal(const Expression<T>* a, const Expression<T>* b) {
+            if (a->GetOp() != b->GetOp()) {
+                return false;
+            }
+            if (SameOperand(a->GetLeft(), b->GetLeft()) && SameOperand(a->GetRight(), b->GetRight())) {
+                return true;
+            }
+            return RecordingContext<T>::IsCommutative(a->GetOp())
+                    && SameOperand(a->GetLeft(), b->GetRight())
+                    && SameOperand(a->GetRight(), b->GetLeft());
+        }
+
+        /**
+         * The table's node equal to node, with the same value, or NULL.
+         * Leaves are never stored.
+         */
+        Expression<T>* Find(Expression<T>* node) const {
+            if (node == NULL || cons_table_m.empty()) {
+                return NULL;
+            }
+            int op = node->GetOp();
+            if (op == CONSTANT || op == VARIABLE || op == NONE) {
+                return NULL;
+            }
+
+            size_t mask = cons_table_m.size() - 1;
+            size_t i = RecordingContext<T>::Hash(node) & mask;
+            while (cons_table_m[i] != NULL) {
+                Expression<T>* existing = cons_table_m[i];
+                if (existing == node) {
+                    return node;
+                }
+                //a different value means an operand changed since, and
+                //the stored node is stale
+                if (RecordingContext<T>::Equal(existing, node) && existing->GetValue() == node->GetValue()) {
+                    return existing;
+                }
+                i = (i + 1) & mask;
+            }
+            return NULL;
+        }
+
+        void GrowHashCons() {
+            std::vector<Expression<T>*> old(cons_table_m.empty() ? 1024 : cons_table_m.size() * 2, NULL);
+            old.swap(cons_table_m);
+            size_t mask = cons_table_m.size() - 1;
+            for (size_t i = 0; i < old.size(); i++) {
+                if (old[i] != NULL) {
+                    size_t j = RecordingContext<T>::Hash(old[i]) & mask;
+                    while (cons_table_m[j] != NULL) {
+                        j = (j + 1) & mask;
+                    }
+                    cons_table_m[j] = old[i];
+                }
+            }
+        }
+
+        /**
+         * Alignment of Expression<T>: the padding a struct adds in front of
+         * it after a single char.
+         */
+        static size_t NodeAlignment() {
+
+            struct Probe {
+                char c;
+                Expression<T> node;
+            };
+            return sizeof (Probe) - sizeof (Expression<T>);
+        }
+
+        inline void* AllocateFromArena(size_t size) {
+            //slabs start aligned, so aligned sizes keep every node aligned
+            size_t mask = RecordingContext<T>::NodeAlignment() - 1;
+            size = (size + mask) & ~mask;
+            if (slab_m < slabs_m.size() && slab_offset_m + size <= slab_sizes_m[slab_m]) {
+                void* ptr = slabs_m[slab_m] + slab_offset_m;
+                slab_offset_m += size;
+                return ptr;
+            }
+            return NextSlab(size);
+        }
+
+        void* NextSlab(size_t size) {
+            if (slab_m < slabs_m.size()) {
+                slab_m++;
+            }
+
+            while (slab_m < slabs_m.size() && slab_sizes_m[slab_m] < size) {
+                slab_m++;
+            }
+
+            if (slab_m == slabs_m.size()) {
+                size_t bytes = slab_size_m < size ? size : slab_size_m;
+                size_t mask = RecordingContext<T>::NodeAlignment() - 1;
+                char* block = static_cast<char*> (malloc(bytes + mask));
+                if (block == NULL) {
+                    throw std::bad_alloc();
+                }
+                uintptr_t start = (reinterpret_cast<uintptr_t> (block) + mask) & ~static_cast<uintptr_t> (mask);
+                slab_blocks_m.push_back(block);
+                slabs_m.push_back(reinterpret_cast<char*> (start));
+                slab_sizes_m.push_back(bytes);
+            }
+
+            slab_offset_m = size;
+            return slabs_m[slab_m];
+        }
+
+        static RecordingContext<T>* Default() {
+            RecordingContext<T>* context = static_cast<RecordingContext<T>*> (pthread_getspecific(RecordingContext<T>::default_key_m));
+            if (context == NULL) {
+                context = new RecordingContext<T > ();
+                pthread_setspecific(RecordingContext<T>::default_key_m, context);
+            }
+            return context;
+        }
+
+        RecordingContext(const RecordingContext<T>& other);
+        RecordingContext<T>& operator=(const RecordingContext<T>& other);
+    };
+
+    template<class T>
+    pthread_key_t RecordingContext<T>::active_key_m;
+
+    template<class T>
+    pthread_key_t RecordingContext<T>::default_key_m;
+
+}
+
+#endif	/* RECORDINGCONTEXT_HPP */
+
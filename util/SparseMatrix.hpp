@@ -0,0 +1,196 @@
+/*
+ * File:   SparseMatrix.hpp
+ * Author: matthewsupernaw
+ *
+ * Created on October 17, 2026
+ *
+ * Compressed sparse row storage for derivative matrices and the star
+ * coloring used to recover a sparse symmetric matrix (a Hessian) from a
+ * few products with the matrix.
+ *
+ * A star coloring colors the adjacency graph of the off-diagonal pattern
+ * so that adjacent columns differ and every path on four vertices uses at
+ * least three colors. Multiplying the matrix by the indicator vector of
+ * each color then determines every entry directly, with no substitution:
+ * see Gebremedhin, Manne and Pothen, "What color is your Jacobian? Graph
+ * coloring for computing derivatives", SIAM Review 47 (2005).
+ */
+
+#ifndef SPARSEMATRIX_HPP
+#define	SPARSEMATRIX_HPP
+
+#include <vector>
+#include <valarray>
+#include <algorithm>
+
+namespace ad {
+
+    /**
+     * Row i holds columns[row_offsets[i]..row_offsets[i + 1]), sorted, with
+     * the matching values.
+     */
+    template<class T>
+    struct CSRMatrix {
+        size_t rows;
+        size_t cols;
+        std::vector<int> row_offsets;
+        std::vector<int> columns;
+        std::vector<T> values;
+
+        CSRMatrix() : rows(0), cols(0), row_offsets(1, 0) {
+        }
+
+        size_t NonZeros() const {
+            return columns.size();
+        }
+
+        /**
+         * Entry (i, j), zero if it is not stored.
+         */
+        const T Get(size_t i, size_t j) const {
+            std::vector<int>::const_iterator b = columns.begin() + row_offsets[i];
+            std::vector<int>::const_iterator e = columns.begin() + row_offsets[i + 1];
+            std::vector<int>::const_iterator it = std::lower_bound(b, e, static_cast<int> (j));
+            if (it != e && *it == static_cast<int> (j)) {
+                return values[it - columns.begin()];
+            }
+            return T(0);
+        }
+
+        /**
+         * Sets the shape from per row column lists, which are sorted and
+         * made unique. Values are zeroed.
+         */
+        void SetPattern(size_t cols, std::vector<std::vector<int> > &pattern) {
+            this->rows = pattern.size();
+            this->cols = cols;
+            row_offsets.assign(rows + 1, 0);
+            columns.clear();
+            for (size_t i = 0; i < rows; i++) {
+                std::vector<int> &row = pattern[i];
+                std::sort(row.begin(), row.end());
+                row.erase(std::unique(row.begin(), row.end()), row.end());
+                columns.insert(columns.end(), row.begin(), row.end());
+                row_offsets[i + 1] = static_cast<int> (columns.size());
+            }
+            values.assign(columns.size(), T(0));
+        }
+
+        /**
+         * Expands to a dense matrix.
+         */
+        void ToDense(std::valarray<std::valarray<T> > &dense) const {
+            dense.resize(rows);
+            for (size_t i = 0; i < rows; i++) {
+                dense[i].resize(cols, T(0));
+                dense[i] = T(0);
+                for (int k = row_offsets[i]; k < row_offsets[i + 1]; k++) {
+                    dense[i][columns[k]] = values[k];
+                }
+            }
+        }
+    };
+
+    /**
+     * Greedy star coloring of the graph whose adjacency lists are the rows
+     * of a symmetric pattern; diagonal entries are ignored.
+     *
+     * @param pattern symmetric, rows sorted
+     * @param colors receives a color in [0, count) per vertex
+     * @return count, the number of colors
+     */
+    template<class T>
+    int StarColoring(const CSRMatrix<T> &pattern, std::vector<int> &colors) {
+        size_t n = pattern.rows;
+        const std::vector<int> &offsets = pattern.row_offsets;
+        const std::vector<int> &adj = pattern.columns;
+
+        colors.assign(n, -1);
+        std::vector<int> forbidden(n + 1, -1);
+        int count = 0;
+
+        for (size_t v = 0; v < n; v++) {
+            int vi = static_cast<int> (v);
+            for (int a = offsets[v]; a < offsets[v + 1]; a++) {
+                int w = adj[a];
+                if (w == vi) {
+                    continue;
+                }
+                if (colors[w] > -1) {
+                    forbidden[colors[w]] = vi;
+                }
+                for (int b = offsets[w]; b < offsets[w + 1]; b++) {
+                    int x = adj[b];
+                    if (x == vi || x == w || colors[x] < 0) {
+                        continue;
+                    }
+                    if (colors[w] < 0) {
+                        //v and x would both be adjacent to w: distance two
+                        forbidden[colors[x]] = vi;
+                    } else {
+                        //x-w already two colored through another neighbor
+                        //of x: v may not repeat x's color
+                        for (int c = offsets[x]; c < offsets[x + 1]; c++) {
+                            int y = adj[c];
+                            if (y != w && y != x && colors[y] == colors[w]) {
+                                forbidden[colors[x]] = vi;
+                                break;
+                            }
+                        }
+                    }
+                }
+            }
+
+            int color = 0;
+            while (forbidden[color] == vi) {
+                color++;
+            }
+            colors[v] = color;
+            count = std::max(count, color + 1);
+        }
+        return count;
+    }
+
+    /**
+     * Fills the values of a symmetric matrix with the pattern of h from its
+     * products with the color indicator vectors: products[c] = H * s_c,
+     * where s_c is one on the vertices of color c.
+     *
+     * @param h pattern in, values out
+     * @param colors a star coloring of the pattern
+     * @param products one vector per color
+     */
+    template<class T>
+    void RecoverStarColored(CSRMatrix<T> &h, const std::vector<int> &colors,
+            const std::vector<std::valarray<T> > &products) {
+        size_t n = h.rows;
+        int count = static_cast<int> (products.size());
+        std::vector<int> seen(static_cast<size_t> (count) * n, 0);
+
+        //number of neighbors of each vertex per color
+        for (size_t i = 0; i < n; i++) {
+            for (int k = h.row_offsets[i]; k < h.row_offsets[i + 1]; k++) {
+                int j = h.columns[k];
+                if (j != static_cast<int> (i)) {
+                    seen[i * count + colors[j]]++;
+                }
+            }
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            for (int k = h.row_offsets[i]; k < h.row_offsets[i + 1]; k++) {
+                int j = h.columns[k];
+                if (j == static_cast<int> (i) || seen[i * count + colors[j]] == 1) {
+                    //the only column of its color in row i
+                    h.values[k] = products[colors[j]][i];
+                } else {
+                    //star property: i is the only neighbor of j with i's color
+                    h.values[k] = products[colors[i]][j];
+                }
+            }
+        }
+    }
+
+}
+
+#endif	/* SPARSEMATRIX_HPP */
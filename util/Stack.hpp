@@ -1,106 +1,293 @@
-/* 
+/*
  * File:   Stack.hpp
  * Author: matthewsupernaw
  *
  * Created on March 21, 2014, 9:52 AM
+ *
+ * A stack with a small inline buffer. Short traversals never allocate;
+ * deeper ones grow geometrically into a heap buffer, which is handed back
+ * to a per-thread cache when the stack is destroyed so the next traversal
+ * on that thread can reuse it. Elements are copy constructed and destroyed
+ * in place, so T need not be POD.
  */
 
 #ifndef STACK_HPP
 #define	STACK_HPP
 #include <stdlib.h>
+#include <new>
+#include <pthread.h>
+//MPI runtimes use allocator extensions (malloc_usable_size and the like)
+//that clfmalloc does not provide, so they keep the system allocator
+#ifndef ADNUMBER_MPI_SUPPORT
 #include "clfmalloc.h"
+#endif
 
 namespace ad{
-    
-    
-    
-    
-        template <class T>
+
+    /**
+     * Keeps the largest spare stack buffer of the calling thread. Buffers
+     * are raw memory; they hold no live elements while cached.
+     */
+    template <class T>
+    class StackBufferCache {
+
+        struct Buffer {
+            void* data;
+            int capacity;
+        };
+
+        static pthread_key_t key_m;
+
+        static void CreateKey() {
+            pthread_key_create(&StackBufferCache<T>::key_m, &StackBufferCache<T>::Destroy);
+        }
+
+        static void Destroy(void* ptr) {
+            Buffer* buffer = static_cast<Buffer*> (ptr);
+            ::operator delete(buffer->data);
+            delete buffer;
+        }
+
+        static Buffer* Get() {
+            static pthread_once_t once = PTHREAD_ONCE_INIT;
+            pthread_once(&once, &StackBufferCache<T>::CreateKey);
+
+            Buffer* buffer = static_cast<Buffer*> (pthread_getspecific(StackBufferCache<T>::key_m));
+            if (buffer == NULL) {
+                buffer = new Buffer();
+                buffer->data = NULL;
+                buffer->capacity = 0;
+                pthread_setspecific(StackBufferCache<T>::key_m, buffer);
+            }
+            return buffer;
+        }
+
+    public:
+
+        /**
+         * Takes the cached buffer if it holds at least min_capacity elements.
+         *
+         * @return the buffer, or NULL
+         */
+        static T* Acquire(int min_capacity, int &capacity) {
+            Buffer* buffer = StackBufferCache<T>::Get();
+            if (buffer->data == NULL || buffer->capacity < min_capacity) {
+                return NULL;
+            }
+            T* data = static_cast<T*> (buffer->data);
+            capacity = buffer->capacity;
+            buffer->data = NULL;
+            buffer->capacity = 0;
+            return data;
+        }
+
+        /**
+         * Caches data if it is larger than the buffer already cached,
+         * otherwise frees it.
+         */
+        static void Offer(T* data, int capacity) {
+            Buffer* buffer = StackBufferCache<T>::Get();
+            if (capacity > buffer->capacity) {
+                ::operator delete(buffer->data);
+                buffer->data = data;
+                buffer->capacity = capacity;
+            } else {
+                ::operator delete(data);
+            }
+        }
+    };
+
+    template <class T>
+    pthread_key_t StackBufferCache<T>::key_m;
+
+        template <class T, int N = 32>
         class Stack {
         public:
             T* st;
             int allocationSize;
             int lastIndex;
-    
+
+        private:
+
+            union InlineBuffer {
+                char bytes[N * sizeof (T)];
+                long double align_ld;
+                long long align_ll;
+                void* align_p;
+            };
+
+            InlineBuffer inline_m;
+
+            inline T* inlineData() {
+                return reinterpret_cast<T*> (inline_m.bytes);
+            }
+
+            void grow(int minimum);
+            void destroyAll();
+
         public:
-            Stack(int stackSize = 1000000);
- 
+            Stack(int stackSize = N);
+
+            Stack(const Stack<T, N> &other);
+
+            Stack<T, N>& operator=(const Stack<T, N> &other);
+
             ~Stack();
-    
+
             inline void resize(int newSize);
             inline void push(const T &x);
             inline void pop();
-            inline T& getAndRemove();
+            inline T getAndRemove();
             inline T& top();
             inline void clear();
-    
+
             inline const int empty() {
                 return this->lastIndex == -1;
             }
+
+            inline const int size() const {
+                return this->lastIndex + 1;
+            }
         };
-    
-        //template <class T>
-        //FastStack<T>::FastStack() {
-        //    lastIndex = -1;
-        //    st = NULL;
-        //}
-    
-        template <class T>
-        Stack<T>::Stack(int stackSize) {
-            st = NULL;
-            this->allocationSize = stackSize;
-            st = (T*) malloc(sizeof (T) * stackSize);
+
+        template <class T, int N>
+        Stack<T, N>::Stack(int stackSize) {
+            st = inlineData();
+            allocationSize = N;
             lastIndex = -1;
+            if (stackSize > N) {
+                grow(stackSize);
+            }
         }
-    
-        template <class T>
-        Stack<T>::~Stack() {
-            free(st);
-        }
-    
-        template <class T>
-        void Stack<T>::clear() {
+
+        template <class T, int N>
+        Stack<T, N>::Stack(const Stack<T, N> &other) {
+            st = inlineData();
+            allocationSize = N;
             lastIndex = -1;
+            *this = other;
+        }
+
+        template <class T, int N>
+        Stack<T, N>& Stack<T, N>::operator=(const Stack<T, N> &other) {
+            if (this != &other) {
+                clear();
+                if (other.lastIndex + 1 > allocationSize) {
+                    grow(other.lastIndex + 1);
+                }
+                for (int i = 0; i <= other.lastIndex; i++) {
+                    push(other.st[i]);
+                }
+            }
+            return *this;
+        }
+
+        template <class T, int N>
+        Stack<T, N>::~Stack() {
+            destroyAll();
+            if (st != inlineData()) {
+                StackBufferCache<T>::Offer(st, allocationSize);
+            }
+        }
+
+        template <class T, int N>
+        void Stack<T, N>::destroyAll() {
+            for (; lastIndex >= 0; --lastIndex) {
+                st[lastIndex].~T();
+            }
+        }
+
+        /**
+         * Moves the elements to a buffer of at least minimum elements,
+         * doubling the capacity. On an exception the stack is unchanged.
+         */
+        template <class T, int N>
+        void Stack<T, N>::grow(int minimum) {
+            int capacity = allocationSize;
+            while (capacity < minimum) {
+                capacity += capacity;
+            }
+
+            int acquired = 0;
+            T* data = StackBufferCache<T>::Acquire(capacity, acquired);
+            if (data != NULL) {
+                capacity = acquired;
+            } else {
+                data = static_cast<T*> (::operator new(sizeof (T) * capacity));
+            }
+
+            int i = 0;
+            try {
+                for (; i <= lastIndex; i++) {
+                    new (data + i) T(st[i]);
+                }
+            } catch (...) {
+                while (--i >= 0) {
+                    data[i].~T();
+                }
+                ::operator delete(data);
+                throw;
+            }
+
+            int count = lastIndex;
+            destroyAll();
+            lastIndex = count;
+
+            if (st != inlineData()) {
+                StackBufferCache<T>::Offer(st, allocationSize);
+            }
+            st = data;
+            allocationSize = capacity;
         }
-    
-        template <class T>
-        T& Stack<T>::top() {
-    
+
+        template <class T, int N>
+        void Stack<T, N>::clear() {
+            destroyAll();
+        }
+
+        template <class T, int N>
+        T& Stack<T, N>::top() {
+
             return st[lastIndex];
         }
-    
-        template <class T>
-        T& Stack<T>::getAndRemove() {
-            return st[lastIndex--];
-        }
-    
-        template <class T>
-        void Stack<T>::pop() {
-            --lastIndex;
-        }
-    
-        template <class T>
-        void Stack<T>::push(const T &x) {
-            if (++lastIndex == (this->allocationSize)) {
-    
-                this->allocationSize += this->allocationSize;
-                st = (T *) realloc(st, this->allocationSize * sizeof (T));
-                //        free(st);
-                //        this->st = temp;
-            }
-    
-            st[lastIndex] = x;
-        }
-    
-        template <class T>
-        void Stack<T>::resize(int newSize) {
-            if (st != NULL)
-                delete [] st;
-            st = new T[newSize];
-        }
-    
-    
-    
+
+        template <class T, int N>
+        T Stack<T, N>::getAndRemove() {
+            T x(st[lastIndex]);
+            st[lastIndex--].~T();
+            return x;
+        }
+
+        template <class T, int N>
+        void Stack<T, N>::pop() {
+            st[lastIndex--].~T();
+        }
+
+        template <class T, int N>
+        void Stack<T, N>::push(const T &x) {
+            if (lastIndex + 1 == this->allocationSize) {
+                //x may live in this stack
+                T copy(x);
+                grow(this->allocationSize + 1);
+                new (st + lastIndex + 1) T(copy);
+            } else {
+                new (st + lastIndex + 1) T(x);
+            }
+            ++lastIndex;
+        }
+
+        /**
+         * Ensures room for newSize elements. Existing elements are kept.
+         */
+        template <class T, int N>
+        void Stack<T, N>::resize(int newSize) {
+            if (newSize > allocationSize) {
+                grow(newSize);
+            }
+        }
+
+
+
 }
 
 
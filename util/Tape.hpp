@@ -0,0 +1,404 @@
+/*
+ * File:   Tape.hpp
+ * Author: matthewsupernaw
+ *
+ * Created on October 17, 2026
+ *
+ * A flat, linear recording of operations (Wengert list). Each operation
+ * appends one fixed-size TapeEntry holding its op code, the tape indices of
+ * its operands and the local partial derivatives with respect to those
+ * operands. Entries are stored contiguously in recording order, so operands
+ * always precede their results and the adjoint sweep is a single backward
+ * pass through memory.
+ *
+ * A statement recorded through the expression templates (see
+ * ExpressionTemplate.hpp) is one FUSED entry whose operands and partials
+ * are kept in side arrays, however many operations the statement has.
+ *
+ * A TapeSegment is a region recorded by its inputs and outputs only, whose
+ * adjoint the segment computes itself during the backward pass; see
+ * ad::Checkpoint.
+ *
+ * With a memory budget (SetMemoryBudget) the records past it are spilled to
+ * a scratch file and streamed back during the backward pass, so a tape can
+ * outgrow memory; see TapeStorage.hpp. The adjoints, one value per entry,
+ * stay in memory.
+ */
+
+#ifndef TAPE_HPP
+#define	TAPE_HPP
+
+#include <vector>
+#include <valarray>
+#include <map>
+#include <algorithm>
+#include "RecordingContext.hpp"
+#include "TapeStorage.hpp"
+
+namespace ad {
+
+    /**
+     * One recorded operation. Operand indices are -1 when the operand is a
+     * constant or not present. For a FUSED entry left is the offset of its
+     * operands in the side arrays and right their count. For a SEGMENT
+     * entry left is the segment and right the output's position in it.
+     */
+    template<class T>
+    struct TapeEntry {
+        int op;
+        int left;
+        int right;
+        unsigned long id;
+        T value;
+        T partial_left;
+        T partial_right;
+    };
+
+    /**
+     * A recorded region that differentiates itself. Its outputs are
+     * consecutive SEGMENT entries on the tape.
+     */
+    template<class T>
+    class TapeSegment {
+    public:
+
+        virtual ~TapeSegment() {
+        }
+
+        /**
+         * Given the adjoints of the outputs, adds the adjoints of the
+         * inputs to input_adjoints, which has one element per input.
+         *
+         * @param output_adjoints
+         * @param input_adjoints
+         */
+        virtual void Reverse(const std::vector<T> &output_adjoints, std::vector<T> &input_adjoints) = 0;
+    };
+
+    template<class T>
+    class Tape {
+        TapeBudget budget_m;
+        TapeStorage<TapeEntry<T> > entries_m;
+        TapeStorage<int> operands_m;
+        TapeStorage<T> partials_m;
+        std::vector<T> adjoints_m;
+        unsigned long generation_m;
+
+        struct Segment {
+            TapeSegment<T>* segment;
+            std::vector<int> inputs;
+            int outputs;
+        };
+        std::vector<Segment> segments_m;
+
+    public:
+
+        /**
+         * Generations come from the process wide id source, so a value's
+         * generation matches only the tape it was recorded on, also when a
+         * context switches tapes (see RecordingContext::SwapTape).
+         */
+        Tape(size_t reserve = 4096) :
+        entries_m(&budget_m, reserve),
+        operands_m(&budget_m),
+        partials_m(&budget_m),
+        generation_m(IDAllocator::Reserve(1)) {
+        }
+
+        ~Tape() {
+            this->ClearSegments();
+        }
+
+        /**
+         * Returns the tape of the calling thread's recording context.
+         * @return
+         */
+        static Tape<T>* Active() {
+            return RecordingContext<T>::Active()->GetTape();
+        }
+
+        /**
+         * Appends an entry and returns its index.
+         */
+        inline int Push(int op, unsigned long id, const T &value,
+                int left, int right,
+                const T &partial_left, const T &partial_right) {
+            TapeEntry<T> e;
+            e.op = op;
+            e.left = left;
+            e.right = right;
+            e.id = id;
+            e.value = value;
+            e.partial_left = partial_left;
+            e.partial_right = partial_right;
+            return static_cast<int> (entries_m.Push(e));
+        }
+
+        /**
+         * Appends a FUSED entry, the result of a whole statement, with the
+         * tape indices of its operands and the partials of the result with
+         * respect to them. Repeated operands are allowed.
+         *
+         * @param value
+         * @param operands
+         * @param partials
+         * @param count
+         * @return index of the entry
+         */
+        inline int PushFused(const T &value, const int *operands,
+                const T *partials, int count) {
+            int offset = static_cast<int> (operands_m.Size());
+            operands_m.Append(operands, count);
+            partials_m.Append(partials, count);
+            return Push(FUSED, 0, value, offset, count, T(0), T(0));
+        }
+
+        /**
+         * Registers segment, which the tape then owns, with the tape indices
+         * of its inputs (-1 for a constant). Its outputs must be pushed next,
+         * in order, as SEGMENT entries with left the returned index and
+         * right the output's position.
+         *
+         * @param segment
+         * @param inputs
+         * @param outputs number of outputs
+         * @return index of the segment
+         */
+        int AddSegment(TapeSegment<T>* segment, const std::vector<int> &inputs, int outputs) {
+            Segment s;
+            s.segment = segment;
+            s.inputs = inputs;
+            s.outputs = outputs;
+            segments_m.push_back(s);
+            return static_cast<int> (segments_m.size() - 1);
+        }
+
+        /**
+         * Discards all entries. Indices handed out before the call become
+         * stale, which is detected by comparing generations.
+         */
+        void Clear() {
+            entries_m.Clear();
+            operands_m.Clear();
+            partials_m.Clear();
+            this->ClearSegments();
+            generation_m = IDAllocator::Reserve(1);
+        }
+
+        const unsigned long Generation() const {
+            return generation_m;
+        }
+
+        const size_t Size() const {
+            return entries_m.Size();
+        }
+
+        void Reserve(size_t size) {
+            entries_m.Reserve(size);
+        }
+
+        /**
+         * Keeps the recorded entries within about bytes of memory, spilling
+         * the older ones to an unlinked scratch file in directory ($TMPDIR
+         * or /tmp when empty). 0, the default, keeps everything in memory.
+         * Applies to entries recorded from then on. The adjoints of a
+         * backward pass, one T per entry swept, are not counted; the sweep
+         * reads them at random and they stay in memory. Failing to create,
+         * write or map the scratch file throws std::runtime_error.
+         *
+         * @param bytes
+         * @param directory
+         */
+        void SetMemoryBudget(size_t bytes, const std::string &directory = "") {
+            budget_m.limit = bytes;
+            budget_m.directory = directory;
+        }
+
+        const size_t MemoryBudget() const {
+            return budget_m.limit;
+        }
+
+        /**
+         * Bytes of records held in memory.
+         */
+        const size_t ResidentBytes() const {
+            return budget_m.resident;
+        }
+
+        /**
+         * Bytes of records on file.
+         */
+        const size_t SpilledBytes() const {
+            return entries_m.Spilled() * TapeStorage<TapeEntry<T> >::BlockSize * sizeof (TapeEntry<T>)
+                    +operands_m.Spilled() * TapeStorage<int>::BlockSize * sizeof (int)
+                    +partials_m.Spilled() * TapeStorage<T>::BlockSize * sizeof (T);
+        }
+
+        const TapeEntry<T>& operator[](size_t i) const {
+            return entries_m[i];
+        }
+
+        /**
+         * Computes the gradient of the entry at root with respect to the
+         * variables in ids with one backward pass over the tape.
+         *
+         * @param root
+         * @param ids
+         * @param gradient
+         */
+        void Gradient(int root, const std::vector<unsigned long> &ids, std::valarray<T> &gradient) {
+            if (gradient.size() != ids.size()) {
+                gradient.resize(ids.size());
+            }
+            gradient = T(0);
+
+            if (root < 0 || static_cast<size_t> (root) >= entries_m.Size()) {
+                return;
+            }
+
+            std::map<unsigned long, size_t> positions;
+            for (size_t i = 0; i < ids.size(); i++) {
+                positions.insert(std::pair<unsigned long, size_t>(ids[i], i));
+            }
+
+            adjoints_m.assign(root + 1, T(0));
+            adjoints_m[root] = T(1);
+            this->Sweep(root, &positions, gradient);
+        }
+
+        /**
+         * One backward pass seeded with weights[k] at entry seeds[k]
+         * (repeated seeds add up). Afterwards Adjoint(i) is the derivative
+         * of the weighted sum with respect to entry i.
+         *
+         * @param seeds
+         * @param weights
+         */
+        void Reverse(const std::vector<int> &seeds, const std::vector<T> &weights) {
+            int last = -1;
+            for (size_t k = 0; k < seeds.size(); k++) {
+                last = std::max(last, seeds[k]);
+            }
+            adjoints_m.assign(last + 1, T(0));
+            for (size_t k = 0; k < seeds.size(); k++) {
+                if (seeds[k] > -1) {
+                    adjoints_m[seeds[k]] += weights[k];
+                }
+            }
+
+            std::valarray<T> unused;
+            this->Sweep(last, NULL, unused);
+        }
+
+        /**
+         * Adjoint of entry i from the last Reverse, zero past its seeds.
+         */
+        const T Adjoint(size_t i) const {
+            return i < adjoints_m.size() ? adjoints_m[i] : T(0);
+        }
+
+    private:
+
+        /**
+         * Backward pass from entry last over adjoints_m. With positions,
+         * the adjoints of VARIABLE entries are also summed into gradient.
+         */
+        void Sweep(int last, const std::map<unsigned long, size_t>* positions, std::valarray<T> &gradient) {
+            if (last < 0) {
+                return;
+            }
+
+            T* adjoints = &adjoints_m.front();
+            std::vector<T> outputs;
+            std::vector<T> inputs;
+
+            //block by block, so a spilled block is mapped once
+            for (int i = last; i >= 0;) {
+                size_t b = static_cast<size_t> (i) >> TapeStorage<TapeEntry<T> >::Shift;
+                int first = static_cast<int> (b << TapeStorage<TapeEntry<T> >::Shift);
+                const TapeEntry<T>* block = entries_m.Block(b);
+
+                for (; i >= first; i--) {
+                    const TapeEntry<T> &e = block[i - first];
+                    if (e.op == SEGMENT) {
+                        //outputs follow their first one, so theirs are complete
+                        if (e.right == 0) {
+                            this->ReverseSegment(segments_m[e.left], i, last, outputs, inputs);
+                        }
+                        continue;
+                    }
+
+                    T a = adjoints[i];
+                    if (a == T(0)) {
+                        continue;
+                    }
+
+                    if (e.op == VARIABLE) {
+                        if (positions != NULL) {
+                            typename std::map<unsigned long, size_t>::const_iterator it = positions->find(e.id);
+                            if (it != positions->end()) {
+                                gradient[it->second] += a;
+                            }
+                        }
+                        continue;
+                    }
+
+                    if (e.op == FUSED) {
+                        for (int k = e.left; k < e.left + e.right; k++) {
+                            adjoints[operands_m[k]] += a * partials_m[k];
+                        }
+                        continue;
+                    }
+
+                    if (e.left > -1) {
+                        adjoints[e.left] += a * e.partial_left;
+                    }
+
+                    if (e.right > -1) {
+                        adjoints[e.right] += a * e.partial_right;
+                    }
+                }
+            }
+        }
+
+        /**
+         * Propagates the adjoints of the outputs of s, the first at entry
+         * first, to its inputs. Outputs past last are not seeded.
+         */
+        void ReverseSegment(const Segment &s, int first, int last,
+                std::vector<T> &outputs, std::vector<T> &inputs) {
+            bool seeded = false;
+            outputs.assign(s.outputs, T(0));
+            for (int k = 0; k < s.outputs && first + k <= last; k++) {
+                outputs[k] = adjoints_m[first + k];
+                seeded = seeded || outputs[k] != T(0);
+            }
+            if (!seeded) {
+                return;
+            }
+
+            inputs.assign(s.inputs.size(), T(0));
+            s.segment->Reverse(outputs, inputs);
+            for (size_t k = 0; k < s.inputs.size(); k++) {
+                if (s.inputs[k] > -1) {
+                    adjoints_m[s.inputs[k]] += inputs[k];
+                }
+            }
+        }
+
+        void ClearSegments() {
+            for (size_t i = 0; i < segments_m.size(); i++) {
+                delete segments_m[i].segment;
+            }
+            segments_m.clear();
+        }
+
+        Tape(const Tape<T>& other);
+        Tape<T>& operator=(const Tape<T>& other);
+
+    };
+
+}
+
+#endif	/* TAPE_HPP */
+
@@ -0,0 +1,348 @@
+/*
+ * File:   TapeStorage.hpp
+ * Author: matthewsupernaw
+ *
+ * Created on October 17, 2026
+ *
+ * Append only block storage for tape records that can spill to disk. Records
+ * live in blocks of 2^16; only the first block grows from a small size, so
+ * short tapes stay small. Appending never moves a record.
+ *
+ * Storages that share a TapeBudget keep their blocks in memory until the
+ * budget is reached. Past it, each new block pushes the oldest full blocks
+ * out to an unlinked scratch file, written in order with one sequential
+ * write per block. Reading a spilled block maps it back in as a whole, asks
+ * the kernel to read it ahead (the backward pass then walks it from memory)
+ * and hints that the block before it comes next, so the file is streamed
+ * back in reverse while the sweep works on the current block.
+ *
+ * Records are copied bytewise, to and from the file.
+ */
+
+#ifndef TAPESTORAGE_HPP
+#define	TAPESTORAGE_HPP
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <new>
+#include <stdexcept>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace ad {
+
+    /**
+     * Memory limit shared by the storages of one tape. limit is 0 for no
+     * limit.
+     */
+    struct TapeBudget {
+        size_t limit;
+        size_t resident;
+        std::string directory;
+
+        TapeBudget() : limit(0), resident(0) {
+        }
+    };
+
+    template<class X>
+    class TapeStorage {
+    public:
+        static const size_t Shift = 16;
+        static const size_t BlockSize = static_cast<size_t> (1) << Shift;
+        static const size_t Mask = BlockSize - 1;
+
+    private:
+        std::vector<X*> blocks_m; //NULL once spilled
+        X* current_m;
+        size_t count_m; //records in the current block
+        size_t capacity_m; //capacity of the current block
+        size_t size_m;
+        size_t spilled_m; //blocks [0, spilled_m) are on file
+        TapeBudget* budget_m;
+        int file_m;
+        mutable X* mapped_m;
+        mutable size_t mapped_block_m;
+
+    public:
+
+        TapeStorage(TapeBudget* budget, size_t reserve = 0) :
+        current_m(NULL),
+        count_m(0),
+        capacity_m(0),
+        size_m(0),
+        spilled_m(0),
+        budget_m(budget),
+        file_m(-1),
+        mapped_m(NULL),
+        mapped_block_m(0) {
+            if (reserve > 0) {
+                this->Reserve(reserve);
+            }
+        }
+
+        ~TapeStorage() {
+            this->Unmap();
+            for (size_t b = 0; b < blocks_m.size(); b++) {
+                this->Release(b);
+            }
+            if (file_m != -1) {
+                ::close(file_m);
+            }
+        }
+
+        /**
+         * Appends x and returns its index.
+         */
+        inline size_t Push(const X &x) {
+            if (count_m == capacity_m) {
+                this->Grow();
+            }
+            current_m[count_m++] = x;
+            return size_m++;
+        }
+
+        /**
+         * Appends count records.
+         */
+        void Append(const X *x, size_t count) {
+            for (size_t k = 0; k < count; k++) {
+                this->Push(x[k]);
+            }
+        }
+
+        const size_t Size() const {
+            return size_m;
+        }
+
+        const size_t Blocks() const {
+            return blocks_m.size();
+        }
+
+        /**
+         * Number of blocks currently on file.
+         */
+        const size_t Spilled() const {
+            return spilled_m;
+        }
+
+        /**
+         * Record i. A spilled block is mapped in as needed, one at a time.
+         */
+        inline const X& operator[](size_t i) const {
+            const X* block = blocks_m[i >> Shift];
+            if (block == NULL) {
+                block = this->Map(i >> Shift);
+            }
+            return block[i & Mask];
+        }
+
+        /**
+         * The records of block b, valid until another spilled block is
+         * read. Reading a spilled block hints that block b - 1 follows.
+         */
+        const X* Block(size_t b) const {
+            const X* block = blocks_m[b];
+            return block != NULL ? block : this->Map(b);
+        }
+
+        /**
+         * Grows the first block to hold size records, up to a full block.
+         */
+        void Reserve(size_t size) {
+            if (blocks_m.size() <= 1 && size > capacity_m) {
+                this->Resize(std::min(size, BlockSize));
+            }
+        }
+
+        /**
+         * Discards all records, keeping the first block in memory.
+         */
+        void Clear() {
+            this->Unmap();
+            for (size_t b = 1; b < blocks_m.size(); b++) {
+                this->Release(b);
+            }
+            if (blocks_m.size() > 1) {
+                blocks_m.resize(1);
+                current_m = blocks_m[0];
+                if (current_m == NULL) {
+                    //the first block was spilled, start over
+                    blocks_m.clear();
+                    capacity_m = 0;
+                } else {
+                    capacity_m = BlockSize;
+                }
+            }
+            if (file_m != -1 && spilled_m > 0) {
+                if (::ftruncate(file_m, 0) != 0) {
+                    ::close(file_m);
+                    file_m = -1;
+                }
+            }
+            spilled_m = 0;
+            count_m = 0;
+            size_m = 0;
+        }
+
+    private:
+
+        void Grow() {
+            if (blocks_m.empty() || capacity_m < BlockSize) {
+                this->Resize(capacity_m == 0 ? 64 : std::min(2 * capacity_m, BlockSize));
+                return;
+            }
+
+            current_m = static_cast<X*> (std::malloc(BlockSize * sizeof (X)));
+            if (current_m == NULL) {
+                throw std::bad_alloc();
+            }
+            blocks_m.push_back(current_m);
+            budget_m->resident += BlockSize * sizeof (X);
+            count_m = 0;
+            capacity_m = BlockSize;
+
+            //the current block stays
+            while (budget_m->limit != 0 && budget_m->resident > budget_m->limit
+                    && spilled_m + 1 < blocks_m.size()) {
+                this->Spill();
+            }
+        }
+
+        /**
+         * Reallocates the first (and only) block.
+         */
+        void Resize(size_t capacity) {
+            X* block = static_cast<X*> (std::realloc(current_m, capacity * sizeof (X)));
+            if (block == NULL) {
+                throw std::bad_alloc();
+            }
+            budget_m->resident += (capacity - capacity_m) * sizeof (X);
+            if (blocks_m.empty()) {
+                blocks_m.push_back(block);
+            } else {
+                blocks_m[0] = block;
+            }
+            current_m = block;
+            capacity_m = capacity;
+        }
+
+        /**
+         * Writes the oldest block in memory to the scratch file and frees
+         * it. Blocks are full and page aligned in the file.
+         */
+        void Spill() {
+            if (file_m == -1) {
+                this->Open();
+            }
+
+            size_t bytes = BlockSize * sizeof (X);
+            const char* data = reinterpret_cast<const char*> (blocks_m[spilled_m]);
+            off_t offset = static_cast<off_t> (spilled_m) * static_cast<off_t> (bytes);
+            size_t written = 0;
+            while (written < bytes) {
+                ssize_t n = ::pwrite(file_m, data + written, bytes - written, offset + static_cast<off_t> (written));
+                if (n < 0) {
+                    TapeStorage<X>::Fail("cannot write the scratch file");
+                }
+                if (n == 0) {
+                    throw std::runtime_error("TapeStorage: cannot write the scratch file: no space written");
+                }
+                written += static_cast<size_t> (n);
+            }
+
+            this->Release(spilled_m);
+            spilled_m++;
+        }
+
+        /**
+         * Creates the scratch file. It is unlinked at once, so it goes away
+         * with the process.
+         */
+        void Open() {
+            std::string path = budget_m->directory;
+            if (path.empty()) {
+                const char* tmp = std::getenv("TMPDIR");
+                path = tmp != NULL ? tmp : "/tmp";
+            }
+            path += "/adnumber_tape_XXXXXX";
+
+            std::vector<char> name(path.begin(), path.end());
+            name.push_back('\0');
+            file_m = ::mkstemp(&name[0]);
+            if (file_m == -1) {
+                TapeStorage<X>::Fail("cannot create a scratch file");
+            }
+            ::unlink(&name[0]);
+        }
+
+        void Release(size_t b) {
+            if (blocks_m[b] != NULL) {
+                budget_m->resident -= (b + 1 == blocks_m.size() ? capacity_m : BlockSize) * sizeof (X);
+                std::free(blocks_m[b]);
+                blocks_m[b] = NULL;
+            }
+        }
+
+        /**
+         * Maps spilled block b in place of the one mapped before.
+         */
+        const X* Map(size_t b) const {
+            if (mapped_m != NULL && mapped_block_m == b) {
+                return mapped_m;
+            }
+            this->Unmap();
+
+            size_t bytes = BlockSize * sizeof (X);
+            off_t offset = static_cast<off_t> (b) * static_cast<off_t> (bytes);
+            void* data = ::mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, file_m, offset);
+            if (data == MAP_FAILED) {
+                TapeStorage<X>::Fail("cannot map a spilled block");
+            }
+            //all of it is needed now, and the block before it next
+            ::madvise(data, bytes, MADV_WILLNEED);
+#ifdef POSIX_FADV_WILLNEED
+            if (b > 0) {
+                ::posix_fadvise(file_m, offset - static_cast<off_t> (bytes), static_cast<off_t> (bytes), POSIX_FADV_WILLNEED);
+            }
+#endif
+            mapped_m = static_cast<X*> (data);
+            mapped_block_m = b;
+            return mapped_m;
+        }
+
+        /**
+         * Throws std::runtime_error for a failed file operation, with the
+         * reason errno gives.
+         */
+        static void Fail(const char* what) {
+            throw std::runtime_error(std::string("TapeStorage: ") + what + ": " + std::strerror(errno));
+        }
+
+        void Unmap() const {
+            if (mapped_m != NULL) {
+                ::munmap(mapped_m, BlockSize * sizeof (X));
+                mapped_m = NULL;
+            }
+        }
+
+        TapeStorage(const TapeStorage<X>& other);
+        TapeStorage<X>& operator=(const TapeStorage<X>& other);
+    };
+
+    template<class X>
+    const size_t TapeStorage<X>::Shift;
+
+    template<class X>
+    const size_t TapeStorage<X>::BlockSize;
+
+    template<class X>
+    const size_t TapeStorage<X>::Mask;
+
+}
+
+#endif	/* TAPESTORAGE_HPP */
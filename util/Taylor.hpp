@@ -0,0 +1,1007 @@
+/*
+ * File:   Taylor.hpp
+ * Author: matthewsupernaw
+ *
+ * Created on October 17, 2026
+ *
+ * Univariate Taylor propagation over a compiled expression graph. The
+ * leaves are set to the polynomials x(t) = x + t * direction and one forward
+ * sweep carries the truncated Taylor series of every node, to degree d,
+ * through the graph. Coefficient k of the root is the k-th derivative of
+ * f(x + t * direction) at t = 0 divided by k!. Each operation costs
+ * O(d^2), so all derivatives up to order d along one direction cost
+ * O(d^2) graph sweeps' worth of arithmetic, with no derivative graphs.
+ * TaylorDerivative runs the same recurrences with coefficients recorded as
+ * expression nodes when the derivative itself is wanted as a graph.
+ *
+ * The recurrences are the standard ones for Taylor arithmetic; see
+ * Griewank and Walther, "Evaluating Derivatives", 2nd ed., chapter 13.
+ */
+
+#ifndef TAYLOR_HPP
+#define	TAYLOR_HPP
+
+#include <vector>
+#include <valarray>
+#include <cmath>
+#include <map>
+#include <algorithm>
+
+#include "CompiledExpression.hpp"
+
+namespace ad {
+
+    /**
+     * The value of a series coefficient, the coefficient itself for plain
+     * numbers.
+     */
+    template<class S>
+    static inline const S& SeriesValue(const S &s) {
+        return s;
+    }
+
+    /**
+     * Is the coefficient known to be zero.
+     */
+    template<class S>
+    static inline bool SeriesIsZero(const S &s) {
+        return s == S(0);
+    }
+
+    /**
+     * A Taylor coefficient recorded as an expression node, the coefficient
+     * type of the graph sweep in TaylorDerivative. It holds one reference
+     * on its node. The empty term is an exact zero, a coefficient the
+     * series never reaches: products and quotients with it are empty and
+     * sums with it are the other operand, so the graph only grows with the
+     * coefficients that are not identically zero. Where the other operand
+     * is infinite or NaN this gives 0 where the value sweep gives NaN.
+     */
+    template<class T>
+    class TaylorTerm {
+        Expression<T>* exp_m;
+    public:
+
+        TaylorTerm() : exp_m(NULL) {
+        }
+
+        TaylorTerm(const T &value) : exp_m(NULL) {
+            if (value != T(0)) {
+                exp_m = NEW_EXPRESSION(T)(value, 0, CONSTANT, NULL, NULL);
+                exp_m->take();
+            }
+        }
+
+        TaylorTerm(const TaylorTerm<T> &orig) : exp_m(orig.exp_m) {
+            if (exp_m != NULL) {
+                exp_m->take();
+            }
+        }
+
+        ~TaylorTerm() {
+            if (exp_m != NULL) {
+                exp_m->release();
+            }
+        }
+
+        TaylorTerm<T>& operator=(const TaylorTerm<T> &other) {
+            if (other.exp_m != NULL) {
+                other.exp_m->take();
+            }
+            if (exp_m != NULL) {
+                exp_m->release();
+            }
+            exp_m = other.exp_m;
+            return *this;
+        }
+
+        /**
+         * The term of an existing node, taking a reference on it.
+         */
+        static const TaylorTerm<T> Of(Expression<T>* exp) {
+            TaylorTerm<T> ret;
+            ret.exp_m = exp;
+            exp->take();
+            return ret;
+        }
+
+        inline bool IsEmpty() const {
+            return exp_m == NULL;
+        }
+
+        inline const T GetValue() const {
+            return exp_m != NULL ? exp_m->GetValue() : T(0);
+        }
+
+        inline const Expression<T>* GetExpression() const {
+            return exp_m;
+        }
+
+        /**
+         * The node with a reference for the caller; a constant 0 for the
+         * empty term.
+         */
+        Expression<T>* TakeNode() const {
+            Expression<T>* exp = exp_m != NULL ? exp_m : NEW_EXPRESSION(T)(T(0), 0, CONSTANT, NULL, NULL);
+            exp->take();
+            return exp;
+        }
+
+        /**
+         * Records op(left, right), canonicalized as a recorded node (see
+         * CanonicalizeNode). right is NULL for functions of one argument.
+         */
+        static const TaylorTerm<T> Apply(Operation op, const TaylorTerm<T> &left, const TaylorTerm<T>* right) {
+            Expression<T>* l = left.TakeNode();
+            Expression<T>* r = right != NULL ? right->TakeNode() : NULL;
+            T value = ad::ApplyOperation<T > (op, l->GetValue(), r != NULL ? r->GetValue() : T(0));
+            Expression<T>* exp = NEW_EXPRESSION(T)(value, 0, op, l, r);
+            exp->take();
+            l->release();
+            if (r != NULL) {
+                r->release();
+            }
+            TaylorTerm<T> ret;
+            ret.exp_m = ad::CanonicalizeNode<T > (exp);
+            return ret;
+        }
+
+        TaylorTerm<T>& operator+=(const TaylorTerm<T> &rhs) {
+            return *this = *this + rhs;
+        }
+
+        TaylorTerm<T>& operator-=(const TaylorTerm<T> &rhs) {
+            return *this = *this - rhs;
+        }
+
+        TaylorTerm<T>& operator*=(const TaylorTerm<T> &rhs) {
+            return *this = *this * rhs;
+        }
+
+        TaylorTerm<T>& operator/=(const TaylorTerm<T> &rhs) {
+            return *this = *this / rhs;
+        }
+    };
+
+    template<class T>
+    static inline const T SeriesValue(const TaylorTerm<T> &s) {
+        return s.GetValue();
+    }
+
+    /**
+     * Only a constant node is known to be zero for every value of the
+     * variables.
+     */
+    template<class T>
+    static inline bool SeriesIsZero(const TaylorTerm<T> &s) {
+        return s.IsEmpty() || (ad::IsConstant(s.GetExpression()) && s.GetValue() == T(0));
+    }
+
+    template<class T>
+    inline const TaylorTerm<T> operator+(const TaylorTerm<T> &lhs, const TaylorTerm<T> &rhs) {
+        if (lhs.IsEmpty()) {
+            return rhs;
+        }
+        if (rhs.IsEmpty()) {
+            return lhs;
+        }
+        return TaylorTerm<T>::Apply(PLUS, lhs, &rhs);
+    }
+
+    template<class T>
+    inline const TaylorTerm<T> operator-(const TaylorTerm<T> &lhs, const TaylorTerm<T> &rhs) {
+        if (rhs.IsEmpty()) {
+            return lhs;
+        }
+        return TaylorTerm<T>::Apply(MINUS, lhs, &rhs);
+    }
+
+    template<class T>
+    inline const TaylorTerm<T> operator-(const TaylorTerm<T> &val) {
+        if (val.IsEmpty()) {
+            return val;
+        }
+        return TaylorTerm<T>::Apply(MINUS, TaylorTerm<T > (), &val);
+    }
+
+    template<class T>
+    inline const TaylorTerm<T> operator*(const TaylorTerm<T> &lhs, const TaylorTerm<T> &rhs) {
+        if (lhs.IsEmpty() || rhs.IsEmpty()) {
+            return TaylorTerm<T > ();
+        }
+        return TaylorTerm<T>::Apply(MULTIPLY, lhs, &rhs);
+    }
+
+    template<class T>
+    inline const TaylorTerm<T> operator/(const TaylorTerm<T> &lhs, const TaylorTerm<T> &rhs) {
+        if (lhs.IsEmpty()) {
+            return lhs;
+        }
+        return TaylorTerm<T>::Apply(DIVIDE, lhs, &rhs);
+    }
+
+    //the series branch on coefficient values, as the value sweep does
+#define AD_TAYLOR_COMPARISON(SYMBOL) \
+    template<class T> \
+    inline bool operator SYMBOL(const TaylorTerm<T> &lhs, const TaylorTerm<T> &rhs) { \
+        return lhs.GetValue() SYMBOL rhs.GetValue(); \
+    }
+
+    AD_TAYLOR_COMPARISON(==)
+    AD_TAYLOR_COMPARISON(!=)
+    AD_TAYLOR_COMPARISON(<)
+    AD_TAYLOR_COMPARISON(>)
+
+#undef AD_TAYLOR_COMPARISON
+
+}
+
+namespace std {
+
+    //functions of a recorded coefficient record a node
+#define AD_TAYLOR_FUNCTION(NAME, OP) \
+    template<class T> \
+    inline const ad::TaylorTerm<T> NAME(const ad::TaylorTerm<T> &val) { \
+        return ad::TaylorTerm<T>::Apply(OP, val, NULL); \
+    }
+
+    AD_TAYLOR_FUNCTION(sin, ad::SIN)
+    AD_TAYLOR_FUNCTION(cos, ad::COS)
+    AD_TAYLOR_FUNCTION(tan, ad::TAN)
+    AD_TAYLOR_FUNCTION(asin, ad::ASIN)
+    AD_TAYLOR_FUNCTION(acos, ad::ACOS)
+    AD_TAYLOR_FUNCTION(atan, ad::ATAN)
+    AD_TAYLOR_FUNCTION(sqrt, ad::SQRT)
+    AD_TAYLOR_FUNCTION(log, ad::LOG)
+    AD_TAYLOR_FUNCTION(exp, ad::EXP)
+    AD_TAYLOR_FUNCTION(sinh, ad::SINH)
+    AD_TAYLOR_FUNCTION(cosh, ad::COSH)
+    AD_TAYLOR_FUNCTION(tanh, ad::TANH)
+    AD_TAYLOR_FUNCTION(floor, ad::FLOOR)
+
+#undef AD_TAYLOR_FUNCTION
+
+    template<class T>
+    inline const ad::TaylorTerm<T> atan2(const ad::TaylorTerm<T> &y, const ad::TaylorTerm<T> &x) {
+        return ad::TaylorTerm<T>::Apply(ad::ATAN2, y, &x);
+    }
+
+    template<class T>
+    inline const ad::TaylorTerm<T> pow(const ad::TaylorTerm<T> &x, const ad::TaylorTerm<T> &p) {
+        return ad::TaylorTerm<T>::Apply(ad::POW, x, &p);
+    }
+}
+
+namespace ad {
+
+    /**
+     * Truncated Taylor series arithmetic: the series of each operation, to
+     * degree d, from the series of its operands. S is the coefficient type,
+     * T for the value sweep of Taylor and TaylorTerm<T> for the graph sweep
+     * of TaylorDerivative.
+     */
+    template<class S>
+    class TaylorSeries {
+        //scratch series for operations that need intermediate series
+        std::vector<S> a_m;
+        std::vector<S> b_m;
+
+        /**
+         * v = u * w.
+         */
+        static void Multiply(const S* u, const S* w, S* v, int d) {
+            for (int k = d; k >= 0; k--) {
+                S sum = S(0);
+                for (int j = 0; j <= k; j++) {
+                    sum += u[j] * w[k - j];
+                }
+                v[k] = sum;
+            }
+        }
+
+        /**
+         * v = u / w.
+         */
+        static void Divide(const S* u, const S* w, S* v, int d) {
+            for (int k = 0; k <= d; k++) {
+                S sum = u[k];
+                for (int j = 0; j < k; j++) {
+                    sum -= v[j] * w[k - j];
+                }
+                v[k] = sum / w[0];
+            }
+        }
+
+        static void Exp(const S* u, S* v, int d) {
+            v[0] = std::exp(u[0]);
+            for (int k = 1; k <= d; k++) {
+                S sum = S(0);
+                for (int j = 1; j <= k; j++) {
+                    sum += S(j) * u[j] * v[k - j];
+                }
+                v[k] = sum / S(k);
+            }
+        }
+
+        static void Log(const S* u, S* v, int d) {
+            v[0] = std::log(u[0]);
+            for (int k = 1; k <= d; k++) {
+                S sum = S(0);
+                for (int j = 1; j < k; j++) {
+                    sum += S(j) * v[j] * u[k - j];
+                }
+                v[k] = (u[k] - sum / S(k)) / u[0];
+            }
+        }
+
+        static void Sqrt(const S* u, S* v, int d) {
+            v[0] = std::sqrt(u[0]);
+            for (int k = 1; k <= d; k++) {
+                S sum = S(0);
+                for (int j = 1; j < k; j++) {
+                    sum += v[j] * v[k - j];
+                }
+                v[k] = (u[k] - sum) / (S(2) * v[0]);
+            }
+        }
+
+        /**
+         * s = sin(u), c = cos(u), or sinh and cosh when hyperbolic.
+         */
+        static void SinCos(const S* u, S* s, S* c, int d, bool hyperbolic) {
+            s[0] = hyperbolic ? std::sinh(u[0]) : std::sin(u[0]);
+            c[0] = hyperbolic ? std::cosh(u[0]) : std::cos(u[0]);
+            for (int k = 1; k <= d; k++) {
+                S ss = S(0);
+                S cs = S(0);
+                for (int j = 1; j <= k; j++) {
+                    ss += S(j) * u[j] * c[k - j];
+                    cs += S(j) * u[j] * s[k - j];
+                }
+                s[k] = ss / S(k);
+                c[k] = (hyperbolic ? cs : -cs) / S(k);
+            }
+        }
+
+        /**
+         * v' = sign * u' / w, given v[0].
+         */
+        static void Quotient(const S* u, const S* w, S* v, int d, S sign) {
+            for (int k = 1; k <= d; k++) {
+                S sum = S(0);
+                for (int j = 1; j < k; j++) {
+                    sum += S(j) * v[j] * w[k - j];
+                }
+                v[k] = (sign * u[k] - sum / S(k)) / w[0];
+            }
+        }
+
+        /**
+         * v' = (1 + sign * v^2) * u', given v[0]: tan (sign 1) and tanh
+         * (sign -1). w receives 1 + sign * v^2.
+         */
+        static void SquareRatio(const S* u, S* v, S* w, int d, S sign) {
+            for (int k = 0; k <= d; k++) {
+                if (k > 0) {
+                    S sum = S(0);
+                    for (int j = 1; j <= k; j++) {
+                        sum += S(j) * u[j] * w[k - j];
+                    }
+                    v[k] = sum / S(k);
+                }
+                S square = S(0);
+                for (int j = 0; j <= k; j++) {
+                    square += v[j] * v[k - j];
+                }
+                w[k] = (k == 0 ? S(1) : S(0)) + sign * square;
+            }
+        }
+
+        /**
+         * v = u^r for a constant r.
+         */
+        static void PowConstant(const S* u, S r, S* v, S* scratch, int d) {
+            v[0] = std::pow(u[0], r);
+            if (u[0] != S(0)) {
+                //v' u = r v u'
+                for (int k = 1; k <= d; k++) {
+                    S sum = S(0);
+                    for (int j = 1; j <= k; j++) {
+                        sum += r * S(j) * u[j] * v[k - j];
+                        if (j < k) {
+                            sum -= S(k - j) * v[k - j] * u[j];
+                        }
+                    }
+                    v[k] = sum / (S(k) * u[0]);
+                }
+                return;
+            }
+
+            int n = static_cast<int> (SeriesValue(r));
+            if (S(n) == r && n >= 0) {
+                //integer power of a series through zero
+                for (int k = 0; k <= d; k++) {
+                    v[k] = k == 0 ? S(1) : S(0);
+                }
+                for (int i = 0; i < n; i++) {
+                    Multiply(v, u, scratch, d);
+                    for (int k = 0; k <= d; k++) {
+                        v[k] = scratch[k];
+                    }
+                }
+                return;
+            }
+
+            //not differentiable at zero; carry the infinities of u^(r - k)
+            for (int k = 1; k <= d; k++) {
+                v[k] = std::pow(u[0], r - S(k));
+            }
+        }
+
+    public:
+
+        /**
+         * Sizes the scratch series for series of the given degree.
+         */
+        void Reserve(unsigned int degree) {
+            a_m.resize(degree + 1);
+            b_m.resize(degree + 1);
+        }
+
+        /**
+         * Does Step compute the series of op.
+         */
+        static bool Covers(int op) {
+            switch (op) {
+                case PLUS:
+                case MINUS:
+                case MULTIPLY:
+                case DIVIDE:
+                case SIN:
+                case COS:
+                case SINH:
+                case COSH:
+                case TAN:
+                case TANH:
+                case ATAN:
+                case ASIN:
+                case ACOS:
+                case ATAN2:
+                case SQRT:
+                case POW:
+                case LOG:
+                case LOG10:
+                case EXP:
+                case FABS:
+                case ABS:
+                case FLOOR:
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
+        /**
+         * Series of one node from the series of its operands.
+         */
+        void Step(int op, const S* u, const S* w, S* v, int d) {
+            S* a = &a_m.front();
+            S* b = &b_m.front();
+
+            switch (op) {
+                case PLUS:
+                    for (int k = 0; k <= d; k++) {
+                        v[k] = u[k] + w[k];
+                    }
+                    break;
+                case MINUS:
+                    for (int k = 0; k <= d; k++) {
+                        v[k] = u[k] - w[k];
+                    }
+                    break;
+                case MULTIPLY:
+                    Multiply(u, w, v, d);
+                    break;
+                case DIVIDE:
+                    Divide(u, w, v, d);
+                    break;
+                case SIN:
+                    SinCos(u, v, a, d, false);
+                    break;
+                case COS:
+                    SinCos(u, a, v, d, false);
+                    break;
+                case SINH:
+                    SinCos(u, v, a, d, true);
+                    break;
+                case COSH:
+                    SinCos(u, a, v, d, true);
+                    break;
+                case TAN:
+                    v[0] = std::tan(u[0]);
+                    SquareRatio(u, v, a, d, S(1));
+                    break;
+                case TANH:
+                    v[0] = std::tanh(u[0]);
+                    SquareRatio(u, v, a, d, S(-1));
+                    break;
+                case ATAN:
+                    //w = 1 + u^2
+                    Multiply(u, u, a, d);
+                    a[0] += S(1);
+                    v[0] = std::atan(u[0]);
+                    Quotient(u, a, v, d, S(1));
+                    break;
+                case ASIN:
+                case ACOS:
+                    //w = sqrt(1 - u^2)
+                    Multiply(u, u, a, d);
+                    for (int k = 0; k <= d; k++) {
+                        a[k] = -a[k];
+                    }
+                    a[0] += S(1);
+                    Sqrt(a, b, d);
+                    v[0] = op == ASIN ? std::asin(u[0]) : std::acos(u[0]);
+                    Quotient(u, b, v, d, op == ASIN ? S(1) : S(-1));
+                    break;
+                case ATAN2:
+                    //v' (u^2 + w^2) = w u' - u w'
+                    Multiply(u, u, a, d);
+                    Multiply(w, w, b, d);
+                    for (int k = 0; k <= d; k++) {
+                        a[k] += b[k];
+                    }
+                    v[0] = std::atan2(u[0], w[0]);
+                    for (int k = 1; k <= d; k++) {
+                        S sum = S(0);
+                        for (int j = 1; j <= k; j++) {
+                            sum += S(j) * (w[k - j] * u[j] - u[k - j] * w[j]);
+                        }
+                        for (int j = 1; j < k; j++) {
+                            sum -= S(j) * v[j] * a[k - j];
+                        }
+                        v[k] = sum / (S(k) * a[0]);
+                    }
+                    break;
+                case SQRT:
+                    Sqrt(u, v, d);
+                    break;
+                case POW:
+                {
+                    bool constant = true;
+                    for (int k = 1; k <= d; k++) {
+                        if (!SeriesIsZero(w[k])) {
+                            constant = false;
+                            break;
+                        }
+                    }
+                    if (constant) {
+                        PowConstant(u, w[0], v, a, d);
+                    } else {
+                        //exp(w log(u))
+                        Log(u, a, d);
+                        Multiply(a, w, b, d);
+                        Exp(b, v, d);
+                    }
+                    break;
+                }
+                case LOG:
+                    Log(u, v, d);
+                    break;
+                case LOG10:
+                {
+                    Log(u, v, d);
+                    S ln10 = std::log(S(10));
+                    for (int k = 0; k <= d; k++) {
+                        v[k] /= ln10;
+                    }
+                    break;
+                }
+                case EXP:
+                    Exp(u, v, d);
+                    break;
+                case FABS:
+                case ABS:
+                {
+                    //the sign of the series is that of its first nonzero
+                    //coefficient
+                    S sign = S(0);
+                    for (int k = 0; k <= d && sign == S(0); k++) {
+                        sign = u[k] > S(0) ? S(1) : (u[k] < S(0) ? S(-1) : S(0));
+                    }
+                    for (int k = 0; k <= d; k++) {
+                        v[k] = sign * u[k];
+                    }
+                    break;
+                }
+                case FLOOR:
+                    v[0] = std::floor(u[0]);
+                    for (int k = 1; k <= d; k++) {
+                        v[k] = S(0);
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+    };
+
+    template<class T>
+    class Taylor {
+        unsigned int degree_m;
+        size_t directions_m;
+        //[node][direction][degree]
+        std::vector<T> coefficients_m;
+        int root_m;
+        TaylorSeries<T> series_m;
+
+    public:
+
+        Taylor() : degree_m(0), directions_m(0), root_m(-1) {
+        }
+
+        /**
+         * Propagates x(t) = x + t * directions[q] through graph to the given
+         * degree, for every direction q in the same sweep. Leaves recorded
+         * for ids[i] move along directions[q][i]; all other leaves are
+         * constant. The graph's current values are used.
+         *
+         * @param graph
+         * @param ids
+         * @param directions
+         * @param degree
+         */
+        void Propagate(const CompiledExpression<T> &graph, const std::vector<unsigned long> &ids,
+                const std::vector<std::valarray<T> > &directions, unsigned int degree) {
+            int d = static_cast<int> (degree);
+            size_t stride = degree + 1;
+            size_t count = directions.size();
+            size_t block = count * stride;
+            size_t size = graph.Size();
+            degree_m = degree;
+            directions_m = count;
+            root_m = graph.Root();
+            coefficients_m.assign(size * block, T(0));
+            series_m.Reserve(degree);
+            if (root_m < 0 || count == 0) {
+                return;
+            }
+
+            const std::vector<T> &values = graph.Values();
+            const std::vector<unsigned long> &node_ids = graph.Ids();
+            const std::vector<int> &variables = graph.Variables();
+            T* c = &coefficients_m.front();
+            for (size_t i = 0; i < size; i++) {
+                for (size_t q = 0; q < count; q++) {
+                    c[i * block + q * stride] = values[i];
+                }
+            }
+            for (size_t i = 0; i < variables.size() && d > 0; i++) {
+                int v = variables[i];
+                for (size_t p = 0; p < ids.size(); p++) {
+                    if (ids[p] == node_ids[v]) {
+                        for (size_t q = 0; q < count; q++) {
+                            c[v * block + q * stride + 1] = directions[q][p];
+                        }
+                        break;
+                    }
+                }
+            }
+
+            const std::vector<typename CompiledExpression<T>::Run> &runs = graph.Runs();
+            const std::vector<int> &left = graph.Left();
+            const std::vector<int> &right = graph.Right();
+            for (size_t r = 0; r < runs.size(); r++) {
+                int op = runs[r].op;
+                if (op == CONSTANT || op == VARIABLE || op == NONE) {
+                    continue;
+                }
+                for (int i = runs[r].begin; i < runs[r].end; i++) {
+                    const T* u = c + left[i] * block;
+                    const T* w = right[i] > -1 ? c + right[i] * block : u;
+                    T* v = c + i * block;
+                    for (size_t q = 0; q < block; q += stride) {
+                        series_m.Step(op, u + q, w + q, v + q, d);
+                    }
+                }
+            }
+        }
+
+        void Propagate(const CompiledExpression<T> &graph, const std::vector<unsigned long> &ids,
+                const std::valarray<T> &direction, unsigned int degree) {
+            std::vector<std::valarray<T> > directions(1, direction);
+            this->Propagate(graph, ids, directions, degree);
+        }
+
+        /**
+         * Propagates along the variable id alone.
+         */
+        void Propagate(const CompiledExpression<T> &graph, unsigned long id, unsigned int degree) {
+            std::vector<unsigned long> ids(1, id);
+            std::valarray<T> direction(T(1), 1);
+            this->Propagate(graph, ids, direction, degree);
+        }
+
+        const unsigned int Degree() const {
+            return degree_m;
+        }
+
+        const size_t Directions() const {
+            return directions_m;
+        }
+
+        /**
+         * Taylor coefficient k of the root along direction q.
+         */
+        const T Coefficient(unsigned int k, size_t q = 0) const {
+            if (root_m < 0 || k > degree_m || q >= directions_m) {
+                return T(0);
+            }
+            size_t stride = degree_m + 1;
+            return coefficients_m[(root_m * directions_m + q) * stride + k];
+        }
+
+        /**
+         * k-th derivative of the root along direction q, k! times
+         * coefficient k.
+         */
+        const T Derivative(unsigned int k, size_t q = 0) const {
+            T factorial = T(1);
+            for (unsigned int i = 2; i <= k; i++) {
+                factorial *= T(i);
+            }
+            return factorial * this->Coefficient(k, q);
+        }
+
+        /**
+         * All derivatives of the root along the direction, orders 0 to
+         * Degree().
+         */
+        void Derivatives(std::valarray<T> &derivatives) const {
+            derivatives.resize(degree_m + 1);
+            for (unsigned int k = 0; k <= degree_m; k++) {
+                derivatives[k] = this->Derivative(k);
+            }
+        }
+    };
+
+    /**
+     * All multi-indices of p components with sum d, each a vector of
+     * counts, in lexicographic order.
+     *
+     * @param p
+     * @param d
+     * @param indices
+     */
+    static inline void MultiIndices(size_t p, unsigned int d, std::vector<std::vector<unsigned int> > &indices) {
+        indices.clear();
+        if (p == 0) {
+            return;
+        }
+        std::vector<unsigned int> index(p, 0);
+        index[p - 1] = d;
+        while (true) {
+            indices.push_back(index);
+            //next composition: move one unit left from the last nonzero
+            //component before the tail
+            size_t last = p - 1;
+            while (last > 0 && index[last] == 0) {
+                last--;
+            }
+            if (last == 0) {
+                break;
+            }
+            unsigned int tail = index[last];
+            index[last] = 0;
+            index[last - 1]++;
+            index[p - 1] = tail - 1;
+        }
+        std::reverse(indices.begin(), indices.end());
+    }
+
+    /**
+     * Position of direction k in directions, adding it if it is new.
+     */
+    template<class T>
+    static size_t TaylorDirection(const std::vector<unsigned int> &k,
+            std::map<std::vector<unsigned int>, size_t> &positions, std::vector<std::valarray<T> > &directions) {
+        std::map<std::vector<unsigned int>, size_t>::iterator it = positions.find(k);
+        if (it != positions.end()) {
+            return it->second;
+        }
+        size_t q = directions.size();
+        positions[k] = q;
+        std::valarray<T> direction(T(0), k.size());
+        for (size_t i = 0; i < k.size(); i++) {
+            direction[i] = T(k[i]);
+        }
+        directions.push_back(direction);
+        return q;
+    }
+
+    /**
+     * Mixed partial derivatives of the graph's root, one per multi-index:
+     * indices[m][i] is the order with respect to ids[i]. For |i| = d,
+     *
+     *     d^i f = sum over 0 < k <= i of (-1)^|i - k| C(i, k) f_d(k),
+     *
+     * where f_d(k) is the degree d Taylor coefficient of f along direction
+     * k and C(i, k) the product of binomial coefficients. All directions an
+     * order needs are propagated in a single multi-directional Taylor
+     * sweep.
+     *
+     * @param graph
+     * @param ids
+     * @param indices
+     * @param partials resized to indices.size()
+     */
+    template<class T>
+    void MixedPartials(const CompiledExpression<T> &graph, const std::vector<unsigned long> &ids,
+            const std::vector<std::vector<unsigned int> > &indices, std::vector<T> &partials) {
+        partials.assign(indices.size(), T(0));
+
+        std::vector<unsigned int> orders(indices.size(), 0);
+        std::vector<unsigned int> distinct;
+        for (size_t m = 0; m < indices.size(); m++) {
+            for (size_t i = 0; i < indices[m].size(); i++) {
+                orders[m] += indices[m][i];
+            }
+            if (std::find(distinct.begin(), distinct.end(), orders[m]) == distinct.end()) {
+                distinct.push_back(orders[m]);
+            }
+        }
+
+        for (size_t o = 0; o < distinct.size(); o++) {
+            unsigned int d = distinct[o];
+            if (d == 0) {
+                for (size_t m = 0; m < indices.size(); m++) {
+                    if (orders[m] == 0) {
+                        partials[m] = graph.Value();
+                    }
+                }
+                continue;
+            }
+
+            //directions shared by all indices of this order
+            std::map<std::vector<unsigned int>, size_t> positions;
+            std::vector<std::valarray<T> > directions;
+            std::vector<std::vector<std::pair<size_t, T> > > terms(indices.size());
+
+            for (size_t m = 0; m < indices.size(); m++) {
+                if (orders[m] != d) {
+                    continue;
+                }
+                const std::vector<unsigned int> &index = indices[m];
+                size_t p = index.size();
+                std::vector<unsigned int> k(p, 0);
+
+                size_t nonzero = 0;
+                for (size_t i = 0; i < p; i++) {
+                    if (index[i] > 0) {
+                        nonzero++;
+                        k[i] = 1;
+                    }
+                }
+                if (nonzero == 1) {
+                    //pure partial: d! times the coefficient along the axis
+                    T factorial = T(1);
+                    for (unsigned int b = 2; b <= d; b++) {
+                        factorial *= T(b);
+                    }
+                    size_t q = TaylorDirection(k, positions, directions);
+                    terms[m].push_back(std::pair<size_t, T>(q, factorial));
+                    continue;
+                }
+                std::fill(k.begin(), k.end(), 0);
+
+                while (true) {
+                    //odometer over 0 <= k <= index
+                    size_t c = 0;
+                    while (c < p && k[c] == index[c]) {
+                        k[c] = 0;
+                        c++;
+                    }
+                    if (c == p) {
+                        break;
+                    }
+                    k[c]++;
+
+                    T weight = T(1);
+                    unsigned int size = 0;
+                    for (size_t i = 0; i < p; i++) {
+                        for (unsigned int b = 0; b < k[i]; b++) {
+                            weight *= T(index[i] - b) / T(b + 1);
+                        }
+                        size += k[i];
+                    }
+                    if ((d - size) % 2 == 1) {
+                        weight = -weight;
+                    }
+
+                    size_t q = TaylorDirection(k, positions, directions);
+                    terms[m].push_back(std::pair<size_t, T>(q, weight));
+                }
+            }
+
+            Taylor<T> taylor;
+            taylor.Propagate(graph, ids, directions, d);
+            for (size_t m = 0; m < indices.size(); m++) {
+                T sum = T(0);
+                for (size_t t = 0; t < terms[m].size(); t++) {
+                    sum += terms[m][t].second * taylor.Coefficient(d, terms[m][t].first);
+                }
+                if (orders[m] == d) {
+                    partials[m] = sum;
+                }
+            }
+        }
+    }
+
+    /**
+     * The derivative of the given order of exp with respect to the variable
+     * id as an expression graph, recorded by one univariate Taylor sweep
+     * with TaylorTerm coefficients: order! times the root's coefficient.
+     * The series of a node that does not depend on id is the node itself,
+     * and coefficient 0 of every series is its node, so the result is
+     * built on exp's graph and can be differentiated again. The cost is
+     * O(order^2) recorded nodes per node of exp, where repeated
+     * differentiation stacks order derivative graphs. Returns NULL if a
+     * node that depends on id has an operation the series do not cover
+     * (see TaylorSeries::Covers). The result holds a reference owned by
+     * the caller.
+     *
+     * @param exp
+     * @param id
+     * @param order
+     * @return derivative
+     */
+    template<class T>
+    Expression<T>* TaylorDerivative(Expression<T>* exp, unsigned long id, unsigned int order) {
+        std::vector<Expression<T>* > nodes;
+        ad::TopologicalOrder<T > (exp, nodes);
+        if (nodes.empty()) {
+            return NULL;
+        }
+
+        int d = static_cast<int> (order);
+        size_t stride = order + 1;
+        std::vector<TaylorTerm<T> > c(nodes.size() * stride);
+        std::vector<bool> depends(nodes.size(), false);
+        TaylorSeries<TaylorTerm<T> > series;
+        series.Reserve(order);
+
+        for (size_t i = 0; i < nodes.size(); i++) {
+            Expression<T>* n = nodes[i];
+            TaylorTerm<T>* v = &c[i * stride];
+            Expression<T>* l = n->GetLeft();
+            Expression<T>* r = n->GetRight();
+            if (n->GetOp() == VARIABLE && id != 0 && n->GetId() == id) {
+                depends[i] = true;
+                if (d > 0) {
+                    v[1] = TaylorTerm<T > (T(1));
+                }
+            } else if (l != NULL && (depends[l->GetIndex()] || (r != NULL && depends[r->GetIndex()]))) {
+                if (!TaylorSeries<TaylorTerm<T> >::Covers(n->GetOp())) {
+                    return NULL;
+                }
+                const TaylorTerm<T>* u = &c[l->GetIndex() * stride];
+                const TaylorTerm<T>* w = r != NULL ? &c[r->GetIndex() * stride] : u;
+                series.Step(n->GetOp(), u, w, v, d);
+                depends[i] = true;
+            }
+            v[0] = TaylorTerm<T>::Of(n);
+        }
+
+        T factorial = T(1);
+        for (unsigned int i = 2; i <= order; i++) {
+            factorial *= T(i);
+        }
+        TaylorTerm<T> derivative = c[(nodes.size() - 1) * stride + order];
+        if (order > 1) {
+            derivative *= TaylorTerm<T > (factorial);
+        }
+        return derivative.TakeNode();
+    }
+}
+
+#endif	/* TAYLOR_HPP */